@@ -0,0 +1,157 @@
+/*
+ * This file implements arenas: memory we allocate from by bumping a
+ * pointer, and give back all at once, rather than piece by piece.
+ *
+ * Each device has two. Its frame arena holds what only lives as long as a
+ * commit, such as the atomic requests the main loop builds; it is reset
+ * once each commit has been made. Its device arena holds metadata which
+ * lives as long as the device does. Each output also has an arena of its
+ * own for its KMS metadata, such as property tables and its static and test
+ * requests, which goes when the output does, so unplugging monitors doesn't
+ * leave anything behind.
+ *
+ * An arena takes memory from the heap a block at a time. When a block runs
+ * out, we add a bigger one; resetting an arena which needed more than one
+ * block replaces them all with a single block as big as all of them, so by
+ * the time we reach steady state, resetting the frame arena is all each
+ * commit costs, and no frame touches the heap. Every block we malloc is
+ * counted, so the main loop can check that; see main.c.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+/* Enough for anything we put in an arena, including uint64_t and double. */
+#define ARENA_ALIGN 16
+
+struct arena_block {
+	struct arena_block *next; /* the block we filled before this one */
+	size_t size; /* how much memory follows the header */
+	size_t used;
+};
+
+/* Where the memory starts, after the header. */
+#define ARENA_HEADER_SIZE \
+	((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+static size_t arena_align(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+static void arena_add_block(struct arena *arena, size_t size)
+{
+	struct arena_block *block = malloc(ARENA_HEADER_SIZE + size);
+
+	assert(block);
+	block->next = arena->blocks;
+	block->size = size;
+	block->used = 0;
+	arena->blocks = block;
+	arena->heap_allocs++;
+}
+
+/*
+ * Sets up an empty arena, which takes memory from the heap at least
+ * block_size bytes at a time, starting from the first allocation.
+ */
+void arena_init(struct arena *arena, size_t block_size)
+{
+	arena->blocks = NULL;
+	arena->block_size = arena_align(block_size);
+	arena->heap_allocs = 0;
+}
+
+/* Returns size bytes of zeroed memory, which lasts until the arena is reset. */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_block *block = arena->blocks;
+	void *ret;
+
+	size = arena_align(size);
+	if (!block || block->size - block->used < size) {
+		size_t block_size = arena->block_size;
+
+		/* Each block doubles what we had, so we soon stop growing. */
+		if (block && block->size * 2 > block_size)
+			block_size = block->size * 2;
+		if (size > block_size)
+			block_size = size;
+		arena_add_block(arena, block_size);
+		block = arena->blocks;
+	}
+
+	ret = (char *) block + ARENA_HEADER_SIZE + block->used;
+	block->used += size;
+	memset(ret, 0, size);
+	return ret;
+}
+
+/*
+ * Gives back everything allocated from the arena at once. If it took more
+ * than one block, we swap them for a single block which holds as much, so
+ * the same allocations fit in one next time round.
+ */
+void arena_reset(struct arena *arena)
+{
+	struct arena_block *block = arena->blocks;
+	size_t total = 0;
+
+	if (!block)
+		return;
+
+	if (!block->next) {
+		block->used = 0;
+		return;
+	}
+
+	while (block) {
+		struct arena_block *next = block->next;
+
+		total += block->size;
+		free(block);
+		block = next;
+	}
+	arena->blocks = NULL;
+	arena_add_block(arena, total);
+}
+
+void arena_fini(struct arena *arena)
+{
+	struct arena_block *block = arena->blocks;
+
+	while (block) {
+		struct arena_block *next = block->next;
+
+		free(block);
+		block = next;
+	}
+	arena->blocks = NULL;
+}
@@ -0,0 +1,472 @@
+/*
+ * This file implements the benchmark mode, started with --benchmark on the
+ * command line.
+ *
+ * Rather than running the timed render loop, which is paced by the display
+ * and so can only tell us whether or not we made each deadline, we render a
+ * fixed number of frames back-to-back as fast as we can, and report how long
+ * each one took. This gives repeatable numbers which can be compared between
+ * builds to catch performance regressions.
+ *
+ * By default this is headless: the software path renders into system memory
+ * shaped like a dumb buffer, and the GPU path renders into GBM buffers on a
+ * render node, so neither needs a display or a VT. With --test-commit, we
+ * instead open the KMS device as normal and check every frame with a
+ * TEST_ONLY atomic commit, which also measures the cost of the kernel's
+ * atomic check without ever displaying anything.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+/* The animation loop is split into this many steps across frames. */
+#define BENCH_ANIM_STEPS 240
+
+struct bench_options {
+	unsigned int frames;
+	unsigned int width;
+	unsigned int height;
+	bool run_dumb;
+	bool run_egl;
+	bool test_commit;
+	bool damage;
+	bool text;
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s --benchmark [options]\n"
+		"\t--frames=N      render N frames per backend (default 600)\n"
+		"\t--size=WxH      headless buffer size (default 1920x1080)\n"
+		"\t--backend=NAME  'dumb', 'egl' or 'all' (default 'all')\n"
+		"\t--test-commit   drive the real KMS device, checking every\n"
+		"\t                frame with a TEST_ONLY commit\n"
+		"\t--damage        only repaint what changed, as the display\n"
+		"\t                loop does, rather than every pixel\n"
+		"\t--text          fill the screen with scrolling text on the\n"
+		"\t                GPU path; implies repainting every pixel\n",
+		argv0);
+}
+
+static bool parse_options(int argc, char *argv[], struct bench_options *opts)
+{
+	*opts = (struct bench_options) {
+		.frames = 600,
+		.width = 1920,
+		.height = 1080,
+		.run_dumb = true,
+		.run_egl = true,
+	};
+
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (strcmp(arg, "--benchmark") == 0) {
+			continue;
+		} else if (strncmp(arg, "--frames=", 9) == 0) {
+			opts->frames = strtoul(arg + 9, NULL, 10);
+			if (opts->frames == 0)
+				return false;
+		} else if (strncmp(arg, "--size=", 7) == 0) {
+			if (sscanf(arg + 7, "%ux%u", &opts->width,
+				   &opts->height) != 2 ||
+			    opts->width == 0 || opts->height == 0)
+				return false;
+		} else if (strcmp(arg, "--backend=dumb") == 0) {
+			opts->run_egl = false;
+		} else if (strcmp(arg, "--backend=egl") == 0) {
+			opts->run_dumb = false;
+		} else if (strcmp(arg, "--backend=all") == 0) {
+			opts->run_dumb = opts->run_egl = true;
+		} else if (strcmp(arg, "--test-commit") == 0) {
+			opts->test_commit = true;
+		} else if (strcmp(arg, "--damage") == 0) {
+			opts->damage = true;
+		} else if (strcmp(arg, "--text") == 0) {
+			opts->text = true;
+		} else {
+			fprintf(stderr, "unknown benchmark option '%s'\n", arg);
+			return false;
+		}
+	}
+
+	/* Damage tracking doesn't know the text scrolls. */
+	if (opts->text)
+		opts->damage = false;
+
+	return true;
+}
+
+static int64_t clock_nsec(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return timespec_to_nsec(&ts);
+}
+
+/*
+ * The GPU path only queues rendering when we fill the buffer; in order to
+ * measure the time taken to actually render, we need to wait for it to
+ * complete, either on the render fence or by stalling in glFinish.
+ */
+static void bench_wait_render(struct buffer *buffer)
+{
+	if (!buffer->gbm.bo)
+		return;
+
+	if (buffer->render_fence_fd >= 0) {
+		struct pollfd pfd = {
+			.fd = buffer->render_fence_fd,
+			.events = POLLIN,
+		};
+		int ret;
+
+		do {
+			ret = poll(&pfd, 1, -1);
+		} while (ret == -1 && errno == EINTR);
+	} else {
+		glFinish();
+	}
+}
+
+static void bench_report(const char *name, const struct bench_options *opts,
+			 unsigned int width, unsigned int height,
+			 int64_t *frame_times, int64_t *commit_times,
+			 int64_t wall_nsec, int64_t cpu_nsec)
+{
+	unsigned int n = opts->frames;
+	/* stats_percentile() sorts the array, so compute these in order. */
+	int64_t p50 = stats_percentile(frame_times, n, 50);
+	int64_t p90 = stats_percentile(frame_times, n, 90);
+	int64_t p99 = stats_percentile(frame_times, n, 99);
+	int64_t max = frame_times[n - 1];
+
+	printf("%s: %u frames at %u x %u\n", name, n, width, height);
+	printf("\tthroughput: %.1f frames/s\n",
+	       (double) n * NSEC_PER_SEC / wall_nsec);
+	printf("\tCPU time per frame: %.3fms\n",
+	       (double) cpu_nsec / n / NSEC_PER_MSEC);
+	printf("\tframe time: p50 %.3fms, p90 %.3fms, p99 %.3fms, max %.3fms\n",
+	       (double) p50 / NSEC_PER_MSEC, (double) p90 / NSEC_PER_MSEC,
+	       (double) p99 / NSEC_PER_MSEC, (double) max / NSEC_PER_MSEC);
+	if (commit_times) {
+		p50 = stats_percentile(commit_times, n, 50);
+		p99 = stats_percentile(commit_times, n, 99);
+		printf("\tTEST_ONLY commit: p50 %.3fms, p99 %.3fms\n",
+		       (double) p50 / NSEC_PER_MSEC, (double) p99 / NSEC_PER_MSEC);
+	}
+}
+
+/*
+ * Renders the configured number of frames into the given buffers in turn,
+ * and reports the timings. If test_commit is set, every frame is also
+ * checked against KMS as if we were about to display it.
+ */
+static int bench_run_frames(const char *name, const struct bench_options *opts,
+			    struct output *output, struct buffer **buffers,
+			    unsigned int num_buffers)
+{
+	int64_t *frame_times = calloc(opts->frames, sizeof(*frame_times));
+	int64_t *commit_times = NULL;
+	struct atomic_req *req = NULL;
+	int64_t wall_start, cpu_start;
+	int ret = 0;
+
+	assert(frame_times);
+	if (opts->test_commit) {
+		commit_times = calloc(opts->frames, sizeof(*commit_times));
+		assert(commit_times);
+		req = atomic_req_create(&output->arena);
+	}
+
+	/* Damage tracking walks the output's buffers to age them. */
+	assert(num_buffers <= BUFFER_QUEUE_MAX);
+	for (unsigned int i = 0; i < num_buffers; i++)
+		output->buffers[i] = buffers[i];
+	output->num_buffers = num_buffers;
+
+	wall_start = clock_nsec(CLOCK_MONOTONIC);
+	cpu_start = clock_nsec(CLOCK_PROCESS_CPUTIME_ID);
+
+	for (unsigned int i = 0; i < opts->frames; i++) {
+		struct buffer *buffer = buffers[i % num_buffers];
+		float anim_progress =
+			(float) (i % BENCH_ANIM_STEPS) / BENCH_ANIM_STEPS;
+		int64_t start = clock_nsec(CLOCK_MONOTONIC);
+
+		/* Scroll as if each frame were shown at 60Hz. */
+		output_scroll_set_time(output, i * (NSEC_PER_SEC / 60));
+		if (opts->damage) {
+			struct region repaint;
+
+			output_damage_frame(output, buffer, anim_progress,
+					    &repaint);
+			buffer_fill(buffer, anim_progress, &repaint);
+		} else {
+			buffer_fill(buffer, anim_progress, NULL);
+		}
+		bench_wait_render(buffer);
+
+		if (req) {
+			int64_t commit_start = clock_nsec(CLOCK_MONOTONIC);
+
+			atomic_req_reset(req);
+			output_add_atomic_req(output, req, buffer, true);
+			ret = atomic_test(output->device, req, true);
+			if (ret != 0) {
+				fprintf(stderr, "TEST_ONLY commit failed: %s\n",
+					strerror(-ret));
+				goto out;
+			}
+			commit_times[i] = clock_nsec(CLOCK_MONOTONIC) - commit_start;
+		}
+
+		frame_times[i] = clock_nsec(CLOCK_MONOTONIC) - start;
+	}
+
+	bench_report(name, opts, buffers[0]->width, buffers[0]->height,
+		     frame_times, commit_times,
+		     clock_nsec(CLOCK_MONOTONIC) - wall_start,
+		     clock_nsec(CLOCK_PROCESS_CPUTIME_ID) - cpu_start);
+
+out:
+	free(commit_times);
+	free(frame_times);
+	return ret;
+}
+
+/*
+ * Creates a buffer in system memory laid out exactly like a dumb buffer, so
+ * we can measure the software fill path without a KMS device.
+ */
+static struct buffer *bench_sysmem_buffer_create(struct output *output)
+{
+	struct buffer *ret = calloc(1, sizeof(*ret));
+	void *mem;
+
+	assert(ret);
+	ret->output = output;
+	ret->format = DRM_FORMAT_XRGB8888;
+	ret->modifier = DRM_FORMAT_MOD_LINEAR;
+	ret->width = output->mode.hdisplay;
+	ret->height = output->mode.vdisplay;
+	ret->pitches[0] = ret->width * 4;
+	ret->render_fence_fd = -1;
+	ret->kms_fence_fd = -1;
+	ret->dumb.size = ret->pitches[0] * ret->height;
+	if (posix_memalign(&mem, 64, ret->dumb.size) != 0) {
+		free(ret);
+		return NULL;
+	}
+	ret->dumb.mem = mem;
+
+	return ret;
+}
+
+/* A stand-in output for headless rendering, which is never displayed. */
+static struct output *bench_output_create(struct device *device,
+					  const struct bench_options *opts)
+{
+	struct output *output = calloc(1, sizeof(*output));
+
+	assert(output);
+	output->device = device;
+	snprintf(output->name, sizeof(output->name), "headless");
+	output->mode.hdisplay = opts->width;
+	output->mode.vdisplay = opts->height;
+	output->commit_fence_fd = -1;
+	output->repaint_timer_fd = -1;
+	/* Lets us wait on render fences if EGL supports them. */
+	output->explicit_fencing = true;
+
+	return output;
+}
+
+static int bench_headless_dumb(const struct bench_options *opts)
+{
+	struct output *output = bench_output_create(NULL, opts);
+	struct buffer *buffers[BUFFER_QUEUE_DEPTH] = { NULL, };
+	int ret = 0;
+
+	for (int i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
+		buffers[i] = bench_sysmem_buffer_create(output);
+		if (!buffers[i]) {
+			ret = 1;
+			goto out;
+		}
+	}
+
+	ret = bench_run_frames("dumb (system memory)", opts, output,
+			       buffers, BUFFER_QUEUE_DEPTH);
+
+out:
+	for (int i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
+		if (!buffers[i])
+			continue;
+		free(buffers[i]->dumb.mem);
+		free(buffers[i]);
+	}
+	free(output);
+	return ret;
+}
+
+static int bench_headless_egl(const struct bench_options *opts)
+{
+	struct device *device = device_create_render_only();
+	struct buffer *buffers[BUFFER_QUEUE_DEPTH] = { NULL, };
+	struct output *output;
+	int ret = 0;
+
+	if (!device)
+		return 1;
+
+	output = bench_output_create(device, opts);
+	if (!output_egl_setup(output)) {
+		ret = 1;
+		goto out_output;
+	}
+	output->egl.atlas.page = opts->text;
+
+	for (int i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
+		buffers[i] = buffer_egl_create(device, output);
+		if (!buffers[i]) {
+			ret = 1;
+			goto out;
+		}
+	}
+
+	ret = bench_run_frames("egl (render node)", opts, output,
+			       buffers, BUFFER_QUEUE_DEPTH);
+
+out:
+	for (int i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
+		if (!buffers[i])
+			continue;
+		buffer_egl_destroy(device, buffers[i]);
+		free(buffers[i]);
+	}
+	output_egl_destroy(device, output);
+out_output:
+	free(output);
+	device_destroy(device);
+	return ret;
+}
+
+/*
+ * Drives the real KMS devices, using whichever rendering path each would
+ * normally use (set KMS_NO_GBM to force the dumb-buffer path).
+ */
+static int bench_test_commit_device(const struct bench_options *opts,
+				    struct device *device)
+{
+	int ret = 0;
+
+	for (int i = 0; i < device->num_outputs && ret == 0; i++) {
+		struct output *output = device->outputs[i];
+		char name[64];
+
+		if (device->gbm_device && !output_egl_setup(output)) {
+			ret = 2;
+			break;
+		}
+		output->egl.atlas.page = opts->text;
+
+		/*
+		 * Settle on a modifier as the display loop would; see
+		 * format.c.
+		 */
+		output->num_buffers = BUFFER_QUEUE_DEPTH;
+		output->buffers[0] = output_format_negotiate(output);
+		for (int j = 0; j < BUFFER_QUEUE_DEPTH; j++) {
+			if (!output->buffers[j])
+				output->buffers[j] = buffer_create(device,
+								   output);
+			if (!output->buffers[j]) {
+				ret = 3;
+				break;
+			}
+		}
+		if (ret != 0)
+			break;
+
+		snprintf(name, sizeof(name), "%s (%s, TEST_ONLY)", output->name,
+			 device->gbm_device ? "egl" : "dumb");
+		ret = bench_run_frames(name, opts, output, output->buffers,
+				       BUFFER_QUEUE_DEPTH);
+	}
+
+	return ret;
+}
+
+static int bench_test_commit(const struct bench_options *opts)
+{
+	struct device **devices;
+	int num_devices = 0;
+	int ret = 0;
+
+	devices = devices_create(&num_devices);
+	if (!devices)
+		return 1;
+
+	for (int d = 0; d < num_devices && ret == 0; d++)
+		ret = bench_test_commit_device(opts, devices[d]);
+
+	devices_destroy(devices, num_devices);
+	return ret;
+}
+
+int benchmark_run(int argc, char *argv[])
+{
+	struct bench_options opts;
+	int ret = 0;
+
+	if (!parse_options(argc, argv, &opts)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (opts.test_commit) {
+		ret = bench_test_commit(&opts);
+	} else {
+		if (opts.run_dumb)
+			ret |= bench_headless_dumb(&opts);
+		if (opts.run_egl)
+			ret |= bench_headless_egl(&opts);
+	}
+
+	fill_fini();
+	return ret;
+}
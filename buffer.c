@@ -39,41 +39,69 @@
 #include "kms-quads.h"
 
 /*
- * Using the CPU mapping, fill the buffer with a simple pixel-by-pixel
- * checkerboard; the boundaries advance from top-left to bottom-right.
+ * Using the CPU mapping, fill the buffer with a simple checkerboard; the
+ * boundaries advance from top-left to bottom-right.
  */
-void buffer_fill(struct buffer *buffer, float anim_progress)
+void buffer_fill(struct buffer *buffer, float anim_progress,
+		 const struct region *repaint)
 {
 	struct output *output = buffer->output;
+	unsigned int split_x, split_y;
+	struct region full;
 
 	if (buffer->gbm.bo) {
-		buffer_egl_fill(buffer, anim_progress);
+		buffer_egl_fill(buffer, anim_progress, repaint);
 		return;
 	}
 
-	for (unsigned int y = 0; y < buffer->height; y++) {
-		/*
-		 * We play silly games with pointer types so we advance
-		 * by (y*pitch) in bytes rather than in pixels, then cast back.
-		 */
-		uint8_t b;
-		uint32_t *pix =
-			(uint32_t *) ((uint8_t *) buffer->dumb.mem + (y * buffer->pitches[0]));
-		if (y >= (buffer->height * anim_progress))
-			b = 0xff;
-		else
-			b = 0;
-
-		for (unsigned int x = 0; x < buffer->width; x++) {
-			uint32_t r;
-
-			if (x >= (buffer->width * anim_progress))
-				r = 0xff;
-			else
-				r = 0;
-
-			*pix++ = (0xff << 24 /* A */) | (r << 16) | \
-				 (0x00 <<  8 /* G */) | b;
+	/*
+	 * With explicit fencing, we get the buffer back as soon as the commit
+	 * which replaces it on screen has been made, rather than once it has
+	 * completed; the CPU has to wait for KMS to let go of it before we
+	 * can write to it. (The GPU path waits on the GPU instead.)
+	 */
+	if (buffer->kms_fence_fd >= 0) {
+		linux_sync_file_wait(buffer->kms_fence_fd);
+		fd_replace(&buffer->kms_fence_fd, -1);
+	}
+
+	/*
+	 * Rather than deciding the colour of each pixel, work out where the
+	 * boundaries are once, and let the fill code write solid runs.
+	 */
+	scene_split(buffer->width, buffer->height, anim_progress,
+		    &split_x, &split_y);
+
+	if (!repaint) {
+		region_init_rect(&full, 0, 0, buffer->width, buffer->height);
+		repaint = &full;
+	}
+
+	for (unsigned int i = 0; i < repaint->num_rects; i++)
+		buffer_fill_quadrants(buffer, split_x, split_y,
+				      scene_colours, &repaint->rects[i]);
+
+	/*
+	 * Draw any layers which aren't on planes over the top, bottom first;
+	 * with the split at the origin, every pixel gets the last colour.
+	 */
+	for (unsigned int l = 0; l < output->num_layers; l++) {
+		const struct layer *layer = &output->layers[l];
+		const uint32_t colours[4] = {
+			layer->colour, layer->colour,
+			layer->colour, layer->colour,
+		};
+
+		if (layer->plane)
+			continue;
+
+		for (unsigned int i = 0; i < repaint->num_rects; i++) {
+			struct rect clip;
+
+			if (rect_intersect(&layer->rect, &repaint->rects[i],
+					   &clip))
+				buffer_fill_quadrants(buffer, 0, 0, colours,
+						      &clip);
 		}
 	}
 }
@@ -88,27 +116,20 @@ void buffer_fill(struct buffer *buffer, float anim_progress)
  * comprehensive example of multiple buffer types:
  *   https://gitlab.freedesktop.org/wayland/weston/tree/master/libweston/compositor-drm.c
  */
-static struct buffer *buffer_dumb_create(struct device *device, struct output *output)
+static struct buffer *buffer_dumb_create(struct device *device,
+					 struct output *output,
+					 unsigned int width,
+					 unsigned int height,
+					 uint32_t format)
 {
 	struct buffer *ret = calloc(1, sizeof(*ret));
 	struct drm_mode_create_dumb create;
 	struct drm_mode_map_dumb map;
 	struct drm_mode_destroy_dumb destroy;
-	unsigned int m;
 	int err;
 
 	assert(ret);
 
-	/*
-	 * As we only create linear buffers here, make sure the plane supports
-	 * the linear modifier.
-	 */
-	for (m = 0; m < output->num_modifiers; m++) {
-		if (output->modifiers[m] == DRM_FORMAT_MOD_LINEAR)
-			break;
-	}
-	assert(!device->fb_modifiers || m < output->num_modifiers);
-
 	/*
 	 * The create ioctl uses the combination of depth and bpp to infer
 	 * a format; 24/32 refers to DRM_FORMAT_XRGB8888 as defined in
@@ -126,8 +147,8 @@ static struct buffer *buffer_dumb_create(struct device *device, struct output *o
 	 *   https://afrantzis.com/pixel-format-guide/
 	 */
 	create = (struct drm_mode_create_dumb) {
-		.width = output->mode.hdisplay,
-		.height = output->mode.vdisplay,
+		.width = width,
+		.height = height,
 		.bpp = 32,
 	};
 	err = drmIoctl(device->kms_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create);
@@ -142,7 +163,7 @@ static struct buffer *buffer_dumb_create(struct device *device, struct output *o
 
 	ret->output = output;
 	ret->gem_handles[0] = create.handle;
-	ret->format = DRM_FORMAT_XRGB8888;
+	ret->format = format;
 	ret->modifier = DRM_FORMAT_MOD_LINEAR;
 	ret->width = create.width;
 	ret->height = create.height;
@@ -187,75 +208,175 @@ err:
 	return NULL;
 }
 
-struct buffer *buffer_create(struct device *device, struct output *output)
+/*
+ * Wrap our GEM buffer in a KMS framebuffer, so we can then attach it to a
+ * plane.
+ *
+ * drmModeAddFB2 accepts multiple image planes (not to be confused with the
+ * KMS plane objects!), for images which have multiple buffers. For example,
+ * YUV images may have the luma (Y) components in a separate buffer to the
+ * chroma (UV) components.
+ *
+ * When using modifiers (which we do not for dumb buffers), we can also have
+ * multiple planes even for RGB images, as image compression often uses an
+ * auxiliary buffer to store compression metadata.
+ *
+ * Dumb buffers are always strictly single-planar, so we do not need the
+ * extra planes nor the offset field.
+ *
+ * AddFB2WithModifiers takes a list of modifiers per plane, however the
+ * kernel enforces that they must be the same for each plane which is there,
+ * and 0 for everything else. Buffers whose layout the driver chose
+ * implicitly have DRM_FORMAT_MOD_INVALID, and are added without modifiers.
+ */
+bool buffer_add_fb(struct device *device, struct buffer *buffer)
 {
-	struct buffer *ret;
+	const char *kind = buffer->dmabuf.external ? "external" :
+			   (buffer->dumb.mem) ? "dumb" : "GBM";
 	uint64_t modifiers[4] = { 0, };
 	int err;
 
-	if (device->gbm_device)
-		ret = buffer_egl_create(device, output);
-	else
-		ret = buffer_dumb_create(device, output);
-
-	if (!ret)
-		return NULL;
-
-	for (int i = 0; ret->gem_handles[i]; i++) {
-		modifiers[i] = ret->modifier;
+	for (int i = 0; buffer->gem_handles[i]; i++) {
+		modifiers[i] = buffer->modifier;
 		debug("[GEM:%" PRIu32 "]: %u x %u %s buffer (plane %d), pitch %u\n",
-		      ret->gem_handles[i], ret->width, ret->height,
-		      (ret->dumb.mem) ? "dumb" : "GBM",
-		      i, ret->pitches[i]);
+		      buffer->gem_handles[i], buffer->width, buffer->height,
+		      kind, i, buffer->pitches[i]);
 	}
 
-	/*
-	 * Wrap our GEM buffer in a KMS framebuffer, so we can then attach it
-	 * to a plane.
-	 *
-	 * drmModeAddFB2 accepts multiple image planes (not to be confused with
-	 * the KMS plane objects!), for images which have multiple buffers.
-	 * For example, YUV images may have the luma (Y) components in a
-	 * separate buffer to the chroma (UV) components.
-	 *
-	 * When using modifiers (which we do not for dumb buffers), we can also
-	 * have multiple planes even for RGB images, as image compression often
-	 * uses an auxiliary buffer to store compression metadata.
-	 *
-	 * Dumb buffers are always strictly single-planar, so we do not need
-	 * the extra planes nor the offset field.
-	 *
-	 * AddFB2WithModifiers takes a list of modifiers per plane, however
-	 * the kernel enforces that they must be the same for each plane
-	 * which is there, and 0 for everything else.
-	 */
-	if (device->fb_modifiers) {
+	if (device->fb_modifiers && buffer->modifier != DRM_FORMAT_MOD_INVALID) {
 		err = drmModeAddFB2WithModifiers(device->kms_fd,
-						 ret->width, ret->height,
-						 ret->format,
-						 ret->gem_handles,
-						 ret->pitches,
-						 ret->offsets,
-						 modifiers, &ret->fb_id,
+						 buffer->width, buffer->height,
+						 buffer->format,
+						 buffer->gem_handles,
+						 buffer->pitches,
+						 buffer->offsets,
+						 modifiers, &buffer->fb_id,
 						 DRM_MODE_FB_MODIFIERS);
 	} else {
-		err = drmModeAddFB2(device->kms_fd, ret->width, ret->height,
-			    	    ret->format, ret->gem_handles, ret->pitches,
-				    ret->offsets, &ret->fb_id, 0);
+		err = drmModeAddFB2(device->kms_fd, buffer->width,
+				    buffer->height, buffer->format,
+				    buffer->gem_handles, buffer->pitches,
+				    buffer->offsets, &buffer->fb_id, 0);
 	}
 
-	if (err != 0 || ret->fb_id == 0) {
+	if (err != 0 || buffer->fb_id == 0) {
 		fprintf(stderr, "failed AddFB2 on %u x %u %s (modifier 0x%" PRIx64 ") buffer: %s\n",
-			ret->width, ret->height,
-			(ret->dumb.mem) ? "dumb" : "GBM",
-			ret->modifier, strerror(errno));
-		goto err;
+			buffer->width, buffer->height, kind,
+			buffer->modifier, strerror(errno));
+		return false;
 	}
+
+	return true;
+}
+
+struct buffer *buffer_create(struct device *device, struct output *output)
+{
+	struct buffer *ret;
+	unsigned int m;
+
+	if (device->gbm_device) {
+		ret = buffer_egl_create(device, output);
+	} else {
+		/*
+		 * As we only create linear buffers here, make sure the plane
+		 * supports the linear modifier.
+		 */
+		for (m = 0; m < output->num_modifiers; m++) {
+			if (output->modifiers[m] == DRM_FORMAT_MOD_LINEAR)
+				break;
+		}
+		assert(!device->fb_modifiers || m < output->num_modifiers);
+
+		ret = buffer_dumb_create(device, output, output->mode.hdisplay,
+					 output->mode.vdisplay,
+					 DRM_FORMAT_XRGB8888);
+	}
+
+	if (ret && !buffer_add_fb(device, ret)) {
+		buffer_destroy(ret);
+		ret = NULL;
+	}
+
+	/*
+	 * If we can't allocate or scan out a buffer with the modifiers we
+	 * chose for this output, let the driver choose its layout implicitly
+	 * from now on; while negotiating (see format.c), we just move on to
+	 * the next modifiers instead. If another GPU renders for us and we
+	 * still can't scan out the buffer it gave us, fall back to copying
+	 * every frame into one we can; see buffer_egl_create().
+	 */
+	if (!ret && device->gbm_device && output->format.use_modifiers &&
+	    !output->format.negotiating) {
+		fprintf(stderr, "[%s] couldn't create buffer with format modifiers; falling back to implicit layout\n",
+			output->name);
+		output->format.use_modifiers = false;
+		return buffer_create(device, output);
+	}
+	if (!ret && device->gbm_device && !output->format.negotiating &&
+	    device->render_device != device && !output->egl.prime_copy) {
+		fprintf(stderr, "[%s] can't scan out buffers from %s; copying frames instead\n",
+			output->name, device->render_device->node);
+		output->egl.prime_copy = true;
+		return buffer_create(device, output);
+	}
+
 	return ret;
+}
 
-err:
-	buffer_destroy(ret);
-	return NULL;
+/*
+ * Creates a dumb buffer of the given size, filled with a single opaque
+ * colour, for content which never changes such as our layers (see
+ * layer.c). We use ARGB8888 rather than XRGB8888, as it is much more
+ * commonly supported by cursor planes.
+ */
+struct buffer *buffer_create_solid(struct device *device, struct output *output,
+				   unsigned int width, unsigned int height,
+				   uint32_t argb)
+{
+	const uint32_t colours[4] = { argb, argb, argb, argb };
+	struct buffer *ret;
+
+	ret = buffer_dumb_create(device, output, width, height,
+				 DRM_FORMAT_ARGB8888);
+	if (!ret)
+		return NULL;
+
+	buffer_fill_quadrants(ret, 0, 0, colours, NULL);
+
+	if (!buffer_add_fb(device, ret)) {
+		buffer_destroy(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Creates a dumb ARGB8888 buffer holding the given image, which is width
+ * pixels to a row, for small pre-rendered content such as our cursor (see
+ * cursor.c).
+ */
+struct buffer *buffer_create_argb(struct device *device, struct output *output,
+				  unsigned int width, unsigned int height,
+				  const uint32_t *pixels)
+{
+	struct buffer *ret;
+
+	ret = buffer_dumb_create(device, output, width, height,
+				 DRM_FORMAT_ARGB8888);
+	if (!ret)
+		return NULL;
+
+	for (unsigned int y = 0; y < height; y++)
+		memcpy((uint8_t *) ret->dumb.mem + y * ret->pitches[0],
+		       &pixels[y * width], width * sizeof(*pixels));
+
+	if (!buffer_add_fb(device, ret)) {
+		buffer_destroy(ret);
+		return NULL;
+	}
+
+	return ret;
 }
 
 void buffer_destroy(struct buffer *buffer)
@@ -263,7 +384,10 @@ void buffer_destroy(struct buffer *buffer)
 	struct output *output = buffer->output;
 	struct device *device = output->device;
 
-	drmModeRmFB(device->kms_fd, buffer->fb_id);
+	if (buffer->fb_id)
+		drmModeRmFB(device->kms_fd, buffer->fb_id);
+	fd_replace(&buffer->render_fence_fd, -1);
+	fd_replace(&buffer->kms_fence_fd, -1);
 
 	if (buffer->dumb.mem) {
 		struct drm_mode_destroy_dumb destroy = {
@@ -274,6 +398,8 @@ void buffer_destroy(struct buffer *buffer)
 		drmIoctl(device->kms_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
 	} else if (buffer->gbm.bo) {
 		buffer_egl_destroy(device, buffer);
+	} else if (buffer->dmabuf.external) {
+		buffer_dmabuf_destroy(buffer);
 	}
 	free(buffer);
 }
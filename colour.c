@@ -0,0 +1,403 @@
+/*
+ * This file looks after each output's colour transform: a warmer white
+ * point for night light ($KMS_NIGHT_LIGHT, in Kelvin), dimming
+ * ($KMS_BRIGHTNESS, from 0.1 to 1, also changed with the - and = keys), and
+ * an extra display gamma ($KMS_GAMMA).
+ *
+ * Doing any of this on the GPU would cost a full-screen pass over every
+ * frame, and mean repainting everything whenever it changes. Most CRTCs can
+ * do it for free as they scan out, though, with a colour pipeline of three
+ * stages: a degamma LUT, a 3x3 colour transform matrix (CTM), then a gamma
+ * LUT. Each is a blob we hand to KMS as a CRTC property; 0 leaves the stage
+ * out. Our transform is a scale of each channel in linear light, so with the
+ * whole pipeline we decode sRGB in the degamma LUT, scale in the CTM, and
+ * encode again in the gamma LUT, which is where gamma goes too. With just a
+ * gamma LUT, we fold all of that into the one curve per channel, which only
+ * works because our matrix is diagonal. With just a CTM, we scale the
+ * encoded values instead, which is close enough, but can't do gamma.
+ *
+ * Only with none of these does the renderer do it, with a multiply pass
+ * after drawing each frame; see output_egl_colour_apply(). The software
+ * renderer doesn't, so dumb buffers only get a transform in hardware.
+ *
+ * We build the blobs when the transform changes, rather than every frame:
+ * they stay on the CRTC until we replace them, so commits only carry them
+ * when they've changed, or when we send our full state; see
+ * output_add_atomic_req().
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+#define COLOUR_BRIGHTNESS_MIN 0.1
+#define COLOUR_KELVIN_MIN 1000.0
+#define COLOUR_KELVIN_MAX 6600.0 /* where the approximation is white */
+
+static const char *const colour_mode_names[] = {
+	[COLOUR_MODE_PIPELINE] = "CRTC degamma LUT, CTM and gamma LUT",
+	[COLOUR_MODE_GAMMA_LUT] = "CRTC gamma LUT",
+	[COLOUR_MODE_CTM] = "CRTC CTM",
+	[COLOUR_MODE_GPU] = "GPU",
+};
+
+static double srgb_eotf(double x)
+{
+	if (x <= 0.04045)
+		return x / 12.92;
+	return pow((x + 0.055) / 1.055, 2.4);
+}
+
+static double srgb_oetf(double y)
+{
+	if (y <= 0.0031308)
+		return y * 12.92;
+	return 1.055 * pow(y, 1.0 / 2.4) - 0.055;
+}
+
+static double clamp_unit(double x)
+{
+	return fmin(fmax(x, 0.0), 1.0);
+}
+
+/*
+ * The colour of a black body at the given temperature, as sRGB-encoded
+ * values from 0 to 1, using Tanner Helland's curve fit; it's only meant to
+ * look right, which is all night light needs.
+ */
+static void kelvin_to_rgb(double kelvin, double rgb[3])
+{
+	double t = kelvin / 100.0;
+
+	if (t <= 66.0) {
+		rgb[0] = 255.0;
+		rgb[1] = 99.4708025861 * log(t) - 161.1195681661;
+	} else {
+		rgb[0] = 329.698727446 * pow(t - 60.0, -0.1332047592);
+		rgb[1] = 288.1221695283 * pow(t - 60.0, -0.0755148492);
+	}
+
+	if (t >= 66.0)
+		rgb[2] = 255.0;
+	else if (t <= 19.0)
+		rgb[2] = 0.0;
+	else
+		rgb[2] = 138.5177312231 * log(t - 10.0) - 305.0447927307;
+
+	for (int c = 0; c < 3; c++)
+		rgb[c] = clamp_unit(rgb[c] / 255.0);
+}
+
+/* How much to scale each channel by, in linear light. */
+static void colour_scale(const struct output *output, double scale[3])
+{
+	double dim = srgb_eotf(output->colour.brightness);
+
+	for (int c = 0; c < 3; c++)
+		scale[c] = output->colour.white[c] * dim;
+}
+
+static bool colour_is_identity(const struct output *output,
+			       const double scale[3])
+{
+	return scale[0] == 1.0 && scale[1] == 1.0 && scale[2] == 1.0 &&
+	       output->colour.gamma == 1.0;
+}
+
+/* Encodes linear light for the display, with our extra gamma on top. */
+static double colour_encode(const struct output *output, double y)
+{
+	return pow(srgb_oetf(clamp_unit(y)), 1.0 / output->colour.gamma);
+}
+
+static uint16_t lut_entry(double x)
+{
+	return (uint16_t) lround(clamp_unit(x) * 0xffff);
+}
+
+enum lut_kind {
+	LUT_DEGAMMA, /* decode sRGB */
+	LUT_GAMMA, /* encode again, with gamma */
+	LUT_WHOLE, /* decode, scale and encode in one */
+};
+
+/*
+ * Builds a LUT blob of the given size, whose entries map evenly-spaced
+ * inputs from 0 to 1 to outputs, one curve per channel. Returns 0 if KMS
+ * won't take it, which just leaves that stage out.
+ */
+static uint32_t lut_blob_create(struct output *output, uint32_t size,
+				enum lut_kind kind, const double scale[3])
+{
+	struct drm_color_lut *lut;
+	uint32_t blob_id = 0;
+	int ret;
+
+	assert(size >= 2);
+	lut = calloc(size, sizeof(*lut));
+	assert(lut);
+
+	for (uint32_t i = 0; i < size; i++) {
+		double x = (double) i / (size - 1);
+		double v[3];
+
+		for (int c = 0; c < 3; c++) {
+			switch (kind) {
+			case LUT_DEGAMMA:
+				v[c] = srgb_eotf(x);
+				break;
+			case LUT_GAMMA:
+				v[c] = colour_encode(output, x);
+				break;
+			case LUT_WHOLE:
+				v[c] = colour_encode(output,
+						     scale[c] * srgb_eotf(x));
+				break;
+			}
+		}
+
+		lut[i].red = lut_entry(v[0]);
+		lut[i].green = lut_entry(v[1]);
+		lut[i].blue = lut_entry(v[2]);
+	}
+
+	ret = drmModeCreatePropertyBlob(output->device->kms_fd, lut,
+					size * sizeof(*lut), &blob_id);
+	if (ret != 0) {
+		error("[%s] couldn't create LUT blob: %s\n", output->name,
+		      strerror(-ret));
+		blob_id = 0;
+	}
+
+	free(lut);
+	return blob_id;
+}
+
+/*
+ * Builds a CTM blob scaling each channel. CTM entries are S31.32 fixed
+ * point, in sign-magnitude rather than two's complement, but ours are never
+ * negative.
+ */
+static uint32_t ctm_blob_create(struct output *output, const double scale[3])
+{
+	struct drm_color_ctm ctm;
+	uint32_t blob_id = 0;
+	int ret;
+
+	memset(&ctm, 0, sizeof(ctm));
+	for (int c = 0; c < 3; c++)
+		ctm.matrix[c * 3 + c] = (uint64_t) llround(scale[c] * (1LL << 32));
+
+	ret = drmModeCreatePropertyBlob(output->device->kms_fd, &ctm,
+					sizeof(ctm), &blob_id);
+	if (ret != 0) {
+		error("[%s] couldn't create CTM blob: %s\n", output->name,
+		      strerror(-ret));
+		blob_id = 0;
+	}
+
+	return blob_id;
+}
+
+/*
+ * Replaces one of our blobs. The CRTC keeps its own reference to whatever it
+ * is showing, so we can destroy the old one straight away, even though the
+ * commit replacing it hasn't happened yet.
+ */
+static void blob_replace(struct output *output, uint32_t *blob_id,
+			 uint32_t new_id)
+{
+	if (*blob_id != 0)
+		drmModeDestroyPropertyBlob(output->device->kms_fd, *blob_id);
+	*blob_id = new_id;
+}
+
+/* Works the current settings out for wherever our transform runs. */
+static void colour_update(struct output *output)
+{
+	double scale[3];
+	bool identity;
+	uint32_t degamma = 0, ctm = 0, gamma = 0;
+
+	colour_scale(output, scale);
+	identity = colour_is_identity(output, scale);
+
+	switch (output->colour.mode) {
+	case COLOUR_MODE_PIPELINE:
+		if (identity)
+			break;
+		degamma = lut_blob_create(output,
+					  output->colour.degamma_lut_size,
+					  LUT_DEGAMMA, scale);
+		ctm = ctm_blob_create(output, scale);
+		gamma = lut_blob_create(output, output->colour.gamma_lut_size,
+					LUT_GAMMA, scale);
+		break;
+	case COLOUR_MODE_GAMMA_LUT:
+		if (!identity)
+			gamma = lut_blob_create(output,
+						output->colour.gamma_lut_size,
+						LUT_WHOLE, scale);
+		break;
+	case COLOUR_MODE_CTM:
+	case COLOUR_MODE_GPU:
+		/*
+		 * Without a LUT either side, we scale the encoded values,
+		 * which for a plain scale only differs by the exponent.
+		 */
+		for (int c = 0; c < 3; c++)
+			scale[c] = pow(scale[c], 1.0 / 2.2);
+		if (output->colour.mode == COLOUR_MODE_CTM) {
+			if (!identity)
+				ctm = ctm_blob_create(output, scale);
+			break;
+		}
+		for (int c = 0; c < 3; c++)
+			output->colour.frame_scale[c] = scale[c];
+		output->colour.frame_identity = identity;
+		output->colour.frame_serial++;
+		return;
+	}
+
+	blob_replace(output, &output->colour.degamma_blob_id, degamma);
+	blob_replace(output, &output->colour.ctm_blob_id, ctm);
+	blob_replace(output, &output->colour.gamma_blob_id, gamma);
+	output->colour.dirty = true;
+}
+
+/* Reads a number from the environment, if it is set and in range. */
+static bool colour_getenv(const char *name, double min, double max,
+			  double *val)
+{
+	const char *str = getenv(name);
+	char *end;
+	double v;
+
+	if (!str)
+		return false;
+
+	v = strtod(str, &end);
+	if (end == str || *end != '\0' || v < min || v > max) {
+		error("ignoring %s=%s: should be from %g to %g\n", name, str,
+		      min, max);
+		return false;
+	}
+
+	*val = v;
+	return true;
+}
+
+void output_colour_init(struct output *output, uint32_t degamma_lut_size,
+			uint32_t gamma_lut_size)
+{
+	const struct drm_property_info *props = output->props.crtc;
+	bool have_degamma = props[WDRM_CRTC_DEGAMMA_LUT].prop_id &&
+			    degamma_lut_size >= 2;
+	bool have_gamma = props[WDRM_CRTC_GAMMA_LUT].prop_id &&
+			  gamma_lut_size >= 2;
+	bool have_ctm = props[WDRM_CRTC_CTM].prop_id != 0;
+	double kelvin = COLOUR_KELVIN_MAX;
+	double scale[3];
+
+	memset(&output->colour, 0, sizeof(output->colour));
+	output->colour.degamma_lut_size = degamma_lut_size;
+	output->colour.gamma_lut_size = gamma_lut_size;
+	output->colour.brightness = 1.0;
+	output->colour.gamma = 1.0;
+
+	colour_getenv("KMS_BRIGHTNESS", COLOUR_BRIGHTNESS_MIN, 1.0,
+		      &output->colour.brightness);
+	colour_getenv("KMS_GAMMA", 0.1, 10.0, &output->colour.gamma);
+	colour_getenv("KMS_NIGHT_LIGHT", COLOUR_KELVIN_MIN, COLOUR_KELVIN_MAX,
+		      &kelvin);
+	kelvin_to_rgb(kelvin, output->colour.white);
+	for (int c = 0; c < 3; c++)
+		output->colour.white[c] = srgb_eotf(output->colour.white[c]);
+
+	if (have_degamma && have_ctm && have_gamma)
+		output->colour.mode = COLOUR_MODE_PIPELINE;
+	else if (have_gamma)
+		output->colour.mode = COLOUR_MODE_GAMMA_LUT;
+	else if (have_ctm)
+		output->colour.mode = COLOUR_MODE_CTM;
+	else
+		output->colour.mode = COLOUR_MODE_GPU;
+
+	colour_scale(output, scale);
+	if (!colour_is_identity(output, scale))
+		printf("[%s] colour transform on %s\n", output->name,
+		       colour_mode_names[output->colour.mode]);
+	if (output->colour.gamma != 1.0 &&
+	    (output->colour.mode == COLOUR_MODE_CTM ||
+	     output->colour.mode == COLOUR_MODE_GPU))
+		printf("[%s] no gamma LUT; ignoring $KMS_GAMMA\n",
+		       output->name);
+
+	colour_update(output);
+}
+
+void output_colour_fini(struct output *output)
+{
+	blob_replace(output, &output->colour.degamma_blob_id, 0);
+	blob_replace(output, &output->colour.ctm_blob_id, 0);
+	blob_replace(output, &output->colour.gamma_blob_id, 0);
+}
+
+void output_colour_set_brightness(struct output *output, double brightness)
+{
+	output->colour.brightness_pending =
+		fmin(fmax(brightness, COLOUR_BRIGHTNESS_MIN), 1.0);
+}
+
+/*
+ * Called by the main loop as each frame begins, like the rest of the state a
+ * frame latches; see repaint_one_output(). A render thread only reads the
+ * frame_ fields, and only once it has been handed the frame.
+ */
+void output_colour_latch(struct output *output)
+{
+	double brightness = output->colour.brightness_pending;
+
+	if (brightness == 0.0)
+		return;
+
+	output->colour.brightness_pending = 0.0;
+	if (brightness == output->colour.brightness)
+		return;
+
+	output->colour.brightness = brightness;
+	colour_update(output);
+}
+
+bool output_colour_on_gpu(const struct output *output)
+{
+	return output->colour.mode == COLOUR_MODE_GPU &&
+	       !output->colour.frame_identity &&
+	       output->device->egl_dpy != EGL_NO_DISPLAY;
+}
@@ -0,0 +1,184 @@
+/*
+ * This file puts the pointer on a cursor plane of its own, so moving it
+ * never costs any rendering.
+ *
+ * The cursor image is a small arrow we draw once, into a dumb buffer of the
+ * size the device wants for its cursor planes (see DRM_CAP_CURSOR_WIDTH),
+ * and the buffer then stays on the plane for good: all pointer motion has
+ * to change is the plane's CRTC_X and CRTC_Y. When a frame is going out,
+ * those ride along in its commit; otherwise the main loop commits them on
+ * their own, taking in every motion since the last one, so the pointer moves
+ * once per vblank however long our frames take to render. See
+ * cursor_commit_wanted() in main.c.
+ *
+ * We take the first cursor plane the output has, and don't use it for
+ * layers; set $KMS_NO_CURSOR to leave it to them instead.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+/* How tall our arrow is, if the cursor buffer is big enough. */
+#define CURSOR_ARROW_SIZE 24
+
+/*
+ * Whether a pixel is inside our arrow: a triangle with its tip at the
+ * origin, a vertical left edge, and its right-hand corner two-thirds of the
+ * way down.
+ */
+static bool arrow_contains(int x, int y, int size)
+{
+	return x >= 0 && y >= 0 && 3 * x <= 2 * y && 2 * y + x <= 2 * size;
+}
+
+/*
+ * Draws a white arrow with a black outline, so it shows up on anything;
+ * everything else is left transparent.
+ */
+static void cursor_draw(uint32_t *pixels, unsigned int width,
+			unsigned int height)
+{
+	int size = CURSOR_ARROW_SIZE;
+
+	if (size > (int) width)
+		size = width;
+	if (size > (int) height)
+		size = height;
+
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			if (!arrow_contains(x, y, size))
+				continue;
+			if (!arrow_contains(x - 1, y, size) ||
+			    !arrow_contains(x + 1, y, size) ||
+			    !arrow_contains(x, y - 1, size) ||
+			    !arrow_contains(x, y + 1, size))
+				pixels[y * width + x] = 0xff000000;
+			else
+				pixels[y * width + x] = 0xffffffff;
+		}
+	}
+}
+
+void output_cursor_init(struct output *output)
+{
+	struct device *device = output->device;
+	unsigned int width = device->cursor_width;
+	unsigned int height = device->cursor_height;
+	struct plane *plane = NULL;
+	uint32_t *pixels;
+
+	if (getenv("KMS_NO_CURSOR"))
+		return;
+
+	for (unsigned int p = 0; p < output->num_planes && !plane; p++) {
+		if (output->planes[p].type == WDRM_PLANE_TYPE_CURSOR)
+			plane = &output->planes[p];
+	}
+	if (!plane) {
+		debug("[%s] no cursor plane; not showing a pointer\n",
+		      output->name);
+		return;
+	}
+
+	pixels = calloc(width * height, sizeof(*pixels));
+	assert(pixels);
+	cursor_draw(pixels, width, height);
+	output->cursor.buffer = buffer_create_argb(device, output, width,
+						   height, pixels);
+	free(pixels);
+	if (!output->cursor.buffer)
+		return;
+
+	output->cursor.plane = plane;
+	output->cursor.x = output->mode.hdisplay / 2;
+	output->cursor.y = output->mode.vdisplay / 2;
+	output->cursor.hot_x = 0;
+	output->cursor.hot_y = 0;
+	printf("[%s] pointer on cursor plane %u\n", output->name,
+	       plane->plane_id);
+}
+
+void output_cursor_fini(struct output *output)
+{
+	if (output->cursor.buffer)
+		buffer_destroy(output->cursor.buffer);
+	output->cursor.buffer = NULL;
+	output->cursor.plane = NULL;
+}
+
+/* Moves the pointer by the given distance, keeping it on the output. */
+void output_cursor_move(struct output *output, double dx, double dy)
+{
+	double max_x = output->mode.hdisplay - 1;
+	double max_y = output->mode.vdisplay - 1;
+
+	if (!output->cursor.plane)
+		return;
+
+	output->cursor.x += dx;
+	output->cursor.y += dy;
+	if (output->cursor.x < 0.0)
+		output->cursor.x = 0.0;
+	if (output->cursor.x > max_x)
+		output->cursor.x = max_x;
+	if (output->cursor.y < 0.0)
+		output->cursor.y = 0.0;
+	if (output->cursor.y > max_y)
+		output->cursor.y = max_y;
+}
+
+void output_cursor_state(const struct output *output,
+			 struct plane_state *state)
+{
+	const struct buffer *buffer = output->cursor.buffer;
+
+	memset(state, 0, sizeof(*state));
+	if (!output->cursor.plane)
+		return;
+
+	state->fb = output->cursor.buffer;
+	state->rect.x1 = (int32_t) output->cursor.x - output->cursor.hot_x;
+	state->rect.y1 = (int32_t) output->cursor.y - output->cursor.hot_y;
+	state->rect.x2 = state->rect.x1 + buffer->width;
+	state->rect.y2 = state->rect.y1 + buffer->height;
+}
+
+bool output_cursor_moved(const struct output *output)
+{
+	struct plane_state state;
+
+	if (!output->cursor.plane)
+		return false;
+
+	output_cursor_state(output, &state);
+	return memcmp(&state, &output->cursor.plane->committed,
+		      sizeof(state)) != 0;
+}
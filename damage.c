@@ -0,0 +1,325 @@
+/*
+ * This file implements damage tracking: working out which parts of the
+ * screen have changed between two frames, so we only have to repaint those.
+ *
+ * Between two steps of our animation, only thin strips around the quadrant
+ * boundaries actually change colour; everything else stays exactly as it
+ * was. The difficulty is that we don't render into the same buffer every
+ * frame: with several buffers per output, the buffer we're about to paint
+ * was last painted a few frames ago, so it's missing every change made since
+ * then, not just the latest one.
+ *
+ * So every buffer keeps its own accumulated damage. Whenever we paint a
+ * frame, we add that frame's changes to the damage of every other buffer; when
+ * we come to paint into a buffer, we repaint its accumulated damage plus the
+ * changes for the new frame, and it is then up to date. This is equivalent to
+ * the 'buffer age' approach used with EGL_EXT_buffer_age, and the age is kept
+ * alongside: a buffer whose age is 0 has never been painted, and is always
+ * repainted in full.
+ *
+ * The changes for the frame alone are also what KMS wants to know about: we
+ * pass them in the plane's FB_DAMAGE_CLIPS property (see kms.c), which lets
+ * drivers which have to copy or transmit our framebuffer (virtual GPUs, USB
+ * and SPI displays, panels with self-refresh) only update what changed.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+static int32_t min_i32(int32_t a, int32_t b)
+{
+	return (a < b) ? a : b;
+}
+
+static int32_t max_i32(int32_t a, int32_t b)
+{
+	return (a > b) ? a : b;
+}
+
+static bool rect_is_empty(const struct rect *r)
+{
+	return r->x1 >= r->x2 || r->y1 >= r->y2;
+}
+
+static bool rect_contains(const struct rect *outer, const struct rect *inner)
+{
+	return outer->x1 <= inner->x1 && outer->y1 <= inner->y1 &&
+	       outer->x2 >= inner->x2 && outer->y2 >= inner->y2;
+}
+
+/*
+ * Returns true, and stores their union in a, if two rectangles can be
+ * combined into a single rectangle without covering anything new: i.e. they
+ * span the same columns and touching or overlapping rows, or vice versa.
+ */
+static bool rect_try_merge(struct rect *a, const struct rect *b)
+{
+	if (a->x1 == b->x1 && a->x2 == b->x2 &&
+	    a->y1 <= b->y2 && b->y1 <= a->y2) {
+		a->y1 = min_i32(a->y1, b->y1);
+		a->y2 = max_i32(a->y2, b->y2);
+		return true;
+	}
+
+	if (a->y1 == b->y1 && a->y2 == b->y2 &&
+	    a->x1 <= b->x2 && b->x1 <= a->x2) {
+		a->x1 = min_i32(a->x1, b->x1);
+		a->x2 = max_i32(a->x2, b->x2);
+		return true;
+	}
+
+	return false;
+}
+
+static void rect_union(struct rect *a, const struct rect *b)
+{
+	a->x1 = min_i32(a->x1, b->x1);
+	a->y1 = min_i32(a->y1, b->y1);
+	a->x2 = max_i32(a->x2, b->x2);
+	a->y2 = max_i32(a->y2, b->y2);
+}
+
+bool rect_intersect(const struct rect *a, const struct rect *b,
+		    struct rect *out)
+{
+	out->x1 = max_i32(a->x1, b->x1);
+	out->y1 = max_i32(a->y1, b->y1);
+	out->x2 = min_i32(a->x2, b->x2);
+	out->y2 = min_i32(a->y2, b->y2);
+
+	return !rect_is_empty(out);
+}
+
+void region_init(struct region *region)
+{
+	region->num_rects = 0;
+}
+
+void region_init_rect(struct region *region, int32_t x1, int32_t y1,
+		      int32_t x2, int32_t y2)
+{
+	struct rect r = { x1, y1, x2, y2 };
+
+	region_init(region);
+	region_add_rect(region, &r);
+}
+
+bool region_is_empty(const struct region *region)
+{
+	return region->num_rects == 0;
+}
+
+void region_add_rect(struct region *region, const struct rect *rect)
+{
+	struct rect r = *rect;
+	unsigned int i = 0;
+
+	if (rect_is_empty(&r))
+		return;
+
+	/*
+	 * Fold the new rectangle together with any existing rectangle it
+	 * contains, is contained by, or can be merged with. Merging can
+	 * make the new rectangle mergeable with ones we've already passed,
+	 * so start again from the beginning whenever that happens.
+	 */
+	while (i < region->num_rects) {
+		struct rect *cur = &region->rects[i];
+
+		if (rect_contains(cur, &r))
+			return;
+
+		if (rect_contains(&r, cur) || rect_try_merge(&r, cur)) {
+			*cur = region->rects[--region->num_rects];
+			i = 0;
+			continue;
+		}
+
+		i++;
+	}
+
+	if (region->num_rects == REGION_MAX_RECTS) {
+		for (i = 1; i < region->num_rects; i++)
+			rect_union(&region->rects[0], &region->rects[i]);
+		rect_union(&region->rects[0], &r);
+		region->num_rects = 1;
+		return;
+	}
+
+	region->rects[region->num_rects++] = r;
+}
+
+void region_union(struct region *dst, const struct region *src)
+{
+	for (unsigned int i = 0; i < src->num_rects; i++)
+		region_add_rect(dst, &src->rects[i]);
+}
+
+void region_extents(const struct region *region, struct rect *extents)
+{
+	*extents = (struct rect) { 0, 0, 0, 0 };
+	if (region->num_rects == 0)
+		return;
+
+	*extents = region->rects[0];
+	for (unsigned int i = 1; i < region->num_rects; i++)
+		rect_union(extents, &region->rects[i]);
+}
+
+const uint32_t scene_colours[4] = {
+	0xff000000, /* top left: black */
+	0xffff0000, /* top right: red */
+	0xff0000ff, /* bottom left: blue */
+	0xffff00ff, /* bottom right: purple */
+};
+
+/*
+ * Pixels at or beyond width * anim_progress are red, and rows at or beyond
+ * height * anim_progress are blue; this returns the first such column and
+ * row.
+ */
+void scene_split(unsigned int width, unsigned int height, float anim_progress,
+		 unsigned int *split_x, unsigned int *split_y)
+{
+	float fx = width * anim_progress;
+	float fy = height * anim_progress;
+
+	*split_x = (unsigned int) fx;
+	*split_y = (unsigned int) fy;
+	if ((float) *split_x < fx)
+		(*split_x)++;
+	if ((float) *split_y < fy)
+		(*split_y)++;
+	if (*split_x > width)
+		*split_x = width;
+	if (*split_y > height)
+		*split_y = height;
+}
+
+void output_damage_frame(struct output *output, struct buffer *buffer,
+			 float anim_progress, struct region *repaint)
+{
+	struct region *frame = &buffer->frame_damage;
+	int32_t width = buffer->width;
+	int32_t height = buffer->height;
+	unsigned int split_x, split_y;
+
+	scene_split(buffer->width, buffer->height, anim_progress,
+		    &split_x, &split_y);
+
+	region_init(frame);
+	if (!output->damage.have_scene ||
+	    output->colour.frame_serial != output->damage.colour_serial ||
+	    (output->scroll.enabled &&
+	     output->scroll.frame_offset != output->damage.scroll_offset)) {
+		/*
+		 * Scrolling moves everything; see scroll.c. So does a new
+		 * colour transform we apply on the GPU; see colour.c.
+		 */
+		region_init_rect(frame, 0, 0, width, height);
+	} else if (!output->scroll.enabled) {
+		/*
+		 * Everything between the old and new boundaries changes
+		 * colour. GL rasterises the quad edges from floating-point
+		 * co-ordinates, which can land a pixel either side of our
+		 * integer split, so widen each strip by a pixel to cover it.
+		 */
+		int32_t x1 = min_i32(split_x, output->damage.split_x);
+		int32_t x2 = max_i32(split_x, output->damage.split_x);
+		int32_t y1 = min_i32(split_y, output->damage.split_y);
+		int32_t y2 = max_i32(split_y, output->damage.split_y);
+
+		if (x1 != x2) {
+			struct rect r = {
+				max_i32(x1 - 1, 0), 0,
+				min_i32(x2 + 1, width), height,
+			};
+			region_add_rect(frame, &r);
+		}
+		if (y1 != y2) {
+			struct rect r = {
+				0, max_i32(y1 - 1, 0),
+				width, min_i32(y2 + 1, height),
+			};
+			region_add_rect(frame, &r);
+		}
+	}
+
+	/*
+	 * Layers we composite are part of our content too: if one has moved,
+	 * or moved between a plane and being composited, both where it was
+	 * and where it is now have changed. So has all of one showing a new
+	 * external buffer.
+	 */
+	for (unsigned int i = 0; i < output->num_layers; i++) {
+		struct layer *layer = &output->layers[i];
+		struct rect bounds = { 0, 0, width, height };
+		struct rect now = { 0, 0, 0, 0 };
+		bool changed = layer->frame_changed;
+
+		layer->frame_changed = false;
+		if (!layer->plane)
+			rect_intersect(&layer->rect, &bounds, &now);
+		if (changed)
+			region_add_rect(frame, &now);
+		if (memcmp(&now, &layer->drawn, sizeof(now)) == 0)
+			continue;
+		region_add_rect(frame, &layer->drawn);
+		region_add_rect(frame, &now);
+		layer->drawn = now;
+	}
+
+	buffer->frame_damage_full = !output->damage.have_scene;
+	output->damage.have_scene = true;
+	output->damage.split_x = split_x;
+	output->damage.split_y = split_y;
+	output->damage.scroll_offset = output->scroll.frame_offset;
+	output->damage.colour_serial = output->colour.frame_serial;
+
+	for (unsigned int i = 0; i < output->num_buffers; i++) {
+		struct buffer *other = output->buffers[i];
+
+		if (!other || other == buffer || other->age == 0)
+			continue;
+		region_union(&other->damage, frame);
+		other->age++;
+	}
+
+	if (buffer->age == 0) {
+		region_init_rect(repaint, 0, 0, width, height);
+	} else {
+		*repaint = buffer->damage;
+		region_union(repaint, frame);
+	}
+
+	buffer->age = 1;
+	region_init(&buffer->damage);
+}
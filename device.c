@@ -11,9 +11,11 @@
  * In case logind can't be used, we fall back to direct VT handling, in which
  * case this sample needs to run as root.
  *
- * VT switching is currently unimplemented. An example of how to implement VT
- * switching is found in launcher-direct.c from Weston for direct use of VT,
- * and in the full logind.c sources of wlroots when going over logind.
+ * With logind, we follow VT switches: logind pauses and resumes our devices
+ * as the user switches away and back, and main.c stops and restarts
+ * committing to match; see logind.c. Direct VT handling doesn't support VT
+ * switching yet. An example of how to implement it is found in
+ * launcher-direct.c from Weston.
  */
 
 /*
@@ -45,6 +47,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -60,6 +63,11 @@
 
 #include "kms-quads.h"
 
+/* Added in Linux 6.8, so older libdrm headers don't have it. */
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
 /*
  * Set up the VT/TTY so it runs in graphics mode and lets us handle our own
  * input. This uses the VT specified in $TTYNO if specified, or the current VT
@@ -165,24 +173,113 @@ static int vt_setup(struct device *device)
 
 static void vt_reset(struct device *device)
 {
+	if (device->vt_fd < 0)
+		return;
+
 	ioctl(device->vt_fd, KDSKBMODE, device->saved_kb_mode);
 	ioctl(device->vt_fd, KDSETMODE, KD_TEXT);
 }
 
 /*
- * Open a single KMS device, enumerate its resources, and attempt to find
- * usable outputs.
+ * KMS gives us completion events by CRTC ID, which are arbitrary object IDs
+ * rather than indices, so we keep our outputs in a small open-addressed hash
+ * table keyed on them. It never holds more than 32 entries in 64 slots, so
+ * a lookup almost always lands on the right output first time.
+ */
+static void device_map_crtc(struct device *device, struct output *output)
+{
+	unsigned int slot = output->crtc_id % DEVICE_CRTC_MAP_SIZE;
+
+	while (device->crtc_map[slot])
+		slot = (slot + 1) % DEVICE_CRTC_MAP_SIZE;
+	device->crtc_map[slot] = output;
+}
+
+/* Outputs come and go on hotplug, so we rebuild the table from scratch. */
+static void device_remap_crtcs(struct device *device)
+{
+	memset(device->crtc_map, 0, sizeof(device->crtc_map));
+	for (int i = 0; i < device->num_outputs; i++)
+		device_map_crtc(device, device->outputs[i]);
+}
+
+struct output *device_output_for_crtc(struct device *device, uint32_t crtc_id)
+{
+	unsigned int slot = crtc_id % DEVICE_CRTC_MAP_SIZE;
+
+	for (int i = 0; i < DEVICE_CRTC_MAP_SIZE; i++) {
+		struct output *output = device->crtc_map[slot];
+
+		if (!output)
+			return NULL;
+		if (output->crtc_id == crtc_id)
+			return output;
+		slot = (slot + 1) % DEVICE_CRTC_MAP_SIZE;
+	}
+
+	return NULL;
+}
+
+/* The output using a plane as its primary or for a layer, if any. */
+struct output *device_output_for_plane(struct device *device,
+				       uint32_t plane_id)
+{
+	for (int i = 0; i < device->num_outputs; i++) {
+		struct output *output = device->outputs[i];
+
+		if (output->primary_plane_id == plane_id)
+			return output;
+		for (unsigned int p = 0; p < output->num_planes; p++) {
+			if (output->planes[p].plane_id == plane_id)
+				return output;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * drmModeGetConnector() has the driver probe the connector afresh, which
+ * usually means reading the display's EDID over DDC and takes tens of
+ * milliseconds for each connector. The kernel probed every connector when
+ * it found the device, and keeps its state up to date on hotplug, so what
+ * it already knows is almost always good enough; we only force a probe for
+ * connectors it doesn't know the state of, or which claim to be connected
+ * but have never been probed.
+ */
+static drmModeConnectorPtr device_get_connector(struct device *device,
+						uint32_t connector_id)
+{
+	drmModeConnectorPtr connector;
+
+	connector = drmModeGetConnectorCurrent(device->kms_fd, connector_id);
+	if (connector &&
+	    (connector->connection == DRM_MODE_UNKNOWNCONNECTION ||
+	     (connector->connection == DRM_MODE_CONNECTED &&
+	      connector->count_modes == 0))) {
+		drmModeFreeConnector(connector);
+		connector = drmModeGetConnector(device->kms_fd, connector_id);
+	}
+
+	return connector;
+}
+
+/*
+ * Open a single KMS device and make sure we are its master; everything
+ * else about it is found out by device_probe().
  */
 static struct device *device_open(struct logind *session, const char *filename)
 {
 	struct device *ret = calloc(1, sizeof(*ret));
-	const char *gbm_env;
-	drmModePlaneResPtr plane_res;
 	drm_magic_t magic;
-	uint64_t cap;
-	int err;
+	struct stat st;
 
 	assert(ret);
+	arena_init(&ret->arena, ARENA_DEVICE_BLOCK_SIZE);
+	arena_init(&ret->frame_arena, ARENA_FRAME_BLOCK_SIZE);
+	ret->render_event_fd = -1;
+	ret->vt_fd = -1;
+	snprintf(ret->node, sizeof(ret->node), "%s", filename);
 
 	/*
 	 * Open the device and ensure we have support for universal planes and
@@ -211,11 +308,52 @@ static struct device *device_open(struct logind *session, const char *filename)
 		goto err_fd;
 	}
 
+	if (fstat(ret->kms_fd, &st) == 0)
+		ret->devnum = st.st_rdev;
+
+	return ret;
+
+err_fd:
+	if (session)
+		logind_release_device(session, ret->kms_fd);
+	else
+		close(ret->kms_fd);
+err:
+	free(ret);
+	return NULL;
+}
+
+static void device_close(struct logind *session, struct device *device)
+{
+	if (session)
+		logind_release_device(session, device->kms_fd);
+	else
+		close(device->kms_fd);
+	arena_fini(&device->arena);
+	arena_fini(&device->frame_arena);
+	free(device);
+}
+
+/*
+ * Enumerate a device's resources, attempt to find usable outputs, and set
+ * up rendering with its GPU if we want to. None of this touches anything
+ * but the device itself, so devices_create() probes every device at once:
+ * the round trips to the driver, and lighting up EGL in particular, are a
+ * good part of our startup time. Returns false if the device turns out not
+ * to be usable, leaving our caller to close it.
+ */
+static bool device_probe(struct device *ret, bool want_gpu)
+{
+	const char *filename = ret->node;
+	drmModePlaneResPtr plane_res;
+	uint64_t cap;
+	int err;
+
 	err = drmSetClientCap(ret->kms_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
 	err |= drmSetClientCap(ret->kms_fd, DRM_CLIENT_CAP_ATOMIC, 1);
 	if (err != 0) {
 		fprintf(stderr, "no support for universal planes or atomic\n");
-		goto err_fd;
+		return false;
 	}
 
 	err = drmGetCap(ret->kms_fd, DRM_CAP_ADDFB2_MODIFIERS, &cap);
@@ -228,6 +366,24 @@ static struct device *device_open(struct logind *session, const char *filename)
 	debug("device %s clock monotonic timestamps\n",
 	      (ret->monotonic_timestamps) ? "supports" : "does not support");
 
+	/*
+	 * Older kernels only allow asynchronous flips through the legacy
+	 * drmModePageFlip(); this tells us atomic commits can use them too.
+	 */
+	err = drmGetCap(ret->kms_fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap);
+	ret->atomic_async_flip = (err == 0 && cap != 0);
+	debug("device %s atomic async page flips\n",
+	      (ret->atomic_async_flip) ? "supports" : "does not support");
+
+	/*
+	 * Many cursor planes only take buffers of exactly this size; 64x64
+	 * is what the kernel assumes for drivers which don't say.
+	 */
+	err = drmGetCap(ret->kms_fd, DRM_CAP_CURSOR_WIDTH, &cap);
+	ret->cursor_width = (err == 0 && cap != 0) ? cap : 64;
+	err = drmGetCap(ret->kms_fd, DRM_CAP_CURSOR_HEIGHT, &cap);
+	ret->cursor_height = (err == 0 && cap != 0) ? cap : 64;
+
 	/*
 	 * The two 'resource' properties describe the KMS capabilities for
 	 * this device.
@@ -236,7 +392,7 @@ static struct device *device_open(struct logind *session, const char *filename)
 	if (!ret->res) {
 		fprintf(stderr, "couldn't get card resources for %s\n",
 			filename);
-		goto err_fd;
+		return false;
 	}
 
 	plane_res = drmModeGetPlaneResources(ret->kms_fd);
@@ -251,17 +407,16 @@ static struct device *device_open(struct logind *session, const char *filename)
 		goto err_plane_res;
 	}
 
-	ret->planes = calloc(plane_res->count_planes, sizeof(*ret->planes));
+	ret->planes = arena_alloc(&ret->arena, plane_res->count_planes *
+					       sizeof(*ret->planes));
 	ret->num_planes = plane_res->count_planes;
-	assert(ret->planes);
 	for (unsigned int i = 0; i < plane_res->count_planes; i++) {
 		ret->planes[i] = drmModeGetPlane(ret->kms_fd, plane_res->planes[i]);
 		assert(ret->planes[i]);
 	}
 
-	ret->outputs = calloc(ret->res->count_connectors,
-			      sizeof(*ret->outputs));
-	assert(ret->outputs);
+	ret->outputs = arena_alloc(&ret->arena, ret->res->count_connectors *
+						sizeof(*ret->outputs));
 
 	/*
 	 * Go through our connectors one by one and try to find a usable
@@ -271,20 +426,24 @@ static struct device *device_open(struct logind *session, const char *filename)
 	 */
 	for (int i = 0; i < ret->res->count_connectors; i++) {
 		drmModeConnectorPtr connector =
-			drmModeGetConnector(ret->kms_fd,
-					    ret->res->connectors[i]);
+			device_get_connector(ret, ret->res->connectors[i]);
 		struct output *output = output_create(ret, connector);
 
 		if (!output)
 			continue;
 
 		ret->outputs[ret->num_outputs++] = output;
+		device_map_crtc(ret, output);
 	}
 
-	if (ret->num_outputs == 0) {
-		fprintf(stderr, "device %s has no active outputs\n", filename);
-		goto err_outputs;
-	}
+	/*
+	 * A device with nothing plugged in yet is still worth keeping, so
+	 * that plugging a monitor into it later works; see
+	 * device_connector_rescan(). We set it up in full regardless, so it
+	 * is ready to render as soon as it has an output.
+	 */
+	if (ret->num_outputs == 0)
+		printf("device %s has no monitors connected yet\n", filename);
 
 	/*
 	 * If using GPU rendering, create a GBM device to allocate buffers
@@ -292,48 +451,116 @@ static struct device *device_open(struct logind *session, const char *filename)
 	 *
 	 * We don't create surfaces or contexts here; we'll do that later
 	 * in per-output setup.
+	 *
+	 * Not every KMS device has a GPU we can render with, such as display
+	 * controllers on SoCs or USB displays. Those can still have another
+	 * device render for them, or fall back to software rendering; see
+	 * devices_create().
 	 */
-	if (!getenv("KMS_NO_GBM"))
+	if (want_gpu)
 		ret->gbm_device = gbm_create_device(ret->kms_fd);
-	if (ret->gbm_device && !device_egl_setup(ret))
-		goto err_gbm;
+	if (ret->gbm_device && !device_egl_setup(ret)) {
+		gbm_device_destroy(ret->gbm_device);
+		ret->gbm_device = NULL;
+		ret->egl_dpy = EGL_NO_DISPLAY;
+	}
+	if (ret->gbm_device)
+		ret->render_device = ret;
 
-	printf("using device %s with %d outputs and %s rendering\n",
-	       filename, ret->num_outputs,
-	       (ret->gbm_device) ? "GPU" : "software");
-	return ret;
+	return true;
 
-err_gbm:
-	gbm_device_destroy(ret->gbm_device);
-err_outputs:
-	free(ret->outputs);
-	for (int i = 0; i < ret->num_planes; i++)
-		drmModeFreePlane(ret->planes[i]);
-	free(ret->planes);
 err_plane_res:
 	drmModeFreePlaneResources(plane_res);
 err_res:
 	drmModeFreeResources(ret->res);
-err_fd:
-	if (session)
-		logind_release_device(session, ret->kms_fd);
-	else
-		close(ret->kms_fd);
-err:
-	free(ret);
+	return false;
+}
+
+struct device_probe_job {
+	struct device *device;
+	bool want_gpu;
+	bool ok;
+	bool threaded;
+	pthread_t thread;
+};
+
+static void *device_probe_thread(void *data)
+{
+	struct device_probe_job *job = data;
+
+	job->ok = device_probe(job->device, job->want_gpu);
 	return NULL;
 }
 
 /*
- * Enumerate all KMS devices and find one we can use; also set up our TTY for
- * graphics mode if we find one.
+ * Open a DRM node purely for rendering, with no outputs and without
+ * touching the VT. Render nodes can be opened by anyone; primary nodes work
+ * too, as long as we don't need KMS on them.
  */
-struct device *device_create(void)
+static struct device *device_open_render(const char *filename)
 {
-	struct logind *session;
 	struct device *ret;
+	int fd;
+
+	fd = open(filename, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	ret = calloc(1, sizeof(*ret));
+	assert(ret);
+	arena_init(&ret->arena, ARENA_DEVICE_BLOCK_SIZE);
+	arena_init(&ret->frame_arena, ARENA_FRAME_BLOCK_SIZE);
+	ret->kms_fd = fd;
+	ret->vt_fd = -1;
+	ret->render_event_fd = -1;
+	ret->monotonic_timestamps = true;
+	snprintf(ret->node, sizeof(ret->node), "%s", filename);
+
+	ret->gbm_device = gbm_create_device(fd);
+	if (!ret->gbm_device || !device_egl_setup(ret)) {
+		if (ret->gbm_device)
+			gbm_device_destroy(ret->gbm_device);
+		close(fd);
+		free(ret);
+		return NULL;
+	}
+	ret->render_device = ret;
+
+	/* We never create KMS framebuffers, so there is no plane to
+	 * negotiate modifiers with. */
+	ret->fb_modifiers = false;
+
+	return ret;
+}
+
+/*
+ * Enumerate all KMS devices and open every one we can use, so we drive
+ * every output on every card; also set up our TTY for graphics mode if we
+ * find any. Returns an array of devices, with their number in num_devices.
+ *
+ * Each device renders with its own GPU if it has one. KMS devices without
+ * a GPU we can use borrow the first one which does: the render GPU allocates
+ * buffers for them, which they import through PRIME, sharing the dma-buf
+ * between the two drivers (see buffer_egl_create()). If nothing can render,
+ * we fall back to dumb buffers and software rendering.
+ *
+ * $KMS_RENDER_DEVICE names a DRM node, such as /dev/dri/renderD129, to do
+ * all our rendering on instead; for instance, to use a discrete GPU for
+ * outputs which are connected to an integrated one. $KMS_NO_GBM disables
+ * GPU rendering altogether.
+ */
+struct device **devices_create(int *num_devices)
+{
+	const char *render_env = getenv("KMS_RENDER_DEVICE");
+	bool no_gbm = getenv("KMS_NO_GBM") != NULL;
+	struct device **ret = NULL;
+	struct device *gpu = NULL;
+	struct device_probe_job *jobs;
+	struct logind *session;
 	drmDevicePtr *devices;
-	int num_devices;
+	int num_drm_devices;
+	int num_jobs = 0;
+	int count = 0;
 
 #if defined(HAVE_LOGIND)
 	session = logind_create();
@@ -346,20 +573,28 @@ struct device *device_create(void)
 	session = NULL;
 #endif
 
-	num_devices = drmGetDevices2(0, NULL, 0);
-	if (num_devices == 0) {
+	num_drm_devices = drmGetDevices2(0, NULL, 0);
+	if (num_drm_devices <= 0) {
 		fprintf(stderr, "no DRM devices available\n");
 		goto err;
 	}
 
-	devices = calloc(num_devices, sizeof(*devices));
+	devices = calloc(num_drm_devices, sizeof(*devices));
 	assert(devices);
-	num_devices = drmGetDevices2(0, devices, num_devices);
-	printf("%d DRM devices available\n", num_devices);
+	num_drm_devices = drmGetDevices2(0, devices, num_drm_devices);
+	printf("%d DRM devices available\n", num_drm_devices);
 
-	for (int i = 0; i < num_devices; i++) {
+	/* One more slot, for a render-only $KMS_RENDER_DEVICE. */
+	ret = calloc(num_drm_devices + 1, sizeof(*ret));
+	assert(ret);
+	jobs = calloc(num_drm_devices, sizeof(*jobs));
+	assert(jobs);
+
+	for (int i = 0; i < num_drm_devices; i++) {
 		drmDevicePtr candidate = devices[i];
-		int fd;
+		const char *node;
+		struct device *device;
+		bool want_gpu;
 
 		/*
 		 * We need /dev/dri/cardN nodes for modesetting, not render
@@ -369,54 +604,386 @@ struct device *device_create(void)
 		 */
 		if (!(candidate->available_nodes & (1 << DRM_NODE_PRIMARY)))
 			continue;
+		node = candidate->nodes[DRM_NODE_PRIMARY];
 
-		ret = device_open(session, candidate->nodes[DRM_NODE_PRIMARY]);
-		if (ret)
-			break;
+		/*
+		 * With $KMS_RENDER_DEVICE, only that device renders, whether
+		 * it is named by its primary or its render node.
+		 */
+		want_gpu = !no_gbm;
+		if (render_env) {
+			want_gpu &= (strcmp(render_env, node) == 0 ||
+				     ((candidate->available_nodes &
+				       (1 << DRM_NODE_RENDER)) &&
+				      strcmp(render_env,
+					     candidate->nodes[DRM_NODE_RENDER]) == 0));
+		}
+
+		device = device_open(session, node);
+		if (!device)
+			continue;
+
+		jobs[num_jobs].device = device;
+		jobs[num_jobs].want_gpu = want_gpu;
+		num_jobs++;
 	}
 
-	drmFreeDevices(devices, num_devices);
-	if (!ret) {
+	drmFreeDevices(devices, num_drm_devices);
+
+	/*
+	 * Taking devices goes through logind's D-Bus connection, which isn't
+	 * thread-safe, so we do that one device at a time above; then probe
+	 * them all at once, keeping the order we found them in.
+	 */
+	for (int i = 0; num_jobs > 1 && i < num_jobs; i++)
+		jobs[i].threaded = pthread_create(&jobs[i].thread, NULL,
+						  device_probe_thread,
+						  &jobs[i]) == 0;
+
+	for (int i = 0; i < num_jobs; i++) {
+		struct device *device = jobs[i].device;
+
+		if (jobs[i].threaded)
+			pthread_join(jobs[i].thread, NULL);
+		else
+			device_probe_thread(&jobs[i]);
+		if (!jobs[i].ok) {
+			device_close(session, device);
+			continue;
+		}
+
+		ret[count++] = device;
+		if (!gpu && device->gbm_device)
+			gpu = device;
+	}
+	free(jobs);
+	if (count == 0) {
 		fprintf(stderr, "couldn't find any suitable KMS device\n");
 		goto err;
 	}
 
-	if (!session && vt_setup(ret) != 0) {
+	/*
+	 * The render device may have no outputs of its own, in which case we
+	 * open it just for rendering.
+	 */
+	if (render_env && !no_gbm && !gpu) {
+		gpu = device_open_render(render_env);
+		if (gpu)
+			ret[count++] = gpu;
+		else
+			fprintf(stderr, "couldn't render with %s\n", render_env);
+	}
+
+	/*
+	 * KMS devices without outputs yet still get set up to render, for
+	 * when a monitor is plugged in; only a render-only device, which has
+	 * no KMS resources, is left out.
+	 */
+	for (int i = 0; i < count; i++) {
+		struct device *device = ret[i];
+
+		if (!device->res)
+			continue;
+
+		if (!device->gbm_device && gpu && !device_egl_share(device, gpu))
+			fprintf(stderr, "device %s can't import buffers from %s\n",
+				device->node, gpu->node);
+
+		printf("using device %s with %d outputs and %s rendering%s%s\n",
+		       device->node, device->num_outputs,
+		       (device->gbm_device) ? "GPU" : "software",
+		       (device->render_device &&
+			device->render_device != device) ? " on " : "",
+		       (device->render_device &&
+			device->render_device != device) ?
+				device->render_device->node : "");
+	}
+
+	/*
+	 * There's only one VT however many devices we have, so it belongs to
+	 * the first.
+	 */
+	if (!session && vt_setup(ret[0]) != 0) {
 		fprintf(stderr, "couldn't set up VT for graphics mode\n");
 		goto err_dev;
 	}
 
-	ret->session = session;
+	for (int i = 0; i < count; i++)
+		ret[i]->session = session;
+	*num_devices = count;
 	return ret;
 
 err_dev:
-	device_destroy(ret);
+	devices_destroy(ret, count);
+	return NULL;
 err:
+	free(ret);
 	if (session)
 	    logind_destroy(session);
 	return NULL;
 }
 
+/*
+ * Open a device purely for rendering, with no outputs and without touching
+ * the VT. This is used by the benchmark mode, which needs to run on machines
+ * which only have a render node, or where another display server is already
+ * driving KMS.
+ *
+ * Render nodes are preferred, since anyone can open them; we fall back to a
+ * primary node if that is all there is.
+ */
+struct device *device_create_render_only(void)
+{
+	static const int node_types[] = { DRM_NODE_RENDER, DRM_NODE_PRIMARY };
+	struct device *ret = NULL;
+	drmDevicePtr *devices;
+	int num_devices;
+
+	num_devices = drmGetDevices2(0, NULL, 0);
+	if (num_devices <= 0) {
+		fprintf(stderr, "no DRM devices available\n");
+		return NULL;
+	}
+
+	devices = calloc(num_devices, sizeof(*devices));
+	assert(devices);
+	num_devices = drmGetDevices2(0, devices, num_devices);
+
+	for (size_t n = 0; n < ARRAY_LENGTH(node_types) && !ret; n++) {
+		for (int i = 0; i < num_devices && !ret; i++) {
+			drmDevicePtr candidate = devices[i];
+			int node = node_types[n];
+
+			if (!(candidate->available_nodes & (1 << node)))
+				continue;
+
+			ret = device_open_render(candidate->nodes[node]);
+			if (ret)
+				printf("using %s for render-only operation\n",
+				       candidate->nodes[node]);
+		}
+	}
+
+	drmFreeDevices(devices, num_devices);
+	if (!ret)
+		fprintf(stderr, "couldn't find any device usable for rendering\n");
+	return ret;
+}
+
 void device_destroy(struct device *device)
 {
 	struct output *output;
 
 	for (int i = 0; i < device->num_outputs; i++)
 		output_destroy(device->outputs[i]);
-	free(device->outputs);
 
-	if (device->gbm_device)
+	if (device->render_event_fd >= 0)
+		close(device->render_event_fd);
+
+	/* Devices rendering with another's GPU only borrow its GBM device. */
+	if (device->gbm_device && device->render_device == device)
 		gbm_device_destroy(device->gbm_device);
 
 	if (device->session)
 	{
 		logind_release_device(device->session, device->kms_fd);
-		logind_destroy(device->session);
 	}
 	else
 	{
 		close(device->kms_fd);
 		vt_reset(device);
 	}
+	arena_fini(&device->arena);
+	arena_fini(&device->frame_arena);
 	free(device);
 }
+
+/*
+ * Our copies of the device's planes say which CRTC each was on when we
+ * started, which output_create() uses to find free ones; by the time a
+ * monitor is plugged in, we have likely moved some of them, and unplugged
+ * outputs have let others go.
+ */
+static void device_planes_refresh(struct device *device)
+{
+	for (int i = 0; i < device->num_planes; i++) {
+		drmModePlanePtr plane = drmModeGetPlane(device->kms_fd,
+							device->planes[i]->plane_id);
+
+		if (!plane)
+			continue;
+		drmModeFreePlane(device->planes[i]);
+		device->planes[i] = plane;
+	}
+}
+
+/*
+ * Looks at one connector afresh after a hotplug event, and works out
+ * whether it has been plugged in or unplugged since we last looked. A newly
+ * connected one gets an output, which is added to the device and returned
+ * for our caller to set up. An output whose connector has gone away is
+ * returned for our caller to stop using, and then to hand to
+ * device_output_remove(). Outputs whose connector is still there are left
+ * alone, as is everything else on the device.
+ *
+ * New connectors, from DisplayPort MST hubs, aren't picked up: we only look
+ * at those the device had when we started.
+ */
+enum connector_change device_connector_rescan(struct device *device,
+					      uint32_t connector_id,
+					      struct output **output)
+{
+	drmModeConnectorPtr connector;
+	bool connected;
+
+	*output = NULL;
+	for (int i = 0; i < device->num_outputs; i++) {
+		if (device->outputs[i]->connector_id == connector_id)
+			*output = device->outputs[i];
+	}
+
+	connector = device_get_connector(device, connector_id);
+	if (!connector)
+		return CONNECTOR_UNCHANGED;
+	connected = (connector->connection == DRM_MODE_CONNECTED &&
+		     connector->count_modes > 0);
+
+	if (*output) {
+		drmModeFreeConnector(connector);
+		if (connected) {
+			*output = NULL;
+			return CONNECTOR_UNCHANGED;
+		}
+		printf("[%s] unplugged\n", (*output)->name);
+		return CONNECTOR_REMOVED;
+	}
+
+	if (!connected) {
+		drmModeFreeConnector(connector);
+		return CONNECTOR_UNCHANGED;
+	}
+
+	device_planes_refresh(device);
+	*output = output_create(device, connector);
+	drmModeFreeConnector(connector);
+	if (!*output)
+		return CONNECTOR_UNCHANGED;
+
+	assert(device->num_outputs < device->res->count_connectors);
+	device->outputs[device->num_outputs++] = *output;
+	device_map_crtc(device, *output);
+	printf("[%s] plugged in\n", (*output)->name);
+
+	return CONNECTOR_ADDED;
+}
+
+/*
+ * Switches an unplugged output off and destroys it. Our caller must have
+ * stopped rendering and committing for it already.
+ */
+void device_output_remove(struct device *device, struct output *output)
+{
+	int i;
+
+	for (i = 0; i < device->num_outputs; i++) {
+		if (device->outputs[i] == output)
+			break;
+	}
+	assert(i < device->num_outputs);
+	memmove(&device->outputs[i], &device->outputs[i + 1],
+		(device->num_outputs - i - 1) * sizeof(*device->outputs));
+	device->num_outputs--;
+	device_remap_crtcs(device);
+
+	if (!device->paused && output_disable(output) != 0)
+		error("[%s] couldn't switch off unplugged output\n",
+		      output->name);
+	output_destroy(output);
+}
+
+struct device *devices_find(struct device **devices, int num_devices,
+			    dev_t devnum)
+{
+	for (int i = 0; i < num_devices; i++) {
+		if (devices[i]->devnum == devnum)
+			return devices[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * When our session is switched away from, we lose DRM master, so we can no
+ * longer commit; everything else we have on the device, from GEM handles
+ * and framebuffers to the GBM device and EGL contexts, belongs to our open
+ * file and stays where it is.
+ */
+void device_pause(struct device *device)
+{
+	if (device->paused)
+		return;
+
+	printf("%s paused\n", device->node);
+	device->paused = true;
+}
+
+/*
+ * logind gives us master back on the same open file it handed us in
+ * TakeDevice, so the FD it sends with ResumeDevice refers to the file we
+ * already have, and we keep using ours; replacing it with a different open
+ * file would lose every framebuffer and GEM handle we had. Someone else
+ * has had the device in the meantime, so the next commit for each output
+ * must carry its full state, and a modeset; see main.c.
+ */
+bool device_resume(struct device *device)
+{
+	drm_magic_t magic;
+
+	if (!device->paused)
+		return true;
+
+	if (drmGetMagic(device->kms_fd, &magic) != 0 ||
+	    drmAuthMagic(device->kms_fd, magic) != 0) {
+		fprintf(stderr, "%s resumed, but we are not master\n",
+			device->node);
+		return false;
+	}
+
+	printf("%s resumed\n", device->node);
+	device->paused = false;
+
+	/* Monitors may have come and gone while we were away. */
+	device->hotplug.pending = true;
+	device->hotplug.connector_id = 0;
+	for (int i = 0; i < device->num_outputs; i++)
+		__atomic_store_n(&device->outputs[i]->atomic.full_state, true,
+				 __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*
+ * Destroys everything from devices_create(). Devices which render on
+ * another's GPU go first, as their outputs' EGL contexts and buffers belong
+ * to the other's EGLDisplay and GBM device.
+ */
+void devices_destroy(struct device **devices, int num_devices)
+{
+	struct logind *session = num_devices > 0 ? devices[0]->session : NULL;
+
+	for (int i = 0; i < num_devices; i++) {
+		if (devices[i]->render_device &&
+		    devices[i]->render_device != devices[i]) {
+			device_destroy(devices[i]);
+			devices[i] = NULL;
+		}
+	}
+	for (int i = 0; i < num_devices; i++) {
+		if (devices[i])
+			device_destroy(devices[i]);
+	}
+	free(devices);
+
+	if (session)
+		logind_destroy(session);
+}
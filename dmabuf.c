@@ -0,0 +1,416 @@
+/*
+ * This file implements showing buffers produced outside of us, such as
+ * frames from a video decoder or a camera, without copying them.
+ *
+ * Producers hand us their buffers as dma-bufs: one FD per plane of the
+ * image, with the layout of each given by its pitch and offset, and by the
+ * format and modifier for the image as a whole. buffer_import_dmabuf()
+ * imports the FDs into our KMS device as GEM handles, and wraps those in a
+ * framebuffer, just as we do for our own buffers; from then on the buffer
+ * can go on a plane like any other, and the display controller scans it out
+ * straight from the producer's memory.
+ *
+ * We show external buffers on layers (see layer.c): output_layer_attach()
+ * swaps the buffer a layer shows from the output's next frame on, and the
+ * plane assignment then finds a plane which will take it, with the same
+ * TEST_ONLY commits as for any other layer. If no plane takes the buffer,
+ * because of its format, modifier, size or scaling, or because KMS can't
+ * make a framebuffer of it at all, the renderer imports it as an EGLImage
+ * and composites it into our main content instead (see
+ * output_egl_draw_image() in egl-gles.c). That costs a GPU copy of the
+ * layer every frame it changes, but means anything EGL can sample is shown.
+ * The primary plane always carries our own main content, so external
+ * buffers only replace it where they cover it.
+ *
+ * Producers usually hand us buffers before they have finished writing to
+ * them, along with a fence which signals once they are done. On a plane,
+ * we pass the fence to KMS through the plane's IN_FENCE_FD, and it waits
+ * for the fence before scanning out the new buffer; when compositing, the
+ * GPU waits for it instead. Without explicit fencing, we wait for it on the
+ * CPU before the frame which first shows the buffer.
+ *
+ * A buffer we've replaced may still be on screen, or in a frame we've
+ * queued for KMS, so we only destroy it once nothing refers to it any more,
+ * which we check each time a commit completes.
+ *
+ * Set $KMS_DMABUF_DEMO to show a layer alternating between two dma-bufs
+ * every second, standing in for a video; we make these with dumb buffers,
+ * export them, and drop our own handles to them, so we import them exactly
+ * as we would a real producer's.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kms-quads.h"
+
+/* How many frames the demo shows each of its buffers for. */
+#define DMABUF_DEMO_FRAMES 60
+
+struct buffer *buffer_import_dmabuf(struct output *output,
+				    const struct dmabuf_attributes *attrs,
+				    int fence_fd)
+{
+	static uint64_t next_serial = 1;
+	struct device *device = output->device;
+	struct buffer *ret = calloc(1, sizeof(*ret));
+
+	assert(ret);
+	assert(attrs->num_planes > 0 && attrs->num_planes <= 4);
+
+	ret->output = output;
+	ret->format = attrs->format;
+	ret->modifier = attrs->modifier;
+	ret->width = attrs->width;
+	ret->height = attrs->height;
+	ret->render_fence_fd = -1;
+	ret->kms_fence_fd = -1;
+	ret->dmabuf.external = true;
+	ret->dmabuf.serial = next_serial++;
+	ret->dmabuf.num_planes = attrs->num_planes;
+	ret->dmabuf.fence_fd = fence_fd;
+	for (int i = 0; i < 4; i++)
+		ret->dmabuf.fds[i] = -1;
+
+	/*
+	 * Planes of one image often share a dma-buf, in which case PRIME
+	 * gives us the same handle for each; buffer_dmabuf_destroy() only
+	 * closes it once.
+	 */
+	for (int i = 0; i < attrs->num_planes; i++) {
+		ret->dmabuf.fds[i] = fcntl(attrs->fds[i], F_DUPFD_CLOEXEC, 0);
+		if (ret->dmabuf.fds[i] < 0) {
+			error("[%s] couldn't duplicate dma-buf FD: %s\n",
+			      output->name, strerror(errno));
+			goto err;
+		}
+		if (drmPrimeFDToHandle(device->kms_fd, attrs->fds[i],
+				       &ret->gem_handles[i]) != 0) {
+			error("[%s] failed to import dma-buf plane %d: %s\n",
+			      output->name, i, strerror(errno));
+			goto err;
+		}
+		ret->pitches[i] = attrs->pitches[i];
+		ret->offsets[i] = attrs->offsets[i];
+	}
+
+	/*
+	 * If KMS won't make a framebuffer of it, the buffer can still be
+	 * composited; leaving fb_id as 0 keeps it off the planes.
+	 */
+	if (!buffer_add_fb(device, ret)) {
+		ret->fb_id = 0;
+		printf("[%s] can't scan out %u x %u dma-buf (format 0x%08" PRIx32 ", modifier 0x%016" PRIx64 "); compositing it\n",
+		       output->name, ret->width, ret->height, ret->format,
+		       ret->modifier);
+	}
+
+	return ret;
+
+err:
+	buffer_destroy(ret);
+	return NULL;
+}
+
+void buffer_dmabuf_destroy(struct buffer *buffer)
+{
+	struct device *device = buffer->output->device;
+
+	for (int i = 0; i < 4 && buffer->gem_handles[i]; i++) {
+		struct drm_gem_close close_req = {
+			.handle = buffer->gem_handles[i],
+		};
+		bool dup = false;
+
+		for (int j = 0; j < i; j++)
+			dup |= buffer->gem_handles[j] == buffer->gem_handles[i];
+		if (!dup)
+			drmIoctl(device->kms_fd, DRM_IOCTL_GEM_CLOSE, &close_req);
+	}
+
+	for (int i = 0; i < 4; i++)
+		fd_replace(&buffer->dmabuf.fds[i], -1);
+	fd_replace(&buffer->dmabuf.fence_fd, -1);
+}
+
+/*
+ * This only touches layer->pending, which the renderer never looks at, so
+ * it is safe even while a frame is being rendered on a render thread.
+ */
+void output_layer_attach(struct output *output UNUSED, struct layer *layer,
+			 struct buffer *buffer)
+{
+	assert(buffer->dmabuf.external);
+
+	/* Nothing has seen a buffer we haven't latched yet. */
+	if (layer->pending)
+		buffer_destroy(layer->pending);
+	layer->pending = buffer;
+}
+
+bool output_layers_pending(struct output *output)
+{
+	for (unsigned int i = 0; i < output->num_layers; i++) {
+		if (output->layers[i].pending)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Whether KMS can wait for producers' fences on every plane we might put a
+ * layer on; the primary plane's IN_FENCE_FD support is what explicit_fencing
+ * tells us about.
+ */
+static bool planes_take_fences(struct output *output)
+{
+	if (!output->explicit_fencing)
+		return false;
+
+	for (unsigned int p = 0; p < output->num_planes; p++) {
+		if (&output->planes[p] != output->cursor.plane &&
+		    !output->planes[p].props[WDRM_PLANE_IN_FENCE_FD].prop_id)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Whether any frame still on screen, in flight or queued shows the buffer.
+ * We only look at each frame's snapshot of its layers, which is complete
+ * once the frame has been queued, and at what each plane was committed
+ * with, which only the main thread ever touches.
+ */
+static bool buffer_in_use(struct output *output, const struct buffer *fb)
+{
+	struct buffer *frames[BUFFER_QUEUE_MAX + 2];
+	unsigned int num_frames = 0;
+	unsigned int head = output->queue_head;
+	unsigned int tail = __atomic_load_n(&output->queue_tail,
+					    __ATOMIC_ACQUIRE);
+
+	if (output->buffer_last)
+		frames[num_frames++] = output->buffer_last;
+	if (output->buffer_pending)
+		frames[num_frames++] = output->buffer_pending;
+	for (unsigned int i = head; i != tail; i++)
+		frames[num_frames++] = output->queue[i % BUFFER_QUEUE_MAX];
+
+	for (unsigned int i = 0; i < num_frames; i++) {
+		for (unsigned int l = 0; l < frames[i]->num_layers; l++) {
+			if (frames[i]->layers[l].fb == fb)
+				return true;
+		}
+	}
+
+	for (unsigned int p = 0; p < output->num_planes; p++) {
+		if (output->planes[p].committed.fb == fb)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Called once a commit has completed, when buffer_last is what is on
+ * screen. A frame being rendered may still refer to anything the layer
+ * showed when it began, so we leave everything until it's done.
+ */
+void output_layers_release(struct output *output)
+{
+	if (output_render_busy(output))
+		return;
+
+	for (unsigned int i = 0; i < output->num_layers; i++) {
+		struct layer *layer = &output->layers[i];
+		unsigned int kept = 0;
+
+		for (unsigned int r = 0; r < layer->num_retired; r++) {
+			struct buffer *buffer = layer->retired[r];
+
+			if (buffer_in_use(output, buffer)) {
+				layer->retired[kept++] = buffer;
+				continue;
+			}
+			debug("[%s] releasing external buffer %" PRIu64 "\n",
+			      output->name, buffer->dmabuf.serial);
+			buffer_destroy(buffer);
+		}
+		layer->num_retired = kept;
+	}
+}
+
+/* Swaps the demo's buffers over every so often. */
+static void dmabuf_demo_update(struct output *output)
+{
+	struct buffer *buffer;
+
+	if (!output->dmabuf_demo.layer || output->dmabuf_demo.frames_left-- > 0)
+		return;
+
+	output->dmabuf_demo.frames_left = DMABUF_DEMO_FRAMES - 1;
+	buffer = buffer_import_dmabuf(output,
+				      &output->dmabuf_demo.frames[output->dmabuf_demo.shown],
+				      -1);
+	output->dmabuf_demo.shown ^= 1;
+	if (buffer)
+		output_layer_attach(output, output->dmabuf_demo.layer, buffer);
+}
+
+/*
+ * Applies whatever has been attached to our layers, just before a frame is
+ * rendered; the main loop calls this before handing the frame to the
+ * renderer, as with input. We only retire the buffers it replaces here;
+ * output_layers_release() destroys them when it is safe to.
+ *
+ * This changes the layers themselves, so a render thread mustn't be using
+ * them; see layer.c.
+ */
+void output_layers_latch(struct output *output)
+{
+	bool fences = planes_take_fences(output);
+
+	assert(!output_render_busy(output));
+	dmabuf_demo_update(output);
+
+	for (unsigned int i = 0; i < output->num_layers; i++) {
+		struct layer *layer = &output->layers[i];
+		struct buffer *buffer = layer->pending;
+
+		if (!buffer)
+			continue;
+
+		if (buffer->dmabuf.fence_fd >= 0 && !fences) {
+			linux_sync_file_wait(buffer->dmabuf.fence_fd);
+			fd_replace(&buffer->dmabuf.fence_fd, -1);
+		}
+
+		if (layer->buffer) {
+			assert(layer->num_retired < LAYER_MAX_RETIRED);
+			layer->retired[layer->num_retired++] = layer->buffer;
+		}
+		layer->buffer = buffer;
+		layer->pending = NULL;
+		layer->frame_changed = true;
+	}
+}
+
+/*
+ * Stands in for a producer: allocates a dumb buffer filled with a colour,
+ * exports it as a dma-buf, and drops our own handle to it, leaving the
+ * dma-buf FD as the only reference.
+ */
+static bool dmabuf_demo_frame(struct output *output, unsigned int width,
+			      unsigned int height, uint32_t argb,
+			      struct dmabuf_attributes *attrs)
+{
+	struct device *device = output->device;
+	struct buffer *buffer;
+	int fd;
+
+	buffer = buffer_create_solid(device, output, width, height, argb);
+	if (!buffer)
+		return false;
+
+	if (drmPrimeHandleToFD(device->kms_fd, buffer->gem_handles[0],
+			       DRM_CLOEXEC | DRM_RDWR, &fd) != 0) {
+		error("[%s] couldn't export dumb buffer: %s\n", output->name,
+		      strerror(errno));
+		buffer_destroy(buffer);
+		return false;
+	}
+
+	*attrs = (struct dmabuf_attributes) {
+		.width = buffer->width,
+		.height = buffer->height,
+		.format = buffer->format,
+		.modifier = DRM_FORMAT_MOD_LINEAR,
+		.num_planes = 1,
+		.fds = { fd, -1, -1, -1 },
+		.pitches = { buffer->pitches[0], },
+		.offsets = { buffer->offsets[0], },
+	};
+	buffer_destroy(buffer);
+
+	return true;
+}
+
+void output_dmabuf_demo_init(struct output *output)
+{
+	const uint32_t colours[2] = { 0xff2060c0, 0xffc06020 };
+	unsigned int width = output->mode.hdisplay / 3;
+	unsigned int height = output->mode.vdisplay / 3;
+	int32_t x = output->mode.hdisplay / 2;
+	int32_t y = output->mode.vdisplay / 16;
+	struct layer *layer;
+
+	if (!getenv("KMS_DMABUF_DEMO") ||
+	    output->num_layers == OUTPUT_MAX_LAYERS)
+		return;
+
+	for (unsigned int i = 0; i < 2; i++) {
+		if (!dmabuf_demo_frame(output, width, height, colours[i],
+				       &output->dmabuf_demo.frames[i])) {
+			if (i > 0)
+				close(output->dmabuf_demo.frames[0].fds[0]);
+			return;
+		}
+	}
+
+	/*
+	 * Without GL we can't composite the buffers, so we draw black where
+	 * they would be instead if no plane takes them.
+	 */
+	layer = &output->layers[output->num_layers++];
+	memset(layer, 0, sizeof(*layer));
+	layer->name = "video";
+	layer->colour = 0xff000000;
+	layer->rect = (struct rect) { x, y, x + width, y + height };
+
+	output->dmabuf_demo.layer = layer;
+	output->dmabuf_demo.shown = 0;
+	output->dmabuf_demo.frames_left = 0;
+	output->layers_changed = true;
+}
+
+void output_dmabuf_demo_fini(struct output *output)
+{
+	if (!output->dmabuf_demo.layer)
+		return;
+
+	for (unsigned int i = 0; i < 2; i++)
+		close(output->dmabuf_demo.frames[i].fds[0]);
+	output->dmabuf_demo.layer = NULL;
+}
@@ -73,6 +73,7 @@
 #define EDID_DESCRIPTOR_ALPHANUMERIC_DATA_STRING	0xfe
 #define EDID_DESCRIPTOR_DISPLAY_PRODUCT_NAME		0xfc
 #define EDID_DESCRIPTOR_DISPLAY_PRODUCT_SERIAL_NUMBER	0xff
+#define EDID_DESCRIPTOR_RANGE_LIMITS			0xfd
 #define EDID_OFFSET_DATA_BLOCKS				0x36
 #define EDID_OFFSET_LAST_BLOCK				0x6c
 #define EDID_OFFSET_PNPID				0x08
@@ -115,6 +116,29 @@ edid_parse_string(const uint8_t *data, char text[])
 		text[0] = '\0';
 }
 
+/*
+ * Parse a detailed timing descriptor into the preferred mode's size and
+ * refresh rate. The pixel clock is in units of 10kHz, and each dimension's
+ * active and blanking sizes are split into 8 low bits and 4 high bits.
+ */
+static void
+edid_parse_timing(const uint8_t *data, struct edid_info *edid)
+{
+	uint64_t clock_khz = ((uint32_t) data[1] << 8 | data[0]) * 10;
+	uint32_t hactive = data[2] | ((data[4] & 0xf0) << 4);
+	uint32_t hblank = data[3] | ((data[4] & 0x0f) << 8);
+	uint32_t vactive = data[5] | ((data[7] & 0xf0) << 4);
+	uint32_t vblank = data[6] | ((data[7] & 0x0f) << 8);
+	uint64_t total = (uint64_t) (hactive + hblank) * (vactive + vblank);
+
+	if (total == 0)
+		return;
+
+	edid->preferred_width = hactive;
+	edid->preferred_height = vactive;
+	edid->preferred_refresh_mhz = (clock_khz * 1000000 + total / 2) / total;
+}
+
 /* Parse a standard EDID block. */
 struct edid_info *
 edid_parse(const uint8_t *data, size_t length)
@@ -151,9 +175,15 @@ edid_parse(const uint8_t *data, size_t length)
 	for (i = EDID_OFFSET_DATA_BLOCKS;
 	     i <= EDID_OFFSET_LAST_BLOCK;
 	     i += 18) {
-		/* ignore pixel clock data */
-		if (data[i] != 0)
+		/*
+		 * Blocks with a pixel clock are detailed timings; the first
+		 * is the monitor's preferred mode.
+		 */
+		if (data[i] != 0 || data[i+1] != 0) {
+			if (i == EDID_OFFSET_DATA_BLOCKS)
+				edid_parse_timing(&data[i], edid);
 			continue;
+		}
 		if (data[i+2] != 0)
 			continue;
 
@@ -167,6 +197,15 @@ edid_parse(const uint8_t *data, size_t length)
 		} else if (data[i+3] == EDID_DESCRIPTOR_ALPHANUMERIC_DATA_STRING) {
 			edid_parse_string(&data[i+5],
 					  edid->eisa_id);
+		} else if (data[i+3] == EDID_DESCRIPTOR_RANGE_LIMITS) {
+			/*
+			 * The vertical rate limits are in Hz; flags in byte
+			 * 4 add 255 to either of them, for rates above 255Hz.
+			 */
+			edid->min_vrefresh_hz = data[i+5] +
+				((data[i+4] & 0x1) && (data[i+4] & 0x2) ? 255 : 0);
+			edid->max_vrefresh_hz = data[i+6] +
+				((data[i+4] & 0x2) ? 255 : 0);
 		}
 	}
 
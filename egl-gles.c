@@ -25,6 +25,9 @@
  */
 
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,34 +39,6 @@
 #include "kms-quads.h"
 
 #include <drm/drm.h>
-#include <EGL/egl.h>
-#include <EGL/eglext.h>
-
-#if defined(HAVE_GL_CORE)
-#include <GL/gl.h>
-#include <GL/glext.h>
-#define _APIENTRYP APIENTRYP
-#else
-#include <GLES3/gl3.h>
-#include <GLES3/gl3ext.h>
-/*
- * GLES2 exts is needed for prototypes of GL_OES_EGL_image
- * (i.e. glEGLImageTargetTexture2DOES etc.)
- */
-#include <GLES2/gl2ext.h>
-#define _APIENTRYP GL_APIENTRYP
-#endif
-
-/* Add glFramebufferParameteri signature manually if needed. Actual context
- * might support higher vGL/GLES version than exposed through headers */
-#if !(GL_VERSION_4_3 == 1) || !(GL_ES_VERSION_3_1 == 1)
-typedef void (_APIENTRYP PFNGLFRAMEBUFFERPARAMETERIPROC) (GLenum target, GLenum pname, GLint param);
-#endif
-
-#if !defined(GL_FRAMEBUFFER_FLIP_Y_MESA)
-/* see https://www.khronos.org/registry/OpenGL/extensions/MESA/MESA_framebuffer_flip_y.txt */
-#define GL_FRAMEBUFFER_FLIP_Y_MESA 0x8BBB
-#endif
 
 bool
 gl_extension_supported(const char *haystack, const char *needle)
@@ -175,6 +150,66 @@ bool device_egl_setup(struct device *device)
 		return false;
 	}
 
+	/*
+	 * Look up every extension entry point we might use now, so drawing
+	 * never has to. Those for extensions an output's context turns out
+	 * not to support are never called.
+	 */
+	device->egl.create_image = (PFNEGLCREATEIMAGEKHRPROC)
+		eglGetProcAddress("eglCreateImageKHR");
+	device->egl.destroy_image = (PFNEGLDESTROYIMAGEKHRPROC)
+		eglGetProcAddress("eglDestroyImageKHR");
+	device->egl.image_target_texture_2d = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)
+		eglGetProcAddress("glEGLImageTargetTexture2DOES");
+	device->egl.framebuffer_parameteri = (PFNGLFRAMEBUFFERPARAMETERIPROC)
+		eglGetProcAddress("glFramebufferParameteri");
+	device->egl.create_sync = (PFNEGLCREATESYNCKHRPROC)
+		eglGetProcAddress("eglCreateSyncKHR");
+	device->egl.wait_sync = (PFNEGLWAITSYNCKHRPROC)
+		eglGetProcAddress("eglWaitSyncKHR");
+	device->egl.destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)
+		eglGetProcAddress("eglDestroySyncKHR");
+	device->egl.dup_native_fence_fd = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)
+		eglGetProcAddress("eglDupNativeFenceFDANDROID");
+	device->egl.get_program_binary = (PFNGLGETPROGRAMBINARYPROC)
+		eglGetProcAddress("glGetProgramBinary");
+	device->egl.program_binary = (PFNGLPROGRAMBINARYPROC)
+		eglGetProcAddress("glProgramBinary");
+
+	if (!device->egl.create_image || !device->egl.destroy_image ||
+	    !device->egl.image_target_texture_2d) {
+		error("EGLImage entry points not found\n");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Renders for a device without a GPU we can use on another device's GPU:
+ * we allocate and render with its GBM device and EGL display, and import
+ * the buffers into our own KMS device. We can only use modifiers if the
+ * render device's EGL can import them as well as our KMS device.
+ */
+bool device_egl_share(struct device *device, struct device *render_device)
+{
+	const char *exts;
+
+	assert(render_device->render_device == render_device);
+
+	device->gbm_device = render_device->gbm_device;
+	device->egl_dpy = render_device->egl_dpy;
+	device->egl = render_device->egl;
+	device->render_device = render_device;
+
+	exts = eglQueryString(device->egl_dpy, EGL_EXTENSIONS);
+	assert(exts);
+	device->fb_modifiers &=
+		gl_extension_supported(exts, "EGL_EXT_image_dma_buf_import_modifiers");
+	debug("[%s] rendering on %s, %susing format modifiers\n",
+	      device->node, render_device->node,
+	      (device->fb_modifiers) ? "" : "not ");
+
 	return true;
 }
 
@@ -295,6 +330,7 @@ egl_create_context(struct output *output)
 		/* GLES2 doesn't have VAO support, and some drivers
 		 * don't handle even VBOs very well */
 		*attrib_version = 2;
+		output->egl.gles2 = true;
 		/* As a last-ditch attempt, try an ES2 context. */
 		ret = eglCreateContext(device->egl_dpy, output->egl.cfg,
 				       EGL_NO_CONTEXT, attribs);
@@ -308,74 +344,362 @@ egl_create_context(struct output *output)
 	return EGL_NO_CONTEXT;
 }
 
-/* The following is boring boilerplate GL to draw four quads. */
+/*
+ * The following is boring boilerplate GL to draw coloured quads. Positions
+ * are in buffer co-ordinates, which u_proj maps to normalised device
+ * co-ordinates; each vertex carries its own colour, so a whole batch of
+ * differently-coloured quads can be drawn with a single call.
+ *
+ * Each vertex also has a position in the glyph atlas (see text.c), whose
+ * coverage scales the colour's alpha: glyphs point at their own texels,
+ * and solid quads at a texel which is always fully covered. So text and
+ * everything else share a single program, and a single batch.
+ */
 static const char *vert_shader_text_gles =
 	"precision highp float;\n"
 	"attribute vec2 in_pos;\n"
+	"attribute vec2 in_tex;\n"
+	"attribute vec4 in_col;\n"
 	"uniform mat4 u_proj;\n"
+	"varying vec2 v_tex;\n"
+	"varying vec4 v_col;\n"
 	"void main() {\n"
 	"  gl_Position = u_proj * vec4(in_pos, 0.0, 1.0);\n"
+	"  v_tex = in_tex;\n"
+	"  v_col = in_col;\n"
 	"}\n";
 
 static const char *frag_shader_text_gles =
-	"precision highp float;\n"
-	"uniform vec4 u_col;\n"
+	"precision mediump float;\n"
+	"uniform sampler2D u_tex;\n"
+	"varying vec2 v_tex;\n"
+	"varying vec4 v_col;\n"
 	"void main() {\n"
-	"  gl_FragColor = u_col;\n"
+	"  gl_FragColor = vec4(v_col.rgb, v_col.a * texture2D(u_tex, v_tex).a);\n"
 	"}\n";
 
 static const char *vert_shader_text_glcore =
 	"#version 330 core\n"
 	"in vec2 in_pos;\n"
+	"in vec2 in_tex;\n"
+	"in vec4 in_col;\n"
 	"uniform mat4 u_proj;\n"
+	"out vec2 v_tex;\n"
+	"out vec4 v_col;\n"
 	"void main() {\n"
 	"  gl_Position = u_proj * vec4(in_pos, 0.0, 1.0);\n"
+	"  v_tex = in_tex;\n"
+	"  v_col = in_col;\n"
 	"}\n";
 
 static const char *frag_shader_text_glcore =
 	"#version 330 core\n"
-	"uniform vec4 u_col;\n"
+	"uniform sampler2D u_tex;\n"
+	"in vec2 v_tex;\n"
+	"in vec4 v_col;\n"
+	"out vec4 out_color;\n"
+	"void main() {\n"
+	"  out_color = vec4(v_col.rgb, v_col.a * texture(u_tex, v_tex).r);\n"
+	"}\n";
+
+/*
+ * External buffers are drawn with the same vertices, sampling their colour
+ * from the buffer rather than the quad; we treat them as opaque.
+ */
+static const char *frag_shader_image_gles =
+	"precision mediump float;\n"
+	"uniform sampler2D u_tex;\n"
+	"varying vec2 v_tex;\n"
+	"varying vec4 v_col;\n"
+	"void main() {\n"
+	"  gl_FragColor = vec4(texture2D(u_tex, v_tex).rgb, 1.0);\n"
+	"}\n";
+
+static const char *frag_shader_image_glcore =
+	"#version 330 core\n"
+	"uniform sampler2D u_tex;\n"
+	"in vec2 v_tex;\n"
+	"in vec4 v_col;\n"
 	"out vec4 out_color;\n"
 	"void main() {\n"
-	"  out_color = u_col;\n"
+	"  out_color = vec4(texture(u_tex, v_tex).rgb, 1.0);\n"
 	"}\n";
 
-static GLuint
-create_shader(GLuint program, const char *source, GLenum shader_type)
+/*
+ * Checking for GL errors forces a round-trip to the driver, so only do it
+ * in debug builds.
+ */
+#if defined(DEBUG)
+#define gl_check_error(what) do { \
+	GLenum err = glGetError(); \
+	if (err != GL_NO_ERROR) \
+		debug("GL error 0x%x after %s\n", err, what); \
+} while (0)
+#else
+#define gl_check_error(what) do { } while (0)
+#endif
+
+/*
+ * Our contexts' state only ever changes through us, so we keep track of
+ * what is bound, and skip binding anything again which already is: with
+ * thousands of draws a frame, redundant state changes add up, as drivers
+ * tend to validate them in full. Each output has a context of its own, so
+ * the state we track lives on the output.
+ */
+void output_gl_bind_framebuffer(struct output *output, GLenum target,
+				GLuint fbo)
 {
-        GLuint shader;
-        GLint status;
-
-        shader = glCreateShader(shader_type);
-        assert(shader != 0);
-
-        glShaderSource(shader, 1, (const char **) &source, NULL);
-        glCompileShader(shader);
-
-        glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-        if (!status) {
-                char log[1000];
-                GLsizei len;
-                glGetShaderInfoLog(shader, 1000, &len, log);
-                fprintf(stderr, "Error: compiling %s: %*s\n",
-                        shader_type == GL_VERTEX_SHADER ? "vertex" : "fragment",
-                        len, log);
-                return EGL_FALSE;
-        }
-
-	glAttachShader(program, shader);
-	glDeleteShader(shader);
-
-        return EGL_TRUE;
+	GLuint *read = &output->egl.state.read_fbo;
+	GLuint *draw = &output->egl.state.draw_fbo;
+
+	if ((target == GL_FRAMEBUFFER && *read == fbo && *draw == fbo) ||
+	    (target == GL_READ_FRAMEBUFFER && *read == fbo) ||
+	    (target == GL_DRAW_FRAMEBUFFER && *draw == fbo))
+		return;
+
+	glBindFramebuffer(target, fbo);
+	if (target != GL_DRAW_FRAMEBUFFER)
+		*read = fbo;
+	if (target != GL_READ_FRAMEBUFFER)
+		*draw = fbo;
 }
 
-bool
-output_egl_setup(struct output *output)
+void output_gl_bind_texture(struct output *output, GLuint tex)
+{
+	if (output->egl.state.texture == tex)
+		return;
+
+	glBindTexture(GL_TEXTURE_2D, tex);
+	output->egl.state.texture = tex;
+}
+
+/*
+ * Deleting a bound framebuffer or texture unbinds it, and GL can then hand
+ * out its name again, which we mustn't mistake for still being bound.
+ */
+void output_gl_forget(struct output *output, GLuint fbo, GLuint tex)
+{
+	if (fbo && output->egl.state.read_fbo == fbo)
+		output->egl.state.read_fbo = 0;
+	if (fbo && output->egl.state.draw_fbo == fbo)
+		output->egl.state.draw_fbo = 0;
+	if (tex && output->egl.state.texture == tex)
+		output->egl.state.texture = 0;
+}
+
+static void gl_use_program(struct output *output, GLuint program)
+{
+	if (output->egl.state.program == program)
+		return;
+
+	glUseProgram(program);
+	output->egl.state.program = program;
+}
+
+static void gl_set_blend(struct output *output, bool blend)
+{
+	if (output->egl.state.blend == blend)
+		return;
+
+	if (blend)
+		glEnable(GL_BLEND);
+	else
+		glDisable(GL_BLEND);
+	output->egl.state.blend = blend;
+}
+
+/*
+ * Points the vertex attributes at the quad VBO, and binds the index buffer;
+ * with VAOs, into the VAO.
+ */
+static void quad_attribs_bind(struct output *output)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, output->egl.vbo);
+	glVertexAttribPointer(output->egl.pos_attr, 2, GL_FLOAT, GL_FALSE,
+			      sizeof(struct quad_vertex),
+			      (void *) offsetof(struct quad_vertex, x));
+	glVertexAttribPointer(output->egl.tex_attr, 2, GL_FLOAT, GL_FALSE,
+			      sizeof(struct quad_vertex),
+			      (void *) offsetof(struct quad_vertex, u));
+	glVertexAttribPointer(output->egl.col_attr, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+			      sizeof(struct quad_vertex),
+			      (void *) offsetof(struct quad_vertex, col));
+	glEnableVertexAttribArray(output->egl.pos_attr);
+	glEnableVertexAttribArray(output->egl.tex_attr);
+	glEnableVertexAttribArray(output->egl.col_attr);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, output->egl.ibo);
+}
+
+/*
+ * Creates the buffers for batched quad rendering. Vertices are rewritten
+ * every batch, so the VBO is a streaming buffer which we orphan before each
+ * upload: the driver can then hand us fresh storage rather than waiting for
+ * the GPU to finish with the last batch. Indices never change: quad n is
+ * always two triangles over vertices 4n .. 4n + 3.
+ */
+static void quad_batch_setup(struct output *output)
+{
+	GLushort *indices = calloc(QUAD_BATCH_MAX * 6, sizeof(*indices));
+
+	assert(indices);
+	for (unsigned int i = 0; i < QUAD_BATCH_MAX; i++) {
+		GLushort v = i * 4;
+
+		indices[i * 6 + 0] = v + 0;
+		indices[i * 6 + 1] = v + 1;
+		indices[i * 6 + 2] = v + 2;
+		indices[i * 6 + 3] = v + 0;
+		indices[i * 6 + 4] = v + 2;
+		indices[i * 6 + 5] = v + 3;
+	}
+
+	output->egl.batch = calloc(QUAD_BATCH_MAX * 4,
+				   sizeof(*output->egl.batch));
+	assert(output->egl.batch);
+	output->egl.batch_quads = 0;
+	output->egl.batch_blend = false;
+
+	glGenBuffers(1, &output->egl.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, output->egl.vbo);
+	glBufferData(GL_ARRAY_BUFFER,
+		     QUAD_BATCH_MAX * 4 * sizeof(*output->egl.batch),
+		     NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glGenBuffers(1, &output->egl.ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, output->egl.ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+		     QUAD_BATCH_MAX * 6 * sizeof(*indices), indices,
+		     GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	free(indices);
+
+	if (output->egl.use_vao) {
+		glGenVertexArrays(1, &output->egl.vao);
+		glBindVertexArray(output->egl.vao);
+	}
+
+	/*
+	 * Nothing else we draw has vertices, so we leave the quad VAO, or
+	 * the VBO, IBO and attributes it would hold, bound for good.
+	 */
+	quad_attribs_bind(output);
+	output->egl.state.quad_state = true;
+
+	gl_check_error("quad batch setup");
+}
+
+void output_egl_batch_add_quad(struct output *output, float x1, float y1,
+			       float x2, float y2, uint32_t argb)
+{
+	/* the centre of the atlas texel which is always fully covered */
+	const float u = 0.5f / TEXT_ATLAS_SIZE;
+	struct quad_vertex *v;
+	GLubyte col[4] = {
+		(argb >> 16) & 0xff,
+		(argb >> 8) & 0xff,
+		argb & 0xff,
+		(argb >> 24) & 0xff,
+	};
+
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	if (output->egl.batch_quads == QUAD_BATCH_MAX)
+		output_egl_batch_flush(output);
+
+	v = &output->egl.batch[output->egl.batch_quads++ * 4];
+	v[0] = (struct quad_vertex) { x1, y1, u, u, { col[0], col[1], col[2], col[3] } };
+	v[1] = (struct quad_vertex) { x2, y1, u, u, { col[0], col[1], col[2], col[3] } };
+	v[2] = (struct quad_vertex) { x2, y2, u, u, { col[0], col[1], col[2], col[3] } };
+	v[3] = (struct quad_vertex) { x1, y2, u, u, { col[0], col[1], col[2], col[3] } };
+}
+
+/*
+ * Queues a glyph from the atlas to be drawn at dst, cropped to clip. Glyphs
+ * are drawn at the size they were rasterised at, on whole pixels, so
+ * cropping the quad crops its texels by exactly the same amount.
+ */
+void output_egl_batch_add_glyph(struct output *output, const struct rect *dst,
+				const struct glyph *glyph,
+				const struct rect *clip, uint32_t argb)
+{
+	const float scale = 1.0f / TEXT_ATLAS_SIZE;
+	struct quad_vertex *v;
+	struct rect r;
+	float u1, v1, u2, v2;
+	GLubyte col[4] = {
+		(argb >> 16) & 0xff,
+		(argb >> 8) & 0xff,
+		argb & 0xff,
+		(argb >> 24) & 0xff,
+	};
+
+	if (!rect_intersect(dst, clip, &r))
+		return;
+
+	if (output->egl.batch_quads == QUAD_BATCH_MAX)
+		output_egl_batch_flush(output);
+
+	u1 = (glyph->x + r.x1 - dst->x1) * scale;
+	v1 = (glyph->y + r.y1 - dst->y1) * scale;
+	u2 = (glyph->x + r.x2 - dst->x1) * scale;
+	v2 = (glyph->y + r.y2 - dst->y1) * scale;
+
+	v = &output->egl.batch[output->egl.batch_quads++ * 4];
+	v[0] = (struct quad_vertex) { r.x1, r.y1, u1, v1, { col[0], col[1], col[2], col[3] } };
+	v[1] = (struct quad_vertex) { r.x2, r.y1, u2, v1, { col[0], col[1], col[2], col[3] } };
+	v[2] = (struct quad_vertex) { r.x2, r.y2, u2, v2, { col[0], col[1], col[2], col[3] } };
+	v[3] = (struct quad_vertex) { r.x1, r.y2, u1, v2, { col[0], col[1], col[2], col[3] } };
+	output->egl.batch_blend = true;
+}
+
+void output_egl_batch_flush(struct output *output)
+{
+	unsigned int n = output->egl.batch_quads;
+
+	if (n == 0)
+		return;
+
+	/* Send any glyphs we've rasterised since the last draw. */
+	output_text_upload(output);
+	gl_use_program(output, output->egl.gl_prog);
+	assert(output->egl.state.quad_state);
+
+	glBufferData(GL_ARRAY_BUFFER,
+		     QUAD_BATCH_MAX * 4 * sizeof(*output->egl.batch),
+		     NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, n * 4 * sizeof(*output->egl.batch),
+			output->egl.batch);
+
+	/*
+	 * Glyphs need blending with whatever is underneath their edges. Our
+	 * solid quads are all opaque, and blending them would only cost
+	 * bandwidth, so we only blend batches with glyphs in.
+	 */
+	gl_set_blend(output, output->egl.batch_blend);
+
+	glDrawElements(GL_TRIANGLES, n * 6, GL_UNSIGNED_SHORT, NULL);
+
+	gl_check_error("quad batch draw");
+	output->egl.batch_quads = 0;
+	output->egl.batch_blend = false;
+}
+
+/*
+ * Sets up the viewport and projection to draw into a framebuffer of the
+ * given size. Buffer co-ordinates have their origin at the top left, and
+ * y = 0 must end up as the first row of the framebuffer in memory, which is
+ * what KMS scans out first.
+ *
+ * GL's window origin is at the bottom, which is the start of the buffer in
+ * memory; GL_MESA_framebuffer_flip_y moves it to the top. For framebuffers
+ * without it, we map y = 0 to the bottom directly in the projection matrix
+ * instead.
+ */
+static void gl_set_proj(GLint uniform, unsigned int width,
+			unsigned int height, bool flip_y)
 {
-	struct device *device = output->device;
-	const char *exts = eglQueryString(device->egl_dpy, EGL_EXTENSIONS);
-	EGLBoolean ret;
-	GLint status;
 	GLfloat proj[] = {
 		1.0f, 0.0f, 0.0f, 0.0f,
 		0.0f, 1.0f, 0.0f, 0.0f,
@@ -383,56 +707,67 @@ output_egl_setup(struct output *output)
 		0.0f, 0.0f, 0.0f, 1.0f
 	};
 
+	proj[0] = 2.0f / width;
+	proj[12] = -1.0f;
+	proj[5] = -2.0f / height;
+	proj[13] = 1.0f;
+	if (!flip_y)
+	{
+		/* flip sign of row=1, col=1 to flip Y */
+		proj[5] *= -1;
+		proj[13] *= -1;
+	}
+	glUniformMatrix4fv(uniform, 1, false, proj);
+}
+
+void output_egl_set_target(struct output *output, unsigned int width,
+			   unsigned int height, bool flip_y)
+{
+	if (output->egl.state.target_width == width &&
+	    output->egl.state.target_height == height &&
+	    output->egl.state.target_flip_y == flip_y)
+		return;
+
 	/*
-	 * Explicit fencing support requires us to be able to export EGLSync
-	 * objects to dma_fence FDs (to give to KMS, so it can wait on GPU
-	 * rendering completion), and to be able to import dma_fence FDs to
-	 * EGLSync objects to give to GL, so it can wait on KMS completion.
+	 * Uniforms belong to their program; the image program's projection
+	 * is only brought up to date when we next draw with it.
 	 */
-	output->explicit_fencing &=
-		(gl_extension_supported(exts, "EGL_KHR_fence_sync") &&
-		 gl_extension_supported(exts, "EGL_KHR_wait_sync") &&
-		 gl_extension_supported(exts, "EGL_ANDROID_native_fence_sync"));
-	debug("%susing explicit fencing\n",
-	      (output->explicit_fencing) ? "" : "not ");
-
-	output->egl.cfg = egl_find_config(output);
-	if (!output->egl.cfg)
-		return false;
+	glViewport(0, 0, width, height);
+	gl_use_program(output, output->egl.gl_prog);
+	gl_set_proj(output->egl.proj_uniform, width, height, flip_y);
+
+	output->egl.state.target_width = width;
+	output->egl.state.target_height = height;
+	output->egl.state.target_flip_y = flip_y;
+	output->egl.state.image_proj = false;
+}
 
-	output->egl.ctx = egl_create_context(output);
-	if (output->egl.ctx == EGL_NO_CONTEXT)
-		return false;
+static pthread_mutex_t gl_exts_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	ret = eglMakeCurrent(output->device->egl_dpy,
-			     EGL_NO_SURFACE, EGL_NO_SURFACE,
-			     output->egl.ctx);
-	assert(ret);
+/*
+ * Finds out which of the GL extensions we care about the current context
+ * supports. Every context we create on a device is the same kind, so we
+ * only need to ask once per device.
+ */
+static void gl_exts_query(struct output *output, struct gl_exts *gl_exts)
+{
+	memset(gl_exts, 0, sizeof(*gl_exts));
+	gl_exts->queried = true;
 
 	/* glGetString on GL Core with GL_EXTENSIONS is an error,
 	 * so only do that if not using GL Core */
 	if (!output->egl.gl_core)
 	{
-		exts = (const char *) glGetString(GL_EXTENSIONS);
-
-		if (!gl_extension_supported(exts, "GL_OES_EGL_image")) {
-			error("GL_OES_EGL_image not supported\n");
-			goto out_ctx;
-		}
+		const char *exts = (const char *) glGetString(GL_EXTENSIONS);
 
-		if (output->explicit_fencing &&
-			!gl_extension_supported(exts, "GL_OES_EGL_sync")) {
-			error("GL_OES_EGL_sync not supported\n");
-			goto out_ctx;
-		}
-
-		output->egl.have_gl_mesa_framebuffer_flip_y =
+		gl_exts->egl_image =
+			gl_extension_supported(exts, "GL_OES_EGL_image");
+		gl_exts->egl_sync =
+			gl_extension_supported(exts, "GL_OES_EGL_sync");
+		gl_exts->flip_y =
 			gl_extension_supported(exts, "GL_MESA_framebuffer_flip_y");
-
 	} else {
 		const GLubyte *ext;
-		bool found_image = false;
-		bool found_sync = false;
 		int num_exts = 0;
 
 		glGetIntegerv(GL_NUM_EXTENSIONS, &num_exts);
@@ -440,23 +775,13 @@ output_egl_setup(struct output *output)
 		for (int i = 0; i < num_exts; i++) {
 			ext = glGetStringi(GL_EXTENSIONS, i);
 			if (strcmp((const char *) ext, "GL_OES_EGL_image") == 0)
-				found_image = true;
+				gl_exts->egl_image = true;
 			else if (strcmp((const char *) ext, "GL_EXT_EGL_sync") == 0)
-				found_sync = true;
+				gl_exts->egl_sync = true;
 			else if (strcmp((const char *) ext, "GL_MESA_framebuffer_flip_y") == 0)
-				output->egl.have_gl_mesa_framebuffer_flip_y = true;
+				gl_exts->flip_y = true;
 			else if (strcmp((const char *) ext, "GL_OES_vertex_array_object") == 0)
-				output->egl.use_vao = true;
-		}
-
-		if (!found_image) {
-			error("GL_OES_EGL_image not supported\n");
-			goto out_ctx;
-		}
-
-		if (output->explicit_fencing && !found_sync) {
-			error("GL_EXT_EGL_sync not supported\n");
-			goto out_ctx;
+				gl_exts->vao = true;
 		}
 	}
 
@@ -467,65 +792,116 @@ output_egl_setup(struct output *output)
 		"   GLSL version '%s'\n",
 		glGetString(GL_RENDERER), glGetString(GL_VENDOR),
 		glGetString(GL_VERSION), glGetString(GL_SHADING_LANGUAGE_VERSION));
+}
 
-	output->egl.gl_prog = glCreateProgram();
-	ret = create_shader(output->egl.gl_prog,
-		output->egl.gl_core ? vert_shader_text_glcore : vert_shader_text_gles,
-		GL_VERTEX_SHADER);
-	assert(ret);
-	ret = create_shader(output->egl.gl_prog,
-		output->egl.gl_core ? frag_shader_text_glcore : frag_shader_text_gles,
-		GL_FRAGMENT_SHADER);
-	assert(ret);
+bool
+output_egl_setup(struct output *output)
+{
+	struct device *device = output->device;
+	const char *exts = eglQueryString(device->egl_dpy, EGL_EXTENSIONS);
+	const struct shader_attrib attribs[] = {
+		{ "in_pos", 0 },
+		{ "in_col", 1 },
+		{ "in_tex", 2 },
+	};
+	struct gl_exts *gl_exts;
+	EGLBoolean ret;
 
-	output->egl.pos_attr = 0;
-	glBindAttribLocation(output->egl.gl_prog, output->egl.pos_attr, "in_pos");
-
-	glLinkProgram(output->egl.gl_prog);
-	glGetProgramiv(output->egl.gl_prog, GL_LINK_STATUS, &status);
-	if (!status) {
-		char log[1000];
-		GLsizei len;
-		glGetProgramInfoLog(output->egl.gl_prog, 1000, &len, log);
-		error("Error: linking GLSL program: %*s\n", len, log);
-		goto err_program;
-	}
-	assert(status);
+	/*
+	 * Explicit fencing support requires us to be able to export EGLSync
+	 * objects to dma_fence FDs (to give to KMS, so it can wait on GPU
+	 * rendering completion), and to be able to import dma_fence FDs to
+	 * EGLSync objects to give to GL, so it can wait on KMS completion.
+	 */
+	output->explicit_fencing &=
+		(gl_extension_supported(exts, "EGL_KHR_fence_sync") &&
+		 gl_extension_supported(exts, "EGL_KHR_wait_sync") &&
+		 gl_extension_supported(exts, "EGL_ANDROID_native_fence_sync"));
+	debug("%susing explicit fencing\n",
+	      (output->explicit_fencing) ? "" : "not ");
 
-	output->egl.col_uniform = glGetUniformLocation(output->egl.gl_prog, "u_col");
-	output->egl.proj_uniform = glGetUniformLocation(output->egl.gl_prog, "u_proj");
+	output->egl.cfg = egl_find_config(output);
+	if (!output->egl.cfg)
+		return false;
 
-	glUseProgram(output->egl.gl_prog);
+	output->egl.ctx = egl_create_context(output);
+	if (output->egl.ctx == EGL_NO_CONTEXT)
+		return false;
 
-	/* If we can't flip Y through GL_MESA_framebuffer_flip_y,
-	 * apply a mirror transformation directly in the shader's
-	 * projection matrix */
-	if (!output->egl.have_gl_mesa_framebuffer_flip_y)
-	{
-		/* flip sign of row=1, col=1 to flip Y */
-		proj[5] *= -1;
+	ret = eglMakeCurrent(output->device->egl_dpy,
+			     EGL_NO_SURFACE, EGL_NO_SURFACE,
+			     output->egl.ctx);
+	assert(ret);
+
+	/* A new context has nothing bound. */
+	memset(&output->egl.state, 0, sizeof(output->egl.state));
+
+	/*
+	 * Outputs on the same device are set up on threads of their own, so
+	 * the first one to get here queries the extensions and the rest wait
+	 * for it.
+	 */
+	gl_exts = &device->gl_exts;
+	pthread_mutex_lock(&gl_exts_lock);
+	if (!gl_exts->queried)
+		gl_exts_query(output, gl_exts);
+	pthread_mutex_unlock(&gl_exts_lock);
+
+	if (!gl_exts->egl_image) {
+		error("GL_OES_EGL_image not supported\n");
+		goto out_ctx;
 	}
-	glUniformMatrix4fv(output->egl.proj_uniform, 1, false, proj);
 
-	glGenBuffers(1, &output->egl.vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, output->egl.vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 8, NULL, GL_DYNAMIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	if (output->explicit_fencing && !gl_exts->egl_sync) {
+		error("%s not supported\n", output->egl.gl_core ?
+		      "GL_EXT_EGL_sync" : "GL_OES_EGL_sync");
+		goto out_ctx;
+	}
 
-	if (output->egl.use_vao) {
-		glGenVertexArrays(1, &output->egl.vao);
-		glBindVertexArray(output->egl.vao);
+	output->egl.have_gl_mesa_framebuffer_flip_y = gl_exts->flip_y;
+	if (gl_exts->vao)
+		output->egl.use_vao = true;
 
-		glBindBuffer(GL_ARRAY_BUFFER, output->egl.vbo);
-		glVertexAttribPointer(output->egl.pos_attr, 2, GL_FLOAT, GL_FALSE, 0, (char *)(NULL));
-		glEnableVertexAttribArray(output->egl.pos_attr);
+	/* See shader.c for how we avoid compiling this every time. */
+	output->egl.gl_prog = output_egl_program_create(output,
+		output->egl.gl_core ? vert_shader_text_glcore : vert_shader_text_gles,
+		output->egl.gl_core ? frag_shader_text_glcore : frag_shader_text_gles,
+		attribs, ARRAY_LENGTH(attribs));
+	if (!output->egl.gl_prog)
+		goto out_ctx;
 
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindVertexArray(0);
-	}
+	output->egl.pos_attr = attribs[0].location;
+	output->egl.col_attr = attribs[1].location;
+	output->egl.tex_attr = attribs[2].location;
+
+	output->egl.proj_uniform = glGetUniformLocation(output->egl.gl_prog, "u_proj");
+	output->egl.tex_uniform = glGetUniformLocation(output->egl.gl_prog, "u_tex");
+
+	output->egl.image_prog = output_egl_program_create(output,
+		output->egl.gl_core ? vert_shader_text_glcore : vert_shader_text_gles,
+		output->egl.gl_core ? frag_shader_image_glcore : frag_shader_image_gles,
+		attribs, ARRAY_LENGTH(attribs));
+	if (!output->egl.image_prog)
+		goto out_prog;
+	output->egl.image_proj_uniform =
+		glGetUniformLocation(output->egl.image_prog, "u_proj");
+	gl_use_program(output, output->egl.image_prog);
+	glUniform1i(glGetUniformLocation(output->egl.image_prog, "u_tex"), 0);
+
+	gl_use_program(output, output->egl.gl_prog);
+	glUniform1i(output->egl.tex_uniform, 0);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	output_egl_set_target(output, output->mode.hdisplay,
+			      output->mode.vdisplay,
+			      output->egl.have_gl_mesa_framebuffer_flip_y);
+
+	quad_batch_setup(output);
+	output_text_init(output);
+	output_scroll_init(output);
 
 	return true;
-err_program:
+out_prog:
 	glDeleteProgram(output->egl.gl_prog);
 out_ctx:
 	eglDestroyContext(output->device->egl_dpy, output->egl.ctx);
@@ -541,109 +917,109 @@ output_egl_destroy(struct device* device, struct output *output)
 			     output->egl.ctx);
 	assert(ret);
 
+	output_scroll_destroy(output);
+	output_text_destroy(output);
 	if (output->egl.use_vao)
 		glDeleteVertexArrays(1, &output->egl.vao);
 	glDeleteBuffers(1, &output->egl.vbo);
+	glDeleteBuffers(1, &output->egl.ibo);
+	free(output->egl.batch);
+	output->egl.batch = NULL;
+	for (unsigned int i = 0; i < OUTPUT_MAX_LAYERS; i++) {
+		struct layer *layer = &output->layers[i];
+
+		if (layer->egl.img)
+			device->egl.destroy_image(device->egl_dpy,
+						  layer->egl.img);
+		glDeleteTextures(1, &layer->egl.tex);
+		memset(&layer->egl, 0, sizeof(layer->egl));
+	}
+	glDeleteProgram(output->egl.image_prog);
 	glDeleteProgram(output->egl.gl_prog);
 	eglDestroyContext(output->device->egl_dpy, output->egl.ctx);
 }
 
 /*
- * Allocates a buffer and makes it usable for rendering with EGL/GL. We achieve
- * this by allocating each individual buffer with GBM, importing it into EGL
- * as an EGLImage, binding the EGLImage to a texture unit, then finally creating
- * a FBO from that texture unit so we can render into it.
+ * Exports each plane of a BO we allocated as a dma-buf FD, along with its
+ * layout, so we can import it into EGL and, when another GPU is rendering
+ * for our device, into our KMS device.
  */
-struct buffer *buffer_egl_create(struct device *device, struct output *output)
+static int bo_export(struct device *device, struct gbm_bo *bo,
+		     uint32_t handles[4], uint32_t pitches[4],
+		     uint32_t offsets[4], uint64_t *modifier, int fds[4])
 {
-	struct buffer *ret = calloc(1, sizeof(*ret));
-	static PFNEGLCREATEIMAGEKHRPROC create_img = NULL;
-	static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC target_tex_2d = NULL;
-	static PFNGLFRAMEBUFFERPARAMETERIPROC framebuffer_parameteri = NULL;
-	EGLint attribs[64] = { 0, }; /* see note below about type */
-	EGLint nattribs = 0;
-	EGLBoolean err;
 	int num_planes;
-	int dma_buf_fds[4] = { -1, -1, -1, -1 };
-
-	assert(ret);
-
-	ret->output = output;
-	ret->render_fence_fd = -1;
-	ret->kms_fence_fd = -1;
-
-	/*
-	 * We have the list of the acceptable modifiers for KMS, which we just
-	 * pass straight to GBM. GBM takes this list of modifiers, and picks
-	 * the 'best' modifier according to whatever internal preference the
-	 * driver wants to use. We can then query the GBM BO to find out which
-	 * modifier it selected.
-	 */
-	if (device->fb_modifiers) {
-		ret->gbm.bo = gbm_bo_create_with_modifiers(device->gbm_device,
-							   output->mode.hdisplay,
-							   output->mode.vdisplay,
-							   DRM_FORMAT_XRGB8888,
-							   output->modifiers,
-							   output->num_modifiers);
-	}
-	if (!ret->gbm.bo) {
-		/*
-		 * Fall back to the non-modifier path if we can't create a
-		 * buffer with modifiers.
-		 */
-		device->fb_modifiers = false;
-		ret->gbm.bo = gbm_bo_create(device->gbm_device,
-					    output->mode.hdisplay,
-					    output->mode.vdisplay,
-					    DRM_FORMAT_XRGB8888,
-					    GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT);
-	}
-
-	if (!ret->gbm.bo) {
-		error("failed to create %u x %u BO\n",
-		      output->mode.hdisplay, output->mode.vdisplay);
-		goto err;
-	}
 
-	/*
-	 * We can query all the image properties from the GBM BO once we've
-	 * created it.
-	 */
-	ret->format = DRM_FORMAT_XRGB8888;
-	ret->width = output->mode.hdisplay;
-	ret->height = output->mode.vdisplay;
-	ret->modifier = gbm_bo_get_modifier(ret->gbm.bo);
-	num_planes = gbm_bo_get_plane_count(ret->gbm.bo);
+	*modifier = gbm_bo_get_modifier(bo);
+	num_planes = gbm_bo_get_plane_count(bo);
 	for (int i = 0; i < num_planes; i++) {
 		union gbm_bo_handle h;
 
 		/* In hindsight, we got this API wrong. */
-		h = gbm_bo_get_handle_for_plane(ret->gbm.bo, i);
+		h = gbm_bo_get_handle_for_plane(bo, i);
 		if (h.u32 == 0 || h.s32 == -1) {
 			error("failed to get handle for BO plane %d (modifier 0x%" PRIx64 ")\n",
-			      i, ret->modifier);
-			goto err_bo;
+			      i, *modifier);
+			return -1;
 		}
-		ret->gem_handles[i] = h.u32;
+		handles[i] = h.u32;
 
-		dma_buf_fds[i] = handle_to_fd(device, ret->gem_handles[i]);
-		if (dma_buf_fds[i] == -1) {
+		fds[i] = handle_to_fd(device->render_device, handles[i]);
+		if (fds[i] == -1) {
 			error("failed to get file descriptor for BO plane %d (modifier 0x%" PRIx64 ")\n",
-			      i, ret->modifier);
-			goto err_bo;
+			      i, *modifier);
+			return -1;
 		}
 
-		ret->pitches[i] = gbm_bo_get_stride_for_plane(ret->gbm.bo, i);
-		if (ret->pitches[i] == 0) {
+		pitches[i] = gbm_bo_get_stride_for_plane(bo, i);
+		if (pitches[i] == 0) {
 			error("failed to get stride for BO plane %d (modifier 0x%" PRIx64 ")\n",
-			      i, ret->modifier);
-			goto err_bo;
+			      i, *modifier);
+			return -1;
 		}
 
-		ret->offsets[i] = gbm_bo_get_offset(ret->gbm.bo, i);
+		offsets[i] = gbm_bo_get_offset(bo, i);
 	}
 
+	return num_planes;
+}
+
+/*
+ * Imports the planes bo_export() gave us as an EGLImage, binds that to a
+ * texture, and attaches the texture to a FBO so we can render into it or
+ * blit from it. External buffers we only sample from, so they get no FBO.
+ */
+static bool egl_import(struct output *output, uint32_t format,
+		       unsigned int width, unsigned int height,
+		       int num_planes, const int fds[4],
+		       const uint32_t pitches[4], const uint32_t offsets[4],
+		       uint64_t modifier, EGLImage *img, GLuint *tex_id,
+		       GLuint *fbo_id)
+{
+	struct device *device = output->device;
+	static const EGLint plane_attribs[4][5] = {
+		{ EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE0_PITCH_EXT,
+		  EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
+		  EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT },
+		{ EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE1_PITCH_EXT,
+		  EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT,
+		  EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT },
+		{ EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE2_PITCH_EXT,
+		  EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT,
+		  EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT },
+		{ EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE3_PITCH_EXT,
+		  EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT,
+		  EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT },
+	};
+	EGLint attribs[64] = { 0, }; /* see note below about type */
+	EGLint nattribs = 0;
+	bool use_modifier = device->fb_modifiers &&
+			    modifier != DRM_FORMAT_MOD_INVALID;
+
 	/*
 	 * EGL has two versions of image creation, which are not actually
 	 * interchangeable: eglCreateImageKHR takes an EGLint for its attrib
@@ -654,155 +1030,265 @@ struct buffer *buffer_egl_create(struct device *device, struct output *output)
 	 * To avoid this, just use eglCreateImageKHR, since everyone
 	 * implements that.
 	 */
-	if (!create_img) {
-		create_img = (PFNEGLCREATEIMAGEKHRPROC)
-			eglGetProcAddress("eglCreateImageKHR");
-	}
-	assert(create_img);
 
 	attribs[nattribs++] = EGL_WIDTH;
-	attribs[nattribs++] = ret->width;
+	attribs[nattribs++] = width;
 	attribs[nattribs++] = EGL_HEIGHT;
-	attribs[nattribs++] = ret->height;
+	attribs[nattribs++] = height;
 	attribs[nattribs++] = EGL_LINUX_DRM_FOURCC_EXT;
-	attribs[nattribs++] = DRM_FORMAT_XRGB8888;
-	debug("importing %u x %u EGLImage with %d planes\n", ret->width, ret->height, num_planes);
-
-	attribs[nattribs++] = EGL_DMA_BUF_PLANE0_FD_EXT;
-	attribs[nattribs++] = dma_buf_fds[0];
-	debug("\tplane 0 FD %d\n", attribs[nattribs - 1]);
-	attribs[nattribs++] = EGL_DMA_BUF_PLANE0_OFFSET_EXT;
-	attribs[nattribs++] = ret->offsets[0];
-	debug("\tplane 0 offset %d\n", attribs[nattribs - 1]);
-	attribs[nattribs++] = EGL_DMA_BUF_PLANE0_PITCH_EXT;
-	attribs[nattribs++] = ret->pitches[0];
-	debug("\tplane 0 pitch %d\n", attribs[nattribs - 1]);
-	if (device->fb_modifiers) {
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT;
-		attribs[nattribs++] = ret->modifier >> 32;
-		debug("\tmodifier hi 0x%" PRIx32 "\n", attribs[nattribs - 1]);
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT;
-		attribs[nattribs++] = ret->modifier & 0xffffffff;
-		debug("\tmodifier lo 0x%" PRIx32 "\n", attribs[nattribs - 1]);
-	}
+	attribs[nattribs++] = format;
+	debug("importing %u x %u EGLImage with %d planes\n", width, height, num_planes);
 
-	if (num_planes > 1) {
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE1_FD_EXT;
-		attribs[nattribs++] = dma_buf_fds[1];
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE1_OFFSET_EXT;
-		attribs[nattribs++] = ret->offsets[1];
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE1_PITCH_EXT;
-		attribs[nattribs++] = ret->pitches[1];
-		if (device->fb_modifiers) {
-			attribs[nattribs++] = EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT;
-			attribs[nattribs++] = ret->modifier >> 32;
-			attribs[nattribs++] = EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT;
-			attribs[nattribs++] = ret->modifier & 0xffffffff;
-		}
-	}
-
-	if (num_planes > 2) {
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE2_FD_EXT;
-		attribs[nattribs++] = dma_buf_fds[2];
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE2_OFFSET_EXT;
-		attribs[nattribs++] = ret->offsets[2];
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE2_PITCH_EXT;
-		attribs[nattribs++] = ret->pitches[2];
-		if (device->fb_modifiers) {
-			attribs[nattribs++] = EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT;
-			attribs[nattribs++] = ret->modifier >> 32;
-			attribs[nattribs++] = EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT;
-			attribs[nattribs++] = ret->modifier & 0xffffffff;
-		}
-	}
-
-	if (num_planes > 3) {
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE3_FD_EXT;
-		attribs[nattribs++] = dma_buf_fds[3];
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE3_OFFSET_EXT;
-		attribs[nattribs++] = ret->offsets[3];
-		attribs[nattribs++] = EGL_DMA_BUF_PLANE3_PITCH_EXT;
-		attribs[nattribs++] = ret->pitches[3];
-		if (device->fb_modifiers) {
-			attribs[nattribs++] = EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT;
-			attribs[nattribs++] = ret->modifier >> 32;
-			attribs[nattribs++] = EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT;
-			attribs[nattribs++] = ret->modifier & 0xffffffff;
+	for (int i = 0; i < num_planes; i++) {
+		attribs[nattribs++] = plane_attribs[i][0];
+		attribs[nattribs++] = fds[i];
+		debug("\tplane %d FD %d\n", i, attribs[nattribs - 1]);
+		attribs[nattribs++] = plane_attribs[i][1];
+		attribs[nattribs++] = offsets[i];
+		debug("\tplane %d offset %d\n", i, attribs[nattribs - 1]);
+		attribs[nattribs++] = plane_attribs[i][2];
+		attribs[nattribs++] = pitches[i];
+		debug("\tplane %d pitch %d\n", i, attribs[nattribs - 1]);
+		if (use_modifier) {
+			attribs[nattribs++] = plane_attribs[i][3];
+			attribs[nattribs++] = modifier >> 32;
+			debug("\tmodifier hi 0x%" PRIx32 "\n", attribs[nattribs - 1]);
+			attribs[nattribs++] = plane_attribs[i][4];
+			attribs[nattribs++] = modifier & 0xffffffff;
+			debug("\tmodifier lo 0x%" PRIx32 "\n", attribs[nattribs - 1]);
 		}
 	}
 
 	attribs[nattribs++] = EGL_NONE;
 
-	err = eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
-			     output->egl.ctx);
-	assert(err);
-
 	/*
 	 * Create an EGLImage from our GBM BO, which will give EGL and GLES
-	 * the ability to use it as a render target.
+	 * the ability to use it as a render target. EGL does not take
+	 * ownership of the dma-buf file descriptors, and clones them
+	 * internally; our caller can close them once we're done.
 	 */
-	ret->gbm.img = create_img(device->egl_dpy, EGL_NO_CONTEXT,
-				  EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
-	if (!ret->gbm.img) {
+	*img = device->egl.create_image(device->egl_dpy, EGL_NO_CONTEXT,
+					EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+	if (!*img) {
 		error("failed to create EGLImage for %u x %u BO (modifier 0x%" PRIx64 ")\n",
-		      ret->width, ret->height, ret->modifier);
-		goto err_bo;
-	}
-
-	/*
-	 * EGL does not take ownership of the dma-buf file descriptors and will
-	 * clone them internally. We don't need the file descriptors after
-	 * they've been imported, so we can just close them now.
-	 */
-	for (int i = 0; i < num_planes; i++) {
-		close(dma_buf_fds[i]);
+		      width, height, modifier);
+		return false;
 	}
 
 	/*
 	 * Bind the EGLImage to a GLES texture unit, then bind that texture
 	 * to a GL framebuffer object, so we can use it to render into.
 	 */
-	glGenTextures(1, &ret->gbm.tex_id);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, ret->gbm.tex_id);
+	glGenTextures(1, tex_id);
+	output_gl_bind_texture(output, *tex_id);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	device->egl.image_target_texture_2d(GL_TEXTURE_2D, *img);
 
-	if (!target_tex_2d) {
-		target_tex_2d = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)
-			eglGetProcAddress("glEGLImageTargetTexture2DOES");
-	}
-	assert(target_tex_2d);
-	target_tex_2d(GL_TEXTURE_2D, ret->gbm.img);
+	if (!fbo_id)
+		return true;
 
-	glGenFramebuffers(1, &ret->gbm.fbo_id);
-	glBindFramebuffer(GL_FRAMEBUFFER, ret->gbm.fbo_id);
+	glGenFramebuffers(1, fbo_id);
+	output_gl_bind_framebuffer(output, GL_FRAMEBUFFER, *fbo_id);
 
 	if (output->egl.have_gl_mesa_framebuffer_flip_y)
 	{
-		if (!framebuffer_parameteri) {
-			framebuffer_parameteri = (PFNGLFRAMEBUFFERPARAMETERIPROC)
-				eglGetProcAddress("glFramebufferParameteri");
-		}
-		assert(framebuffer_parameteri);
-		framebuffer_parameteri(GL_FRAMEBUFFER, GL_FRAMEBUFFER_FLIP_Y_MESA, GL_TRUE);
+		assert(device->egl.framebuffer_parameteri);
+		device->egl.framebuffer_parameteri(GL_FRAMEBUFFER,
+						   GL_FRAMEBUFFER_FLIP_Y_MESA,
+						   GL_TRUE);
 		debug("GL_MESA_framebuffer_flip_y is available\n");
 	}
 
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-			       ret->gbm.tex_id, 0);
+			       *tex_id, 0);
 	assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
 
+	return true;
+}
+
+/*
+ * Imports the planes of a BO exported from the render device into our KMS
+ * device through PRIME, giving us GEM handles we can create a framebuffer
+ * from.
+ */
+static bool prime_import(struct device *device, int num_planes,
+			 const int fds[4], uint32_t handles[4])
+{
+	for (int i = 0; i < num_planes; i++) {
+		if (drmPrimeFDToHandle(device->kms_fd, fds[i], &handles[i]) != 0) {
+			error("failed to import BO plane %d into %s: %s\n",
+			      i, device->node, strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void close_fds(int fds[4])
+{
+	for (int i = 0; i < 4; i++)
+		fd_replace(&fds[i], -1);
+}
+
+/*
+ * Allocates a buffer and makes it usable for rendering with EGL/GL. We achieve
+ * this by allocating each individual buffer with GBM, importing it into EGL
+ * as an EGLImage, binding the EGLImage to a texture unit, then finally creating
+ * a FBO from that texture unit so we can render into it.
+ *
+ * When another GPU renders for our device (see devices_create()), it
+ * allocates the BO, and we import it into our KMS device through PRIME.
+ * The modifiers we ask for come from our plane's IN_FORMATS, so the render
+ * GPU picks one both devices understand; without modifiers, we ask for a
+ * linear BO, which any device can scan out. If our device still can't scan
+ * out what the render GPU gives us, buffer_create() sets prime_copy, and we
+ * render into a BO of the render GPU's choice instead, then copy each frame
+ * into a linear BO we can scan out. That costs a blit per frame, but keeps
+ * rendering in the render GPU's preferred layout.
+ */
+struct buffer *buffer_egl_create(struct device *device, struct output *output)
+{
+	struct buffer *ret = calloc(1, sizeof(*ret));
+	bool prime = device->render_device != device;
+	uint32_t handles[4] = { 0, };
+	uint32_t pitches[4] = { 0, };
+	uint32_t offsets[4] = { 0, };
+	uint64_t modifier;
+	EGLBoolean err;
+	int num_planes;
+	int dma_buf_fds[4] = { -1, -1, -1, -1 };
+
+	assert(ret);
+
+	ret->output = output;
+	ret->render_fence_fd = -1;
+	ret->kms_fence_fd = -1;
+	ret->format = DRM_FORMAT_XRGB8888;
+	ret->width = output->mode.hdisplay;
+	ret->height = output->mode.vdisplay;
+
+	if (prime && output->egl.prime_copy) {
+		/* We can't blit between FBOs in GLES2. */
+		if (output->egl.gles2) {
+			error("[%s] can't copy frames to %s without GLES3\n",
+			      output->name, device->node);
+			goto err;
+		}
+
+		ret->gbm.bo = gbm_bo_create(device->gbm_device,
+					    ret->width, ret->height,
+					    DRM_FORMAT_XRGB8888,
+					    GBM_BO_USE_RENDERING);
+		ret->gbm.scanout_bo = gbm_bo_create(device->gbm_device,
+						    ret->width, ret->height,
+						    DRM_FORMAT_XRGB8888,
+						    GBM_BO_USE_RENDERING |
+						    GBM_BO_USE_LINEAR);
+		if (!ret->gbm.bo || !ret->gbm.scanout_bo) {
+			error("failed to create %u x %u BOs to copy between\n",
+			      ret->width, ret->height);
+			goto err_bo;
+		}
+	} else {
+		/*
+		 * We pass the modifiers we have settled on for this output
+		 * (see format.c) straight to GBM. GBM picks the 'best' one
+		 * according to whatever internal preference the driver wants
+		 * to use, and we can then query the GBM BO to find out which
+		 * modifier it selected. Without modifiers, the driver chooses
+		 * the layout implicitly; buffer_create() falls back to that
+		 * if allocating with modifiers fails.
+		 */
+		if (output->format.use_modifiers) {
+			ret->gbm.bo = gbm_bo_create_with_modifiers(device->gbm_device,
+								   ret->width,
+								   ret->height,
+								   DRM_FORMAT_XRGB8888,
+								   output->format.modifiers,
+								   output->format.num_modifiers);
+		} else {
+			ret->gbm.bo = gbm_bo_create(device->gbm_device,
+						    ret->width, ret->height,
+						    DRM_FORMAT_XRGB8888,
+						    GBM_BO_USE_RENDERING |
+						    GBM_BO_USE_SCANOUT |
+						    (prime ? GBM_BO_USE_LINEAR : 0));
+		}
+
+		if (!ret->gbm.bo) {
+			debug("[%s] failed to create %u x %u BO\n",
+			      output->name, ret->width, ret->height);
+			goto err;
+		}
+	}
+
+	err = eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			     output->egl.ctx);
+	assert(err);
+
+	/*
+	 * We can query all the image properties from the GBM BO once we've
+	 * created it. Unless we are importing it into another device, the
+	 * BO's own GEM handles are the ones we scan out from. If the driver
+	 * chose the layout implicitly, we don't pass on the modifier it
+	 * reports, just as if it didn't know it.
+	 */
+	num_planes = bo_export(device, ret->gbm.bo, handles, pitches, offsets,
+			       &modifier, dma_buf_fds);
+	if (num_planes < 0)
+		goto err_bo;
+	if (!output->format.use_modifiers)
+		modifier = DRM_FORMAT_MOD_INVALID;
+	if (!egl_import(output, DRM_FORMAT_XRGB8888, ret->width, ret->height,
+			num_planes, dma_buf_fds, pitches, offsets, modifier,
+			&ret->gbm.img, &ret->gbm.tex_id, &ret->gbm.fbo_id))
+		goto err_bo;
+
+	if (ret->gbm.scanout_bo) {
+		close_fds(dma_buf_fds);
+		memset(handles, 0, sizeof(handles));
+
+		num_planes = bo_export(device, ret->gbm.scanout_bo, handles,
+				       pitches, offsets, &modifier,
+				       dma_buf_fds);
+		if (num_planes < 0)
+			goto err_bo;
+		if (!output->format.use_modifiers)
+			modifier = DRM_FORMAT_MOD_INVALID;
+		if (!egl_import(output, DRM_FORMAT_XRGB8888, ret->width,
+				ret->height, num_planes, dma_buf_fds, pitches,
+				offsets, modifier, &ret->gbm.scanout_img,
+				&ret->gbm.scanout_tex_id,
+				&ret->gbm.scanout_fbo_id))
+			goto err_bo;
+	}
+
+	ret->modifier = modifier;
+	memcpy(ret->pitches, pitches, sizeof(pitches));
+	memcpy(ret->offsets, offsets, sizeof(offsets));
+	if (prime) {
+		ret->gbm.prime = true;
+		if (!prime_import(device, num_planes, dma_buf_fds,
+				  ret->gem_handles))
+			goto err_bo;
+	} else {
+		memcpy(ret->gem_handles, handles, sizeof(handles));
+	}
+
+	/* We don't need the FDs once they've been imported. */
+	close_fds(dma_buf_fds);
+
 	return ret;
 
 err_bo:
-	gbm_bo_destroy(ret->gbm.bo);
-	for (size_t i = 0; i < ARRAY_LENGTH(dma_buf_fds); i++) {
-		if (dma_buf_fds[i] != -1)
-			close(dma_buf_fds[i]);
-	}
+	close_fds(dma_buf_fds);
+	buffer_egl_destroy(device, ret);
+	free(ret);
+	return NULL;
 err:
 	free(ret);
 	return NULL;
@@ -810,156 +1296,293 @@ err:
 
 void buffer_egl_destroy(struct device *device, struct buffer *buffer)
 {
-	static PFNEGLDESTROYIMAGEKHRPROC destroy_img = NULL;
+	struct output *output = buffer->output;
 	EGLBoolean ret;
 
 	ret = eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
-			     buffer->output->egl.ctx);
+			     output->egl.ctx);
 	assert(ret);
 
-	if (!destroy_img) {
-		destroy_img = (PFNEGLDESTROYIMAGEKHRPROC)
-			eglGetProcAddress("eglDestroyImageKHR");
+	/*
+	 * Handles we imported through PRIME belong to us rather than GBM.
+	 * Planes of one BO often share a handle, which we must only close
+	 * once.
+	 */
+	for (int i = 0; buffer->gbm.prime && i < 4 && buffer->gem_handles[i]; i++) {
+		struct drm_gem_close close_req = {
+			.handle = buffer->gem_handles[i],
+		};
+		bool dup = false;
+
+		for (int j = 0; j < i; j++)
+			dup |= buffer->gem_handles[j] == buffer->gem_handles[i];
+		if (!dup)
+			drmIoctl(device->kms_fd, DRM_IOCTL_GEM_CLOSE, &close_req);
 	}
-	assert(destroy_img);
 
-	destroy_img(device->egl_dpy, buffer->gbm.img);
+	if (buffer->gbm.scanout_img)
+		device->egl.destroy_image(device->egl_dpy,
+					  buffer->gbm.scanout_img);
+	output_gl_forget(output, buffer->gbm.scanout_fbo_id,
+			 buffer->gbm.scanout_tex_id);
+	glDeleteFramebuffers(1, &buffer->gbm.scanout_fbo_id);
+	glDeleteTextures(1, &buffer->gbm.scanout_tex_id);
+	if (buffer->gbm.scanout_bo)
+		gbm_bo_destroy(buffer->gbm.scanout_bo);
+
+	if (buffer->gbm.img)
+		device->egl.destroy_image(device->egl_dpy, buffer->gbm.img);
+	output_gl_forget(output, buffer->gbm.fbo_id, buffer->gbm.tex_id);
 	glDeleteFramebuffers(1, &buffer->gbm.fbo_id);
 	glDeleteTextures(1, &buffer->gbm.tex_id);
-	gbm_bo_destroy(buffer->gbm.bo);
+	if (buffer->gbm.bo)
+		gbm_bo_destroy(buffer->gbm.bo);
 }
 
 /*
- * Fills the vertex and color data to draw one of four quadrants of the
- * full-screen checkerboard pattern.
- *
- * The border separating the quadrants is animated from the upper-left to the
- * lower-right, using `frame_num` to drive the animation. Parameter `loc`
- * defines the quadrant for which to get the data for.
- *
- * A quadrant is drawn as a two-triangle triangle-fan. The vertex array's
- * coordinates will be interpreted directly as X/Y normalized device
- * coordinates where
- *
- *     x = [-1 .. 1] (left ... right)
- *     y = [-1 .. 1] (bottom ... top)
- *
+ * Imports the external buffer a layer shows as an EGLImage to sample from,
+ * replacing the one for whatever it showed before, and has the GPU wait for
+ * the producer to finish writing it. A buffer we can't import is drawn as a
+ * rectangle of the layer's colour instead.
  */
-static void fill_verts(GLfloat *verts, GLfloat *col, float anim_progress, int loc)
+static bool layer_image_import(struct output *output, struct layer *layer)
 {
-	/* factor is in range [-1 .. 1] */
-	float factor = anim_progress * 2.0 - 1.0f;
-	GLfloat top, bottom, left, right;
-
-	assert(loc >= 0 && loc < 4);
-
-	switch (loc) {
-	case 0:
-		/* upper-left black quadrant */
-		col[0] = 0.0f;
-		col[1] = 0.0f;
-		col[2] = 0.0f;
-		col[3] = 1.0f;
-		top = 1.0f;
-		left = -1.0f;
-		bottom = -factor;
-		right = factor;
-		break;
-	case 1:
-		/* upper-right red quadrant */
-		col[0] = 1.0f;
-		col[1] = 0.0f;
-		col[2] = 0.0f;
-		col[3] = 1.0f;
-		top = 1.0f;
-		left = factor;
-		right = 1.0f;
-		bottom = -factor;
-		break;
-	case 2:
-		/* lower-left blue quadrant */
-		col[0] = 0.0f;
-		col[1] = 0.0f;
-		col[2] = 1.0f;
-		col[3] = 1.0f;
-		top = -factor;
-		left = -1.0f;
-		bottom = -1.0f;
-		right = factor;
-		break;
-	case 3:
-		/* lower-right purpose quadrant */
-		col[0] = 1.0f;
-		col[1] = 0.0f;
-		col[2] = 1.0f;
-		col[3] = 1.0f;
-		top = -factor;
-		left = factor;
-		bottom = -1.0f;
-		right = 1.0f;
-		break;
+	struct device *device = output->device;
+	const struct egl_dispatch *egl = &device->egl;
+	struct buffer *buffer = layer->buffer;
+	EGLSyncKHR sync;
+	EGLBoolean ret;
+
+	if (layer->egl.serial == buffer->dmabuf.serial)
+		return layer->egl.img != EGL_NO_IMAGE_KHR;
+
+	if (layer->egl.img)
+		egl->destroy_image(device->egl_dpy, layer->egl.img);
+	output_gl_forget(output, 0, layer->egl.tex);
+	glDeleteTextures(1, &layer->egl.tex);
+	layer->egl.img = EGL_NO_IMAGE_KHR;
+	layer->egl.tex = 0;
+	layer->egl.serial = buffer->dmabuf.serial;
+
+	if (!egl_import(output, buffer->format, buffer->width, buffer->height,
+			buffer->dmabuf.num_planes, buffer->dmabuf.fds,
+			buffer->pitches, buffer->offsets, buffer->modifier,
+			&layer->egl.img, &layer->egl.tex, NULL)) {
+		layer->egl.img = EGL_NO_IMAGE_KHR;
+		return false;
+	}
+
+	if (buffer->dmabuf.fence_fd >= 0 && output->explicit_fencing) {
+		EGLint attribs[] = {
+			EGL_SYNC_NATIVE_FENCE_FD_ANDROID,
+			dup(buffer->dmabuf.fence_fd),
+			EGL_NONE,
+		};
+
+		sync = egl->create_sync(device->egl_dpy,
+					EGL_SYNC_NATIVE_FENCE_ANDROID,
+					attribs);
+		assert(sync);
+		ret = egl->wait_sync(device->egl_dpy, sync, 0);
+		assert(ret);
+		egl->destroy_sync(device->egl_dpy, sync);
+	} else if (buffer->dmabuf.fence_fd >= 0) {
+		linux_sync_file_wait(buffer->dmabuf.fence_fd);
 	}
 
-	verts[0] = left;
-	verts[1] = bottom;
-	verts[2] = left;
-	verts[3] = top;
-	verts[4] = right;
-	verts[5] = top;
-	verts[6] = right;
-	verts[7] = bottom;
+	return true;
+}
+
+/*
+ * Composites the part of a layer's external buffer inside clip, scaled to
+ * the layer's rectangle. This needs a different program, so it takes a
+ * draw call of its own, after whatever is already in the batch.
+ */
+void output_egl_draw_image(struct output *output, struct layer *layer,
+			   const struct rect *clip)
+{
+	const struct rect *r = &layer->rect;
+	float w = r->x2 - r->x1;
+	float h = r->y2 - r->y1;
+	float u1 = (clip->x1 - r->x1) / w;
+	float v1 = (clip->y1 - r->y1) / h;
+	float u2 = (clip->x2 - r->x1) / w;
+	float v2 = (clip->y2 - r->y1) / h;
+	struct quad_vertex *v;
+
+	if (!layer_image_import(output, layer)) {
+		output_egl_batch_add_quad(output, clip->x1, clip->y1,
+					  clip->x2, clip->y2, layer->colour);
+		return;
+	}
+
+	output_egl_batch_flush(output);
+
+	v = output->egl.batch;
+	v[0] = (struct quad_vertex) { clip->x1, clip->y1, u1, v1, { 0xff, 0xff, 0xff, 0xff } };
+	v[1] = (struct quad_vertex) { clip->x2, clip->y1, u2, v1, { 0xff, 0xff, 0xff, 0xff } };
+	v[2] = (struct quad_vertex) { clip->x2, clip->y2, u2, v2, { 0xff, 0xff, 0xff, 0xff } };
+	v[3] = (struct quad_vertex) { clip->x1, clip->y2, u1, v2, { 0xff, 0xff, 0xff, 0xff } };
+
+	gl_use_program(output, output->egl.image_prog);
+	if (!output->egl.state.image_proj) {
+		gl_set_proj(output->egl.image_proj_uniform,
+			    output->egl.state.target_width,
+			    output->egl.state.target_height,
+			    output->egl.state.target_flip_y);
+		output->egl.state.image_proj = true;
+	}
+	output_gl_bind_texture(output, layer->egl.tex);
+	gl_set_blend(output, false);
+
+	glBufferData(GL_ARRAY_BUFFER,
+		     QUAD_BATCH_MAX * 4 * sizeof(*output->egl.batch),
+		     NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, 4 * sizeof(*output->egl.batch),
+			output->egl.batch);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, NULL);
+
+	gl_check_error("image draw");
+}
+
+/*
+ * Applies the colour transform ourselves, when the CRTC has no way to; see
+ * colour.c. It's a scale of each channel, so we draw the repaint area over
+ * again in the scale as a colour, with blending set to multiply what's
+ * already there by it. The CRTC would do this for free, and the transform
+ * changing means repainting everything; see output_damage_frame().
+ */
+void output_egl_colour_apply(struct output *output,
+			     const struct region *repaint)
+{
+	const float *scale = output->colour.frame_scale;
+	uint32_t argb = 0xff000000 |
+			((uint32_t) lroundf(scale[0] * 255.0f) << 16) |
+			((uint32_t) lroundf(scale[1] * 255.0f) << 8) |
+			(uint32_t) lroundf(scale[2] * 255.0f);
+
+	assert(output->egl.batch_quads == 0);
+	for (unsigned int r = 0; r < repaint->num_rects; r++) {
+		const struct rect *rect = &repaint->rects[r];
+
+		output_egl_batch_add_quad(output, rect->x1, rect->y1,
+					  rect->x2, rect->y2, argb);
+	}
+
+	glBlendFunc(GL_ZERO, GL_SRC_COLOR);
+	output->egl.batch_blend = true;
+	output_egl_batch_flush(output);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+/*
+ * Our scene is four quads meeting at (width, height) * anim_progress, or
+ * content scrolling past when $KMS_SCROLL is set (see scroll.c), with a
+ * caption in the corner (see text.c) and any layers we're compositing on
+ * top. Rather than scissoring, we restrict
+ * rendering to the area we were asked to repaint by clipping the quads to
+ * each rectangle on the CPU, which lets us draw everything in a single
+ * batch. The clipped edges lie on pixel boundaries, so no pixels outside the
+ * repaint area are touched.
+ */
+static void draw_scene(struct output *output, struct buffer *buffer,
+		       float anim_progress, const struct region *repaint)
+{
+	float split_x = buffer->width * anim_progress;
+	float split_y = buffer->height * anim_progress;
+	const float quads[4][4] = {
+		{ 0.0f, 0.0f, split_x, split_y },
+		{ split_x, 0.0f, buffer->width, split_y },
+		{ 0.0f, split_y, split_x, buffer->height },
+		{ split_x, split_y, buffer->width, buffer->height },
+	};
+
+	/* Scrolling content replaces the quads; see scroll.c. */
+	if (output->scroll.enabled) {
+		output_scroll_draw(output, buffer, repaint);
+	} else {
+		for (unsigned int r = 0; r < repaint->num_rects; r++) {
+			const struct rect *rect = &repaint->rects[r];
+
+			for (unsigned int i = 0; i < 4; i++) {
+				output_egl_batch_add_quad(output,
+							  fmaxf(quads[i][0], rect->x1),
+							  fmaxf(quads[i][1], rect->y1),
+							  fminf(quads[i][2], rect->x2),
+							  fminf(quads[i][3], rect->y2),
+							  scene_colours[i]);
+			}
+		}
+	}
+
+	/* Then any text, over the scene but under the layers. */
+	output_text_draw_scene(output, anim_progress, repaint);
+
+	/* Draw any layers which aren't on planes over the top, bottom first. */
+	for (unsigned int l = 0; l < output->num_layers; l++) {
+		struct layer *layer = &output->layers[l];
+
+		if (layer->plane)
+			continue;
+
+		for (unsigned int r = 0; r < repaint->num_rects; r++) {
+			struct rect clip;
+
+			if (!rect_intersect(&layer->rect, &repaint->rects[r],
+					    &clip))
+				continue;
+			if (layer->buffer && layer->buffer->dmabuf.external)
+				output_egl_draw_image(output, layer, &clip);
+			else
+				output_egl_batch_add_quad(output,
+							  clip.x1, clip.y1,
+							  clip.x2, clip.y2,
+							  layer->colour);
+		}
+	}
+
+	output_egl_batch_flush(output);
+
+	if (output_colour_on_gpu(output))
+		output_egl_colour_apply(output, repaint);
 }
 
 void
-buffer_egl_fill(struct buffer *buffer, float anim_progress)
+buffer_egl_fill(struct buffer *buffer, float anim_progress,
+		const struct region *repaint)
 {
 	struct output *output = buffer->output;
 	struct device *device = output->device;
-	static PFNEGLCREATESYNCKHRPROC create_sync = NULL;
-	static PFNEGLWAITSYNCKHRPROC wait_sync = NULL;
-	static PFNEGLDESTROYSYNCKHRPROC destroy_sync = NULL;
-	static PFNEGLDUPNATIVEFENCEFDANDROIDPROC dup_fence_fd = NULL;
+	const struct egl_dispatch *egl = &device->egl;
+	struct region full;
 	EGLSyncKHR sync;
 	EGLBoolean ret;
 
-	ret = eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
-			     output->egl.ctx);
-	assert(ret);
+	/*
+	 * With a render thread, the context stays current for good; otherwise
+	 * we switch between outputs' contexts here.
+	 */
+	if (eglGetCurrentContext() != output->egl.ctx) {
+		ret = eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE,
+				     EGL_NO_SURFACE, output->egl.ctx);
+		assert(ret);
+	}
 
 	if (output->explicit_fencing) {
-		if (!create_sync) {
-			create_sync = (PFNEGLCREATESYNCKHRPROC)
-				eglGetProcAddress("eglCreateSyncKHR");
-		}
-		assert(create_sync);
-
-		if (!wait_sync) {
-			wait_sync = (PFNEGLWAITSYNCKHRPROC)
-				eglGetProcAddress("eglWaitSyncKHR");
-		}
-		assert(wait_sync);
-
-		if (!destroy_sync) {
-			destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)
-				eglGetProcAddress("eglDestroySyncKHR");
-		}
-		assert(destroy_sync);
-
-		if (!dup_fence_fd) {
-			dup_fence_fd = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)
-				eglGetProcAddress("eglDupNativeFenceFDANDROID");
-		}
-		assert(dup_fence_fd);
+		assert(egl->create_sync && egl->wait_sync &&
+		       egl->destroy_sync && egl->dup_native_fence_fd);
 
 		/*
 		 * If this buffer was previously used by KMS, insert a sync
 		 * wait before we use it, to ensure that the GPU doesn't render
 		 * to the buffer whilst KMS is still using it.
 		 *
-		 * This isn't actually necessary with our current model, since we
-		 * have more buffers than we need, and we wait in software until
-		 * they've been released. But if you want to start rendering
-		 * ahead of time, this fence will protect us.
+		 * With explicit fencing, main.c hands the buffer back to us
+		 * as soon as it has committed the buffer which replaces it,
+		 * without waiting for that commit to complete; this fence is
+		 * what stops us overwriting the buffer while it's on screen.
+		 * The wait happens on the GPU, so the CPU can carry on and
+		 * queue this frame, or render further ahead.
 		 */
 		if (buffer->kms_fence_fd >= 0) {
 			EGLint attribs[] = {
@@ -968,52 +1591,52 @@ buffer_egl_fill(struct buffer *buffer, float anim_progress)
 			};
 
 			assert(linux_sync_file_is_valid(buffer->kms_fence_fd));
-			sync = create_sync(device->egl_dpy,
-					   EGL_SYNC_NATIVE_FENCE_ANDROID,
-					   attribs);
+			sync = egl->create_sync(device->egl_dpy,
+						EGL_SYNC_NATIVE_FENCE_ANDROID,
+						attribs);
 			assert(sync);
 			buffer->kms_fence_fd = -1;
-			ret = wait_sync(device->egl_dpy, sync, 0);
+			ret = egl->wait_sync(device->egl_dpy, sync, 0);
 			assert(ret);
-			destroy_sync(device->egl_dpy, sync);
+			egl->destroy_sync(device->egl_dpy, sync);
 			sync = EGL_NO_SYNC_KHR;
 		}
 	}
 
-	glBindFramebuffer(GL_FRAMEBUFFER, buffer->gbm.fbo_id);
-	glViewport(0, 0, buffer->width, buffer->height);
-
-	for (unsigned int i = 0; i < 4; i++) {
-		GLfloat col[4];
-		GLfloat verts[8];
-		GLuint err = glGetError();
-		fill_verts(verts, col, anim_progress, i);
-		glBindBuffer(GL_ARRAY_BUFFER, output->egl.vbo);
-		/* glBufferSubData is most supported across GLES2 / Core profile,
-		 * Core profile / GLES3 might have better ways */
-		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 8, verts);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-		if (output->egl.use_vao) {
-			glBindVertexArray(output->egl.vao);
-		} else {
-			glBindBuffer(GL_ARRAY_BUFFER, output->egl.vbo);
-			glVertexAttribPointer(output->egl.pos_attr, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-			glEnableVertexAttribArray(output->egl.pos_attr);
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
-		}
+	output_gl_bind_framebuffer(output, GL_FRAMEBUFFER, buffer->gbm.fbo_id);
+	output_egl_set_target(output, buffer->width, buffer->height,
+			      output->egl.have_gl_mesa_framebuffer_flip_y);
 
-		glUniform4f(output->egl.col_uniform, col[0], col[1], col[2], col[3]);
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-
-		if (output->egl.use_vao)
-			glBindVertexArray(0);
-		else
-			glDisableVertexAttribArray(output->egl.pos_attr);
+	if (!repaint) {
+		region_init_rect(&full, 0, 0, buffer->width, buffer->height);
+		repaint = &full;
+	}
+	draw_scene(output, buffer, anim_progress, repaint);
 
-		err = glGetError();
-		if (err != GL_NO_ERROR)
-			debug("GL error state 0x%x\n", err);
+	/*
+	 * If our KMS device can't scan out what we render into, copy what we
+	 * repainted into the buffer it can; see buffer_egl_create(). Both
+	 * FBOs flip Y alike, so the blit copies rows straight across, but
+	 * with GL_MESA_framebuffer_flip_y our rows count from the bottom.
+	 */
+	if (buffer->gbm.scanout_fbo_id) {
+		output_gl_bind_framebuffer(output, GL_READ_FRAMEBUFFER,
+					   buffer->gbm.fbo_id);
+		output_gl_bind_framebuffer(output, GL_DRAW_FRAMEBUFFER,
+					   buffer->gbm.scanout_fbo_id);
+		for (unsigned int r = 0; r < repaint->num_rects; r++) {
+			const struct rect *rect = &repaint->rects[r];
+			int32_t y1 = rect->y1, y2 = rect->y2;
+
+			if (output->egl.have_gl_mesa_framebuffer_flip_y) {
+				y1 = buffer->height - rect->y2;
+				y2 = buffer->height - rect->y1;
+			}
+			glBlitFramebuffer(rect->x1, y1, rect->x2, y2,
+					  rect->x1, y1, rect->x2, y2,
+					  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		}
+		gl_check_error("copy to scanout buffer");
 	}
 
 	/*
@@ -1033,9 +1656,9 @@ buffer_egl_fill(struct buffer *buffer, float anim_progress)
 			EGL_NONE,
 		};
 
-		sync = create_sync(device->egl_dpy,
-				   EGL_SYNC_NATIVE_FENCE_ANDROID,
-				   attribs);
+		sync = egl->create_sync(device->egl_dpy,
+					EGL_SYNC_NATIVE_FENCE_ANDROID,
+					attribs);
 		assert(sync);
 	}
 
@@ -1046,10 +1669,10 @@ buffer_egl_fill(struct buffer *buffer, float anim_progress)
 	 * rendering, which we can pass to KMS to wait for.
 	 */
 	if (output->explicit_fencing) {
-		int fd = dup_fence_fd(device->egl_dpy, sync);
+		int fd = egl->dup_native_fence_fd(device->egl_dpy, sync);
 		assert(fd >= 0);
 		assert(linux_sync_file_is_valid(fd));
 		fd_replace(&buffer->render_fence_fd, fd);
-		destroy_sync(device->egl_dpy, sync);
+		egl->destroy_sync(device->egl_dpy, sync);
 	}
 }
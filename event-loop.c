@@ -0,0 +1,211 @@
+/*
+ * This file implements our event loop: a thin wrapper around epoll, which
+ * calls back into whoever registered each FD when it becomes ready.
+ *
+ * With poll(), every wake-up meant handing the kernel our whole array of
+ * FDs, and then walking all of them to find the one or two which were
+ * actually ready. epoll keeps the set of FDs in the kernel, and only hands
+ * us back the ones which are ready, along with the source we registered for
+ * each; so the cost of a wake-up no longer grows with the number of outputs
+ * or input devices we have.
+ *
+ * Sources are level-triggered by default: they keep waking us up for as
+ * long as they stay readable, just as with poll(). Passing EPOLLET instead
+ * only reports each change in readiness once, which lets sources such as the
+ * repaint timers be left as they are once they have fired, rather than us
+ * having to drain or disarm them every time; see main.c.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "kms-quads.h"
+
+/* How many ready sources we pick up from the kernel per wake-up. */
+#define EVENT_LOOP_MAX_EVENTS 16
+
+struct event_source {
+	struct event_loop *loop;
+	int fd;
+	event_func_t func;
+	void *data;
+
+	/* every source still in the loop */
+	struct event_source *prev, *next;
+
+	/* sources removed while dispatching, freed once we're done */
+	struct event_source *next_destroyed;
+};
+
+struct event_loop {
+	int epoll_fd;
+	struct event_source *sources;
+
+	bool dispatching;
+	struct event_source *destroyed;
+};
+
+struct event_loop *event_loop_create(void)
+{
+	struct event_loop *loop = calloc(1, sizeof(*loop));
+
+	assert(loop);
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		error("couldn't create epoll FD: %s\n", strerror(errno));
+		free(loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+/* Destroys the loop along with any sources still in it. */
+void event_loop_destroy(struct event_loop *loop)
+{
+	assert(!loop->dispatching);
+
+	while (loop->sources)
+		event_source_remove(loop->sources);
+	close(loop->epoll_fd);
+	free(loop);
+}
+
+/*
+ * Starts watching an FD, calling func whenever it is ready with the epoll
+ * events that are. The FD still belongs to the caller, and must outlive the
+ * source; the source belongs to the loop.
+ */
+struct event_source *event_loop_add_fd(struct event_loop *loop, int fd,
+				       uint32_t events, event_func_t func,
+				       void *data)
+{
+	struct event_source *source = calloc(1, sizeof(*source));
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = source,
+	};
+
+	assert(source);
+	source->loop = loop;
+	source->fd = fd;
+	source->func = func;
+	source->data = data;
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		error("couldn't watch FD %d: %s\n", fd, strerror(errno));
+		free(source);
+		return NULL;
+	}
+
+	source->next = loop->sources;
+	if (loop->sources)
+		loop->sources->prev = source;
+	loop->sources = source;
+
+	return source;
+}
+
+/*
+ * Stops watching a source's FD. This is safe to call from any source's
+ * callback: if we are dispatching, the kernel may already have handed us
+ * this source as ready, so we only free it once we are done.
+ */
+void event_source_remove(struct event_source *source)
+{
+	struct event_loop *loop = source->loop;
+
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	source->fd = -1;
+
+	if (source->prev)
+		source->prev->next = source->next;
+	else
+		loop->sources = source->next;
+	if (source->next)
+		source->next->prev = source->prev;
+
+	if (loop->dispatching) {
+		source->next_destroyed = loop->destroyed;
+		loop->destroyed = source;
+	} else {
+		free(source);
+	}
+}
+
+/*
+ * Waits for up to timeout milliseconds (or forever, if it is -1) for any of
+ * our sources to become ready, and calls back every one which is.
+ *
+ * Returns the number of sources dispatched, or a negative errno if waiting
+ * failed; being interrupted by a signal gives us -EINTR. If a callback
+ * returns a negative errno, we stop there and return that instead.
+ */
+int event_loop_dispatch(struct event_loop *loop, int timeout)
+{
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	int count;
+	int ret;
+
+	count = epoll_wait(loop->epoll_fd, events, ARRAY_LENGTH(events),
+			   timeout);
+	if (count < 0)
+		return -errno;
+
+	ret = count;
+	loop->dispatching = true;
+	for (int i = 0; i < count; i++) {
+		struct event_source *source = events[i].data.ptr;
+
+		/* removed by an earlier callback */
+		if (source->fd < 0)
+			continue;
+
+		int err = source->func(source->fd, events[i].events,
+				       source->data);
+		if (err < 0) {
+			ret = err;
+			break;
+		}
+	}
+	loop->dispatching = false;
+
+	while (loop->destroyed) {
+		struct event_source *source = loop->destroyed;
+
+		loop->destroyed = source->next_destroyed;
+		free(source);
+	}
+
+	return ret;
+}
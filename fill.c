@@ -0,0 +1,386 @@
+/*
+ * This file implements the software renderer used for dumb buffers.
+ *
+ * Our content is four solid rectangles, so rather than deciding the colour of
+ * every pixel individually, we work out where the boundaries are once, and
+ * then fill each row as a couple of runs of identical pixels. Filling a run
+ * is then simply a matter of writing the same value as fast as memory allows.
+ *
+ * Dumb buffers are usually mapped write-combined (or uncached), and we never
+ * read back from them, so we use non-temporal ('streaming') stores where the
+ * CPU has them: these bypass the cache entirely rather than evicting useful
+ * data to make room for pixels we'll never touch again on the CPU. Which
+ * instruction set we use is decided at runtime from what the CPU supports;
+ * setting $KMS_FILL_SIMD to 'none', 'sse2' or 'avx2' overrides this, which is
+ * useful for comparing them with --benchmark.
+ *
+ * At high resolutions a single core can't saturate the memory bus, so the
+ * rows can also be split between a small pool of worker threads. This is off
+ * by default, since it competes with everything else on the machine for CPU
+ * time; set $KMS_FILL_THREADS to the total number of threads to use. The
+ * pool is shared, so when outputs render on threads of their own (see
+ * render.c), their fills take turns using it.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_FILL_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_FILL_NEON 1
+#endif
+
+#include "kms-quads.h"
+
+/* upper limit for $KMS_FILL_THREADS */
+#define FILL_MAX_THREADS 16
+
+typedef void (*fill_span_func)(uint32_t *dst, uint32_t val, unsigned int n);
+
+static void fill_span_c(uint32_t *dst, uint32_t val, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+		dst[i] = val;
+}
+
+#if defined(HAVE_FILL_X86)
+/*
+ * Streaming stores need to be aligned to the vector size, so we write
+ * pixels one at a time until we reach an aligned address, stream as many
+ * whole vectors as we can, then write whatever is left over.
+ */
+__attribute__((target("sse2")))
+static void fill_span_sse2(uint32_t *dst, uint32_t val, unsigned int n)
+{
+	__m128i v = _mm_set1_epi32((int) val);
+
+	while (n > 0 && ((uintptr_t) dst & 15)) {
+		*dst++ = val;
+		n--;
+	}
+	for (; n >= 16; n -= 16, dst += 16) {
+		_mm_stream_si128((__m128i *) dst, v);
+		_mm_stream_si128((__m128i *) (dst + 4), v);
+		_mm_stream_si128((__m128i *) (dst + 8), v);
+		_mm_stream_si128((__m128i *) (dst + 12), v);
+	}
+	for (; n >= 4; n -= 4, dst += 4)
+		_mm_stream_si128((__m128i *) dst, v);
+	fill_span_c(dst, val, n);
+}
+
+__attribute__((target("avx2")))
+static void fill_span_avx2(uint32_t *dst, uint32_t val, unsigned int n)
+{
+	__m256i v = _mm256_set1_epi32((int) val);
+
+	while (n > 0 && ((uintptr_t) dst & 31)) {
+		*dst++ = val;
+		n--;
+	}
+	for (; n >= 32; n -= 32, dst += 32) {
+		_mm256_stream_si256((__m256i *) dst, v);
+		_mm256_stream_si256((__m256i *) (dst + 8), v);
+		_mm256_stream_si256((__m256i *) (dst + 16), v);
+		_mm256_stream_si256((__m256i *) (dst + 24), v);
+	}
+	for (; n >= 8; n -= 8, dst += 8)
+		_mm256_stream_si256((__m256i *) dst, v);
+	fill_span_c(dst, val, n);
+}
+
+/*
+ * Streaming stores are weakly ordered, so they must be fenced before anyone
+ * else (here, the display engine) looks at the buffer.
+ */
+__attribute__((target("sse2")))
+static void fill_fence_sse2(void)
+{
+	_mm_sfence();
+}
+#elif defined(HAVE_FILL_NEON)
+/*
+ * NEON has no non-temporal stores we can reach from intrinsics, but wide
+ * stores still help a lot on write-combined memory, which merges them into
+ * full bursts.
+ */
+static void fill_span_neon(uint32_t *dst, uint32_t val, unsigned int n)
+{
+	uint32x4_t v = vdupq_n_u32(val);
+
+	for (; n >= 16; n -= 16, dst += 16) {
+		vst1q_u32(dst, v);
+		vst1q_u32(dst + 4, v);
+		vst1q_u32(dst + 8, v);
+		vst1q_u32(dst + 12, v);
+	}
+	for (; n >= 4; n -= 4, dst += 4)
+		vst1q_u32(dst, v);
+	fill_span_c(dst, val, n);
+}
+#endif
+
+static void fill_fence_none(void)
+{
+}
+
+/*
+ * A batch of work to fill the clip rectangle of a buffer with four
+ * rectangles split at (split_x, split_y); each thread fills a horizontal
+ * band of the clip's rows.
+ */
+struct fill_job {
+	uint8_t *mem;
+	unsigned int pitch;
+	struct rect clip;
+	unsigned int split_x;
+	unsigned int split_y;
+	uint32_t colours[4];
+};
+
+static struct {
+	bool initialised;
+	fill_span_func span;
+	void (*fence)(void);
+	const char *name;
+
+	/* worker pool; num_threads includes the calling thread */
+	unsigned int num_threads;
+	pthread_t threads[FILL_MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	pthread_mutex_t submit_lock; /* held by the thread using the pool */
+	struct fill_job job;
+	unsigned int generation; /* bumped for every new job */
+	unsigned int pending; /* workers yet to finish the current job */
+	bool quit;
+} fill;
+
+static void fill_band(const struct fill_job *job, unsigned int band,
+		      unsigned int num_bands)
+{
+	unsigned int x1 = job->clip.x1, x2 = job->clip.x2;
+	unsigned int height = job->clip.y2 - job->clip.y1;
+	unsigned int y0 = job->clip.y1 + (height * band) / num_bands;
+	unsigned int y1 = job->clip.y1 + (height * (band + 1)) / num_bands;
+	unsigned int split = job->split_x;
+
+	if (split < x1)
+		split = x1;
+	if (split > x2)
+		split = x2;
+
+	for (unsigned int y = y0; y < y1; y++) {
+		uint32_t *row = (uint32_t *) (job->mem + (y * job->pitch));
+		const uint32_t *col = &job->colours[(y >= job->split_y) ? 2 : 0];
+
+		fill.span(row + x1, col[0], split - x1);
+		fill.span(row + split, col[1], x2 - split);
+	}
+	fill.fence();
+}
+
+static void *fill_worker(void *data)
+{
+	unsigned int band = (unsigned int) (uintptr_t) data;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&fill.lock);
+	for (;;) {
+		while (!fill.quit && fill.generation == seen)
+			pthread_cond_wait(&fill.job_cond, &fill.lock);
+		if (fill.quit)
+			break;
+		seen = fill.generation;
+
+		pthread_mutex_unlock(&fill.lock);
+		fill_band(&fill.job, band, fill.num_threads);
+		pthread_mutex_lock(&fill.lock);
+
+		if (--fill.pending == 0)
+			pthread_cond_signal(&fill.done_cond);
+	}
+	pthread_mutex_unlock(&fill.lock);
+
+	return NULL;
+}
+
+static pthread_mutex_t fill_init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fill_init(void)
+{
+	const char *simd = getenv("KMS_FILL_SIMD");
+	const char *threads = getenv("KMS_FILL_THREADS");
+
+	pthread_mutex_lock(&fill_init_lock);
+	if (fill.initialised) {
+		pthread_mutex_unlock(&fill_init_lock);
+		return;
+	}
+
+	fill.span = fill_span_c;
+	fill.fence = fill_fence_none;
+	fill.name = "scalar";
+
+#if defined(HAVE_FILL_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") &&
+	    (!simd || strcmp(simd, "avx2") == 0)) {
+		fill.span = fill_span_avx2;
+		fill.fence = fill_fence_sse2;
+		fill.name = "AVX2";
+	} else if (__builtin_cpu_supports("sse2") &&
+		   (!simd || strcmp(simd, "avx2") == 0 ||
+		    strcmp(simd, "sse2") == 0)) {
+		fill.span = fill_span_sse2;
+		fill.fence = fill_fence_sse2;
+		fill.name = "SSE2";
+	}
+#elif defined(HAVE_FILL_NEON)
+	if (!simd || strcmp(simd, "neon") == 0) {
+		fill.span = fill_span_neon;
+		fill.name = "NEON";
+	}
+#endif
+
+	fill.num_threads = 1;
+	if (threads) {
+		unsigned long n = strtoul(threads, NULL, 10);
+
+		if (n > FILL_MAX_THREADS)
+			n = FILL_MAX_THREADS;
+		if (n > 1)
+			fill.num_threads = n;
+	}
+
+	pthread_mutex_init(&fill.lock, NULL);
+	pthread_mutex_init(&fill.submit_lock, NULL);
+	pthread_cond_init(&fill.job_cond, NULL);
+	pthread_cond_init(&fill.done_cond, NULL);
+
+	/* The calling thread always takes band 0 itself. */
+	for (unsigned int i = 1; i < fill.num_threads; i++) {
+		if (pthread_create(&fill.threads[i], NULL, fill_worker,
+				   (void *) (uintptr_t) i) != 0) {
+			error("failed to create fill thread, using %u\n", i);
+			fill.num_threads = i;
+			break;
+		}
+	}
+
+	printf("software fill using %s stores on %u thread%s\n", fill.name,
+	       fill.num_threads, (fill.num_threads == 1) ? "" : "s");
+
+	__atomic_store_n(&fill.initialised, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&fill_init_lock);
+}
+
+/*
+ * Fills the buffer with four rectangles meeting at (split_x, split_y):
+ * colours[0] top-left, [1] top-right, [2] bottom-left and [3] bottom-right.
+ * Only pixels inside the clip rectangle are written; NULL fills everything.
+ */
+void buffer_fill_quadrants(struct buffer *buffer, unsigned int split_x,
+			   unsigned int split_y, const uint32_t colours[4],
+			   const struct rect *clip)
+{
+	struct fill_job job = {
+		.mem = (uint8_t *) buffer->dumb.mem,
+		.pitch = buffer->pitches[0],
+		.clip = { 0, 0, buffer->width, buffer->height },
+		.split_x = split_x,
+		.split_y = split_y,
+	};
+
+	if (clip) {
+		if (clip->x1 > job.clip.x1)
+			job.clip.x1 = clip->x1;
+		if (clip->y1 > job.clip.y1)
+			job.clip.y1 = clip->y1;
+		if (clip->x2 < job.clip.x2)
+			job.clip.x2 = clip->x2;
+		if (clip->y2 < job.clip.y2)
+			job.clip.y2 = clip->y2;
+		if (job.clip.x1 >= job.clip.x2 || job.clip.y1 >= job.clip.y2)
+			return;
+	}
+
+	memcpy(job.colours, colours, sizeof(job.colours));
+
+	if (!__atomic_load_n(&fill.initialised, __ATOMIC_ACQUIRE))
+		fill_init();
+
+	if (fill.num_threads == 1) {
+		fill_band(&job, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&fill.submit_lock);
+	pthread_mutex_lock(&fill.lock);
+	fill.job = job;
+	fill.pending = fill.num_threads - 1;
+	fill.generation++;
+	pthread_cond_broadcast(&fill.job_cond);
+	pthread_mutex_unlock(&fill.lock);
+
+	fill_band(&job, 0, fill.num_threads);
+
+	pthread_mutex_lock(&fill.lock);
+	while (fill.pending > 0)
+		pthread_cond_wait(&fill.done_cond, &fill.lock);
+	pthread_mutex_unlock(&fill.lock);
+	pthread_mutex_unlock(&fill.submit_lock);
+}
+
+/* Stops the worker threads, if we started any. */
+void fill_fini(void)
+{
+	if (!fill.initialised)
+		return;
+
+	pthread_mutex_lock(&fill.lock);
+	fill.quit = true;
+	pthread_cond_broadcast(&fill.job_cond);
+	pthread_mutex_unlock(&fill.lock);
+
+	for (unsigned int i = 1; i < fill.num_threads; i++)
+		pthread_join(fill.threads[i], NULL);
+
+	pthread_cond_destroy(&fill.done_cond);
+	pthread_cond_destroy(&fill.job_cond);
+	pthread_mutex_destroy(&fill.submit_lock);
+	pthread_mutex_destroy(&fill.lock);
+	fill.quit = false;
+	fill.initialised = false;
+}
@@ -0,0 +1,257 @@
+/*
+ * This file implements choosing the format modifier for each output's
+ * buffers: how their pixels are laid out in memory.
+ *
+ * A plane's IN_FORMATS property lists every modifier it can scan out
+ * XRGB8888 with (see plane_formats_populate() in kms.c). Handing the whole
+ * list to GBM lets the driver pick, but it doesn't know that we are going to
+ * scan the buffer out, and at 4K the choice matters: a compressed layout,
+ * such as Intel's CCS, AMD's DCC or Arm's AFBC, can cut the memory bandwidth
+ * needed to render and scan out each frame to a fraction of a linear one.
+ * Tiled layouts are cheaper to render into than linear ones, though they
+ * save less.
+ *
+ * So we rank the plane's modifiers, compressed ahead of tiled and tiled
+ * ahead of linear, and try each group in turn, best first: GBM picks a
+ * modifier from within the group, and a TEST_ONLY commit with the buffer on
+ * the primary plane tells us whether KMS will actually take it, since some
+ * combinations of mode, modifier and plane are only rejected at commit time.
+ * The first modifier which passes is the one every buffer in the output's
+ * pool is allocated with from then on.
+ *
+ * All of this is per output: if nothing passes, or allocating with the
+ * modifier we chose fails later, that output falls back to letting the
+ * driver choose implicitly, without affecting any of the others.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+enum modifier_class {
+	MODIFIER_LINEAR = 0,
+	MODIFIER_TILED,
+	MODIFIER_COMPRESSED,
+};
+
+static const char *const modifier_class_names[] = {
+	[MODIFIER_LINEAR]     = "linear",
+	[MODIFIER_TILED]      = "tiled",
+	[MODIFIER_COMPRESSED] = "compressed",
+};
+
+#define modifier_vendor(mod) ((mod) >> 56)
+
+/*
+ * Works out whether a modifier describes a compressed layout. Each vendor
+ * encodes this differently, and newer kernel headers know about more of
+ * them, so we only check for those our headers define. Anything else which
+ * isn't linear, we count as tiled.
+ */
+static enum modifier_class modifier_classify(uint64_t mod)
+{
+	if (mod == DRM_FORMAT_MOD_LINEAR)
+		return MODIFIER_LINEAR;
+
+	switch (modifier_vendor(mod)) {
+	case DRM_FORMAT_MOD_VENDOR_INTEL:
+		if (mod == I915_FORMAT_MOD_Y_TILED_CCS ||
+		    mod == I915_FORMAT_MOD_Yf_TILED_CCS)
+			return MODIFIER_COMPRESSED;
+#ifdef I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS
+		if (mod == I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS ||
+		    mod == I915_FORMAT_MOD_Y_TILED_GEN12_MC_CCS ||
+		    mod == I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS_CC)
+			return MODIFIER_COMPRESSED;
+#endif
+#ifdef I915_FORMAT_MOD_4_TILED_DG2_RC_CCS
+		if (mod == I915_FORMAT_MOD_4_TILED_DG2_RC_CCS ||
+		    mod == I915_FORMAT_MOD_4_TILED_DG2_MC_CCS ||
+		    mod == I915_FORMAT_MOD_4_TILED_DG2_RC_CCS_CC)
+			return MODIFIER_COMPRESSED;
+#endif
+#ifdef I915_FORMAT_MOD_4_TILED_MTL_RC_CCS
+		if (mod == I915_FORMAT_MOD_4_TILED_MTL_RC_CCS ||
+		    mod == I915_FORMAT_MOD_4_TILED_MTL_MC_CCS ||
+		    mod == I915_FORMAT_MOD_4_TILED_MTL_RC_CCS_CC)
+			return MODIFIER_COMPRESSED;
+#endif
+		break;
+#ifdef AMD_FMT_MOD
+	case DRM_FORMAT_MOD_VENDOR_AMD:
+		if (AMD_FMT_MOD_GET(DCC, mod))
+			return MODIFIER_COMPRESSED;
+		break;
+#endif
+	case DRM_FORMAT_MOD_VENDOR_NVIDIA:
+		/*
+		 * Block-linear layouts keep their compression kind in bits
+		 * 23-25; see DRM_FORMAT_MOD_NVIDIA_BLOCK_LINEAR_2D().
+		 */
+		if ((mod & 0x10) && ((mod >> 23) & 0x7))
+			return MODIFIER_COMPRESSED;
+		break;
+	case DRM_FORMAT_MOD_VENDOR_ARM:
+		/* AFBC and AFRC are both compressed; the type is bits 52-55. */
+		if (((mod >> 52) & DRM_FORMAT_MOD_ARM_TYPE_MASK) ==
+		    DRM_FORMAT_MOD_ARM_TYPE_AFBC)
+			return MODIFIER_COMPRESSED;
+#ifdef DRM_FORMAT_MOD_ARM_TYPE_AFRC
+		if (((mod >> 52) & DRM_FORMAT_MOD_ARM_TYPE_MASK) ==
+		    DRM_FORMAT_MOD_ARM_TYPE_AFRC)
+			return MODIFIER_COMPRESSED;
+#endif
+		break;
+#ifdef DRM_FORMAT_MOD_QCOM_COMPRESSED
+	case DRM_FORMAT_MOD_VENDOR_QCOM:
+		if (mod == DRM_FORMAT_MOD_QCOM_COMPRESSED)
+			return MODIFIER_COMPRESSED;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	return MODIFIER_TILED;
+}
+
+/*
+ * Sorts the output's modifiers best first. Within each class we keep the
+ * order the plane listed them in, which drivers tend to list in their own
+ * order of preference, so this is an insertion sort rather than qsort().
+ */
+void output_modifiers_rank(struct output *output)
+{
+	for (unsigned int i = 1; i < output->num_modifiers; i++) {
+		uint64_t mod = output->modifiers[i];
+		enum modifier_class class = modifier_classify(mod);
+		unsigned int j = i;
+
+		while (j > 0 &&
+		       modifier_classify(output->modifiers[j - 1]) < class) {
+			output->modifiers[j] = output->modifiers[j - 1];
+			j--;
+		}
+		output->modifiers[j] = mod;
+	}
+
+	output->format.modifiers = output->modifiers;
+	output->format.num_modifiers = output->num_modifiers;
+}
+
+/* Asks KMS whether it would scan out the buffer on the primary plane. */
+static bool format_test(struct output *output, struct buffer *buffer)
+{
+	if (!output->atomic.test_req)
+		output->atomic.test_req = atomic_req_create(&output->arena);
+	atomic_req_reset(output->atomic.test_req);
+
+	output_add_atomic_req(output, output->atomic.test_req, buffer, true);
+
+	return atomic_test(output->device, output->atomic.test_req, true) == 0;
+}
+
+/*
+ * Settles on the modifier to allocate the output's buffers with, as
+ * described above. Returns the buffer we tested the winning modifier with,
+ * for the caller to keep, or NULL if we didn't negotiate one.
+ *
+ * When another GPU renders for the output's device, the modifiers have to
+ * suit both devices; we leave that to the render GPU's driver, with the
+ * copy fallback in buffer_create() behind it.
+ */
+struct buffer *output_format_negotiate(struct output *output)
+{
+	struct device *device = output->device;
+	struct buffer *ret = NULL;
+	unsigned int start = 0;
+
+	/* Dumb buffers are always linear. */
+	if (!device->gbm_device)
+		return NULL;
+
+	output->format.use_modifiers = device->fb_modifiers &&
+				       output->num_modifiers > 0;
+	if (!output->format.use_modifiers) {
+		printf("[%s] not using format modifiers\n", output->name);
+		return NULL;
+	}
+	if (device->render_device != device)
+		return NULL;
+
+	output->format.negotiating = true;
+	while (!ret && start < output->num_modifiers) {
+		enum modifier_class class =
+			modifier_classify(output->modifiers[start]);
+		unsigned int end = start;
+
+		while (end < output->num_modifiers &&
+		       modifier_classify(output->modifiers[end]) == class)
+			end++;
+
+		output->format.modifiers = &output->modifiers[start];
+		output->format.num_modifiers = end - start;
+		ret = buffer_create(device, output);
+		if (ret && !format_test(output, ret)) {
+			debug("[%s] KMS rejected %s modifier 0x%" PRIx64 "\n",
+			      output->name, modifier_class_names[class],
+			      ret->modifier);
+			buffer_destroy(ret);
+			ret = NULL;
+		}
+
+		start = end;
+	}
+	output->format.negotiating = false;
+
+	if (!ret) {
+		fprintf(stderr, "[%s] no modifier passed a test commit; leaving the choice to the driver\n",
+			output->name);
+		output->format.modifiers = output->modifiers;
+		output->format.num_modifiers = output->num_modifiers;
+		return NULL;
+	}
+
+	/* Allocate every other buffer with exactly the same layout. */
+	for (unsigned int m = 0; m < output->num_modifiers; m++) {
+		if (output->modifiers[m] == ret->modifier) {
+			output->format.modifiers = &output->modifiers[m];
+			output->format.num_modifiers = 1;
+			break;
+		}
+	}
+
+	printf("[%s] using %s modifier 0x%016" PRIx64 "\n", output->name,
+	       modifier_class_names[modifier_classify(ret->modifier)],
+	       ret->modifier);
+
+	return ret;
+}
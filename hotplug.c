@@ -0,0 +1,123 @@
+/*
+ * This file watches for monitors being plugged in and unplugged, through
+ * udev.
+ *
+ * The kernel sends a uevent on the DRM device whenever one of its
+ * connectors changes state, with HOTPLUG=1 set. Newer kernels also name the
+ * connector which changed, as CONNECTOR=<id>; in that case we only need to
+ * look at that one, otherwise the main loop looks at every connector on the
+ * device and acts on whichever have changed. Either way, only the outputs
+ * which were plugged in or unplugged are created or destroyed, and the rest
+ * carry on as they were; see main.c and device_connector_rescan().
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libudev.h>
+
+#include "kms-quads.h"
+
+struct hotplug {
+	struct udev *udev;
+	struct udev_monitor *monitor;
+};
+
+struct hotplug *hotplug_create(void)
+{
+	struct hotplug *ret = calloc(1, sizeof(*ret));
+
+	assert(ret);
+	ret->udev = udev_new();
+	if (!ret->udev) {
+		error("failed to create udev context\n");
+		goto err;
+	}
+
+	ret->monitor = udev_monitor_new_from_netlink(ret->udev, "udev");
+	if (!ret->monitor) {
+		error("failed to create udev monitor\n");
+		goto err_udev;
+	}
+
+	if (udev_monitor_filter_add_match_subsystem_devtype(ret->monitor,
+							    "drm",
+							    "drm_minor") < 0 ||
+	    udev_monitor_enable_receiving(ret->monitor) < 0) {
+		error("failed to watch for DRM hotplug events\n");
+		goto err_monitor;
+	}
+
+	return ret;
+
+err_monitor:
+	udev_monitor_unref(ret->monitor);
+err_udev:
+	udev_unref(ret->udev);
+err:
+	free(ret);
+	return NULL;
+}
+
+void hotplug_destroy(struct hotplug *hotplug)
+{
+	udev_monitor_unref(hotplug->monitor);
+	udev_unref(hotplug->udev);
+	free(hotplug);
+}
+
+int hotplug_get_fd(struct hotplug *hotplug)
+{
+	return udev_monitor_get_fd(hotplug->monitor);
+}
+
+/*
+ * Takes the next event from udev. Returns true if it is a hotplug event for
+ * a DRM device, giving its device number and the connector which changed,
+ * or 0 if the kernel didn't say.
+ */
+bool hotplug_read(struct hotplug *hotplug, dev_t *devnum,
+		  uint32_t *connector_id)
+{
+	struct udev_device *dev;
+	const char *val;
+	bool ret = false;
+
+	dev = udev_monitor_receive_device(hotplug->monitor);
+	if (!dev)
+		return false;
+
+	val = udev_device_get_property_value(dev, "HOTPLUG");
+	if (val && strcmp(val, "1") == 0) {
+		*devnum = udev_device_get_devnum(dev);
+		val = udev_device_get_property_value(dev, "CONNECTOR");
+		*connector_id = val ? strtoul(val, NULL, 10) : 0;
+		ret = true;
+	}
+
+	udev_device_unref(dev);
+	return ret;
+}
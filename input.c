@@ -1,3 +1,18 @@
+/*
+ * This file implements our input handling, on top of libinput.
+ *
+ * Whenever libinput's FD becomes readable, our event loop calls
+ * input_dispatch(), which translates whatever libinput has for us into our
+ * own events and queues them up, along with the time each one was
+ * generated. Nothing acts on them here: the main loop takes them off the
+ * queue just before it repaints, so they go into the very next frame we
+ * render, and the telemetry can measure how long each one took to appear
+ * on screen.
+ *
+ * The queue is a fixed-size ring; if nobody takes events off it for long
+ * enough that it fills, we drop the oldest.
+ */
+
 /*
  * Copyright © 2018-2019 Collabora, Ltd.
  * Copyright © 2018-2019 DAQRI, LLC and its affiliates
@@ -30,9 +45,16 @@
 #include <errno.h>
 #include "kms-quads.h"
 
+/* How many events we hold before dropping the oldest. */
+#define INPUT_QUEUE_SIZE 256
+
 struct input {
 	struct udev *udev;
 	struct libinput *input;
+
+	struct input_event queue[INPUT_QUEUE_SIZE];
+	unsigned int head; /* index of the oldest event */
+	unsigned int count;
 };
 
 static int open_restricted(const char *path, int flags UNUSED, void* user_data)
@@ -100,25 +122,127 @@ void input_destroy(struct input *input)
 	free(input);
 }
 
-bool input_was_ESC_key_pressed(struct input *input)
+/*
+ * The libinput FD becomes readable whenever there are events for us to
+ * dispatch, so we only need to look at our input when it is.
+ */
+int input_get_fd(struct input *input)
+{
+	return libinput_get_fd(input->input);
+}
+
+static void input_queue_push(struct input *input,
+			     const struct input_event *event)
+{
+	if (input->count == INPUT_QUEUE_SIZE) {
+		debug("input queue full; dropping oldest event\n");
+		input->head = (input->head + 1) % INPUT_QUEUE_SIZE;
+		input->count--;
+	}
+
+	input->queue[(input->head + input->count) % INPUT_QUEUE_SIZE] = *event;
+	input->count++;
+}
+
+/*
+ * Translates one libinput event into ours; returns false for anything we
+ * don't care about.
+ */
+static bool input_translate(struct libinput_event *event,
+			    struct input_event *out)
+{
+	struct libinput_event_keyboard *key;
+	struct libinput_event_pointer *pointer;
+
+	memset(out, 0, sizeof(*out));
+
+	switch (libinput_event_get_type(event)) {
+	case LIBINPUT_EVENT_KEYBOARD_KEY:
+		key = libinput_event_get_keyboard_event(event);
+		out->type = INPUT_EVENT_KEY;
+		out->time_usec = libinput_event_keyboard_get_time_usec(key);
+		out->key = libinput_event_keyboard_get_key(key);
+		out->pressed = (libinput_event_keyboard_get_key_state(key) ==
+				LIBINPUT_KEY_STATE_PRESSED);
+		return true;
+	case LIBINPUT_EVENT_POINTER_MOTION:
+		pointer = libinput_event_get_pointer_event(event);
+		out->type = INPUT_EVENT_MOTION;
+		out->time_usec = libinput_event_pointer_get_time_usec(pointer);
+		out->dx = libinput_event_pointer_get_dx(pointer);
+		out->dy = libinput_event_pointer_get_dy(pointer);
+		return true;
+	case LIBINPUT_EVENT_POINTER_AXIS:
+		pointer = libinput_event_get_pointer_event(event);
+		out->type = INPUT_EVENT_SCROLL;
+		out->time_usec = libinput_event_pointer_get_time_usec(pointer);
+		if (libinput_event_pointer_has_axis(pointer,
+						    LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL))
+			out->dx = libinput_event_pointer_get_axis_value(pointer,
+									LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL);
+		if (libinput_event_pointer_has_axis(pointer,
+						    LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL))
+			out->dy = libinput_event_pointer_get_axis_value(pointer,
+									LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Reads everything libinput has for us and queues it up. This never blocks,
+ * so as well as from the event loop, it can be called just before we render
+ * to pick up anything which has arrived since; returns how many events we
+ * queued.
+ */
+int input_dispatch(struct input *input)
 {
-	assert(input);
 	struct libinput_event *event;
+	struct input_event ev;
+	int ret = 0;
+
+	assert(input);
 	libinput_dispatch(input->input);
-	enum libinput_event_type type;
-	bool ret = false;
 
 	while ((event = libinput_get_event(input->input)) != NULL) {
-		type = libinput_event_get_type(event);
-		if (type == LIBINPUT_EVENT_KEYBOARD_KEY) {
-			struct libinput_event_keyboard *key_event = libinput_event_get_keyboard_event(event);
-			uint32_t key_code = libinput_event_keyboard_get_key(key_event);
-			/* 1 == KEY_ESC in input-event-codes.h */
-			ret = ret || (key_code == 1);
+		if (input_translate(event, &ev)) {
+			input_queue_push(input, &ev);
+			ret++;
 		}
 		libinput_event_destroy(event);
-		libinput_dispatch(input->input);
-        }
-        return ret;
+	}
+
+	return ret;
+}
+
+/* Takes the oldest queued event; returns false if there are none. */
+bool input_pop_event(struct input *input, struct input_event *event)
+{
+	if (input->count == 0)
+		return false;
+
+	*event = input->queue[input->head];
+	input->head = (input->head + 1) % INPUT_QUEUE_SIZE;
+	input->count--;
+
+	return true;
 }
 
+/*
+ * While our session is paused, logind revokes our input devices, so we close
+ * them all; resuming opens whichever devices are there now, through logind
+ * again. Anything left in the queue was typed at us before we lost the VT,
+ * and is dropped.
+ */
+void input_suspend(struct input *input)
+{
+	libinput_suspend(input->input);
+	input->count = 0;
+}
+
+void input_resume(struct input *input)
+{
+	if (libinput_resume(input->input) != 0)
+		error("failed to resume libinput\n");
+}
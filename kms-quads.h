@@ -24,13 +24,18 @@
  * Author: Daniel Stone <daniels@collabora.com>
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/ioctl.h>
+#include <sys/types.h>
 
 /* The dma-fence explicit fencing API was previously called sync-file. */
 #include <linux/sync_file.h>
@@ -59,9 +64,27 @@
 #if defined(HAVE_GL_CORE)
 #include <GL/gl.h>
 #include <GL/glext.h>
+#define _APIENTRYP APIENTRYP
 #else
 #include <GLES3/gl3.h>
 #include <GLES3/gl3ext.h>
+/*
+ * GLES2 exts is needed for prototypes of GL_OES_EGL_image
+ * (i.e. glEGLImageTargetTexture2DOES etc.)
+ */
+#include <GLES2/gl2ext.h>
+#define _APIENTRYP GL_APIENTRYP
+#endif
+
+/* Add glFramebufferParameteri signature manually if needed. Actual context
+ * might support higher vGL/GLES version than exposed through headers */
+#if !(GL_VERSION_4_3 == 1) || !(GL_ES_VERSION_3_1 == 1)
+typedef void (_APIENTRYP PFNGLFRAMEBUFFERPARAMETERIPROC) (GLenum target, GLenum pname, GLint param);
+#endif
+
+#if !defined(GL_FRAMEBUFFER_FLIP_Y_MESA)
+/* see https://www.khronos.org/registry/OpenGL/extensions/MESA/MESA_framebuffer_flip_y.txt */
+#define GL_FRAMEBUFFER_FLIP_Y_MESA 0x8BBB
 #endif
 
 /* Utility header from Weston to more easily handle time values. */
@@ -82,15 +105,99 @@
 struct buffer;
 struct device;
 struct output;
+struct plane;
 struct logind;
 struct input;
+struct hotplug;
+struct event_loop;
+struct event_source;
 
 
 #define BUFFER_QUEUE_DEPTH 3 /* how many buffers to allocate per output */
 
+/* Upper bound on buffers per output, including any for rendering ahead. */
+#define BUFFER_QUEUE_MAX 8
+
 /* how long until animation wraps over */
 #define ANIMATION_LOOP_DURATION_NSEC (4u*1000000000u)
 
+/* Allow the driver to drift half a millisecond every frame. */
+#define FRAME_TIMING_TOLERANCE (NSEC_PER_SEC / 2000)
+
+/* The initial amount of time a repaint of an output is scheduled before its
+ * next estimated KMS commit completion time. The scheduler in schedule.c
+ * adapts this to the render cost it measures once frames start flowing. */
+#define RENDER_LEEWAY_NSEC (NSEC_PER_MSEC * 5)
+
+/* how many render cost samples the scheduler keeps per output */
+#define SCHED_COST_SAMPLES 64
+
+/* how many frame records the telemetry ring keeps per output */
+#define TELEMETRY_FRAMES 256
+
+/* how many rectangles a damage region holds before collapsing to its
+ * bounding box */
+#define REGION_MAX_RECTS 8
+
+/* how many layers we can place above an output's main content */
+#define OUTPUT_MAX_LAYERS 4
+
+/* how many replaced external buffers a layer holds on to until KMS and the
+ * renderer have finished with them */
+#define LAYER_MAX_RETIRED 8
+
+/* how many quads the GL renderer batches into a single draw call; with
+ * 16-bit indices, we can't address any more vertices than this */
+#define QUAD_BATCH_MAX 16384
+
+/* width and height of each output's glyph atlas texture, in texels */
+#define TEXT_ATLAS_SIZE 1024
+
+/* how many glyphs the atlas caches; must be a power of two */
+#define TEXT_GLYPH_CACHE_SIZE 1024
+
+/* how much each of our arenas takes from the heap at a time */
+#define ARENA_FRAME_BLOCK_SIZE (64 * 1024)
+#define ARENA_DEVICE_BLOCK_SIZE (4 * 1024)
+#define ARENA_OUTPUT_BLOCK_SIZE (16 * 1024)
+
+/*
+ * Memory we allocate from by bumping a pointer, and give back all at once;
+ * see arena.c. heap_allocs counts the blocks it has taken from the heap.
+ */
+struct arena_block;
+struct arena {
+	struct arena_block *blocks; /* the one we're allocating from first */
+	size_t block_size;
+	unsigned int heap_allocs;
+};
+
+/*
+ * An atomic request: property values to set on KMS objects, which we
+ * commit with the ATOMIC ioctl ourselves rather than with libdrm's
+ * drmModeAtomicCommit(), as that makes several allocations every time.
+ * Everything, including what we hand the ioctl, comes from the arena the
+ * request was created in; see kms.c.
+ */
+struct atomic_prop {
+	uint32_t obj_id;
+	uint32_t prop_id;
+	uint64_t value;
+};
+
+struct atomic_req {
+	struct arena *arena;
+	struct atomic_prop *props; /* in the order they were added */
+	unsigned int num_props;
+	unsigned int max_props;
+
+	/* the ioctl's arrays, filled in from props as we commit */
+	uint32_t *objs;
+	uint32_t *obj_num_props;
+	uint32_t *prop_ids;
+	uint64_t *values;
+};
+
 
 /**
  * Represents the values of an enum-type KMS property. These properties
@@ -141,6 +248,8 @@ enum wdrm_plane_property {
 	WDRM_PLANE_CRTC_ID,
 	WDRM_PLANE_IN_FORMATS,
 	WDRM_PLANE_IN_FENCE_FD,
+	WDRM_PLANE_FB_DAMAGE_CLIPS,
+	WDRM_PLANE_ZPOS,
 	WDRM_PLANE__COUNT
 };
 
@@ -162,6 +271,7 @@ enum wdrm_connector_property {
 	WDRM_CONNECTOR_DPMS,
 	WDRM_CONNECTOR_CRTC_ID,
 	WDRM_CONNECTOR_NON_DESKTOP,
+	WDRM_CONNECTOR_VRR_CAPABLE,
 	WDRM_CONNECTOR__COUNT
 };
 
@@ -180,9 +290,128 @@ enum wdrm_crtc_property {
 	WDRM_CRTC_MODE_ID = 0,
 	WDRM_CRTC_ACTIVE,
 	WDRM_CRTC_OUT_FENCE_PTR,
+	WDRM_CRTC_VRR_ENABLED,
+	WDRM_CRTC_DEGAMMA_LUT,
+	WDRM_CRTC_DEGAMMA_LUT_SIZE,
+	WDRM_CRTC_CTM,
+	WDRM_CRTC_GAMMA_LUT,
+	WDRM_CRTC_GAMMA_LUT_SIZE,
 	WDRM_CRTC__COUNT
 };
 
+/*
+ * Where an output's colour transform runs; see colour.c. The CRTC's colour
+ * pipeline is degamma LUT, then CTM, then gamma LUT, all in display
+ * hardware; we use as much of it as the CRTC has, and only fall back to a
+ * GPU pass when it has none of it.
+ */
+enum colour_mode {
+	COLOUR_MODE_PIPELINE = 0, /* degamma LUT, CTM and gamma LUT */
+	COLOUR_MODE_GAMMA_LUT, /* just the gamma LUT */
+	COLOUR_MODE_CTM, /* just the CTM */
+	COLOUR_MODE_GPU, /* a multiply pass after rendering */
+};
+
+
+/*
+ * Timing information for a single frame, kept by telemetry.c. All times are
+ * CLOCK_MONOTONIC nanoseconds, and 0 if not known.
+ */
+struct frame_record {
+	uint64_t repaint_start; /* when we started painting the frame */
+	uint64_t render_submit; /* when the CPU had submitted all rendering */
+	uint64_t render_done; /* when the render fence signalled */
+	uint64_t flip; /* when KMS told us the frame was being displayed */
+	int64_t delta_nsec; /* flip time minus the time we had predicted */
+	uint64_t input; /* oldest input event first shown by the frame, or 0 */
+	bool async_flip; /* flipped without waiting for vblank */
+	bool after_idle; /* the first frame after we stopped repainting */
+};
+
+/*
+ * Summary statistics over the frames in an output's telemetry ring, as
+ * computed by output_telemetry_get_stats().
+ */
+struct frame_stats {
+	uint64_t total_frames; /* frames displayed since startup */
+	uint64_t missed_frames; /* frames which flipped later than predicted */
+	unsigned int num_samples; /* frame intervals the figures below cover */
+	double frame_mean_nsec;
+	int64_t frame_p50_nsec;
+	int64_t frame_p99_nsec;
+	double jitter_nsec; /* standard deviation of the frame time */
+	int64_t latency_p50_nsec; /* repaint start to flip, vsynced frames */
+	int64_t latency_p99_nsec;
+	unsigned int num_async_samples; /* frames flipped asynchronously */
+	int64_t async_latency_p50_nsec; /* repaint start to flip */
+	int64_t async_latency_p99_nsec;
+	unsigned int num_input_samples; /* frames showing new input */
+	int64_t input_latency_p50_nsec; /* input event to flip */
+	int64_t input_latency_p99_nsec;
+};
+
+/*
+ * A rectangle in buffer co-ordinates; x2 and y2 are exclusive. This has the
+ * same layout as struct drm_mode_rect, which FB_DAMAGE_CLIPS takes.
+ */
+struct rect {
+	int32_t x1, y1;
+	int32_t x2, y2;
+};
+
+/*
+ * A small set of possibly-overlapping rectangles, used for damage tracking
+ * in damage.c. Rather than doing exact region arithmetic, we merge
+ * rectangles where the result is still a rectangle, and fall back to the
+ * bounding box once we run out of slots: repainting a few too many pixels
+ * is always safe.
+ */
+struct region {
+	unsigned int num_rects;
+	struct rect rects[REGION_MAX_RECTS];
+};
+
+/*
+ * One vertex of a quad drawn by the batched GL renderer in egl-gles.c, in
+ * buffer (pixel) co-ordinates with the origin at the top left.
+ */
+struct quad_vertex {
+	GLfloat x, y;
+	GLfloat u, v; /* in the glyph atlas, normalised */
+	GLubyte col[4]; /* RGBA */
+};
+
+/*
+ * A glyph rasterised into an output's atlas, see text.c. Glyphs are cached
+ * by codepoint and pixel size; size 0 marks an empty slot in the cache.
+ */
+struct glyph {
+	uint32_t codepoint;
+	uint16_t size;
+	uint16_t x, y; /* top left in the atlas */
+	uint16_t width, height; /* 0 for glyphs with nothing to draw */
+	int16_t bearing_x; /* from the pen position to the left edge */
+	int16_t bearing_y; /* from the baseline up to the top edge */
+	int16_t advance; /* how far to move the pen afterwards */
+};
+
+/*
+ * Each output's glyph atlas: a single-channel texture holding the coverage
+ * of every glyph we have drawn, packed into rows ('shelves'), and a copy of
+ * it in system memory which glyphs are rasterised into. Only the rows
+ * touched since the last upload are sent to the GPU, before the next draw.
+ */
+struct text_atlas {
+	GLuint tex;
+	uint8_t *pixels; /* TEXT_ATLAS_SIZE squared, one byte per texel */
+	unsigned int shelf_x, shelf_y; /* where the next glyph goes */
+	unsigned int shelf_height; /* tallest glyph on this shelf */
+	unsigned int dirty_y1, dirty_y2; /* rows to upload; empty if equal */
+	struct glyph glyphs[TEXT_GLYPH_CACHE_SIZE];
+	unsigned int num_glyphs;
+	struct text_font *font; /* NULL if we have no font to draw with */
+	bool page; /* fill the screen with text, for benchmarking */
+};
 
 /*
  * A buffer to display on screen. We currently use KMS dumb buffers for this.
@@ -267,6 +496,22 @@ struct buffer {
 	uint32_t format;
 	uint64_t modifier;
 
+	/*
+	 * For buffers produced outside of us and imported with
+	 * buffer_import_dmabuf(): our own duplicates of the dma-buf FDs,
+	 * for importing into EGL if we have to composite the buffer, and
+	 * the producer's fence, which signals once the content is ready.
+	 * Each import gets a new serial, which the renderer keys its
+	 * EGLImage of the buffer on; see dmabuf.c.
+	 */
+	struct {
+		bool external;
+		uint64_t serial;
+		int num_planes;
+		int fds[4];
+		int fence_fd;
+	} dmabuf;
+
 	/* Parameters for our memory-mapped image. */
 	struct {
 		uint32_t *mem;
@@ -278,12 +523,141 @@ struct buffer {
 		EGLImage img;
 		GLuint tex_id;
 		GLuint fbo_id;
+
+		/*
+		 * When another GPU renders for our device, gem_handles are
+		 * the BO imported into our device through PRIME. If it can't
+		 * give us a BO our device can scan out, we render into bo
+		 * and copy each frame into a linear BO we can, scanout_bo;
+		 * see buffer_egl_create().
+		 */
+		bool prime;
+		struct gbm_bo *scanout_bo;
+		EGLImage scanout_img;
+		GLuint scanout_tex_id;
+		GLuint scanout_fbo_id;
 	} gbm;
 
 	unsigned int width;
 	unsigned int height;
 	unsigned int pitches[4]; /* in bytes */
 	unsigned int offsets[4]; /* in bytes */
+
+	/*
+	 * Timing for the frame last rendered into this buffer, which is moved
+	 * into the output's telemetry ring once the frame is displayed.
+	 */
+	struct frame_record frame;
+
+	/*
+	 * Damage tracking, see damage.c. The age is the number of frames
+	 * since this buffer was last painted, or 0 if its contents are
+	 * undefined; the damage is everything which has changed on screen
+	 * since then, i.e. what we have to repaint to bring it up to date.
+	 */
+	unsigned int age;
+	struct region damage;
+
+	/*
+	 * What changed on screen in the frame in this buffer, for
+	 * FB_DAMAGE_CLIPS when we commit it.
+	 */
+	struct region frame_damage;
+	bool frame_damage_full; /* covers the whole output */
+
+	/*
+	 * Where each of the output's layers was in the frame in this buffer,
+	 * and which plane it was on, if any. When rendering ahead, we may
+	 * only commit the buffer after later frames have moved the layers
+	 * on again; see layer.c.
+	 */
+	struct {
+		struct rect rect;
+		struct plane *plane;
+		struct buffer *fb;
+	} layers[OUTPUT_MAX_LAYERS];
+	unsigned int num_layers;
+};
+
+/*
+ * The description of a dma-buf produced outside of us, e.g. by a video
+ * decoder or a camera, for buffer_import_dmabuf(). The layout of each
+ * plane in the dma-buf FDs is described by the format and modifier
+ * together, as with our own buffers. The FDs remain the caller's.
+ */
+struct dmabuf_attributes {
+	unsigned int width;
+	unsigned int height;
+	uint32_t format;
+	uint64_t modifier;
+	int num_planes;
+	int fds[4];
+	uint32_t pitches[4];
+	uint32_t offsets[4];
+};
+
+/*
+ * A KMS plane other than the primary, which can display one of our layers
+ * on top of the output's main content; see layer.c. Each plane is only
+ * ever used by one output.
+ */
+struct plane_state {
+	struct buffer *fb; /* NULL if the plane is off */
+	struct rect rect; /* where on the CRTC it is shown */
+};
+
+struct plane {
+	uint32_t plane_id;
+	enum wdrm_plane_type type;
+	struct drm_property_info props[WDRM_PLANE__COUNT];
+
+	/* the layer we've placed on this plane, or NULL if it is unused */
+	struct layer *layer;
+
+	/* what the plane showed in our last successful commit */
+	struct plane_state committed;
+};
+
+/*
+ * A layer is a rectangle of content stacked above the output's main
+ * content. Ideally each one is placed on its own KMS plane, so the display
+ * controller blends it for free and moving it costs no rendering at all;
+ * when the hardware won't accept that, we composite it into the main
+ * content with the renderer instead. Most of our layers are solid colours,
+ * so compositing them is simply drawing an extra rectangle; layers showing
+ * external dma-bufs are drawn from an EGLImage of the buffer instead, see
+ * dmabuf.c.
+ */
+struct layer {
+	const char *name;
+	uint32_t colour; /* ARGB */
+	struct rect rect; /* position on the output */
+	struct buffer *buffer; /* pre-filled content for a plane */
+
+	/* the plane we're displayed on, or NULL if composited */
+	struct plane *plane;
+	bool composite; /* never try a plane, for $KMS_NO_OVERLAYS */
+
+	/* where we last composited this layer into the main content, for
+	 * damage tracking; empty if it is on a plane */
+	struct rect drawn;
+
+	/*
+	 * For layers showing external buffers: the buffer to show from the
+	 * next frame on, the buffers it replaced which may still be on
+	 * screen or queued, whether the next frame shows new content, and
+	 * the renderer's EGLImage of the buffer being shown, to composite
+	 * it with; see dmabuf.c.
+	 */
+	struct buffer *pending;
+	struct buffer *retired[LAYER_MAX_RETIRED];
+	unsigned int num_retired;
+	bool frame_changed;
+	struct {
+		uint64_t serial;
+		EGLImage img;
+		GLuint tex;
+	} egl;
 };
 
 /*
@@ -315,7 +689,8 @@ struct buffer {
  * show a single flat fullscreen image, overlay planes are used to display
  * content on top of this which is blended by the display controller (often
  * video content), and cursor planes are almost exclusively used for mouse
- * cursors. For our uses, we only care about primary planes.
+ * cursors. Each output has one primary plane for its main content, and may
+ * use some overlay and cursor planes for layers on top of it; see layer.c.
  *
  * Note that _only_ overlay planes will be enumerated by default; enabling
  * the 'universal planes' client capability causes the kernel to advertise
@@ -327,6 +702,12 @@ struct output {
 	/* A friendly name. */
 	char name[32];
 
+	/*
+	 * Where the output's KMS metadata lives, such as its property tables
+	 * and its static and test requests, until it is destroyed.
+	 */
+	struct arena arena;
+
 	/*
 	 * Should we render this output the next time we go through the
 	 * event loop?
@@ -342,10 +723,22 @@ struct output {
 	uint32_t crtc_id;
 	uint32_t connector_id;
 
-	/* Supported format modifiers for XRGB8888. */
+	/* Supported format modifiers for XRGB8888, best first. */
 	uint64_t *modifiers;
 	unsigned int num_modifiers;
 
+	/*
+	 * The modifiers we allocate our buffers with: all of the above until
+	 * we have negotiated one, then just that one; see format.c. Without
+	 * use_modifiers, the driver chooses the layout implicitly.
+	 */
+	struct {
+		const uint64_t *modifiers;
+		unsigned int num_modifiers;
+		bool use_modifiers;
+		bool negotiating;
+	} format;
+
 	struct {
 		struct drm_property_info plane[WDRM_PLANE__COUNT];
 		struct drm_property_info crtc[WDRM_CRTC__COUNT];
@@ -353,7 +746,7 @@ struct output {
 	} props;
 
 	/*
-	 * Mode reused from whatever was active when we started.
+	 * The mode we drive the output with; see output_choose_mode().
 	 *
 	 * 0 is always an invalid mode ID.
 	 */
@@ -361,18 +754,140 @@ struct output {
 	drmModeModeInfo mode;
 	int64_t refresh_interval_nsec;
 
+	/*
+	 * Variable refresh rate: when enabled, the display waits for each
+	 * frame for up to max_interval_nsec, rather than refreshing at a
+	 * fixed rate, so a frame which misses its deadline is shown as soon
+	 * as it is ready rather than a whole refresh interval later. The
+	 * mode's refresh rate is the fastest it will go.
+	 */
+	struct {
+		bool capable;
+		bool enabled;
+		int64_t max_interval_nsec;
+	} vrr;
+
+	/*
+	 * Asynchronous ("tearing") flips, with $KMS_ASYNC_FLIP: frames are
+	 * put on screen as soon as they are ready, rather than at the next
+	 * vblank. enabled is cleared for good if the driver rejects one;
+	 * see output_async_flip_possible().
+	 */
+	struct {
+		bool enabled;
+	} async_flip;
+
+	/*
+	 * Atomic state we keep across frames, see output_add_atomic_req():
+	 * the properties which only need setting on our first commit are
+	 * kept in a request of their own, and the request layer.c uses for
+	 * its TEST_ONLY commits is reused from one frame to the next.
+	 */
+	struct {
+		bool full_state; /* the next commit must carry everything */
+		bool in_req; /* added to the request being built */
+		struct atomic_req *static_req;
+		struct atomic_req *test_req;
+	} atomic;
+
 	/* Whether or not the output supports explicit fencing. */
 	bool explicit_fencing;
 	/* Fence FD for completion of the last atomic commit. */
 	int commit_fence_fd;
 
-	/* Buffers allocated by us. */
-	struct buffer *buffers[BUFFER_QUEUE_DEPTH];
+	/*
+	 * Buffers allocated by us, which grow and shrink with demand; see
+	 * pool.c.
+	 */
+	struct buffer *buffers[BUFFER_QUEUE_MAX];
+	unsigned int num_buffers;
+	struct {
+		unsigned int min_buffers;
+		unsigned int max_buffers;
+		bool want_grow; /* we've missed a deadline */
+		unsigned int calm_frames; /* frames since we last did */
+		/* retired buffers, kept around to reuse if we grow again */
+		struct buffer *spares[BUFFER_QUEUE_MAX];
+		unsigned int num_spares;
+		/* taken by the render and main threads, see render.c */
+		pthread_mutex_t lock;
+		bool initialised;
+	} pool;
+
+	/*
+	 * How many frames we may render ahead of the one in flight to KMS
+	 * ($KMS_RENDER_AHEAD), and the frames we have rendered but not yet
+	 * committed, oldest first. The queue is a ring which the renderer
+	 * pushes to and the main loop pops from; see render.c.
+	 */
+	unsigned int render_ahead;
+	struct buffer *queue[BUFFER_QUEUE_MAX];
+	unsigned int queue_head; /* next to pop, written by the main loop */
+	unsigned int queue_tail; /* next to push, written by the renderer */
+
+	/*
+	 * This output's render thread, if we are running with
+	 * $KMS_RENDER_THREADS; see render.c. The main loop hands it one
+	 * frame at a time, under the lock.
+	 */
+	struct {
+		bool threaded;
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		bool quit;
+		bool requested; /* a frame is waiting to be rendered */
+		float anim_progress; /* ... at this point in the animation */
+		bool first_frame;
+		unsigned int frames_requested; /* only used by the main loop */
+		unsigned int frames_done; /* bumped by the render thread */
+	} render;
+
+	/*
+	 * Overlay and cursor planes we can use for layers, and the layers
+	 * stacked above our main content, bottom first; see layer.c.
+	 */
+	struct plane *planes;
+	unsigned int num_planes;
+	struct layer layers[OUTPUT_MAX_LAYERS];
+	unsigned int num_layers;
+	bool layers_changed; /* retry plane assignment from scratch */
+	unsigned int layers_retry_frames; /* frames since the last retry */
+
+	/*
+	 * The pointer, on a cursor plane of our own; see cursor.c. Moving it
+	 * only needs that plane's position changing, which the main loop
+	 * commits along with the next frame, or by itself when no frame is
+	 * about to go out. in_flight is what our latest commit gave the
+	 * plane, until output_atomic_committed() makes it the plane's
+	 * committed state; commit_pending is set while a commit carrying
+	 * nothing but the cursor waits for its event.
+	 */
+	struct {
+		struct plane *plane; /* NULL if we have no cursor plane */
+		struct buffer *buffer;
+		double x, y; /* where the hotspot is on the output */
+		int32_t hot_x, hot_y; /* the hotspot within the image */
+		struct plane_state in_flight;
+		bool commit_pending;
+	} cursor;
+
+	/*
+	 * With $KMS_DMABUF_DEMO, a layer showing dma-bufs the way an external
+	 * producer would hand them to us, alternating between two frames;
+	 * see dmabuf.c.
+	 */
+	struct {
+		struct layer *layer;
+		struct dmabuf_attributes frames[2];
+		unsigned int shown;
+		unsigned int frames_left; /* until we show the other one */
+	} dmabuf_demo;
 
 	/*
 	 * The buffer we've just committed to KMS, waiting for it to send the
 	 * atomic-complete event to tell us it's started displaying; set by
-	 * repaint_one_output and cleared by atomic_event_handler.
+	 * commit_one_output and cleared by atomic_event_handler.
 	 */
 	struct buffer *buffer_pending;
 
@@ -380,7 +895,8 @@ struct output {
 	 * The buffer currently being displayed by KMS, having been advanced
 	 * from buffer_pending inside atomic_event_handler, then cleared by
 	 * atomic_event_handler when the hardware starts displaying the next
-	 * buffer.
+	 * buffer. With explicit fencing, it is instead released as soon as
+	 * we have committed the next buffer, guarded by the KMS fence.
 	 */
 	struct buffer *buffer_last;
 
@@ -394,21 +910,148 @@ struct output {
 	struct timespec last_frame;
 	struct timespec next_frame;
 
+	/*
+	 * When our session was last resumed, until the first frame after
+	 * that is shown; see output_startup_first_frame().
+	 */
+	uint64_t resume_nsec;
+
+	/*
+	 * State for the adaptive repaint scheduler in schedule.c, which
+	 * decides how long before next_frame we start rendering, based on
+	 * how long our recent frames took to render.
+	 */
+	struct {
+		/* ring of recent render costs, in nanoseconds */
+		int64_t samples[SCHED_COST_SAMPLES];
+		unsigned int num_samples;
+		unsigned int next_sample;
+
+		/* how long before next_frame we start repainting */
+		int64_t leeway_nsec;
+
+		/* one bit per recent frame, set if that frame was late */
+		uint32_t miss_history;
+		unsigned int recover_frames;
+
+		/* 1 to run at full rate, 2 to run at half rate */
+		unsigned int frame_divisor;
+	} sched;
+
+	/*
+	 * Ring of the most recently displayed frames, with counters covering
+	 * the whole run; see telemetry.c.
+	 */
+	struct {
+		struct frame_record frames[TELEMETRY_FRAMES];
+		unsigned int head; /* index the next record is written to */
+		unsigned int count; /* number of valid records */
+		uint64_t total_frames;
+		uint64_t missed_frames;
+	} telemetry;
+
+	/*
+	 * The scene we last painted, and the damage blob we last committed,
+	 * along with the clips it holds, so we can reuse it for as long as
+	 * the damage stays the same; see damage.c.
+	 */
+	struct {
+		bool have_scene;
+		unsigned int split_x;
+		unsigned int split_y;
+		int64_t scroll_offset;
+		unsigned int colour_serial;
+		uint32_t clips_blob_id; /* FB_DAMAGE_CLIPS blob, or 0 */
+		struct drm_mode_rect clips[REGION_MAX_RECTS];
+		unsigned int num_clips;
+	} damage;
+
+	/*
+	 * The colour transform for night light and brightness; see colour.c.
+	 * The main loop sets brightness_pending, and output_colour_latch()
+	 * applies it as the next frame begins: it rebuilds the blobs, which
+	 * are kept between frames, and sets dirty so that the next commit
+	 * sends them. With the GPU fallback, frame_scale is what the renderer
+	 * multiplies the frame by, and frame_serial changes whenever it does.
+	 */
+	struct {
+		enum colour_mode mode;
+		double brightness; /* 0.1 to 1 */
+		double brightness_pending; /* 0 if unchanged */
+		double gamma; /* extra display gamma on top of sRGB */
+		double white[3]; /* night light white point, linear */
+		uint32_t degamma_lut_size;
+		uint32_t gamma_lut_size;
+		uint32_t degamma_blob_id; /* 0 for no blob, i.e. identity */
+		uint32_t ctm_blob_id;
+		uint32_t gamma_blob_id;
+		bool dirty; /* the blobs have changed since our last commit */
+		float frame_scale[3];
+		bool frame_identity; /* frame_scale is all 1 */
+		unsigned int frame_serial;
+	} colour;
+
+	/*
+	 * Scrolling content kept in a ring of rows, which we copy onto the
+	 * screen rather than redrawing, when $KMS_SCROLL is set; see scroll.c.
+	 * Offsets are in rows of content, from its first row; the main loop
+	 * sets frame_offset for each frame it hands over to be rendered.
+	 */
+	struct {
+		bool enabled;
+		double speed; /* rows per second */
+		int64_t frame_offset; /* content row at the top of the frame */
+		GLuint tex;
+		GLuint fbo;
+		unsigned int ring_height;
+		int64_t valid_top; /* the content rows the ring holds */
+		int64_t valid_bottom;
+	} scroll;
+
 	struct {
 		EGLConfig cfg;
 		EGLContext ctx;
 		GLuint gl_prog;
 		GLuint pos_attr;
-		GLuint col_uniform;
+		GLuint col_attr;
+		GLuint tex_attr;
 		GLuint proj_uniform;
-		GLuint vbo;
+		GLuint tex_uniform;
+		GLuint image_prog; /* draws external buffers, see dmabuf.c */
+		GLuint image_proj_uniform;
+		GLuint vbo; /* streamed quad vertices, see egl-gles.c */
+		GLuint ibo; /* static quad indices */
 		GLuint vao;
+		struct quad_vertex *batch; /* QUAD_BATCH_MAX quads */
+		unsigned int batch_quads; /* quads queued in batch */
+		bool batch_blend; /* the batch has glyphs to blend */
+		struct text_atlas atlas; /* see text.c */
+		/*
+		 * What we last bound or set in this context, so we can skip
+		 * doing it again; see egl-gles.c.
+		 */
+		struct {
+			GLuint read_fbo;
+			GLuint draw_fbo;
+			GLuint texture; /* on GL_TEXTURE0, the only unit we use */
+			GLuint program;
+			unsigned int target_width; /* viewport and projection */
+			unsigned int target_height;
+			bool target_flip_y;
+			bool image_proj; /* ... for the image program too */
+			bool blend;
+			bool quad_state; /* quad VAO, or VBO, IBO and attributes */
+		} state;
 		/* Whether to use big OpenGL Core Profile context or to use GLES */
 		bool gl_core;
 		/* Whether or not GL_MESA_framebuffer_flip_y is available */
 		bool have_gl_mesa_framebuffer_flip_y;
 		/* Whether we shall use VAO */
 		bool use_vao;
+		/* Whether we fell back to a GLES2 context */
+		bool gles2;
+		/* Whether we copy every frame to another device; see above */
+		bool prime_copy;
 	} egl;
 
 	/*
@@ -419,8 +1062,63 @@ struct output {
 	 * on this output.
 	 */
 	int repaint_timer_fd;
+	bool repaint_armed; /* the timer is set and hasn't fired yet */
+	struct event_source *repaint_source; /* so hotplug can stop watching */
+
+	/*
+	 * The input we've applied to the scene; see main.c. The main loop
+	 * keeps offset_y and pending_usec up to date as input comes in, and
+	 * copies them into the frame_ fields as it hands each frame to be
+	 * rendered, so a render thread never sees them change under it.
+	 * pending_usec is the time of the oldest input event which no frame
+	 * has shown yet, or 0 if there is none.
+	 */
+	struct {
+		int32_t offset_y; /* how far input has moved the square */
+		uint64_t pending_usec;
+		int32_t frame_offset_y;
+		uint64_t frame_usec;
+	} input;
+
+	/*
+	 * With $KMS_IDLE, we only repaint when the scene changes, and
+	 * otherwise leave buffer_last on screen; see main.c. invalidated
+	 * says the scene has changed since the last frame we handed over to
+	 * be rendered, and woke that the next frame is the first since we
+	 * went idle, which frame_woke passes on to the renderer.
+	 */
+	struct {
+		bool enabled;
+		bool idle; /* no frame in flight or due, and no timer armed */
+		bool invalidated;
+		bool woke;
+		bool frame_woke;
+	} idle;
 };
 
+/*
+ * The EGL and GL extension entry points we use, which we look up once per
+ * EGL display in device_egl_setup(), rather than every time we need them.
+ */
+struct egl_dispatch {
+	PFNEGLCREATEIMAGEKHRPROC create_image;
+	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
+	PFNGLFRAMEBUFFERPARAMETERIPROC framebuffer_parameteri;
+	PFNEGLCREATESYNCKHRPROC create_sync;
+	PFNEGLWAITSYNCKHRPROC wait_sync;
+	PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+	PFNEGLDUPNATIVEFENCEFDANDROIDPROC dup_native_fence_fd;
+	PFNGLGETPROGRAMBINARYPROC get_program_binary;
+	PFNGLPROGRAMBINARYPROC program_binary;
+};
+
+/*
+ * KMS devices can't have more than 32 CRTCs, as possible_crtcs is a 32-bit
+ * mask, so a table twice that size keeps our CRTC ID hash sparse.
+ */
+#define DEVICE_CRTC_MAP_SIZE 64
+
 /*
  * A device is one KMS node from /dev/dri/ and its resources.
  *
@@ -444,8 +1142,27 @@ struct output {
  * the primary devices and check that they are actually KMS devices.
  */
 struct device {
-	/* KMS device node. */
+	/* KMS device node, its path, and its device number. */
 	int kms_fd;
+	char node[64];
+	dev_t devnum;
+
+	/*
+	 * Set while logind has paused the device, because our session has
+	 * been switched away from: we keep everything on it, but can't
+	 * commit until it is resumed; see device_pause().
+	 */
+	bool paused;
+
+	/*
+	 * Set by a hotplug event until the main loop has looked at the
+	 * connector which changed, or at all of them if connector_id is 0;
+	 * see main.c.
+	 */
+	struct {
+		bool pending;
+		uint32_t connector_id;
+	} hotplug;
 
 	/* Queried at startup by
 	 * drmModeGetResources / drmModeGetPlaneResources. */
@@ -453,13 +1170,28 @@ struct device {
 	drmModePlanePtr *planes;
 	int num_planes;
 
+	/*
+	 * Metadata which lasts as long as the device does, and what only lasts
+	 * until our next commit on it, such as the request itself; the main
+	 * loop resets frame_arena once each commit has been made. See arena.c.
+	 */
+	struct arena arena;
+	struct arena frame_arena;
+
 	/* Whether or not the device supports format modifiers. */
 	bool fb_modifiers;
 
 	/* The GBM device is our buffer allocator, and we create an EGL
-	 * display from that to import buffers into. */
+	 * display from that to import buffers into.
+	 *
+	 * render_device is the device these belong to: usually ourselves,
+	 * but a device without a GPU we can use borrows them from another,
+	 * and imports the buffers it allocates; see devices_create(). It is
+	 * NULL when we render in software. */
 	struct gbm_device *gbm_device;
 	EGLDisplay egl_dpy;
+	struct egl_dispatch egl;
+	struct device *render_device;
 
 	/* Populated by us, to combine plane -> CRTC -> connector. */
 	struct output **outputs;
@@ -474,15 +1206,69 @@ struct device {
 
 	/* whether the device reports timestamps relative to MONOTONIC clock */
 	bool monotonic_timestamps;
+
+	/* whether atomic commits can use DRM_MODE_PAGE_FLIP_ASYNC */
+	bool atomic_async_flip;
+
+	/* the size cursor planes take their buffers in */
+	uint32_t cursor_width, cursor_height;
+
+	/*
+	 * The GL extensions our contexts support, which the first output to
+	 * set up EGL finds out for all the others; see egl-gles.c.
+	 */
+	struct gl_exts {
+		bool queried;
+		bool egl_image; /* GL_OES_EGL_image */
+		bool egl_sync; /* GL_OES_EGL_sync, or GL_EXT_EGL_sync on GL */
+		bool flip_y; /* GL_MESA_framebuffer_flip_y */
+		bool vao; /* GL_OES_vertex_array_object */
+	} gl_exts;
+
+	/* eventfd our render threads write to when they finish a frame */
+	int render_event_fd;
+
+	/*
+	 * Our outputs hashed by CRTC ID, so KMS events can find theirs
+	 * directly; see device_output_for_crtc().
+	 */
+	struct output *crtc_map[DEVICE_CRTC_MAP_SIZE];
 };
 
 /*
- * Finds the first KMS-capable device in the system, probes its resources,
- * and sets up VT/TTY handling ready to display content.
+ * Opens every KMS-capable device in the system, probes their resources,
+ * picks a GPU to render for each, and sets up VT/TTY handling ready to
+ * display content.
  */
-struct device *device_create(void);
+struct device **devices_create(int *num_devices);
+void devices_destroy(struct device **devices, int num_devices);
+struct device *devices_find(struct device **devices, int num_devices,
+			    dev_t devnum);
+void device_pause(struct device *device);
+bool device_resume(struct device *device);
+struct device *device_create_render_only(void);
 bool device_egl_setup(struct device *device);
+bool device_egl_share(struct device *device, struct device *render_device);
 void device_destroy(struct device *device);
+struct output *device_output_for_crtc(struct device *device, uint32_t crtc_id);
+struct output *device_output_for_plane(struct device *device,
+				       uint32_t plane_id);
+
+/*
+ * Connector hotplug, from device.c: device_connector_rescan() says whether
+ * a connector has been plugged in or unplugged since we last looked, and
+ * gives the output which has been added or should be removed.
+ */
+enum connector_change {
+	CONNECTOR_UNCHANGED,
+	CONNECTOR_ADDED,
+	CONNECTOR_REMOVED,
+};
+
+enum connector_change device_connector_rescan(struct device *device,
+					      uint32_t connector_id,
+					      struct output **output);
+void device_output_remove(struct device *device, struct output *output);
 
 /*
  * Takes a target KMS connector, and returns a struct containing a complete
@@ -491,25 +1277,252 @@ void device_destroy(struct device *device);
 struct output *output_create(struct device *device,
 			     drmModeConnectorPtr connector);
 bool output_egl_setup(struct output *output);
+void output_egl_set_target(struct output *output, unsigned int width,
+			   unsigned int height, bool flip_y);
+
+/*
+ * Binding through these records what is bound in the output's context, and
+ * skips binding anything which is already; anything which deletes a bound
+ * object must tell us it's gone with output_gl_forget().
+ */
+void output_gl_bind_framebuffer(struct output *output, GLenum target,
+				GLuint fbo);
+void output_gl_bind_texture(struct output *output, GLuint tex);
+void output_gl_forget(struct output *output, GLuint fbo, GLuint tex);
+
+/*
+ * Building GL programs, from shader.c, which keeps the binaries of the
+ * programs it links in memory and under $XDG_CACHE_HOME, and loads them from
+ * there rather than compiling again when it can.
+ */
+struct shader_attrib {
+	const char *name;
+	GLuint location;
+};
+
+GLuint output_egl_program_create(struct output *output, const char *vert,
+				 const char *frag,
+				 const struct shader_attrib *attribs,
+				 unsigned int num_attribs);
 void output_egl_destroy(struct device *device, struct output *output);
 void output_destroy(struct output *output);
 
 /* Create and destroy framebuffers for a given output. */
 struct buffer *buffer_create(struct device *device, struct output *output);
 struct buffer *buffer_egl_create(struct device *device, struct output *output);
+struct buffer *buffer_create_solid(struct device *device, struct output *output,
+				   unsigned int width, unsigned int height,
+				   uint32_t argb);
+struct buffer *buffer_create_argb(struct device *device, struct output *output,
+				  unsigned int width, unsigned int height,
+				  const uint32_t *pixels);
 void buffer_destroy(struct buffer *buffer);
 void buffer_egl_destroy(struct device *device, struct buffer *buffer);
+bool buffer_add_fb(struct device *device, struct buffer *buffer);
+
+/*
+ * Fill a buffer for a given animation progress (0..1). Only the area inside
+ * the given region is repainted; NULL repaints the whole buffer.
+ */
+void buffer_fill(struct buffer *buffer, float anim_progress,
+		 const struct region *repaint);
+void buffer_egl_fill(struct buffer *buffer, float anim_progress,
+		     const struct region *repaint);
+
+/*
+ * Batched quad rendering for the GL path: quads are queued with
+ * output_egl_batch_add_quad() in drawing order, in buffer co-ordinates with
+ * an ARGB colour, and output_egl_batch_flush() draws them all at once into
+ * the currently-bound framebuffer. Adding to a full batch flushes it first.
+ */
+void output_egl_batch_add_quad(struct output *output, float x1, float y1,
+			       float x2, float y2, uint32_t argb);
+void output_egl_batch_add_glyph(struct output *output, const struct rect *dst,
+				const struct glyph *glyph,
+				const struct rect *clip, uint32_t argb);
+void output_egl_batch_flush(struct output *output);
+
+/*
+ * Text rendering for the GL path, from text.c. Every output has a glyph
+ * atlas, which also holds the single opaque texel solid quads are drawn
+ * with. output_text_draw() queues a line of UTF-8 text into the quad batch
+ * with its baseline starting at (x, y), clipped to the given region, and
+ * returns the width of the line. We only rasterise glyphs with FreeType;
+ * without it, or a font, no text is drawn.
+ */
+void output_text_init(struct output *output);
+void output_text_destroy(struct output *output);
+void output_text_upload(struct output *output);
+const struct glyph *output_text_glyph(struct output *output,
+				      uint32_t codepoint, unsigned int size);
+unsigned int output_text_draw(struct output *output, int x, int y,
+			      unsigned int size, uint32_t argb,
+			      const char *utf8, const struct region *clip);
+void output_text_draw_scene(struct output *output, float anim_progress,
+			    const struct region *repaint);
+
+/*
+ * Smooth scrolling for the GL path, from scroll.c. output_scroll_set_time()
+ * moves the content to where it should be at the given time since we
+ * started, and output_scroll_draw() fills the repaint area of the buffer
+ * with it, rendering only the rows which weren't already in the ring.
+ */
+void output_scroll_init(struct output *output);
+void output_scroll_destroy(struct output *output);
+void output_scroll_set_time(struct output *output, int64_t nsec);
+void output_scroll_draw(struct output *output, struct buffer *buffer,
+			const struct region *repaint);
 
-/* Fill a buffer for a given animation progress (0..1) */
-void buffer_fill(struct buffer *buffer, float anim_progress);
-void buffer_egl_fill(struct buffer *buffer, float anim_progress);
+/*
+ * Colour transforms, from colour.c. output_colour_init() reads our settings
+ * from the environment and picks where the transform runs, given the CRTC's
+ * LUT sizes; output_colour_set_brightness() changes the brightness from the
+ * next frame, once output_colour_latch() has been called as it begins.
+ * output_colour_on_gpu() says whether the renderer has to apply the
+ * transform itself for this frame, which output_egl_colour_apply() does.
+ */
+void output_colour_init(struct output *output, uint32_t degamma_lut_size,
+			uint32_t gamma_lut_size);
+void output_colour_fini(struct output *output);
+void output_colour_set_brightness(struct output *output, double brightness);
+void output_colour_latch(struct output *output);
+bool output_colour_on_gpu(const struct output *output);
+void output_egl_colour_apply(struct output *output,
+			     const struct region *repaint);
+
+/*
+ * Layers and their assignment to planes, from layer.c. Layers are created
+ * once the output's buffers exist, and updated at the start of every
+ * repaint; output_assign_planes() then picks a configuration KMS accepts,
+ * using the given buffer on the primary plane; output_add_atomic_req then
+ * adds the planes' state along with everything else.
+ */
+void output_layers_init(struct output *output);
+void output_layers_destroy(struct output *output);
+void output_layers_update(struct output *output, float anim_progress);
+void output_assign_planes(struct output *output, struct buffer *buffer,
+			  bool allow_modeset);
+
+/*
+ * The pointer, from cursor.c. output_cursor_init() takes a cursor plane, if
+ * the output has one, away from the layers; output_cursor_move() moves the
+ * pointer, from the next commit on. output_cursor_state() gives the state
+ * the cursor plane should have, and output_cursor_moved() whether that has
+ * changed since the last commit. output_add_cursor_atomic_req() adds that
+ * state to a request of its own, for commits which only move the pointer.
+ */
+void output_cursor_init(struct output *output);
+void output_cursor_fini(struct output *output);
+void output_cursor_move(struct output *output, double dx, double dy);
+void output_cursor_state(const struct output *output,
+			 struct plane_state *state);
+bool output_cursor_moved(const struct output *output);
+void output_add_cursor_atomic_req(struct output *output,
+				  struct atomic_req *req);
+
+/*
+ * External buffers, from dmabuf.c. buffer_import_dmabuf() wraps a dma-buf
+ * in a buffer we can put on a plane without copying it, taking ownership
+ * of the fence FD, if any. output_layer_attach() shows it on a layer from
+ * the output's next frame, and takes ownership of the buffer; it is
+ * destroyed once it has been replaced and nothing uses it any more.
+ * output_layers_latch() applies attachments as a frame begins, and
+ * output_layers_release() destroys replaced buffers once each commit
+ * completes. The renderer composites layers it couldn't place on a plane
+ * with output_egl_draw_image().
+ */
+struct buffer *buffer_import_dmabuf(struct output *output,
+				    const struct dmabuf_attributes *attrs,
+				    int fence_fd);
+void buffer_dmabuf_destroy(struct buffer *buffer);
+void output_layer_attach(struct output *output, struct layer *layer,
+			 struct buffer *buffer);
+bool output_layers_pending(struct output *output);
+void output_layers_latch(struct output *output);
+void output_layers_release(struct output *output);
+void output_dmabuf_demo_init(struct output *output);
+void output_dmabuf_demo_fini(struct output *output);
+void output_egl_draw_image(struct output *output, struct layer *layer,
+			   const struct rect *clip);
+
+/*
+ * Software fill for dumb buffers, from fill.c: fills the buffer with four
+ * solid rectangles meeting at (split_x, split_y), in the order top-left,
+ * top-right, bottom-left, bottom-right. fill_fini() stops any worker threads.
+ */
+void buffer_fill_quadrants(struct buffer *buffer, unsigned int split_x,
+			   unsigned int split_y, const uint32_t colours[4],
+			   const struct rect *clip);
+void fill_fini(void);
+
+/* Damage regions, from damage.c. */
+bool rect_intersect(const struct rect *a, const struct rect *b,
+		    struct rect *out);
+void region_init(struct region *region);
+void region_init_rect(struct region *region, int32_t x1, int32_t y1,
+		      int32_t x2, int32_t y2);
+bool region_is_empty(const struct region *region);
+void region_add_rect(struct region *region, const struct rect *rect);
+void region_union(struct region *dst, const struct region *src);
+void region_extents(const struct region *region, struct rect *extents);
+
+/*
+ * Column and row at which our scene changes colour, for a given buffer
+ * size and animation progress; shared by the CPU and GL renderers.
+ */
+void scene_split(unsigned int width, unsigned int height, float anim_progress,
+		 unsigned int *split_x, unsigned int *split_y);
+
+/* Colours of our four quadrants, as ARGB: top-left, top-right, bottom-left
+ * and bottom-right. */
+extern const uint32_t scene_colours[4];
+
+/*
+ * Works out what changes on screen for the frame about to be painted into
+ * the given buffer, records it against every other buffer, and returns the
+ * region of this buffer which must be repainted.
+ */
+void output_damage_frame(struct output *output, struct buffer *buffer,
+			 float anim_progress, struct region *repaint);
+
+/* Arenas, from arena.c. */
+void arena_init(struct arena *arena, size_t block_size);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_reset(struct arena *arena);
+void arena_fini(struct arena *arena);
+
+/*
+ * Atomic requests, from kms.c. atomic_req_create() makes an empty request
+ * in the given arena; atomic_req_reset() empties it again, keeping its
+ * memory for the next one. Adding a property an object already has in the
+ * request replaces its value.
+ */
+struct atomic_req *atomic_req_create(struct arena *arena);
+void atomic_req_reset(struct atomic_req *req);
+void atomic_req_add(struct atomic_req *req, uint32_t obj_id,
+		    uint32_t prop_id, uint64_t value);
+void atomic_req_merge(struct atomic_req *req, const struct atomic_req *other);
 
 /*
  * Adds an output's state to an atomic request, setting it up to display a
- * given buffer.
+ * given buffer. Requests only used with TEST_ONLY leave out the damage and
+ * the out-fence, so testing doesn't disturb the state of the commit in
+ * flight, and is safe from a render thread.
  */
-void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
-			   struct buffer *buffer);
+void output_add_atomic_req(struct output *output, struct atomic_req *req,
+			   struct buffer *buffer, bool test_only);
+void output_atomic_committed(struct output *output, struct buffer *buffer);
+
+/*
+ * Asynchronous flips, for outputs with $KMS_ASYNC_FLIP. A frame can only be
+ * flipped asynchronously if nothing but the primary plane's framebuffer
+ * changes; output_add_async_atomic_req() then fills in just that, for
+ * atomic_commit_async() to commit in a request of its own.
+ */
+bool output_async_flip_possible(struct output *output, struct buffer *buffer);
+void output_add_async_atomic_req(struct output *output, struct atomic_req *req,
+				 struct buffer *buffer);
+int atomic_commit_async(struct device *device, struct atomic_req *req);
 
 /*
  * Commits an atomic request to KMS. Upon completion, the KMS FD will become
@@ -520,9 +1533,138 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
  * allows the driver to perform operations which take longer than usual,
  * causing frames to be skipped.
  */
-int atomic_commit(struct device *device, drmModeAtomicReqPtr req,
+int atomic_commit(struct device *device, struct atomic_req *req,
 		  bool allow_modeset);
 
+/* Switches an unplugged output off, blocking until it is; see kms.c. */
+int output_disable(struct output *output);
+
+/*
+ * Checks an atomic request with TEST_ONLY, returning 0 if KMS would accept
+ * it. Nothing is applied, and no events are generated.
+ */
+int atomic_test(struct device *device, struct atomic_req *req,
+		bool allow_modeset);
+
+/*
+ * Rendering a frame for an output and queueing it to be committed, either
+ * directly or on the output's render thread; see render.c.
+ */
+void output_render_frame(struct output *output, float anim_progress,
+			 bool first_frame);
+bool output_render_thread_start(struct output *output);
+void output_render_thread_stop(struct output *output);
+void output_render_thread_kick(struct output *output, float anim_progress,
+			       bool first_frame);
+bool output_render_busy(struct output *output);
+void output_queue_push(struct output *output, struct buffer *buffer);
+struct buffer *output_queue_pop(struct output *output);
+unsigned int output_queue_len(struct output *output);
+
+/*
+ * Format modifier negotiation, see format.c. output_format_negotiate()
+ * returns the buffer it settled on a modifier with, if any.
+ */
+void output_modifiers_rank(struct output *output);
+struct buffer *output_format_negotiate(struct output *output);
+
+/*
+ * Per-output buffer pool, see pool.c. output_pool_get_buffer() returns a
+ * buffer which isn't in use, growing the pool if we are allowed to, or NULL.
+ */
+bool output_pool_init(struct output *output);
+void output_pool_fini(struct output *output);
+struct buffer *output_pool_get_buffer(struct output *output);
+void output_pool_release(struct output *output, struct buffer *buffer);
+bool output_pool_has_buffer(struct output *output);
+void output_pool_frame_done(struct output *output, bool late);
+void output_pool_maintain(struct output *output);
+uint64_t output_pool_bytes(struct output *output);
+
+/*
+ * The adaptive repaint scheduler, from schedule.c. frame_done is called with
+ * the record of the frame just displayed (NULL if its render time tells us
+ * nothing) and the difference between the actual and predicted flip times,
+ * and updates the leeway we use to place the next repaint.
+ *
+ * output_sched_flip_done() is everything which happens when a flip
+ * completes, short of touching KMS or the repaint timer: the KMS event
+ * handler calls it with the flip time, and the scheduler simulation in
+ * sched-sim.c calls it with simulated ones. It returns what to do next.
+ */
+enum sched_action {
+	SCHED_ACTION_REPAINT, /* arm the repaint timer for repaint_time */
+	SCHED_ACTION_RENDER_AHEAD, /* the main loop renders when it can */
+	SCHED_ACTION_IDLE, /* nothing new to show; see output_sched_wake() */
+};
+
+void output_sched_init(struct output *output);
+void output_sched_frame_done(struct output *output,
+			     const struct frame_record *frame,
+			     int64_t flip_delta_nsec);
+int64_t output_sched_frame_interval(struct output *output);
+void output_sched_repaint_time(struct output *output, struct timespec *out);
+bool output_has_changes(struct output *output);
+void output_sched_predict_frame(struct output *output, struct timespec *out);
+void output_sched_wake(struct output *output, const struct timespec *now);
+enum sched_action output_sched_flip_done(struct output *output,
+					 const struct timespec *event_time,
+					 uint64_t render_done_nsec,
+					 struct timespec *repaint_time);
+
+/*
+ * Frame-timing telemetry, from telemetry.c. Each buffer carries the record for
+ * the frame rendered into it, which is filled in as the frame progresses and
+ * moved into the output's ring when KMS reports it has been displayed.
+ */
+void buffer_telemetry_begin(struct buffer *buffer);
+void buffer_telemetry_submitted(struct buffer *buffer);
+void output_telemetry_frame_done(struct output *output, struct buffer *buffer,
+				 uint64_t flip_nsec, uint64_t render_done_nsec,
+				 int64_t delta_nsec, bool predicted);
+void output_telemetry_get_stats(struct output *output, struct frame_stats *stats);
+void output_telemetry_dump(struct output *output, FILE *f);
+int64_t stats_percentile(int64_t *values, unsigned int count,
+			 unsigned int percentile);
+
+/*
+ * Startup timing, also from telemetry.c: startup_begin() starts the clock,
+ * and each call to startup_phase() prints how long the phase which has just
+ * finished took.
+ */
+void startup_begin(void);
+void startup_phase(const char *phase);
+void output_startup_first_frame(struct output *output);
+void output_resume_begin(struct output *output);
+
+/*
+ * Our epoll-based event loop, from event-loop.c. Each source's callback is
+ * given its FD, the epoll events which are ready, and its data pointer; a
+ * negative errno return value stops dispatching and is passed back to the
+ * caller.
+ */
+typedef int (*event_func_t)(int fd, uint32_t events, void *data);
+
+struct event_loop *event_loop_create(void);
+void event_loop_destroy(struct event_loop *loop);
+struct event_source *event_loop_add_fd(struct event_loop *loop, int fd,
+				       uint32_t events, event_func_t func,
+				       void *data);
+void event_source_remove(struct event_source *source);
+int event_loop_dispatch(struct event_loop *loop, int timeout);
+
+/*
+ * Runs the benchmark mode from benchmark.c, taking the full command line;
+ * returns the process exit code.
+ */
+int benchmark_run(int argc, char *argv[]);
+
+/*
+ * Runs the scheduler simulation from sched-sim.c, taking the full command
+ * line; returns the process exit code.
+ */
+int sched_sim_run(int argc, char *argv[]);
+
 /*
  * Parse the very basic information from the EDID block, as described in
  * edid.c. The EDID parser could be fairly trivially extended to pull
@@ -533,6 +1675,15 @@ struct edid_info {
 	char monitor_name[13];
 	char pnp_id[5];
 	char serial_number[13];
+
+	/* the first detailed timing, or 0 if there isn't one */
+	uint32_t preferred_width;
+	uint32_t preferred_height;
+	uint32_t preferred_refresh_mhz;
+
+	/* the range limits descriptor's vertical rates, or 0 */
+	uint32_t min_vrefresh_hz;
+	uint32_t max_vrefresh_hz;
 };
 
 struct edid_info *
@@ -573,6 +1724,21 @@ linux_sync_file_is_valid(int fd)
 	return file_info.num_fences > 0;
 }
 
+/* Blocks until the fence in a sync_file FD has signalled. */
+static void
+linux_sync_file_wait(int fd)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, -1);
+	} while (ret == -1 && errno == EINTR);
+}
+
 static uint64_t
 linux_sync_file_get_fence_time(int fd)
 {
@@ -601,12 +1767,25 @@ linux_sync_file_get_fence_time(int fd)
 	return fence_info.timestamp_ns;
 }
 
+/*
+ * Told when logind pauses and resumes the DRM devices we have taken from it,
+ * when the user switches VT away from our session and back; see logind.c.
+ */
+struct logind_listener {
+	void (*pause)(void *data, dev_t devnum);
+	void (*resume)(void *data, dev_t devnum);
+};
+
 #if defined(HAVE_LOGIND)
 
 struct logind *logind_create(void);
 int logind_take_device(struct logind *s, const char *path);
 void logind_release_device(struct logind *s, int fd);
+int logind_get_fd(struct logind *s);
+int logind_dispatch(struct logind *s);
 void logind_destroy(struct logind *s);
+void logind_set_listener(struct logind *s,
+			 const struct logind_listener *listener, void *data);
 
 #else
 
@@ -614,21 +1793,77 @@ struct logind { int dummy; };
 static inline struct logind *logind_create(void) { return NULL; }
 static inline int logind_take_device(struct logind *s UNUSED, const char *path UNUSED) { return -1; }
 static void inline logind_release_device(struct logind *s UNUSED, int fd UNUSED) {}
+static inline int logind_get_fd(struct logind *s UNUSED) { return -1; }
+static inline int logind_dispatch(struct logind *s UNUSED) { return 0; }
 static void inline logind_destroy(struct logind *s UNUSED) {}
+static inline void logind_set_listener(struct logind *s UNUSED,
+				       const struct logind_listener *listener UNUSED,
+				       void *data UNUSED) {}
 
 #endif
 
+/*
+ * An input event, as queued up by input.c for the main loop. The time is
+ * when the kernel generated the event, in CLOCK_MONOTONIC microseconds.
+ */
+enum input_event_type {
+	INPUT_EVENT_KEY,
+	INPUT_EVENT_MOTION, /* relative pointer motion */
+	INPUT_EVENT_SCROLL,
+};
+
+struct input_event {
+	enum input_event_type type;
+	uint64_t time_usec;
+	uint32_t key; /* evdev code, from linux/input-event-codes.h */
+	bool pressed;
+	double dx, dy; /* motion or scroll distance */
+};
+
 #if defined(HAVE_INPUT)
 
 struct input* input_create(struct logind *session);
 void input_destroy(struct input *input);
-bool input_was_ESC_key_pressed(struct input *input);
+int input_get_fd(struct input *input);
+int input_dispatch(struct input *input);
+bool input_pop_event(struct input *input, struct input_event *event);
+void input_suspend(struct input *input);
+void input_resume(struct input *input);
 
 #else
 
 struct input { int dummy; };
 static inline struct input* input_create(struct logind *session UNUSED) { return NULL; }
 static inline void input_destroy(struct input *input UNUSED) {}
-static inline bool input_was_ESC_key_pressed(struct input *input UNUSED) { return false; }
+static inline int input_get_fd(struct input *input UNUSED) { return -1; }
+static inline int input_dispatch(struct input *input UNUSED) { return 0; }
+static inline bool input_pop_event(struct input *input UNUSED, struct input_event *event UNUSED) { return false; }
+static inline void input_suspend(struct input *input UNUSED) {}
+static inline void input_resume(struct input *input UNUSED) {}
+
+#endif
+
+/*
+ * Monitor hotplug events from udev; see hotplug.c. hotplug_read() returns
+ * true for a DRM hotplug event, with the connector which changed, or 0 if
+ * the kernel didn't say.
+ */
+#if defined(HAVE_UDEV)
+
+struct hotplug *hotplug_create(void);
+void hotplug_destroy(struct hotplug *hotplug);
+int hotplug_get_fd(struct hotplug *hotplug);
+bool hotplug_read(struct hotplug *hotplug, dev_t *devnum,
+		  uint32_t *connector_id);
+
+#else
+
+struct hotplug { int dummy; };
+static inline struct hotplug *hotplug_create(void) { return NULL; }
+static inline void hotplug_destroy(struct hotplug *hotplug UNUSED) {}
+static inline int hotplug_get_fd(struct hotplug *hotplug UNUSED) { return -1; }
+static inline bool hotplug_read(struct hotplug *hotplug UNUSED,
+				dev_t *devnum UNUSED,
+				uint32_t *connector_id UNUSED) { return false; }
 
 #endif
@@ -96,6 +96,8 @@ static const struct drm_property_info plane_props[] = {
 	[WDRM_PLANE_CRTC_ID] = { .name = "CRTC_ID", },
 	[WDRM_PLANE_IN_FORMATS] = { .name = "IN_FORMATS" },
 	[WDRM_PLANE_IN_FENCE_FD] = { .name = "IN_FENCE_FD" },
+	[WDRM_PLANE_FB_DAMAGE_CLIPS] = { .name = "FB_DAMAGE_CLIPS" },
+	[WDRM_PLANE_ZPOS] = { .name = "zpos" },
 };
 
 static struct drm_property_enum_info dpms_state_enums[] = {
@@ -122,12 +124,19 @@ static const struct drm_property_info connector_props[] = {
 	},
 	[WDRM_CONNECTOR_CRTC_ID] = { .name = "CRTC_ID", },
 	[WDRM_CONNECTOR_NON_DESKTOP] = { .name = "non-desktop", },
+	[WDRM_CONNECTOR_VRR_CAPABLE] = { .name = "vrr_capable", },
 };
 
 static const struct drm_property_info crtc_props[] = {
 	[WDRM_CRTC_MODE_ID] = { .name = "MODE_ID", },
 	[WDRM_CRTC_ACTIVE] = { .name = "ACTIVE", },
 	[WDRM_CRTC_OUT_FENCE_PTR] = { .name = "OUT_FENCE_PTR", },
+	[WDRM_CRTC_VRR_ENABLED] = { .name = "VRR_ENABLED", },
+	[WDRM_CRTC_DEGAMMA_LUT] = { .name = "DEGAMMA_LUT", },
+	[WDRM_CRTC_DEGAMMA_LUT_SIZE] = { .name = "DEGAMMA_LUT_SIZE", },
+	[WDRM_CRTC_CTM] = { .name = "CTM", },
+	[WDRM_CRTC_GAMMA_LUT] = { .name = "GAMMA_LUT", },
+	[WDRM_CRTC_GAMMA_LUT_SIZE] = { .name = "GAMMA_LUT_SIZE", },
 };
 
 /**
@@ -207,13 +216,14 @@ drm_property_get_value(struct drm_property_info *info,
  * same-indexed field of the map array.
  *
  * @param device Device
+ * @param arena Arena to allocate the enum value arrays from
  * @param src DRM property info array to source from
  * @param info DRM property info array to copy into
  * @param num_infos Number of entries in the source array
  * @param props DRM object properties for the object
  */
 static void
-drm_property_info_populate(struct device *device,
+drm_property_info_populate(struct device *device, struct arena *arena,
 		           const struct drm_property_info *src,
 			   struct drm_property_info *info,
 			   unsigned int num_infos,
@@ -233,9 +243,8 @@ drm_property_info_populate(struct device *device,
 			continue;
 
 		info[i].enum_values =
-			malloc(src[i].num_enum_values *
-			       sizeof(*info[i].enum_values));
-		assert(info[i].enum_values);
+			arena_alloc(arena, src[i].num_enum_values *
+					   sizeof(*info[i].enum_values));
 		for (j = 0; j < info[i].num_enum_values; j++) {
 			info[i].enum_values[j].name = src[i].enum_values[j].name;
 			info[i].enum_values[j].valid = false;
@@ -290,9 +299,9 @@ drm_property_info_populate(struct device *device,
 /**
  * Free DRM property information
  *
- * Frees all memory associated with a DRM property info array and zeroes
- * it out, leaving it usable for a further drm_property_info_update() or
- * drm_property_info_free().
+ * Zeroes out a DRM property info array, leaving it usable for a further
+ * drm_property_info_populate() or drm_property_info_free(). Its enum value
+ * arrays go back when the arena they came from does.
  *
  * @param info DRM property info array
  * @param num_props Number of entries in array to free
@@ -300,11 +309,6 @@ drm_property_info_populate(struct device *device,
 static void
 drm_property_info_free(struct drm_property_info *info, int num_props)
 {
-	int i;
-
-	for (i = 0; i < num_props; i++)
-		free(info[i].enum_values);
-
 	memset(info, 0, sizeof(*info) * num_props);
 }
 
@@ -411,10 +415,10 @@ static void plane_formats_populate(struct output *output,
 
 /*
  * This gets and prints a little bit of information from the EDID block,
- * as described in edid.c.
+ * as described in edid.c. The caller frees it once done choosing a mode.
  */
-static void output_get_edid(struct output *output,
-			    drmModeObjectPropertiesPtr props)
+static struct edid_info *output_get_edid(struct output *output,
+					 drmModeObjectPropertiesPtr props)
 {
 	drmModePropertyBlobPtr blob;
 	struct edid_info *edid;
@@ -425,7 +429,7 @@ static void output_get_edid(struct output *output,
 					 props, 0);
 	if (blob_id == 0) {
 		debug("[%s] output does not have EDID\n", output->name);
-		return;
+		return NULL;
 	}
 
 	blob = drmModeGetPropertyBlob(output->device->kms_fd, blob_id);
@@ -434,12 +438,246 @@ static void output_get_edid(struct output *output,
 	edid = edid_parse(blob->data, blob->length);
 	drmModeFreePropertyBlob(blob);
 	if (!edid)
-		return;
+		return NULL;
 
 	debug("[%s] EDID PNP ID %s, EISA ID %s, name %s, serial %s\n",
 	       output->name, edid->pnp_id, edid->eisa_id,
 	       edid->monitor_name, edid->serial_number);
-	free(edid);
+	debug("[%s] EDID preferred timing %u x %u, %u mHz; vertical range %u-%u Hz\n",
+	      output->name, edid->preferred_width, edid->preferred_height,
+	      edid->preferred_refresh_mhz, edid->min_vrefresh_hz,
+	      edid->max_vrefresh_hz);
+
+	return edid;
+}
+
+/*
+ * We only use the EDID to pick a mode when the connector doesn't mark one
+ * as preferred, and for the refresh range of a variable-refresh display;
+ * see output_choose_mode() and output_vrr_setup(). Otherwise there's no
+ * point fetching and parsing it at startup.
+ */
+static bool output_needs_edid(struct output *output,
+			      drmModeConnectorPtr connector,
+			      drmModeObjectPropertiesPtr props)
+{
+	for (int m = 0; m < connector->count_modes; m++) {
+		if (connector->modes[m].type & DRM_MODE_TYPE_PREFERRED)
+			return drm_property_get_value(&output->props.connector[WDRM_CONNECTOR_VRR_CAPABLE],
+						      props, 0) != 0;
+	}
+
+	return true;
+}
+
+/*
+ * DRM is supposed to provide a refresh rate, but often doesn't; calculate
+ * our own in milliHz for higher precision anyway.
+ */
+static uint32_t mode_refresh_mhz(const drmModeModeInfo *mode)
+{
+	return ((mode->clock * 1000000LL / mode->htotal) +
+		(mode->vtotal / 2)) / mode->vtotal;
+}
+
+/*
+ * Finds the connector's mode closest to the given size and refresh; with a
+ * refresh of 0, the fastest mode of that size.
+ */
+static const drmModeModeInfo *
+connector_find_mode(drmModeConnectorPtr connector, uint32_t width,
+		    uint32_t height, uint32_t refresh_mhz)
+{
+	const drmModeModeInfo *ret = NULL;
+	int64_t best = 0;
+
+	for (int m = 0; m < connector->count_modes; m++) {
+		const drmModeModeInfo *mode = &connector->modes[m];
+		int64_t score;
+
+		if (mode->hdisplay != width || mode->vdisplay != height ||
+		    (mode->flags & DRM_MODE_FLAG_INTERLACE))
+			continue;
+
+		score = refresh_mhz ?
+			-llabs((long long) mode_refresh_mhz(mode) - refresh_mhz) :
+			mode_refresh_mhz(mode);
+		if (!ret || score > best) {
+			ret = mode;
+			best = score;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Chooses the mode to drive the output with:
+ *
+ *   - $KMS_MODE=<width>x<height>[@<Hz>] picks the closest matching mode
+ *     from the connector's list, for every output that has one;
+ *   - otherwise, if the CRTC is already lit, we keep its mode, which saves
+ *     a full modeset (and the blank screen which comes with it);
+ *   - otherwise, the mode the connector marks as preferred, or failing
+ *     that, the one matching the EDID's preferred timing;
+ *   - and otherwise, the first mode the kernel lists, which it sorts
+ *     best first.
+ */
+static bool output_choose_mode(struct output *output,
+			       drmModeConnectorPtr connector,
+			       drmModeCrtcPtr crtc,
+			       const struct edid_info *edid)
+{
+	const char *env = getenv("KMS_MODE");
+	const drmModeModeInfo *mode = NULL;
+	unsigned int width, height;
+	double hz = 0.0;
+
+	if (env && sscanf(env, "%ux%u@%lf", &width, &height, &hz) >= 2) {
+		mode = connector_find_mode(connector, width, height,
+					   (uint32_t) (hz * 1000.0));
+		if (!mode)
+			fprintf(stderr, "[%s] no mode matching KMS_MODE=%s\n",
+				output->name, env);
+	}
+
+	if (!mode && crtc->mode_valid && crtc->buffer_id != 0)
+		mode = &crtc->mode;
+
+	for (int m = 0; !mode && m < connector->count_modes; m++) {
+		if (connector->modes[m].type & DRM_MODE_TYPE_PREFERRED)
+			mode = &connector->modes[m];
+	}
+
+	if (!mode && edid && edid->preferred_refresh_mhz)
+		mode = connector_find_mode(connector, edid->preferred_width,
+					   edid->preferred_height,
+					   edid->preferred_refresh_mhz);
+
+	if (!mode && connector->count_modes > 0)
+		mode = &connector->modes[0];
+
+	if (!mode)
+		return false;
+
+	output->mode = *mode;
+	return true;
+}
+
+/*
+ * Finds a CRTC we can light up a connector with, for connectors which
+ * aren't already routed through one. We only consider CRTCs which are off,
+ * and which no other output is using.
+ */
+static drmModeCrtcPtr connector_find_crtc(struct device *device,
+					  drmModeConnectorPtr connector,
+					  int *crtc_index)
+{
+	for (int e = 0; e < connector->count_encoders; e++) {
+		drmModeEncoderPtr encoder =
+			drmModeGetEncoder(device->kms_fd,
+					  connector->encoders[e]);
+		uint32_t possible;
+
+		if (!encoder)
+			continue;
+		possible = encoder->possible_crtcs;
+		drmModeFreeEncoder(encoder);
+
+		for (int c = 0; c < device->res->count_crtcs; c++) {
+			drmModeCrtcPtr crtc;
+
+			if (!(possible & (1 << c)) ||
+			    device_output_for_crtc(device,
+						   device->res->crtcs[c]))
+				continue;
+
+			crtc = drmModeGetCrtc(device->kms_fd,
+					      device->res->crtcs[c]);
+			if (crtc && !crtc->mode_valid) {
+				*crtc_index = c;
+				return crtc;
+			}
+			drmModeFreeCrtc(crtc);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Finds the primary plane for a CRTC which isn't active, so we can't find
+ * it from the framebuffer it is showing; see output_create(). Outputs we
+ * add on hotplug have to skip planes which are already ours.
+ */
+static drmModePlanePtr crtc_find_primary_plane(struct device *device,
+					       int crtc_index)
+{
+	for (int p = 0; p < device->num_planes; p++) {
+		drmModePlanePtr kplane = device->planes[p];
+		struct drm_property_info info[WDRM_PLANE__COUNT];
+		drmModeObjectPropertiesPtr props;
+		uint64_t type;
+
+		if (!(kplane->possible_crtcs & (1 << crtc_index)) ||
+		    kplane->crtc_id != 0 ||
+		    device_output_for_plane(device, kplane->plane_id))
+			continue;
+
+		props = drmModeObjectGetProperties(device->kms_fd,
+						   kplane->plane_id,
+						   DRM_MODE_OBJECT_PLANE);
+		if (!props)
+			continue;
+		/* We only need this until our next commit. */
+		drm_property_info_populate(device, &device->frame_arena,
+					   plane_props, info,
+					   WDRM_PLANE__COUNT, props);
+		type = drm_property_get_value(&info[WDRM_PLANE_TYPE], props,
+					      WDRM_PLANE_TYPE__COUNT);
+		drm_property_info_free(info, WDRM_PLANE__COUNT);
+		drmModeFreeObjectProperties(props);
+
+		if (type == WDRM_PLANE_TYPE_PRIMARY)
+			return kplane;
+	}
+
+	return NULL;
+}
+
+/*
+ * Works out whether we can, and should, use variable refresh on the output.
+ * The connector tells us whether the display supports it; we only turn it
+ * on if asked with $KMS_VRR, as some panels visibly flicker when their
+ * refresh rate changes. The EDID's range limits tell us how long the
+ * display will wait for a frame; without them, we assume it will wait at
+ * least twice the refresh interval.
+ */
+static void output_vrr_setup(struct output *output,
+			     drmModeObjectPropertiesPtr props,
+			     const struct edid_info *edid)
+{
+	const char *env = getenv("KMS_VRR");
+
+	output->vrr.capable =
+		drm_property_get_value(&output->props.connector[WDRM_CONNECTOR_VRR_CAPABLE],
+				       props, 0) != 0 &&
+		output->props.crtc[WDRM_CRTC_VRR_ENABLED].prop_id != 0;
+	output->vrr.enabled = output->vrr.capable && env &&
+			      strcmp(env, "0") != 0;
+
+	if (edid && edid->min_vrefresh_hz)
+		output->vrr.max_interval_nsec =
+			millihz_to_nsec(edid->min_vrefresh_hz * 1000);
+	else
+		output->vrr.max_interval_nsec =
+			output->refresh_interval_nsec * 2;
+
+	if (output->vrr.capable)
+		printf("[%s] variable refresh %s, down to %.1f Hz\n",
+		       output->name,
+		       output->vrr.enabled ? "enabled" : "supported (set KMS_VRR=1 to enable)",
+		       1e9 / output->vrr.max_interval_nsec);
 }
 
 /*
@@ -468,14 +706,101 @@ static uint32_t mode_blob_create(struct device *device, drmModeModeInfo *mode)
 	return ret;
 }
 
+static bool plane_supports_format(drmModePlanePtr plane, uint32_t format)
+{
+	for (unsigned int i = 0; i < plane->count_formats; i++) {
+		if (plane->formats[i] == format)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Finds the overlay and cursor planes which can be used with our CRTC, to
+ * place layers on. Planes can often be used with several CRTCs, but can only
+ * display on one at a time, so we skip any plane an earlier output has
+ * already taken.
+ *
+ * If both the primary plane and the overlay have a zpos property, we also
+ * skip overlays which would be stacked below the primary, as anything we
+ * put there would be hidden.
+ */
+static void output_planes_populate(struct output *output, int crtc_index,
+				   uint64_t primary_zpos, bool have_primary_zpos)
+{
+	struct device *device = output->device;
+
+	output->planes = arena_alloc(&output->arena,
+				     device->num_planes * sizeof(*output->planes));
+
+	for (int p = 0; p < device->num_planes; p++) {
+		drmModePlanePtr kplane = device->planes[p];
+		struct plane *plane = &output->planes[output->num_planes];
+		drmModeObjectPropertiesPtr props;
+		bool taken = false;
+		uint64_t type;
+
+		if (kplane->plane_id == output->primary_plane_id ||
+		    !(kplane->possible_crtcs & (1 << crtc_index)) ||
+		    !plane_supports_format(kplane, DRM_FORMAT_ARGB8888))
+			continue;
+
+		for (int o = 0; o < device->num_outputs && !taken; o++) {
+			struct output *other = device->outputs[o];
+
+			for (unsigned int i = 0; i < other->num_planes; i++) {
+				if (other->planes[i].plane_id == kplane->plane_id)
+					taken = true;
+			}
+		}
+		if (taken)
+			continue;
+
+		props = drmModeObjectGetProperties(device->kms_fd,
+						   kplane->plane_id,
+						   DRM_MODE_OBJECT_PLANE);
+		if (!props)
+			continue;
+		drm_property_info_populate(device, &output->arena, plane_props,
+					   plane->props, WDRM_PLANE__COUNT,
+					   props);
+		type = drm_property_get_value(&plane->props[WDRM_PLANE_TYPE],
+					      props, WDRM_PLANE_TYPE__COUNT);
+		if (have_primary_zpos &&
+		    plane->props[WDRM_PLANE_ZPOS].prop_id != 0 &&
+		    drm_property_get_value(&plane->props[WDRM_PLANE_ZPOS],
+					   props, 0) <= primary_zpos)
+			type = WDRM_PLANE_TYPE__COUNT;
+		drmModeFreeObjectProperties(props);
+
+		if (type != WDRM_PLANE_TYPE_OVERLAY &&
+		    type != WDRM_PLANE_TYPE_CURSOR) {
+			drm_property_info_free(plane->props, WDRM_PLANE__COUNT);
+			continue;
+		}
+
+		plane->plane_id = kplane->plane_id;
+		plane->type = type;
+		output->num_planes++;
+		debug("[%s] can use %s plane %" PRIu32 " for layers\n",
+		      output->name,
+		      (type == WDRM_PLANE_TYPE_CURSOR) ? "cursor" : "overlay",
+		      plane->plane_id);
+	}
+}
+
+static struct atomic_req *output_static_atomic_req(struct output *output);
+
 /*
  * Create an output structure by working backwards from a connector to
- * find an active plane -> CRTC -> connector display chain. Also fills in the
+ * find a plane -> CRTC -> connector display chain. Also fills in the
  * object property structures so they're ready for use.
  *
- * This reuses existing routing, so requires the target connector to already be
- * active. It is possible to use our routing, but per the comment below, this
- * makes the code more difficult to follow.
+ * Where the connector is already active, we reuse its existing routing.
+ * Connectors which are plugged in but switched off get a CRTC which nobody
+ * else is using, along with that CRTC's primary plane; our first commit then
+ * lights them up, with ALLOW_MODESET. Either way, we choose the mode
+ * ourselves; see output_choose_mode().
  *
  * In a system which tracks every KMS object (plane/CRTC/connector), instead of
  * calling drmModeGet*() for each object, you could instead just use
@@ -489,22 +814,28 @@ struct output *output_create(struct device *device,
 	drmModeEncoderPtr encoder = NULL;
 	drmModePlanePtr plane = NULL;
 	drmModeCrtcPtr crtc = NULL;
+	struct edid_info *edid;
 	uint64_t refresh;
+	uint64_t primary_zpos;
+	bool have_primary_zpos;
+	int crtc_index = -1;
 	int timer_fd;
 
-	/* Find the encoder (a deprecated KMS object) for this connector. */
-	if (connector->encoder_id == 0) {
-		debug("[CONN:%" PRIu32 "]: no encoder\n", connector->connector_id);
+	if (connector->connection != DRM_MODE_CONNECTED ||
+	    connector->count_modes == 0) {
+		debug("[CONN:%" PRIu32 "]: not connected\n", connector->connector_id);
 		return NULL;
 	}
-	for (int e = 0; e < device->res->count_encoders; e++) {
+
+	/* Find the encoder (a deprecated KMS object) for this connector. */
+	for (int e = 0; connector->encoder_id != 0 &&
+			e < device->res->count_encoders; e++) {
 		if (device->res->encoders[e] == connector->encoder_id) {
 			encoder = drmModeGetEncoder(device->kms_fd,
 						    device->res->encoders[e]);
 			break;
 		}
 	}
-	assert(encoder);
 
 	/*
 	 * Find the CRTC currently used by this connector. It is possible to
@@ -521,26 +852,24 @@ struct output *output_create(struct device *device,
 	 * our first commit set or cleared out the state on every object.
 	 * Weston handles this with its 'state_invalid' flag.
 	 *
-	 * As this makes enumeration more complex, we have chosen to not do
-	 * that in this example.
+	 * As this makes enumeration more complex, we only pick a CRTC of our
+	 * own for connectors which don't have one, and then only one which
+	 * is switched off.
 	 */
-	if (encoder->crtc_id == 0) {
-		debug("[CONN:%" PRIu32 "]: no CRTC\n", connector->connector_id);
-		goto out_encoder;
-	}
-	for (int c = 0; c < device->res->count_crtcs; c++) {
+	for (int c = 0; encoder && encoder->crtc_id != 0 &&
+			c < device->res->count_crtcs; c++) {
 		if (device->res->crtcs[c] == encoder->crtc_id) {
 			crtc = drmModeGetCrtc(device->kms_fd,
 					      device->res->crtcs[c]);
+			crtc_index = c;
 			break;
 		}
 	}
-	assert(crtc);
-
-	/* Ensure the CRTC is active. */
-	if (crtc->buffer_id == 0) {
-		debug("[CONN:%" PRIu32 "]: not active\n", connector->connector_id);
-		goto out_crtc;
+	if (!crtc)
+		crtc = connector_find_crtc(device, connector, &crtc_index);
+	if (!crtc) {
+		debug("[CONN:%" PRIu32 "]: no CRTC\n", connector->connector_id);
+		goto out_encoder;
 	}
 
 	/*
@@ -548,9 +877,10 @@ struct output *output_create(struct device *device,
 	 * single primary plane for this CRTC (i.e. what would be updated
 	 * by drmModeSetCrtc), but if it's already active then we can cheat
 	 * by looking for something displaying the same framebuffer ID,
-	 * since that information is duplicated.
+	 * since that information is duplicated. Otherwise, we look for a
+	 * free plane whose type is primary.
 	 */
-	for (int p = 0; p < device->num_planes; p++) {
+	for (int p = 0; crtc->buffer_id != 0 && p < device->num_planes; p++) {
 		debug("[PLANE: %" PRIu32 "] CRTC ID %" PRIu32 ", FB %" PRIu32 "\n", device->planes[p]->plane_id, device->planes[p]->crtc_id, device->planes[p]->fb_id);
 		if (device->planes[p]->crtc_id == crtc->crtc_id &&
 		    device->planes[p]->fb_id == crtc->buffer_id) {
@@ -558,31 +888,29 @@ struct output *output_create(struct device *device,
 			break;
 		}
 	}
-	assert(plane);
-
-	/* DRM is supposed to provide a refresh interval, but often doesn't;
-	 * calculate our own in milliHz for higher precision anyway. */
-	refresh = ((crtc->mode.clock * 1000000LL / crtc->mode.htotal) +
-		   (crtc->mode.vtotal / 2)) / crtc->mode.vtotal;
-
-	printf("[CRTC:%" PRIu32 ", CONN %" PRIu32 ", PLANE %" PRIu32 "]: active at %u x %u, %" PRIu64 " mHz\n",
-	       crtc->crtc_id, connector->connector_id, plane->plane_id,
-	       crtc->width, crtc->height, refresh);
+	if (!plane)
+		plane = crtc_find_primary_plane(device, crtc_index);
+	if (!plane) {
+		debug("[CRTC:%" PRIu32 "]: no primary plane\n", crtc->crtc_id);
+		goto out_crtc;
+	}
 
 	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 	if (timer_fd < 0)
 	{
 		fprintf(stderr, "failed to create timer file descriptor: %s\n", strerror(errno));
-		goto out_plane;
+		goto out_crtc;
 	}
 
 	output = calloc(1, sizeof(*output));
 	assert(output);
+	arena_init(&output->arena, ARENA_OUTPUT_BLOCK_SIZE);
 	output->device = device;
 	output->primary_plane_id = plane->plane_id;
 	output->crtc_id = crtc->crtc_id;
 	output->connector_id = connector->connector_id;
 	output->commit_fence_fd = -1;
+	output->atomic.full_state = true;
 	snprintf(output->name, sizeof(output->name), "%s-%d",
 		 (connector->connector_type < ARRAY_LENGTH(connector_type_names) ?
 		 	connector_type_names[connector->connector_type] :
@@ -590,17 +918,7 @@ struct output *output_create(struct device *device,
 		 connector->connector_type_id);
 	output->needs_repaint = true;
 	output->repaint_timer_fd = timer_fd;
-
-	/*
-	 * Just reuse the CRTC's existing mode: requires it to already be
-	 * active. In order to use a different mode, we could look at the
-	 * mode list exposed in the connector, or construct a new DRM mode
-	 * from EDID.
-	 */
-	output->mode = crtc->mode;
-	output->refresh_interval_nsec = millihz_to_nsec(refresh);
-	debug("[%s] refresh interval %" PRIu64 "ns / %" PRIu64 "ms\n", output->name, output->refresh_interval_nsec, output->refresh_interval_nsec / 1000000UL);
-	output->mode_blob_id = mode_blob_create(device, &output->mode);
+	output_sched_init(output);
 
 	/*
 	 * Now we have all our objects lined up, get their property lists from
@@ -610,25 +928,59 @@ struct output *output_create(struct device *device,
 	props = drmModeObjectGetProperties(device->kms_fd, output->primary_plane_id,
 					   DRM_MODE_OBJECT_PLANE);
 	assert(props);
-	drm_property_info_populate(device, plane_props, output->props.plane,
-				   WDRM_PLANE__COUNT, props);
+	drm_property_info_populate(device, &output->arena, plane_props,
+				   output->props.plane, WDRM_PLANE__COUNT,
+				   props);
 	plane_formats_populate(output, props);
+	output_modifiers_rank(output);
+	have_primary_zpos = (output->props.plane[WDRM_PLANE_ZPOS].prop_id != 0);
+	primary_zpos = drm_property_get_value(&output->props.plane[WDRM_PLANE_ZPOS],
+					      props, 0);
 	drmModeFreeObjectProperties(props);
 
+	output_planes_populate(output, crtc_index, primary_zpos,
+			       have_primary_zpos);
+
 	props = drmModeObjectGetProperties(device->kms_fd, output->crtc_id,
 					   DRM_MODE_OBJECT_CRTC);
 	assert(props);
-	drm_property_info_populate(device, crtc_props, output->props.crtc,
-				   WDRM_CRTC__COUNT, props);
+	drm_property_info_populate(device, &output->arena, crtc_props,
+				   output->props.crtc, WDRM_CRTC__COUNT, props);
+	output_colour_init(output,
+			   drm_property_get_value(&output->props.crtc[WDRM_CRTC_DEGAMMA_LUT_SIZE],
+						  props, 0),
+			   drm_property_get_value(&output->props.crtc[WDRM_CRTC_GAMMA_LUT_SIZE],
+						  props, 0));
 	drmModeFreeObjectProperties(props);
 
 	props = drmModeObjectGetProperties(device->kms_fd, output->connector_id,
 					   DRM_MODE_OBJECT_CONNECTOR);
 	assert(props);
-	drm_property_info_populate(device, connector_props, output->props.connector,
+	drm_property_info_populate(device, &output->arena, connector_props,
+				   output->props.connector,
 				   WDRM_CONNECTOR__COUNT, props);
-	output_get_edid(output, props);
+	edid = output_needs_edid(output, connector, props) ?
+		output_get_edid(output, props) : NULL;
+
+	/*
+	 * Choosing a different mode from whatever the CRTC had, or lighting
+	 * up a CRTC which was off, needs ALLOW_MODESET, which our first
+	 * commit always has.
+	 */
+	output_choose_mode(output, connector, crtc, edid);
+	refresh = mode_refresh_mhz(&output->mode);
+	output->refresh_interval_nsec = millihz_to_nsec(refresh);
+	debug("[%s] refresh interval %" PRIu64 "ns / %" PRIu64 "ms\n", output->name, output->refresh_interval_nsec, output->refresh_interval_nsec / 1000000UL);
+	output->mode_blob_id = mode_blob_create(device, &output->mode);
+
+	printf("[CRTC:%" PRIu32 ", CONN %" PRIu32 ", PLANE %" PRIu32 "]: %s at %u x %u, %" PRIu64 " mHz\n",
+	       crtc->crtc_id, connector->connector_id, plane->plane_id,
+	       (crtc->buffer_id != 0) ? "active" : "lighting up",
+	       output->mode.hdisplay, output->mode.vdisplay, refresh);
+
+	output_vrr_setup(output, props, edid);
 	drmModeFreeObjectProperties(props);
+	free(edid);
 
 	/*
 	 * Set if we support explicit fencing inside KMS; the EGL renderer will
@@ -638,12 +990,20 @@ struct output *output_create(struct device *device,
 		(output->props.plane[WDRM_PLANE_IN_FENCE_FD].prop_id &&
 		 output->props.crtc[WDRM_CRTC_OUT_FENCE_PTR].prop_id);
 
-out_plane:
-	drmModeFreePlane(plane);
+	output->atomic.static_req = output_static_atomic_req(output);
+
+	if (getenv("KMS_ASYNC_FLIP")) {
+		output->async_flip.enabled = device->atomic_async_flip;
+		if (!output->async_flip.enabled)
+			printf("[%s] driver has no atomic async flips; flipping on vblank\n",
+			       output->name);
+	}
+
 out_crtc:
 	drmModeFreeCrtc(crtc);
 out_encoder:
-	drmModeFreeEncoder(encoder);
+	if (encoder)
+		drmModeFreeEncoder(encoder);
 
 	return output;
 }
@@ -651,12 +1011,9 @@ out_encoder:
 void output_destroy(struct output *output)
 {
 	struct device *device = output->device;
-	int i;
-
-	for (i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
-		if (output->buffers[i])
-			buffer_destroy(output->buffers[i]);
-	}
+	output_pool_fini(output);
+	output_layers_destroy(output);
+	output_cursor_fini(output);
 
 	if (output->device->egl_dpy)
 		output_egl_destroy(device, output);
@@ -664,87 +1021,467 @@ void output_destroy(struct output *output)
 	if (output->mode_blob_id != 0)
 		drmModeDestroyPropertyBlob(device->kms_fd, output->mode_blob_id);
 
+	if (output->damage.clips_blob_id != 0)
+		drmModeDestroyPropertyBlob(device->kms_fd,
+					   output->damage.clips_blob_id);
+
+	output_colour_fini(output);
+
 	if (output->repaint_timer_fd >= 0)
 		close(output->repaint_timer_fd);
 
+	/* Our planes, property tables and requests all go with this. */
+	arena_fini(&output->arena);
 	free(output);
 }
 
+/*
+ * Requests start out with room for this many properties, which is enough
+ * for an output's full state, and double whenever they run out.
+ */
+#define ATOMIC_REQ_MIN_PROPS 64
+
+struct atomic_req *atomic_req_create(struct arena *arena)
+{
+	struct atomic_req *req = arena_alloc(arena, sizeof(*req));
+
+	req->arena = arena;
+	return req;
+}
+
+void atomic_req_reset(struct atomic_req *req)
+{
+	req->num_props = 0;
+}
+
+/*
+ * Makes room for more properties. The arrays we replace stay in the arena
+ * until it is reset, but as we double each time, that is never more than
+ * the request ends up using.
+ */
+static void atomic_req_grow(struct atomic_req *req)
+{
+	unsigned int max = req->max_props ? req->max_props * 2 :
+					   ATOMIC_REQ_MIN_PROPS;
+	struct atomic_prop *props = arena_alloc(req->arena,
+						max * sizeof(*props));
+
+	if (req->num_props)
+		memcpy(props, req->props, req->num_props * sizeof(*props));
+	req->props = props;
+	req->objs = arena_alloc(req->arena, max * sizeof(*req->objs));
+	req->obj_num_props = arena_alloc(req->arena,
+					 max * sizeof(*req->obj_num_props));
+	req->prop_ids = arena_alloc(req->arena, max * sizeof(*req->prop_ids));
+	req->values = arena_alloc(req->arena, max * sizeof(*req->values));
+	req->max_props = max;
+}
+
+void atomic_req_add(struct atomic_req *req, uint32_t obj_id,
+		    uint32_t prop_id, uint64_t value)
+{
+	if (req->num_props == req->max_props)
+		atomic_req_grow(req);
+
+	req->props[req->num_props++] = (struct atomic_prop) {
+		.obj_id = obj_id,
+		.prop_id = prop_id,
+		.value = value,
+	};
+}
+
+void atomic_req_merge(struct atomic_req *req, const struct atomic_req *other)
+{
+	for (unsigned int i = 0; i < other->num_props; i++)
+		atomic_req_add(req, other->props[i].obj_id,
+			       other->props[i].prop_id, other->props[i].value);
+}
+
+static bool atomic_prop_before(const struct atomic_prop *a,
+			       const struct atomic_prop *b)
+{
+	if (a->obj_id != b->obj_id)
+		return a->obj_id < b->obj_id;
+	return a->prop_id < b->prop_id;
+}
+
+/*
+ * The ATOMIC ioctl takes each object once, with all its properties after
+ * it, so we sort the request by object and property. Requests are a few
+ * dozen properties long, so an insertion sort is all we need; as it keeps
+ * properties set more than once in the order they were added, we then keep
+ * the last of each, which is what they were last set to.
+ */
+static void atomic_req_sort(struct atomic_req *req)
+{
+	unsigned int num = 0;
+
+	for (unsigned int i = 1; i < req->num_props; i++) {
+		struct atomic_prop prop = req->props[i];
+		unsigned int j = i;
+
+		while (j > 0 && atomic_prop_before(&prop, &req->props[j - 1])) {
+			req->props[j] = req->props[j - 1];
+			j--;
+		}
+		req->props[j] = prop;
+	}
+
+	for (unsigned int i = 0; i < req->num_props; i++) {
+		if (i + 1 < req->num_props &&
+		    req->props[i].obj_id == req->props[i + 1].obj_id &&
+		    req->props[i].prop_id == req->props[i + 1].prop_id)
+			continue;
+		req->props[num++] = req->props[i];
+	}
+	req->num_props = num;
+}
+
+/*
+ * Does what drmModeAtomicCommit() does, returning 0 or a negative errno,
+ * but without allocating anything: the arrays the ioctl takes were made
+ * along with the request. Sorting leaves the request setting the same
+ * values as before, so it can be committed again.
+ */
+static int atomic_req_commit(int fd, struct atomic_req *req, uint32_t flags,
+			     void *user_data)
+{
+	struct drm_mode_atomic atomic = { 0 };
+	unsigned int num_objs = 0;
+
+	if (req->num_props == 0)
+		return 0;
+
+	atomic_req_sort(req);
+	for (unsigned int i = 0; i < req->num_props; i++) {
+		const struct atomic_prop *prop = &req->props[i];
+
+		if (i == 0 || prop->obj_id != req->props[i - 1].obj_id) {
+			req->objs[num_objs] = prop->obj_id;
+			req->obj_num_props[num_objs] = 0;
+			num_objs++;
+		}
+		req->obj_num_props[num_objs - 1]++;
+		req->prop_ids[i] = prop->prop_id;
+		req->values[i] = prop->value;
+	}
+
+	atomic.flags = flags;
+	atomic.count_objs = num_objs;
+	atomic.objs_ptr = (uint64_t) (uintptr_t) req->objs;
+	atomic.count_props_ptr = (uint64_t) (uintptr_t) req->obj_num_props;
+	atomic.props_ptr = (uint64_t) (uintptr_t) req->prop_ids;
+	atomic.prop_values_ptr = (uint64_t) (uintptr_t) req->values;
+	atomic.user_data = (uint64_t) (uintptr_t) user_data;
+
+	if (drmIoctl(fd, DRM_IOCTL_MODE_ATOMIC, &atomic) != 0)
+		return -errno;
+	return 0;
+}
+
 /* Sets a CRTC property inside an atomic request. */
 static int
-crtc_add_prop(drmModeAtomicReq *req, struct output *output,
+crtc_add_prop(struct atomic_req *req, struct output *output,
 	      enum wdrm_crtc_property prop, uint64_t val)
 {
 	struct drm_property_info *info = &output->props.crtc[prop];
-	int ret;
 
 	if (info->prop_id == 0)
 		return -1;
 
-	ret = drmModeAtomicAddProperty(req, output->crtc_id, info->prop_id,
-				       val);
+	atomic_req_add(req, output->crtc_id, info->prop_id, val);
 	debug("\t[CRTC:%lu] %lu (%s) -> %llu (0x%llx)\n",
 	      (unsigned long) output->crtc_id,
 	      (unsigned long) info->prop_id, info->name,
 	      (unsigned long long) val, (unsigned long long) val);
-	return (ret <= 0) ? -1 : 0;
+	return 0;
 }
 
 /* Sets a connector property inside an atomic request. */
 static int
-connector_add_prop(drmModeAtomicReq *req, struct output *output,
+connector_add_prop(struct atomic_req *req, struct output *output,
 		   enum wdrm_connector_property prop, uint64_t val)
 {
 	struct drm_property_info *info = &output->props.connector[prop];
-	int ret;
 
 	if (info->prop_id == 0)
 		return -1;
 
-	ret = drmModeAtomicAddProperty(req, output->connector_id,
-				       info->prop_id, val);
+	atomic_req_add(req, output->connector_id, info->prop_id, val);
 	debug("\t[CONN:%lu] %lu (%s) -> %llu (0x%llx)\n",
 	      (unsigned long) output->connector_id,
 	      (unsigned long) info->prop_id, info->name,
 	      (unsigned long long) val, (unsigned long long) val);
-	return (ret <= 0) ? -1 : 0;
+	return 0;
 }
 
-/* Sets a plane property inside an atomic request. */
-static int
-plane_add_prop(drmModeAtomicReq *req, struct output *output,
-	       enum wdrm_plane_property prop, uint64_t val)
+/*
+ * Gives us a blob for the FB_DAMAGE_CLIPS property holding the damage of the
+ * frame in the buffer we are about to commit.
+ *
+ * Damage often stays the same for many frames, e.g. while only the moving
+ * square or the scrolling text changes, so we keep the last blob we made,
+ * and only replace it when the clips change. Destroying a blob we've
+ * committed is safe: the kernel keeps its own reference for as long as the
+ * plane uses it.
+ *
+ * A blob of 0 means the whole plane has changed, which is what we return
+ * for a full repaint, or if we couldn't create the blob. A frame with no
+ * damage at all instead gets a single zero-area clip, which tells KMS that
+ * nothing has changed.
+ */
+static uint32_t output_damage_clips_blob(struct output *output,
+					 struct buffer *buffer)
 {
-	struct drm_property_info *info = &output->props.plane[prop];
+	struct device *device = output->device;
+	struct region *frame = &buffer->frame_damage;
+	struct drm_mode_rect clips[REGION_MAX_RECTS];
+	unsigned int num_clips = frame->num_rects;
 	int ret;
 
+	if (buffer->frame_damage_full)
+		return 0;
+
+	for (unsigned int i = 0; i < frame->num_rects; i++) {
+		clips[i].x1 = frame->rects[i].x1;
+		clips[i].y1 = frame->rects[i].y1;
+		clips[i].x2 = frame->rects[i].x2;
+		clips[i].y2 = frame->rects[i].y2;
+	}
+	if (num_clips == 0) {
+		memset(&clips[0], 0, sizeof(clips[0]));
+		num_clips = 1;
+	}
+
+	if (output->damage.clips_blob_id != 0 &&
+	    output->damage.num_clips == num_clips &&
+	    memcmp(output->damage.clips, clips,
+		   num_clips * sizeof(clips[0])) == 0)
+		return output->damage.clips_blob_id;
+
+	if (output->damage.clips_blob_id != 0) {
+		drmModeDestroyPropertyBlob(device->kms_fd,
+					   output->damage.clips_blob_id);
+		output->damage.clips_blob_id = 0;
+	}
+
+	ret = drmModeCreatePropertyBlob(device->kms_fd, clips,
+					num_clips * sizeof(clips[0]),
+					&output->damage.clips_blob_id);
+	if (ret != 0) {
+		debug("[%s] couldn't create damage blob: %s\n", output->name,
+		      strerror(-ret));
+		output->damage.clips_blob_id = 0;
+		return 0;
+	}
+
+	memcpy(output->damage.clips, clips, num_clips * sizeof(clips[0]));
+	output->damage.num_clips = num_clips;
+
+	return output->damage.clips_blob_id;
+}
+
+/* Sets a property on any plane inside an atomic request. */
+static int
+plane_obj_add_prop(struct atomic_req *req, uint32_t plane_id,
+		   struct drm_property_info *props,
+		   enum wdrm_plane_property prop, uint64_t val)
+{
+	struct drm_property_info *info = &props[prop];
+
 	if (info->prop_id == 0)
 		return -1;
 
-	ret = drmModeAtomicAddProperty(req, output->primary_plane_id,
-				       info->prop_id, val);
+	atomic_req_add(req, plane_id, info->prop_id, val);
 	debug("\t[PLANE:%lu] %lu (%s) -> %llu (0x%llx)\n",
-	      (unsigned long) output->primary_plane_id,
+	      (unsigned long) plane_id,
 	      (unsigned long) info->prop_id, info->name,
 	      (unsigned long long) val, (unsigned long long) val);
-	return (ret <= 0) ? -1 : 0;
+	return 0;
+}
+
+/* Sets a property on the output's primary plane inside an atomic request. */
+static int
+plane_add_prop(struct atomic_req *req, struct output *output,
+	       enum wdrm_plane_property prop, uint64_t val)
+{
+	return plane_obj_add_prop(req, output->primary_plane_id,
+				  output->props.plane, prop, val);
 }
 
+/*
+ * Works out what one of our overlay or cursor planes should be showing for
+ * the frame in the given buffer: the layer we've placed on it, unscaled, at
+ * the position recorded in the buffer, or nothing. We use the placement
+ * recorded in the buffer rather than the output's current one, which may
+ * already be for a later frame.
+ */
+static void plane_state_for_buffer(struct output *output,
+				   struct buffer *buffer, struct plane *plane,
+				   struct plane_state *state)
+{
+	memset(state, 0, sizeof(*state));
+
+	for (unsigned int i = 0; i < buffer->num_layers; i++) {
+		if (buffer->layers[i].plane == plane) {
+			state->fb = buffer->layers[i].fb;
+			state->rect = buffer->layers[i].rect;
+			return;
+		}
+	}
+}
 
 /*
- * Populates an atomic request structure with this output's current
- * configuration.
+ * Adds everything about one of our overlay or cursor planes: either the
+ * buffer it displays and where, or that it is switched off.
+ */
+static int plane_add_state(struct atomic_req *req, struct output *output,
+			   struct plane *plane, const struct plane_state *state)
+{
+	uint32_t id = plane->plane_id;
+	int ret = 0;
+
+	if (!state->fb) {
+		ret |= plane_obj_add_prop(req, id, plane->props,
+					  WDRM_PLANE_FB_ID, 0);
+		ret |= plane_obj_add_prop(req, id, plane->props,
+					  WDRM_PLANE_CRTC_ID, 0);
+		return ret;
+	}
+
+	ret |= plane_obj_add_prop(req, id, plane->props,
+				  WDRM_PLANE_FB_ID, state->fb->fb_id);
+	ret |= plane_obj_add_prop(req, id, plane->props,
+				  WDRM_PLANE_CRTC_ID, output->crtc_id);
+	ret |= plane_obj_add_prop(req, id, plane->props,
+				  WDRM_PLANE_SRC_X, 0);
+	ret |= plane_obj_add_prop(req, id, plane->props,
+				  WDRM_PLANE_SRC_Y, 0);
+	ret |= plane_obj_add_prop(req, id, plane->props,
+				  WDRM_PLANE_SRC_W,
+				  (uint64_t) state->fb->width << 16);
+	ret |= plane_obj_add_prop(req, id, plane->props,
+				  WDRM_PLANE_SRC_H,
+				  (uint64_t) state->fb->height << 16);
+	/* CRTC_X and CRTC_Y are signed, so may be off-screen. */
+	ret |= plane_obj_add_prop(req, id, plane->props,
+				  WDRM_PLANE_CRTC_X,
+				  (uint64_t) (int64_t) state->rect.x1);
+	ret |= plane_obj_add_prop(req, id, plane->props,
+				  WDRM_PLANE_CRTC_Y,
+				  (uint64_t) (int64_t) state->rect.y1);
+	ret |= plane_obj_add_prop(req, id, plane->props,
+				  WDRM_PLANE_CRTC_W,
+				  state->rect.x2 - state->rect.x1);
+	ret |= plane_obj_add_prop(req, id, plane->props,
+				  WDRM_PLANE_CRTC_H,
+				  state->rect.y2 - state->rect.y1);
+
+	/*
+	 * External buffers may come with a fence for their content; KMS
+	 * waits for it before scanning the buffer out. Where the plane can't
+	 * take it, we've already waited on the CPU; see output_layers_latch().
+	 */
+	if (state->fb->dmabuf.external && state->fb->dmabuf.fence_fd >= 0 &&
+	    plane->props[WDRM_PLANE_IN_FENCE_FD].prop_id)
+		ret |= plane_obj_add_prop(req, id, plane->props,
+					  WDRM_PLANE_IN_FENCE_FD,
+					  state->fb->dmabuf.fence_fd);
+
+	return ret;
+}
+
+/*
+ * Adds the state of the overlay and cursor planes we use for layers: each
+ * plane either displays a layer or is switched off. Unless we are sending
+ * the full state, planes which would be left as they were by the last
+ * commit are skipped. The pointer's cursor plane is left to
+ * output_add_cursor_props().
  *
- * Atomic requests are applied incrementally on top of the current state, so
- * there is no need here to apply the entire output state, except on the first
- * modeset if we are changing the display routing (per output_create comments).
+ * Test requests always carry every plane in full. They are made while
+ * placing layers, which may be on a render thread, whereas each plane's
+ * committed state belongs to the main thread, which updates it whenever a
+ * commit goes through; so the test path must never look at it. Sending
+ * everything costs a few more properties, but tests what we'd actually
+ * end up with whichever commit lands first.
+ */
+static int output_add_planes_atomic_req(struct output *output,
+					struct atomic_req *req,
+					struct buffer *buffer, bool test_only)
+{
+	int ret = 0;
+
+	for (unsigned int p = 0; p < output->num_planes; p++) {
+		struct plane *plane = &output->planes[p];
+		struct plane_state state;
+
+		if (plane == output->cursor.plane)
+			continue;
+
+		plane_state_for_buffer(output, buffer, plane, &state);
+		if (!test_only &&
+		    !__atomic_load_n(&output->atomic.full_state,
+				     __ATOMIC_ACQUIRE) &&
+		    memcmp(&state, &plane->committed, sizeof(state)) == 0)
+			continue;
+
+		ret |= plane_add_state(req, output, plane, &state);
+	}
+
+	return ret;
+}
+
+/*
+ * Adds the pointer's cursor plane, if it has changed since our last
+ * commit; see cursor.c. Once its buffer is on the plane, the pointer
+ * moving only changes CRTC_X and CRTC_Y, so that's all we send. Like any
+ * other plane property, they bring the plane's CRTC into the commit, so we
+ * still get an event for it.
+ */
+static int output_add_cursor_props(struct output *output,
+				   struct atomic_req *req)
+{
+	struct plane *plane = output->cursor.plane;
+	struct plane_state state;
+	int ret = 0;
+
+	if (!plane)
+		return 0;
+
+	output_cursor_state(output, &state);
+	output->cursor.in_flight = state;
+
+	if (__atomic_load_n(&output->atomic.full_state, __ATOMIC_ACQUIRE) ||
+	    state.fb != plane->committed.fb)
+		return plane_add_state(req, output, plane, &state);
+
+	if (state.rect.x1 != plane->committed.rect.x1)
+		ret |= plane_obj_add_prop(req, plane->plane_id, plane->props,
+					  WDRM_PLANE_CRTC_X,
+					  (uint64_t) (int64_t) state.rect.x1);
+	if (state.rect.y1 != plane->committed.rect.y1)
+		ret |= plane_obj_add_prop(req, plane->plane_id, plane->props,
+					  WDRM_PLANE_CRTC_Y,
+					  (uint64_t) (int64_t) state.rect.y1);
+
+	return ret;
+}
+
+/*
+ * Builds the part of this output's state which never changes in steady
+ * state: the routing from primary plane to CRTC to connector, the mode, and
+ * the primary plane's full-screen geometry. We keep it in an atomic request
+ * of its own, which we merge into the real request whenever we need to send
+ * the full state.
  */
-void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
-			   struct buffer *buffer)
+static struct atomic_req *output_static_atomic_req(struct output *output)
 {
+	struct atomic_req *req;
 	int ret;
 
-	debug("[%s] atomic state for commit:\n", output->name);
+	req = atomic_req_create(&output->arena);
+
+	debug("[%s] static atomic state:\n", output->name);
 
 	ret = plane_add_prop(req, output, WDRM_PLANE_CRTC_ID, output->crtc_id);
 
@@ -754,18 +1491,12 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
 	 * co-ordinates are in 16.16 fixed-point to allow for better scaling;
 	 * as we just use a full-size uncropped image, we don't need this.
 	 */
-	ret |= plane_add_prop(req, output, WDRM_PLANE_FB_ID, buffer->fb_id);
-	if (output->explicit_fencing && buffer->render_fence_fd >= 0) {
-		assert(linux_sync_file_is_valid(buffer->render_fence_fd));
-		ret |= plane_add_prop(req, output, WDRM_PLANE_IN_FENCE_FD,
-				      buffer->render_fence_fd);
-	}
 	ret |= plane_add_prop(req, output, WDRM_PLANE_SRC_X, 0);
 	ret |= plane_add_prop(req, output, WDRM_PLANE_SRC_Y, 0);
 	ret |= plane_add_prop(req, output, WDRM_PLANE_SRC_W,
-			      buffer->width << 16);
+			      (uint64_t) output->mode.hdisplay << 16);
 	ret |= plane_add_prop(req, output, WDRM_PLANE_SRC_H,
-			      buffer->height << 16);
+			      (uint64_t) output->mode.vdisplay << 16);
 
 	/*
 	 * DST_X/Y/W/H position the plane's output within the CRTC's output
@@ -776,12 +1507,10 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
 	 */
 	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_X, 0);
 	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_Y, 0);
-	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_W, buffer->width);
-	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_H, buffer->height);
-
-	/* Ensure we do actually have a full-screen buffer. */
-	assert(buffer->width == output->mode.hdisplay);
-	assert(buffer->height == output->mode.vdisplay);
+	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_W,
+			      output->mode.hdisplay);
+	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_H,
+			      output->mode.vdisplay);
 
 	/*
 	 * Changing any of these three properties requires the ALLOW_MODESET
@@ -790,8 +1519,66 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
 	ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID,
 			     output->mode_blob_id);
 	ret |= crtc_add_prop(req, output, WDRM_CRTC_ACTIVE, 1);
+	ret |= connector_add_prop(req, output, WDRM_CONNECTOR_CRTC_ID,
+				  output->crtc_id);
+
+	/*
+	 * Unlike the others, VRR_ENABLED doesn't need a modeset to change, but
+	 * we only ever set it once; see output_vrr_setup().
+	 */
+	if (output->vrr.capable)
+		ret |= crtc_add_prop(req, output, WDRM_CRTC_VRR_ENABLED,
+				     output->vrr.enabled);
+
+	assert(ret == 0);
 
-	if (output->explicit_fencing) {
+	return req;
+}
+
+/*
+ * Populates an atomic request structure with this output's current
+ * configuration.
+ *
+ * Atomic requests are applied incrementally on top of the current state, so
+ * there is no need here to apply the entire output state, except on the first
+ * modeset if we are changing the display routing (per output_create comments).
+ * Until our first commit has gone through, we send the full state; after
+ * that, a frame only carries the properties which change from one frame to
+ * the next: the framebuffer and fences, the damage, and whichever
+ * overlay and cursor planes have changed.
+ */
+void output_add_atomic_req(struct output *output, struct atomic_req *req,
+			   struct buffer *buffer, bool test_only)
+{
+	int ret = 0;
+
+	debug("[%s] atomic state for commit:\n", output->name);
+
+	/* Ensure we do actually have a full-screen buffer. */
+	assert(buffer->width == output->mode.hdisplay);
+	assert(buffer->height == output->mode.vdisplay);
+
+	if (__atomic_load_n(&output->atomic.full_state, __ATOMIC_ACQUIRE))
+		atomic_req_merge(req, output->atomic.static_req);
+
+	ret |= plane_add_prop(req, output, WDRM_PLANE_FB_ID, buffer->fb_id);
+	if (output->explicit_fencing && buffer->render_fence_fd >= 0) {
+		assert(linux_sync_file_is_valid(buffer->render_fence_fd));
+		ret |= plane_add_prop(req, output, WDRM_PLANE_IN_FENCE_FD,
+				      buffer->render_fence_fd);
+	}
+
+	/*
+	 * Tell KMS which parts of the buffer changed since the last frame,
+	 * if the plane supports it; without this, drivers have to assume
+	 * that everything has changed.
+	 */
+	if (!test_only &&
+	    output->props.plane[WDRM_PLANE_FB_DAMAGE_CLIPS].prop_id != 0)
+		ret |= plane_add_prop(req, output, WDRM_PLANE_FB_DAMAGE_CLIPS,
+				      output_damage_clips_blob(output, buffer));
+
+	if (!test_only && output->explicit_fencing) {
 		if (output->commit_fence_fd >= 0)
 			close(output->commit_fence_fd);
 		output->commit_fence_fd = -1;
@@ -805,12 +1592,158 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
 				     (uint64_t) (uintptr_t) &output->commit_fence_fd);
 	}
 
-	ret |= connector_add_prop(req, output, WDRM_CONNECTOR_CRTC_ID,
-				  output->crtc_id);
+	/*
+	 * Our colour blobs are KMS state like any other, so we only send
+	 * them when they've changed, or with the full state; see colour.c.
+	 * 0 takes the CRTC's LUT or matrix out of the pipeline.
+	 */
+	if (!test_only &&
+	    (output->colour.dirty ||
+	     __atomic_load_n(&output->atomic.full_state, __ATOMIC_ACQUIRE))) {
+		if (output->props.crtc[WDRM_CRTC_DEGAMMA_LUT].prop_id)
+			ret |= crtc_add_prop(req, output, WDRM_CRTC_DEGAMMA_LUT,
+					     output->colour.degamma_blob_id);
+		if (output->props.crtc[WDRM_CRTC_CTM].prop_id)
+			ret |= crtc_add_prop(req, output, WDRM_CRTC_CTM,
+					     output->colour.ctm_blob_id);
+		if (output->props.crtc[WDRM_CRTC_GAMMA_LUT].prop_id)
+			ret |= crtc_add_prop(req, output, WDRM_CRTC_GAMMA_LUT,
+					     output->colour.gamma_blob_id);
+	}
+
+	ret |= output_add_planes_atomic_req(output, req, buffer, test_only);
+
+	/*
+	 * Test commits are made while placing layers, which may be on a
+	 * render thread; they leave the cursor plane as it is in KMS.
+	 */
+	if (!test_only)
+		ret |= output_add_cursor_props(output, req);
 
 	assert(ret == 0);
 }
 
+/*
+ * Populates a request which only moves the pointer, for when no frame is
+ * going out with it; see cursor_commit_wanted() in main.c.
+ */
+void output_add_cursor_atomic_req(struct output *output,
+				  struct atomic_req *req)
+{
+	int ret;
+
+	debug("[%s] atomic state for cursor commit:\n", output->name);
+	ret = output_add_cursor_props(output, req);
+	assert(ret == 0);
+}
+
+/*
+ * Called once a commit containing this output's state for the given buffer
+ * has been accepted, so we know what KMS's state is from now on, and later
+ * commits can leave out whatever stays the same. The buffer is NULL for
+ * commits which only moved the pointer.
+ */
+void output_atomic_committed(struct output *output, struct buffer *buffer)
+{
+	if (output->cursor.plane)
+		output->cursor.plane->committed = output->cursor.in_flight;
+	if (!buffer)
+		return;
+
+	for (unsigned int p = 0; p < output->num_planes; p++) {
+		if (&output->planes[p] == output->cursor.plane)
+			continue;
+		plane_state_for_buffer(output, buffer, &output->planes[p],
+				       &output->planes[p].committed);
+	}
+	output->colour.dirty = false;
+	__atomic_store_n(&output->atomic.full_state, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Asynchronous flips replace the framebuffer on screen straight away, part
+ * of the way through scanning out the last one, rather than waiting for the
+ * next vblank. That tears, but for content which changes every frame, such
+ * as text scrolling quickly, it saves waiting for up to a whole refresh
+ * interval between finishing a frame and starting to show it.
+ *
+ * The price is that the kernel only lets an asynchronous commit change the
+ * primary plane's FB_ID: the hardware can swap the scanout address mid-frame,
+ * but not much else. So we only flip asynchronously once our full state is
+ * in place, and when none of our other planes change in the frame; anything
+ * else goes through a normal commit at the next vblank.
+ *
+ * Leaving out IN_FENCE_FD means KMS waits for rendering through the buffer's
+ * implicit fence instead. Leaving out OUT_FENCE_PTR means we release the
+ * last buffer from the flip event rather than the fence.
+ */
+bool output_async_flip_possible(struct output *output, struct buffer *buffer)
+{
+	if (!output->async_flip.enabled || output->colour.dirty ||
+	    output_cursor_moved(output) ||
+	    __atomic_load_n(&output->atomic.full_state, __ATOMIC_ACQUIRE))
+		return false;
+
+	for (unsigned int p = 0; p < output->num_planes; p++) {
+		struct plane *plane = &output->planes[p];
+		struct plane_state state;
+
+		if (plane == output->cursor.plane)
+			continue;
+		plane_state_for_buffer(output, buffer, plane, &state);
+		if (memcmp(&state, &plane->committed, sizeof(state)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+void output_add_async_atomic_req(struct output *output, struct atomic_req *req,
+				 struct buffer *buffer)
+{
+	int ret;
+
+	debug("[%s] atomic state for async commit:\n", output->name);
+	ret = plane_add_prop(req, output, WDRM_PLANE_FB_ID, buffer->fb_id);
+	assert(ret == 0);
+}
+
+/*
+ * Switches the output off, when its monitor has been unplugged, so we can
+ * destroy its framebuffers without the kernel having to take them off
+ * screen for us. This only touches the output's own planes, CRTC and
+ * connector, so although it needs ALLOW_MODESET, no other output is
+ * modeset. The commit blocks, waiting for any commit still in flight for
+ * the output; the event for that one is ignored once the output is gone.
+ */
+int output_disable(struct output *output)
+{
+	struct atomic_req *req = atomic_req_create(&output->arena);
+	int ret;
+
+	debug("[%s] atomic state for disabling:\n", output->name);
+
+	ret = plane_add_prop(req, output, WDRM_PLANE_FB_ID, 0);
+	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_ID, 0);
+	for (unsigned int p = 0; p < output->num_planes; p++) {
+		struct plane *plane = &output->planes[p];
+
+		if (!plane->committed.fb)
+			continue;
+		ret |= plane_obj_add_prop(req, plane->plane_id, plane->props,
+					  WDRM_PLANE_FB_ID, 0);
+		ret |= plane_obj_add_prop(req, plane->plane_id, plane->props,
+					  WDRM_PLANE_CRTC_ID, 0);
+	}
+	ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID, 0);
+	ret |= crtc_add_prop(req, output, WDRM_CRTC_ACTIVE, 0);
+	ret |= connector_add_prop(req, output, WDRM_CONNECTOR_CRTC_ID, 0);
+	assert(ret == 0);
+
+	return atomic_req_commit(output->device->kms_fd, req,
+				 DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+}
+
 /*
  * Commits the atomic state to KMS.
  *
@@ -822,7 +1755,7 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
  * For atomic commits, this goes to the page_flip_handler2 vfunc we set
  * in our DRM event context passed to drmHandleEvent(), which will be
  * called once for each CRTC affected by this atomic commit; the last
- * parameter of drmModeAtomicCommit() is a user-data parameter which
+ * parameter of atomic_req_commit() is a user-data parameter which
  * will be passed to the handler.
  *
  * The ALLOW_MODESET flag should not be used in regular operation.
@@ -842,7 +1775,7 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
  * as KMS itself does not describe the constraints a driver has, e.g.
  * certain planes can only scale by certain amounts.
  */
-int atomic_commit(struct device *device, drmModeAtomicReqPtr req,
+int atomic_commit(struct device *device, struct atomic_req *req,
 		  bool allow_modeset)
 {
 	int ret;
@@ -852,5 +1785,33 @@ int atomic_commit(struct device *device, drmModeAtomicReqPtr req,
 	if (allow_modeset)
 		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
 
-	return drmModeAtomicCommit(device->kms_fd, req, flags, device);
+	return atomic_req_commit(device->kms_fd, req, flags, device);
+}
+
+/*
+ * Commits an asynchronous flip, as above. We still get an event, once the
+ * new framebuffer has been latched.
+ */
+int atomic_commit_async(struct device *device, struct atomic_req *req)
+{
+	uint32_t flags = (DRM_MODE_ATOMIC_NONBLOCK |
+			  DRM_MODE_PAGE_FLIP_EVENT |
+			  DRM_MODE_PAGE_FLIP_ASYNC);
+
+	return atomic_req_commit(device->kms_fd, req, flags, device);
+}
+
+/*
+ * Checks whether the atomic state would be accepted by KMS, without actually
+ * applying it; see the notes on TEST_ONLY above.
+ */
+int atomic_test(struct device *device, struct atomic_req *req,
+		bool allow_modeset)
+{
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
+
+	if (allow_modeset)
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	return atomic_req_commit(device->kms_fd, req, flags, device);
 }
@@ -0,0 +1,316 @@
+/*
+ * This file implements layers: rectangles of content stacked above an
+ * output's main content, which we try to place on overlay and cursor planes.
+ *
+ * Most of a typical UI doesn't change from one frame to the next. If each
+ * static or independently-moving piece of it is on its own plane, the
+ * display controller blends them together as it scans out, and the GPU
+ * never has to touch them again: moving a layer is just a change of its
+ * plane's CRTC_X/CRTC_Y properties.
+ *
+ * Whether a particular combination of planes, sizes, positions and formats
+ * works is entirely up to the hardware, and there is no way to know other
+ * than asking. So, as Weston does, we build a candidate configuration and
+ * ask KMS whether it would accept it with a TEST_ONLY commit. We start from
+ * the topmost layer and give each one the first plane which passes the test;
+ * any layer we can't place is composited into the main content by the
+ * renderer instead. Compositing a layer means anything below it which it
+ * overlaps must be composited too, or it would end up being drawn on top.
+ *
+ * Searching costs a TEST_ONLY commit per candidate, so we only do it when
+ * something has changed that might need it. On every other frame we make a
+ * single test that the previous configuration, with the layers' new
+ * positions, still works.
+ *
+ * Our layers are currently a static status bar and a square which moves
+ * across the screen, and which the arrow keys and scrolling move up and
+ * down, plus, with $KMS_DMABUF_DEMO, one showing external
+ * buffers (see dmabuf.c). Set $KMS_NO_LAYERS to leave them out, or
+ * $KMS_NO_OVERLAYS to always composite them. The pointer isn't a layer: it
+ * keeps a cursor plane to itself, see cursor.c.
+ *
+ * With $KMS_RENDER_THREADS, the layers belong to whoever is rendering the
+ * output; see render.c. The render thread moves them and assigns them to
+ * planes (layer->plane and plane->layer) while it renders a frame, and the
+ * main thread only touches them in between, while output_render_busy() is
+ * false: latching newly attached buffers before handing a frame over, and
+ * releasing retired ones. The hand-off itself, under the render lock one
+ * way and through the frame counter the other, orders the two. Anything
+ * the main thread needs about a frame once it has been rendered comes from
+ * the frame's own snapshot in buffer->layers, never the live layers.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+/* How often to try placing composited layers on planes again. */
+#define LAYER_RETRY_FRAMES 60
+
+/* Indices into output->layers for our demo layers. */
+enum {
+	LAYER_STATUS_BAR = 0,
+	LAYER_SQUARE,
+};
+
+static bool rects_overlap(const struct rect *a, const struct rect *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 &&
+	       a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+static void layer_init(struct output *output, struct layer *layer,
+		       const char *name, uint32_t colour,
+		       unsigned int width, unsigned int height)
+{
+	memset(layer, 0, sizeof(*layer));
+	layer->name = name;
+	layer->colour = colour;
+	layer->rect = (struct rect) { 0, 0, width, height };
+
+	/*
+	 * Without any planes, the layer can only ever be composited, so
+	 * there's no need for a buffer.
+	 */
+	if (output->num_planes > 0 && !getenv("KMS_NO_OVERLAYS"))
+		layer->buffer = buffer_create_solid(output->device, output,
+						    width, height, colour);
+}
+
+void output_layers_init(struct output *output)
+{
+	unsigned int width = output->mode.hdisplay;
+	unsigned int height = output->mode.vdisplay;
+	unsigned int bar_height = height / 20;
+	unsigned int square_size = height / 8;
+
+	output->num_layers = 0;
+	if (getenv("KMS_NO_LAYERS"))
+		return;
+
+	layer_init(output, &output->layers[LAYER_STATUS_BAR], "status bar",
+		   0xff303030, width, bar_height);
+	output->layers[LAYER_STATUS_BAR].rect.y1 = height - bar_height;
+	output->layers[LAYER_STATUS_BAR].rect.y2 = height;
+
+	layer_init(output, &output->layers[LAYER_SQUARE], "square",
+		   0xffffffff, square_size, square_size);
+
+	output->num_layers = 2;
+	output->layers_changed = true;
+
+	output_dmabuf_demo_init(output);
+	if (getenv("KMS_NO_OVERLAYS")) {
+		for (unsigned int i = 0; i < output->num_layers; i++)
+			output->layers[i].composite = true;
+	}
+}
+
+void output_layers_destroy(struct output *output)
+{
+	for (unsigned int i = 0; i < output->num_layers; i++) {
+		struct layer *layer = &output->layers[i];
+
+		if (layer->buffer)
+			buffer_destroy(layer->buffer);
+		if (layer->pending)
+			buffer_destroy(layer->pending);
+		for (unsigned int r = 0; r < layer->num_retired; r++)
+			buffer_destroy(layer->retired[r]);
+		layer->num_retired = 0;
+	}
+	output_dmabuf_demo_fini(output);
+	output->num_layers = 0;
+}
+
+/*
+ * Moves the square back and forth across the screen once per animation
+ * loop, at the height input has moved it to; the status bar never changes.
+ */
+void output_layers_update(struct output *output, float anim_progress)
+{
+	struct layer *square;
+	int32_t size, travel, x, y;
+	float t;
+
+	if (output->num_layers <= LAYER_SQUARE)
+		return;
+
+	square = &output->layers[LAYER_SQUARE];
+	size = square->rect.x2 - square->rect.x1;
+	travel = output->mode.hdisplay - size;
+	t = (anim_progress < 0.5f) ? anim_progress * 2.0f :
+				     2.0f - anim_progress * 2.0f;
+	x = (int32_t) (travel * t);
+	y = (output->mode.vdisplay - size) / 2 + output->input.frame_offset_y;
+	if (y < 0)
+		y = 0;
+	if (y > (int32_t) output->mode.vdisplay - size)
+		y = output->mode.vdisplay - size;
+
+	square->rect = (struct rect) { x, y, x + size, y + size };
+}
+
+/*
+ * Records where our layers currently are, which planes they are on, and
+ * which buffers they show, in the buffer for this frame; this is what
+ * output_add_atomic_req() puts on the planes when the buffer is committed.
+ */
+static void layers_snapshot(struct output *output, struct buffer *buffer)
+{
+	for (unsigned int i = 0; i < output->num_layers; i++) {
+		buffer->layers[i].rect = output->layers[i].rect;
+		buffer->layers[i].plane = output->layers[i].plane;
+		buffer->layers[i].fb = output->layers[i].buffer;
+	}
+	buffer->num_layers = output->num_layers;
+}
+
+/*
+ * Asks KMS whether it would accept our current plane assignment, with the
+ * given buffer on the primary plane.
+ */
+static bool layers_test(struct output *output, struct buffer *buffer,
+			bool allow_modeset)
+{
+	int ret;
+
+	if (!output->atomic.test_req)
+		output->atomic.test_req = atomic_req_create(&output->arena);
+	atomic_req_reset(output->atomic.test_req);
+
+	layers_snapshot(output, buffer);
+	output_add_atomic_req(output, output->atomic.test_req, buffer,
+			      true);
+	ret = atomic_test(output->device, output->atomic.test_req,
+			  allow_modeset);
+
+	return ret == 0;
+}
+
+static void layer_set_plane(struct layer *layer, struct plane *plane)
+{
+	if (layer->plane)
+		layer->plane->layer = NULL;
+	layer->plane = plane;
+	if (plane)
+		plane->layer = layer;
+}
+
+void output_assign_planes(struct output *output, struct buffer *buffer,
+			  bool allow_modeset)
+{
+	struct plane *before[OUTPUT_MAX_LAYERS];
+	bool composite_all = output_colour_on_gpu(output);
+
+	if (output->num_layers == 0 || output->num_planes == 0) {
+		layers_snapshot(output, buffer);
+		return;
+	}
+
+	/*
+	 * Layers we had to composite might fit on a plane again now that
+	 * they've moved, so search again every so often; there's no point
+	 * doing it every frame, e.g. if there just aren't enough planes.
+	 *
+	 * When we apply the colour transform on the GPU, planes would skip
+	 * it, so everything has to be composited; see colour.c.
+	 */
+	for (unsigned int i = 0; i < output->num_layers; i++) {
+		const struct layer *layer = &output->layers[i];
+
+		if (layer->plane && composite_all) {
+			output->layers_changed = true;
+			break;
+		}
+		if (layer->buffer && layer->buffer->fb_id &&
+		    !layer->composite && !layer->plane && !composite_all &&
+		    ++output->layers_retry_frames >= LAYER_RETRY_FRAMES) {
+			output->layers_changed = true;
+			break;
+		}
+	}
+
+	if (!output->layers_changed &&
+	    layers_test(output, buffer, allow_modeset))
+		return;
+
+	for (unsigned int i = 0; i < output->num_layers; i++) {
+		before[i] = output->layers[i].plane;
+		layer_set_plane(&output->layers[i], NULL);
+	}
+
+	/* Work down from the top, so a layer only overlaps planes above it. */
+	for (int i = output->num_layers - 1; i >= 0; i--) {
+		struct layer *layer = &output->layers[i];
+		bool occluded = false;
+
+		/*
+		 * If a composited layer above overlaps us, we have to be
+		 * composited underneath it.
+		 */
+		for (unsigned int j = i + 1; j < output->num_layers; j++) {
+			if (!output->layers[j].plane &&
+			    rects_overlap(&layer->rect, &output->layers[j].rect))
+				occluded = true;
+		}
+		if (occluded || !layer->buffer || !layer->buffer->fb_id ||
+		    layer->composite || composite_all)
+			continue;
+
+		for (unsigned int p = 0; p < output->num_planes; p++) {
+			struct plane *plane = &output->planes[p];
+
+			if (plane->layer || plane == output->cursor.plane)
+				continue;
+
+			layer_set_plane(layer, plane);
+			if (layers_test(output, buffer, allow_modeset))
+				break;
+			layer_set_plane(layer, NULL);
+		}
+	}
+
+	for (unsigned int i = 0; i < output->num_layers; i++) {
+		struct layer *layer = &output->layers[i];
+
+		if (layer->plane == before[i])
+			continue;
+		if (layer->plane)
+			printf("[%s] layer '%s' on plane %u\n", output->name,
+			       layer->name, layer->plane->plane_id);
+		else
+			printf("[%s] layer '%s' composited\n", output->name,
+			       layer->name);
+	}
+
+	output->layers_changed = false;
+	output->layers_retry_frames = 0;
+}
@@ -4,6 +4,14 @@
  *
  * This file is mostly a copy of wlroot's logind session backend:
  * https://github.com/swaywm/wlroots/blob/master/backend/session/logind.c
+ *
+ * When the user switches to another VT, logind pauses every device we have
+ * taken from it: DRM devices lose their master, and input devices are
+ * revoked. It tells us with PauseDevice, and for a "pause" (rather than a
+ * "force") waits for us to acknowledge it with PauseDeviceComplete before
+ * going ahead, so we can stop committing first. On the way back, it gives
+ * DRM devices their master back and sends ResumeDevice. We pass both on to
+ * the listener main.c sets with logind_set_listener().
  */
 
 #define _POSIX_C_SOURCE 200809L
@@ -26,6 +34,8 @@
 	#include <elogind/sd-login.h>
 #endif
 
+#include "kms-quads.h"
+
 enum { DRM_MAJOR = 226 };
 
 struct logind {
@@ -48,6 +58,9 @@ struct logind {
 	// otherwise with the dbus PropertiesChanged on "active" signal
 	bool has_drm;
 	bool active;
+
+	const struct logind_listener *listener;
+	void *listener_data;
 };
 
 int logind_take_device(struct logind *session, const char *path) {
@@ -201,6 +214,130 @@ static void release_control(struct logind *session) {
 	sd_bus_message_unref(msg);
 }
 
+void logind_set_listener(struct logind *session,
+			 const struct logind_listener *listener, void *data) {
+	session->listener = listener;
+	session->listener_data = data;
+}
+
+static void pause_device_complete(struct logind *session, uint32_t major,
+				  uint32_t minor) {
+	int ret;
+	sd_bus_message *msg = NULL;
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+
+	ret = sd_bus_call_method(session->bus, "org.freedesktop.login1",
+		session->path, "org.freedesktop.login1.Session",
+		"PauseDeviceComplete", &error, &msg, "uu", major, minor);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to complete device pause: %s\n",
+			error.message);
+	}
+
+	sd_bus_error_free(&error);
+	sd_bus_message_unref(msg);
+}
+
+static int pause_device(sd_bus_message *msg, void *userdata,
+			sd_bus_error *ret_error UNUSED) {
+	struct logind *session = userdata;
+	uint32_t major, minor;
+	const char *type;
+
+	int ret = sd_bus_message_read(msg, "uus", &major, &minor, &type);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to parse PauseDevice signal: %s\n",
+			strerror(-ret));
+		return 0;
+	}
+
+	if (major == DRM_MAJOR) {
+		session->active = false;
+		if (session->listener && session->listener->pause)
+			session->listener->pause(session->listener_data,
+						 makedev(major, minor));
+	}
+
+	// "gone" means the device was unplugged, and "force" that it has
+	// already been paused; only "pause" waits for us
+	if (strcmp(type, "pause") == 0)
+		pause_device_complete(session, major, minor);
+
+	return 0;
+}
+
+static int resume_device(sd_bus_message *msg, void *userdata,
+			 sd_bus_error *ret_error UNUSED) {
+	struct logind *session = userdata;
+	uint32_t major, minor;
+	int fd;
+
+	int ret = sd_bus_message_read(msg, "uuh", &major, &minor, &fd);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to parse ResumeDevice signal: %s\n",
+			strerror(-ret));
+		return 0;
+	}
+
+	// Input devices are reopened by libinput itself once it is resumed,
+	// so only DRM devices are interesting here. Their FD is the same open
+	// file we took, which we already have; see device_resume().
+	if (major == DRM_MAJOR) {
+		session->active = true;
+		if (session->listener && session->listener->resume)
+			session->listener->resume(session->listener_data,
+						  makedev(major, minor));
+	}
+
+	return 0;
+}
+
+static bool add_signal_matches(struct logind *session) {
+	int ret;
+
+	ret = sd_bus_match_signal(session->bus, NULL, "org.freedesktop.login1",
+		session->path, "org.freedesktop.login1.Session", "PauseDevice",
+		pause_device, session);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to match PauseDevice signal: %s\n",
+			strerror(-ret));
+		return false;
+	}
+
+	ret = sd_bus_match_signal(session->bus, NULL, "org.freedesktop.login1",
+		session->path, "org.freedesktop.login1.Session", "ResumeDevice",
+		resume_device, session);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to match ResumeDevice signal: %s\n",
+			strerror(-ret));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * The D-Bus connection's FD becomes readable when logind sends us a message,
+ * such as a signal for our session. Nothing here waits for one, so unless we
+ * process them as they come in they would queue up in sd-bus forever.
+ */
+int logind_get_fd(struct logind *session) {
+	return sd_bus_get_fd(session->bus);
+}
+
+int logind_dispatch(struct logind *session) {
+	int ret;
+
+	do {
+		ret = sd_bus_process(session->bus, NULL);
+	} while (ret > 0);
+
+	if (ret < 0)
+		fprintf(stderr, "Failed to process D-Bus messages: %s\n",
+			strerror(-ret));
+	return ret;
+}
+
 void logind_destroy(struct logind *session) {
 	release_control(session);
 
@@ -378,6 +515,10 @@ struct logind *logind_create(void) {
 		goto error;
 	}
 
+	if (!add_signal_matches(session)) {
+		goto error_bus;
+	}
+
 	if (!session_activate(session)) {
 		goto error_bus;
 	}
@@ -386,6 +527,7 @@ struct logind *logind_create(void) {
 		goto error_bus;
 	}
 
+	session->active = true;
 	printf("Successfully loaded logind session\n");
 
 	return session;
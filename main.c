@@ -45,39 +45,74 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
-#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
+#include <linux/input-event-codes.h>
 
 #include "kms-quads.h"
 
-/* Allow the driver to drift half a millisecond every frame. */
-#define FRAME_TIMING_TOLERANCE (NSEC_PER_SEC / 2000)
+/*
+ * Rendering ahead lets us queue up finished frames while an earlier one is
+ * still in flight to KMS, so a frame which takes longer than usual to render
+ * doesn't immediately cost us a flip. The price is latency: each queued
+ * frame is displayed one more refresh interval after we rendered it.
+ *
+ * $KMS_RENDER_AHEAD sets how many frames we may queue; 0, the default,
+ * keeps our usual behaviour of rendering each frame just before its
+ * deadline. Every frame we queue needs a buffer of its own.
+ */
+static unsigned int render_ahead_from_env(void)
+{
+	const char *env = getenv("KMS_RENDER_AHEAD");
+	unsigned long frames;
 
-/* The amount of milliseconds a repaint of an output is scheduled before its
- * next estimated KMS commit completion time. There is no guarantee we are
- * going to actually make it with this margin for every GPU out there. */
-#define RENDER_LEEWAY_NSEC (NSEC_PER_MSEC * 5)
+	if (!env)
+		return 0;
 
-static struct buffer *find_free_buffer(struct output *output)
-{
-	for (int i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
-		if (!output->buffers[i]->in_use)
-			return output->buffers[i];
+	frames = strtoul(env, NULL, 10);
+	if (frames > BUFFER_QUEUE_MAX - BUFFER_QUEUE_DEPTH) {
+		fprintf(stderr, "KMS_RENDER_AHEAD=%lu is too deep; using %d\n",
+			frames, BUFFER_QUEUE_MAX - BUFFER_QUEUE_DEPTH);
+		frames = BUFFER_QUEUE_MAX - BUFFER_QUEUE_DEPTH;
 	}
 
-	assert(0 && "could not find free buffer for output!");
+	return frames;
 }
 
+/*
+ * Normally our scene animates constantly, so every output always has a new
+ * frame to show, and we repaint each one at its full refresh rate. On a
+ * static screen that costs a whole GPU frame and an atomic commit every
+ * refresh, for nothing.
+ *
+ * With $KMS_IDLE, the animation holds still, and an output only repaints
+ * once its scene has been invalidated: by input, or because it is
+ * scrolling (see scroll.c). When a frame has flipped and there's nothing
+ * new to show, we don't arm the repaint timer at all, and KMS simply keeps
+ * scanning out buffer_last. The output is then idle until something
+ * invalidates it again.
+ *
+ * By then, the next_frame we predicted after the last flip is long past,
+ * so we work out afresh which vblank the frame we render on waking can
+ * make, counting whole refresh intervals on from the last flip, since the
+ * CRTC has kept its phase all along. Without that, the scheduler would
+ * think the first frame was hugely late and drop our frame rate, and the
+ * animation and frame telemetry would both stutter.
+ */
+#define IDLE_ANIM_PROGRESS 0.5f
+
 /*
  * Informs us that an atomic commit has completed for the given CRTC. This will
  * be called one for each output (identified by the crtc_id) for each commit.
- * We will be given the user_data parameter we passed to drmModeAtomicCommit
+ * We will be given the user_data parameter we passed to atomic_commit()
  * (which for us is just the device struct), as well as the frame sequence
  * counter as well as the time associated with this commit event.
  *
@@ -102,15 +137,14 @@ static void atomic_event_handler(int fd UNUSED,
 		.tv_sec = tv_sec,
 		.tv_nsec = (tv_usec * 1000),
 	};
-	int64_t delta_nsec;
+	uint64_t render_done_nsec = 0;
+	struct itimerspec t = { .it_interval = { 0, 0 } };
+	enum sched_action action;
+	bool first_frame;
+	int ret;
 
 	/* Find the output this event is delivered for. */
-	for (int i = 0; i < device->num_outputs; i++) {
-		if (device->outputs[i]->crtc_id == crtc_id) {
-			output = device->outputs[i];
-			break;
-		}
-	}
+	output = device_output_for_crtc(device, crtc_id);
 	if (!output) {
 		debug("[CRTC:%u] received atomic completion for unknown CRTC",
 		      crtc_id);
@@ -118,39 +152,21 @@ static void atomic_event_handler(int fd UNUSED,
 	}
 
 	/*
-	 * Compare the actual event timestamp to what we had predicted it
-	 * would be when we submitted it.
-	 *
-	 * This example simply screams into the logs if we hit a different
-	 * time from what we had predicted. However, there are a number of
-	 * things you could do to better deal with this: for example, if your
-	 * frame is always late, you need to either start drawing earlier, or
-	 * if that is not possible, halve your frame rate so you can draw
-	 * steadily and predictably, if more slowly.
+	 * A commit which only moved the pointer doesn't change what frame is
+	 * on screen, so the scheduler has nothing to hear about; we can just
+	 * commit again, see cursor_commit_wanted().
 	 */
-	delta_nsec = timespec_sub_to_nsec(&event_time, &output->next_frame);
-	if (timespec_to_nsec(&output->last_frame) != 0 &&
-	    llabs((long long) delta_nsec) > FRAME_TIMING_TOLERANCE) {
-		debug("[%s] FRAME %" PRIi64 "ns %s: expected %" PRIu64 ", got %" PRIu64 "\n",
-		      output->name,
-		      delta_nsec,
-		      (delta_nsec < 0) ? "EARLY" : "LATE",
-		      timespec_to_nsec(&output->next_frame),
-		      timespec_to_nsec(&event_time));
-	} else {
-		debug("[%s] flip event time at %" PRIu64 " (delta %" PRIi64 "ns)\n",
-		      output->name,
-		      timespec_to_nsec(&event_time),
-		      delta_nsec);
+	if (!output->buffer_pending && output->cursor.commit_pending) {
+		output->cursor.commit_pending = false;
+		return;
 	}
 
-	output->last_frame = event_time;
-
 	/*
 	 * buffer_pending is the buffer we've just committed; this event tells
-	 * us that buffer_pending is now being displayed, which means that
-	 * buffer_last is no longer being displayed and we can reuse it.
+	 * us that it is now being displayed. The scheduler moves our buffers
+	 * along and works out when to repaint next; see schedule.c.
 	 */
+	first_frame = (timespec_to_nsec(&output->last_frame) == 0);
 	assert(output->buffer_pending);
 	assert(output->buffer_pending->in_use);
 
@@ -175,139 +191,742 @@ static void atomic_event_handler(int fd UNUSED,
 			 * time.
 			 */
 			assert(linux_sync_file_is_valid(output->buffer_pending->render_fence_fd));
+			render_done_nsec =
+				linux_sync_file_get_fence_time(output->buffer_pending->render_fence_fd);
 			debug("\trender fence time: %" PRIu64 "ns\n",
-			      linux_sync_file_get_fence_time(output->buffer_pending->render_fence_fd));
+			      render_done_nsec);
 		}
 	}
 
-	if (output->buffer_last) {
-		assert(output->buffer_last->in_use);
-		debug("\treleasing buffer with FB ID %" PRIu32 "\n", output->buffer_last->fb_id);
-		output->buffer_last->in_use = false;
-		output->buffer_last = NULL;
-	}
-	output->buffer_last = output->buffer_pending;
-	output->buffer_pending = NULL;
+	action = output_sched_flip_done(output, &event_time, render_done_nsec,
+					&t.it_value);
+	if (first_frame)
+		output_startup_first_frame(output);
+	if (action != SCHED_ACTION_REPAINT)
+		return;
 
-	/* Next frame time is estimated to be flip event time plus refresh
-	 * interval. This timestamp is also used as the presentation time to drive
-	 * the animation progress when repainting outputs.
+	/*
+	 * We use a timerfd to wake us at the time the scheduler gave us.
+	 * Setting the timer also resets its expiry count, so there is no need
+	 * to read or disarm it when it fires: we watch it edge-triggered, and
+	 * only hear from it again once it expires at the time we set here.
 	 */
-	timespec_add_nsec(&output->next_frame, &event_time, output->refresh_interval_nsec);
-
-	debug("[%s] predicting presentation at %" PRIu64 " (%" PRIu64 "ns / %" PRIu64 "ms away)\n",
-	      output->name, timespec_to_nsec(&output->next_frame),
-	      timespec_sub_to_nsec(&output->next_frame, &event_time),
-	      timespec_sub_to_msec(&output->next_frame, &event_time));
-
-	/* If our driver supports MONOTONIC clock based timestamps, schedule the
-	 * repaint to happen shortly before the next frame will be scanned out.  We
-	 * are using timer_fd for that, and set its time relative to the next
-	 * frame's presentation time. We are taking some leeway into account, so
-	 * the frame rendering can actually make the deadline. This technique allows
-	 * a frame to be rendered closely to its presentation time while minimizing
-	 * latency. However, there's the risk that we won't meet the deadline if
-	 * the given leeway is too short.
-	 *
-	 * If the driver doesn't support MONOTONIC timestamps, simply use an
-	 * absolute time that is far in the past so the repaint event will be
-	 * scheduled as soon as possible. */
-	struct itimerspec t = { .it_interval = { 0, 0 }, .it_value = { 0, 1 } };
-	if (device->monotonic_timestamps)
-	{
-		timespec_add_nsec(&t.it_value, &output->next_frame, -RENDER_LEEWAY_NSEC);
-		debug("[%s] scheduling re-paint at %" PRIu64 " (%" PRIu64 "ns / %" PRIu64 "ms away)\n",
-			  output->name, timespec_to_nsec(&t.it_value),
-			  timespec_sub_to_nsec(&t.it_value, &event_time),
-			  timespec_sub_to_msec(&t.it_value, &event_time));
-	} else {
-		debug("[%s] scheduling re-paint to happen immediately\n",
-				output->name);
-	}
-
-	int ret = timerfd_settime(output->repaint_timer_fd, TFD_TIMER_ABSTIME, &t, NULL);
+	ret = timerfd_settime(output->repaint_timer_fd, TFD_TIMER_ABSTIME, &t, NULL);
 	if (ret < 0)
 		error("failed to set timerfd time: %s\n", strerror(errno));
+	else
+		output->repaint_armed = true;
 }
 
-static void repaint_one_output(struct output *output, drmModeAtomicReqPtr req,
-			       const struct timespec *anim_start,
-			       bool *needs_modeset)
+/*
+ * Works out where in our animation the next frame for this output should
+ * be, and renders it, either here or on the output's render thread.
+ */
+static void repaint_one_output(struct output *output,
+			       const struct timespec *anim_start)
 {
-	struct timespec now;
-	struct buffer *buffer;
+	struct timespec target;
 	float anim_progress = 0;
+	bool first_frame;
 
-	/*
-	 * Find a free buffer we can use to render into
-	 */
-	buffer = find_free_buffer(output);
-	assert(buffer);
-
-	if (timespec_to_nsec(&output->last_frame) == 0UL)
+	first_frame = (timespec_to_nsec(&output->last_frame) == 0UL);
+	if (first_frame)
 	{
-		/*
-		 * If this output hasn't been painted before, then we need to set
-		 * ALLOW_MODESET so we can get our first buffer on screen; if we
-		 * have already presented to this output, then we don't need to since
-		 * our configuration is similar enough.
-		 */
-		*needs_modeset = true;
 		debug("[%s] scheduling first frame\n", output->name);
 	} else {
 		/*
-		 * Use the next frame's presentation time to determine
-		 * the progress of the animation loop, and then render the content for
-		 * that position. Since this calculation is based on absolute timing
-		 * it will naturally catch up with dropped frames.
+		 * Use the presentation time of the frame we are about to
+		 * render to determine the progress of the animation loop, and
+		 * then render the content for that position. Since this
+		 * calculation is based on absolute timing it will naturally
+		 * catch up with dropped frames.
 		 */
-		int64_t abs_delta_nsec = timespec_sub_to_nsec(&output->next_frame, anim_start);
+		output_sched_predict_frame(output, &target);
+		int64_t abs_delta_nsec = timespec_sub_to_nsec(&target, anim_start);
 		int64_t rel_delta_nsec = abs_delta_nsec % ANIMATION_LOOP_DURATION_NSEC;
 		anim_progress = (float)rel_delta_nsec / ANIMATION_LOOP_DURATION_NSEC;
+
+		/* Scrolling follows the same clock; see scroll.c. */
+		output_scroll_set_time(output, abs_delta_nsec);
+	}
+
+	if (output->idle.enabled)
+		anim_progress = IDLE_ANIM_PROGRESS;
+	output->idle.invalidated = false;
+	output->idle.frame_woke = output->idle.woke;
+	output->idle.woke = false;
+
+	/* Hand this frame whatever input we have applied to the scene. */
+	output->input.frame_offset_y = output->input.offset_y;
+	output->input.frame_usec = output->input.pending_usec;
+	output->input.pending_usec = 0;
+
+	/* ... and any new buffers for our layers to show. */
+	output_layers_latch(output);
+
+	/* ... and the colour transform; see colour.c. */
+	output_colour_latch(output);
+
+	if (output->render.threaded)
+		output_render_thread_kick(output, anim_progress, first_frame);
+	else
+		output_render_frame(output, anim_progress, first_frame);
+	output->needs_repaint = false;
+}
+
+/*
+ * Tries to flip the buffer onto the output asynchronously, in a commit of
+ * its own; see output_async_flip_possible(). If the driver rejects it, we
+ * stop trying for this output, and flip on vblank from then on.
+ */
+static bool commit_async_flip(struct output *output, struct buffer *buffer,
+			      struct atomic_req *req)
+{
+	int ret;
+
+	if (!output_async_flip_possible(output, buffer))
+		return false;
+
+	atomic_req_reset(req);
+	output_add_async_atomic_req(output, req, buffer);
+	ret = atomic_commit_async(output->device, req);
+	if (ret == -EINVAL) {
+		printf("[%s] driver rejected async flip; flipping on vblank from now on\n",
+		       output->name);
+		output->async_flip.enabled = false;
+	}
+	if (ret != 0)
+		return false;
+
+	/*
+	 * This commit has no out-fence, so make sure we don't release the
+	 * last buffer on an old one; the flip event will do it instead.
+	 */
+	if (output->commit_fence_fd >= 0)
+		close(output->commit_fence_fd);
+	output->commit_fence_fd = -1;
+
+	buffer->frame.async_flip = true;
+	return true;
+}
+
+/*
+ * Commits the oldest frame queued for the output: asynchronously, straight
+ * away, if we can, or else by adding it to the device's request for the
+ * next vblank. Returns true in the latter case. KMS only takes one commit
+ * per CRTC at a time, so we only do this once the previous commit has
+ * completed.
+ */
+static bool commit_one_output(struct output *output, struct atomic_req *req,
+			      struct atomic_req *async_req,
+			      bool *needs_modeset)
+{
+	struct buffer *buffer = output_queue_pop(output);
+
+	assert(buffer);
+	assert(!output->buffer_pending);
+
+	if (commit_async_flip(output, buffer, async_req)) {
+		output->buffer_pending = buffer;
+		return false;
 	}
 
-	buffer_fill(buffer, anim_progress);
+	/*
+	 * If this output hasn't been painted before, then we need to set
+	 * ALLOW_MODESET so we can get our first buffer on screen; if we
+	 * have already presented to this output, then we don't need to since
+	 * our configuration is similar enough.
+	 */
+	if (timespec_to_nsec(&output->last_frame) == 0UL)
+		*needs_modeset = true;
 
 	/* Add the output's new state to the atomic modesetting request. */
-	output_add_atomic_req(output, req, buffer);
-	buffer->in_use = true;
+	output_add_atomic_req(output, req, buffer, false);
+	output->atomic.in_req = true;
 	output->buffer_pending = buffer;
-	output->needs_repaint = false;
+	return true;
+}
 
+/*
+ * Whether to move the pointer with a commit of its own, for an output with
+ * no frame to commit. The CRTC only takes one commit at a time, so we wait
+ * for any commit still in flight, which the pointer's next position then
+ * goes out after; this takes in all the motion in between, so the pointer
+ * moves at most once a vblank. We also leave the pointer to the next
+ * frame's commit if that looks like it's going out at the next vblank, as
+ * our commit would hold it back until the one after.
+ */
+static bool cursor_commit_wanted(struct output *output)
+{
+	int64_t interval = output->refresh_interval_nsec;
+	int64_t last = timespec_to_nsec(&output->last_frame);
+	int64_t now_nsec, next_vblank;
+	struct timespec now;
+
+	if (!output->cursor.plane || output->cursor.commit_pending ||
+	    output->buffer_pending || output_queue_len(output) > 0 ||
+	    __atomic_load_n(&output->atomic.full_state, __ATOMIC_ACQUIRE) ||
+	    !output_cursor_moved(output))
+		return false;
+
+	/* With no frame on its way, there's nothing to get in the way of. */
+	if (!output->needs_repaint && !output->repaint_armed &&
+	    !output_render_busy(output))
+		return true;
+
+	if (!output->device->monotonic_timestamps || interval <= 0 || last == 0)
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_nsec = timespec_to_nsec(&now);
+	next_vblank = last + interval;
+	if (now_nsec > last)
+		next_vblank = last + ((now_nsec - last) / interval + 1) * interval;
+
+	return (int64_t) timespec_to_nsec(&output->next_frame) >
+	       next_vblank + interval / 2;
 }
 
-static bool shall_exit = false;
+static volatile sig_atomic_t shall_exit = false;
+static volatile sig_atomic_t shall_dump_stats = false;
 
 static void sighandler(int signo)
 {
 	if (signo == SIGINT)
 		shall_exit = true;
+	else if (signo == SIGUSR1)
+		shall_dump_stats = true;
 	return;
 }
 
-int main(int argc UNUSED, char *argv[] UNUSED)
+/*
+ * Takes the input which has queued up since we last looked, and applies it
+ * to our scene: the arrow keys and scrolling move the square up and down,
+ * - and = dim and brighten the screen, and Escape quits. The pointer moves
+ * on each output's cursor plane (see cursor.c), or moves the square on
+ * outputs without one.
+ *
+ * Outputs which are waiting on their repaint timer or a commit will pick
+ * the changes up in their next frame anyway. An output with nothing to do,
+ * including one which has gone idle (see output_sched_wake()), renders straight
+ * away, so the input is shown as soon as possible rather than whenever
+ * something else happens to repaint it. Moving the pointer on its plane
+ * doesn't need a frame at all, so on its own it doesn't repaint anything.
+ */
+static void latch_input(struct output **outputs, int num_outputs,
+			struct input *input)
+{
+	struct input_event ev;
+	uint64_t oldest_usec = 0;
+	int key_steps = 0;
+	int brightness_steps = 0;
+	double pixels = 0.0;
+	double pointer_dx = 0.0, pointer_dy = 0.0;
+	bool scene_input = false;
+
+	while (input_pop_event(input, &ev)) {
+		switch (ev.type) {
+		case INPUT_EVENT_KEY:
+			if (!ev.pressed)
+				continue;
+			if (ev.key == KEY_ESC)
+				shall_exit = true;
+			else if (ev.key == KEY_UP)
+				key_steps--;
+			else if (ev.key == KEY_DOWN)
+				key_steps++;
+			else if (ev.key == KEY_MINUS)
+				brightness_steps--;
+			else if (ev.key == KEY_EQUAL)
+				brightness_steps++;
+			else
+				continue;
+			scene_input = true;
+			break;
+		case INPUT_EVENT_MOTION:
+			pointer_dx += ev.dx;
+			pointer_dy += ev.dy;
+			break;
+		case INPUT_EVENT_SCROLL:
+			pixels += ev.dy;
+			scene_input = true;
+			break;
+		}
+
+		if (oldest_usec == 0)
+			oldest_usec = ev.time_usec;
+	}
+
+	if (oldest_usec == 0)
+		return;
+
+	for (int i = 0; i < num_outputs; i++) {
+		struct output *output = outputs[i];
+		int32_t limit = output->mode.vdisplay / 2;
+		int32_t offset = output->input.offset_y;
+		double square_pixels = pixels;
+
+		if (output->cursor.plane) {
+			output_cursor_move(output, pointer_dx, pointer_dy);
+			if (!scene_input)
+				continue;
+		} else {
+			square_pixels += pointer_dy;
+		}
+
+		/* Each key press moves the square a twentieth of the way. */
+		offset += key_steps * (int32_t) (output->mode.vdisplay / 20);
+		offset += (int32_t) square_pixels;
+		if (offset < -limit)
+			offset = -limit;
+		if (offset > limit)
+			offset = limit;
+		output->input.offset_y = offset;
+
+		/* Each brightness key press steps a tenth of the way. */
+		if (brightness_steps != 0) {
+			double brightness = output->colour.brightness_pending;
+
+			if (brightness == 0.0)
+				brightness = output->colour.brightness;
+			output_colour_set_brightness(output,
+						     brightness + brightness_steps * 0.1);
+		}
+
+		if (output->input.pending_usec == 0)
+			output->input.pending_usec = oldest_usec;
+
+		output->idle.invalidated = true;
+		if (output->idle.idle) {
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			output_sched_wake(output, &now);
+		}
+		else if (!output->repaint_armed && !output->needs_repaint &&
+		    !output->buffer_pending && output_queue_len(output) == 0 &&
+		    !output_render_busy(output) &&
+		    timespec_to_nsec(&output->last_frame) != 0)
+			output->needs_repaint = true;
+	}
+}
+
+/*
+ * When the user switches VT away from us, logind pauses our DRM devices, and
+ * we stop rendering and committing to their outputs while keeping all our
+ * buffers, contexts and programs; on the way back, it resumes them, and the
+ * next commit for each output puts everything back with a single modeset.
+ * See logind.c and device_pause().
+ *
+ * We resume an output by treating its next frame as its first: the commit
+ * gets ALLOW_MODESET (see commit_one_output()), and its flip doesn't feed
+ * the scheduler or buffer pool our long absence as a missed deadline. A
+ * frame we rendered ahead before pausing goes out first; otherwise we
+ * render a new one straight away.
+ */
+static struct {
+	struct device **devices; /* also used to find hotplugged devices */
+	int num_devices;
+	struct input *input;
+} session_state;
+
+static bool session_paused(void)
+{
+	for (int d = 0; d < session_state.num_devices; d++) {
+		if (session_state.devices[d]->paused)
+			return true;
+	}
+
+	return false;
+}
+
+static void output_resume(struct output *output)
+{
+	output->last_frame = (struct timespec) { 0 };
+	output->idle.idle = false;
+	output->idle.invalidated = true;
+	output_resume_begin(output);
+
+	if (output_queue_len(output) == 0 && !output->buffer_pending &&
+	    !output_render_busy(output))
+		output->needs_repaint = true;
+}
+
+static void session_pause_cb(void *data UNUSED, dev_t devnum)
+{
+	struct device *device = devices_find(session_state.devices,
+					     session_state.num_devices, devnum);
+	bool was_paused = session_paused();
+
+	if (!device)
+		return;
+
+	device_pause(device);
+	if (!was_paused && session_state.input)
+		input_suspend(session_state.input);
+}
+
+static void session_resume_cb(void *data UNUSED, dev_t devnum)
+{
+	struct device *device = devices_find(session_state.devices,
+					     session_state.num_devices, devnum);
+
+	if (!device || !device_resume(device))
+		return;
+
+	for (int i = 0; i < device->num_outputs; i++)
+		output_resume(device->outputs[i]);
+	if (!session_paused() && session_state.input)
+		input_resume(session_state.input);
+}
+
+static const struct logind_listener session_listener = {
+	.pause = session_pause_cb,
+	.resume = session_resume_cb,
+};
+
+/*
+ * We can lose master before logind tells us we have been paused, in which
+ * case the commit we've just tried fails. We drop the frames it carried,
+ * and pause the device ourselves until logind resumes it.
+ */
+static void commit_lost_master(struct device *device)
+{
+	for (int i = 0; i < device->num_outputs; i++) {
+		struct output *output = device->outputs[i];
+
+		if (!output->atomic.in_req)
+			continue;
+
+		output->atomic.in_req = false;
+		output->cursor.commit_pending = false;
+		if (output->buffer_pending)
+			output_pool_release(output, output->buffer_pending);
+		output->buffer_pending = NULL;
+	}
+
+	device_pause(device);
+}
+
+static void dump_stats(struct output **outputs, int num_outputs)
 {
+	for (int i = 0; i < num_outputs; i++)
+		output_telemetry_dump(outputs[i], stdout);
+	fflush(stdout);
+}
+
+static drmEventContext kms_evctx = {
+	.version = 3,
+	.page_flip_handler2 = atomic_event_handler,
+};
+
+/*
+ * Our event loop's callbacks, one for each kind of FD we watch; see
+ * event-loop.c. None of them do any rendering or committing themselves:
+ * they only note what needs doing, which we do at the top of our main loop
+ * once every ready source has been dispatched.
+ */
+
+/*
+ * An output's repaint timer has fired, so we mark it to get repainted. The
+ * timer is edge-triggered, so we don't need to read or disarm it; see
+ * atomic_event_handler().
+ */
+static int repaint_timer_cb(int fd UNUSED, uint32_t events UNUSED, void *data)
+{
+	struct output *output = data;
+
+	output->needs_repaint = true;
+	output->repaint_armed = false;
+	return 0;
+}
+
+/* The KMS master FD was signaled. Handle any pending DRM events. */
+static int kms_cb(int fd, uint32_t events UNUSED, void *data UNUSED)
+{
+	int ret = drmHandleEvent(fd, &kms_evctx);
+
+	if (ret == -1) {
+		fprintf(stderr, "error reading KMS events: %d\n", ret);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* A render thread has finished a frame; see render.c. */
+static int render_event_cb(int fd, uint32_t events UNUSED, void *data UNUSED)
+{
+	uint64_t frames;
+
+	if (read(fd, &frames, sizeof(frames)) < 0 && errno != EAGAIN)
+		error("failed to read render eventfd: %s\n", strerror(errno));
+	return 0;
+}
+
+/*
+ * udev has told us about a monitor being plugged in or unplugged, which we
+ * note for the main loop to deal with; see outputs_hotplug(). If several
+ * connectors on a device change before it gets to them, it looks at all of
+ * them.
+ */
+static int hotplug_cb(int fd UNUSED, uint32_t events UNUSED, void *data)
+{
+	struct hotplug *hotplug = data;
 	struct device *device;
+	uint32_t connector_id;
+	dev_t devnum;
+
+	if (!hotplug_read(hotplug, &devnum, &connector_id))
+		return 0;
+
+	device = devices_find(session_state.devices, session_state.num_devices,
+			      devnum);
+	if (!device || !device->res)
+		return 0;
+
+	if (device->hotplug.pending &&
+	    device->hotplug.connector_id != connector_id)
+		connector_id = 0;
+	device->hotplug.pending = true;
+	device->hotplug.connector_id = connector_id;
+	return 0;
+}
+
+/* libinput has events for us, which we queue up until we next repaint. */
+static int input_cb(int fd UNUSED, uint32_t events UNUSED, void *data)
+{
+	struct input *input = data;
+
+	input_dispatch(input);
+	return 0;
+}
+
+static int logind_cb(int fd UNUSED, uint32_t events UNUSED, void *data)
+{
+	struct logind *session = data;
+
+	int ret = logind_dispatch(session);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Setting up an output's EGL context, compiling its shaders, and allocating
+ * and testing its first buffer mostly means waiting on the driver, so we do
+ * it for every output at once, on threads of their own. Each leaves its
+ * context free when it is done, for the main thread or the output's render
+ * thread to take.
+ */
+struct output_setup_job {
+	struct output *output;
+	int ret;
+	bool threaded;
+	pthread_t thread;
+};
+
+static void *output_setup_thread(void *data)
+{
+	struct output_setup_job *job = data;
+	struct output *output = job->output;
+	struct device *device = output->device;
+
+	job->ret = 0;
+	if (device->gbm_device && !output_egl_setup(output)) {
+		fprintf(stderr, "Couldn't set up EGL for output %s\n",
+			output->name);
+		job->ret = 2;
+	} else if (!output_pool_init(output)) {
+		job->ret = 3;
+	}
+
+	if (device->egl_dpy && job->threaded) {
+		eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			       EGL_NO_CONTEXT);
+		eglReleaseThread();
+	}
+
+	return NULL;
+}
+
+/*
+ * Most of what we do is per output, whichever device it is on, so we keep a
+ * list of every output across all our devices; hotplug rebuilds it.
+ */
+static struct output **outputs_collect(struct device **devices,
+				       int num_devices, int *num_outputs)
+{
+	struct output **ret;
+	int count = 0;
+
+	for (int d = 0; d < num_devices; d++)
+		count += devices[d]->num_outputs;
+	ret = calloc(count > 0 ? count : 1, sizeof(*ret));
+	assert(ret);
+
+	count = 0;
+	for (int d = 0; d < num_devices; d++) {
+		for (int i = 0; i < devices[d]->num_outputs; i++)
+			ret[count++] = devices[d]->outputs[i];
+	}
+
+	*num_outputs = count;
+	return ret;
+}
+
+/*
+ * Once an output's EGL and buffers are set up, it gets its layers, and a
+ * timer to schedule repainting, which our event loop watches.
+ */
+static bool output_start(struct output *output, struct event_loop *loop)
+{
+	/*
+	 * Static and animated content above the main scene, and the pointer
+	 * above that, which gets its plane first.
+	 */
+	output_cursor_init(output);
+	output_layers_init(output);
+
+	output->repaint_source =
+		event_loop_add_fd(loop, output->repaint_timer_fd,
+				  EPOLLIN | EPOLLET, repaint_timer_cb, output);
+	return output->repaint_source != NULL;
+}
+
+/* Stops everything which might still use an output we are removing. */
+static void output_stop(struct output *output)
+{
+	output_render_thread_stop(output);
+	if (output->repaint_source)
+		event_source_remove(output->repaint_source);
+	output->repaint_source = NULL;
+}
+
+/*
+ * Sets up an output for a monitor which has just been plugged in, just as
+ * we set up outputs at startup, but on its own. Its first commit carries
+ * ALLOW_MODESET, as every output's does, which only modesets the outputs
+ * whose routing it changes; the others carry on at their own pace.
+ */
+static bool output_hotplug_start(struct output *output,
+				 struct event_loop *loop,
+				 unsigned int render_ahead, bool idle)
+{
+	struct output_setup_job job = { .output = output };
+
+	output->render_ahead = render_ahead;
+	output->idle.enabled = idle;
+	output_setup_thread(&job);
+	if (job.ret != 0 || !output_start(output, loop))
+		return false;
+
+	return output->device->render_event_fd < 0 ||
+	       output_render_thread_start(output);
+}
+
+/*
+ * Adds and removes outputs for whichever connectors hotplug events have told
+ * us have changed; see hotplug_cb(). Devices which are paused wait until
+ * they are resumed, as the connectors are someone else's until then.
+ * Returns true if any outputs came or went.
+ */
+static bool outputs_hotplug(struct device **devices, int num_devices,
+			    struct event_loop *loop,
+			    unsigned int render_ahead, bool idle)
+{
+	bool changed = false;
+
+	for (int d = 0; d < num_devices; d++) {
+		struct device *device = devices[d];
+		uint32_t only = device->hotplug.connector_id;
+
+		if (!device->hotplug.pending || device->paused)
+			continue;
+		device->hotplug.pending = false;
+
+		for (int c = 0; c < device->res->count_connectors; c++) {
+			uint32_t connector_id = device->res->connectors[c];
+			struct output *output;
+
+			if (only != 0 && connector_id != only)
+				continue;
+
+			switch (device_connector_rescan(device, connector_id,
+							&output)) {
+			case CONNECTOR_ADDED:
+				changed = true;
+				if (output_hotplug_start(output, loop,
+							 render_ahead, idle))
+					break;
+				fprintf(stderr, "couldn't set up output %s\n",
+					output->name);
+				/* fallthrough */
+			case CONNECTOR_REMOVED:
+				changed = true;
+				output_stop(output);
+				device_output_remove(device, output);
+				break;
+			case CONNECTOR_UNCHANGED:
+				break;
+			}
+		}
+	}
+
+	return changed;
+}
+
+int main(int argc, char *argv[])
+{
+	struct hotplug *hotplug = NULL;
+	struct output_setup_job *jobs;
+	struct device **devices;
+	struct output **outputs = NULL;
+	struct logind *session;
+	int num_devices;
+	int num_outputs = 0;
 	struct input *input;
+	struct event_loop *loop = NULL;
 	int ret = 0;
 	struct timespec anim_start;
+	unsigned int render_ahead = render_ahead_from_env();
+	bool late_latch = getenv("KMS_LATE_LATCH") != NULL;
+	bool idle = getenv("KMS_IDLE") != NULL;
+
+	/*
+	 * The benchmark mode renders a fixed number of frames as fast as it
+	 * can, rather than running our usual display loop; see benchmark.c.
+	 */
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+		return benchmark_run(argc, argv);
+
+	/* ... and the scheduler simulation has no display at all. */
+	if (argc > 1 && strcmp(argv[1], "--sim-schedule") == 0)
+		return sched_sim_run(argc, argv);
+
+	startup_begin();
 
 	struct sigaction sa;
 	sa.sa_handler = sighandler;
 	sigemptyset(&sa.sa_mask);
 	sigaction(SIGINT, &sa, NULL);
+	/* SIGUSR1 dumps the frame-timing statistics for every output. */
+	sigaction(SIGUSR1, &sa, NULL);
 
 	/*
-	 * Find a suitable KMS device, and set up our VT.
+	 * Find every KMS device, and set up our VT.
 	 * This will create outputs for every currently-enabled connector.
 	 */
-	device = device_create();
-	if (!device) {
+	devices = devices_create(&num_devices);
+	if (!devices) {
 		fprintf(stderr, "no usable KMS devices!\n");
 		return 1;
 	}
+	session = devices[0]->session;
+	startup_phase("devices probed");
+
+	outputs = outputs_collect(devices, num_devices, &num_outputs);
+
 #if defined(HAVE_INPUT)
-	input = input_create(device->session);
+	input = input_create(session);
 	if (!input) {
 		fprintf(stderr, "failed to create input\n");
 		return 1;
@@ -316,57 +935,121 @@ int main(int argc UNUSED, char *argv[] UNUSED)
 	input = NULL;
 #endif
 
-	/* we poll each output and the KMS master FD */
-	int num_poll_fds = device->num_outputs + 1;
-	struct pollfd * poll_fds = calloc(num_poll_fds, sizeof(*poll_fds));
+	session_state.devices = devices;
+	session_state.num_devices = num_devices;
+	session_state.input = input;
+	if (session)
+		logind_set_listener(session, &session_listener, NULL);
 
 	/*
-	 * Allocate framebuffers to display on all our outputs.
+	 * With $KMS_RENDER_THREADS, each output renders on its own thread,
+	 * which tells us through its device's eventfd whenever it has
+	 * finished a frame; see render.c.
+	 */
+	for (int d = 0; getenv("KMS_RENDER_THREADS") && d < num_devices; d++) {
+		struct device *device = devices[d];
+
+		device->render_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (device->render_event_fd < 0) {
+			fprintf(stderr, "couldn't create render eventfd: %s\n",
+				strerror(errno));
+			ret = 1;
+			goto out;
+		}
+	}
+
+	loop = event_loop_create();
+	if (!loop) {
+		ret = 1;
+		goto out;
+	}
+
+	/*
+	 * Allocate framebuffers to display on all our outputs, setting every
+	 * output up at once; see output_setup_thread().
 	 *
 	 * It is possible to use an EGLSurface here, but we explicitly allocate
 	 * buffers ourselves so we can manage the queue depth.
 	 */
-	for (int i = 0; i < device->num_outputs; i++) {
-		struct output *output = device->outputs[i];
-		int j;
+	jobs = calloc(num_outputs, sizeof(*jobs));
+	assert(jobs);
+	for (int i = 0; i < num_outputs; i++) {
+		outputs[i]->render_ahead = render_ahead;
+		outputs[i]->idle.enabled = idle;
+		jobs[i].output = outputs[i];
+		jobs[i].threaded = num_outputs > 1 &&
+			pthread_create(&jobs[i].thread, NULL,
+				       output_setup_thread, &jobs[i]) == 0;
+	}
+	for (int i = 0; i < num_outputs; i++) {
+		if (jobs[i].threaded)
+			pthread_join(jobs[i].thread, NULL);
+		else
+			output_setup_thread(&jobs[i]);
+		if (jobs[i].ret && !ret)
+			ret = jobs[i].ret;
+	}
+	free(jobs);
+	if (ret)
+		goto out;
+	startup_phase("outputs set up");
 
-		if (device->gbm_device) {
-			ret = output_egl_setup(output);
-			if (!ret) {
-				fprintf(stderr,
-					"Couldn't set up EGL for output %s\n",
-					output->name);
-				ret = 2;
-				goto out;
-			}
+	for (int i = 0; i < num_outputs; i++) {
+		if (!output_start(outputs[i], loop)) {
+			ret = 1;
+			goto out;
 		}
+	}
 
-		for (j = 0; j < BUFFER_QUEUE_DEPTH; j++) {
-			output->buffers[j] = buffer_create(device, output);
-			if (!output->buffers[j]) {
-				ret = 3;
-				goto out;
-			}
-		}
+	/*
+	 * We also watch the KMS master FD of every KMS device for completion
+	 * events, including those with no outputs yet, which hotplug may add
+	 * some to; only a render-only device has none. We also watch the
+	 * render threads' eventfds if we have them, our input devices, our
+	 * logind session's D-Bus connection, and udev for monitors being
+	 * plugged in and unplugged.
+	 */
+	for (int d = 0; d < num_devices; d++) {
+		struct device *device = devices[d];
 
-		/* each output has an individual timer to shedule repainting. We are
-		 * polling each one in our main loop
-		 */
-		poll_fds[i] = (struct pollfd) {
-			.fd = output->repaint_timer_fd,
-			.events = POLLIN,
-		};
+		if ((device->res &&
+		     !event_loop_add_fd(loop, device->kms_fd, EPOLLIN, kms_cb,
+					NULL)) ||
+		    (device->render_event_fd >= 0 &&
+		     !event_loop_add_fd(loop, device->render_event_fd, EPOLLIN,
+					render_event_cb, NULL))) {
+			ret = 1;
+			goto out;
+		}
+	}
+	if ((input &&
+	     !event_loop_add_fd(loop, input_get_fd(input), EPOLLIN,
+				input_cb, input)) ||
+	    (session &&
+	     !event_loop_add_fd(loop, logind_get_fd(session), EPOLLIN,
+				logind_cb, session))) {
+		ret = 1;
+		goto out;
+	}
+	hotplug = hotplug_create();
+	if (hotplug &&
+	    !event_loop_add_fd(loop, hotplug_get_fd(hotplug), EPOLLIN,
+			       hotplug_cb, hotplug)) {
+		ret = 1;
+		goto out;
 	}
 
-	poll_fds[device->num_outputs] = (struct pollfd) {
-		.fd = device->kms_fd,
-		.events = POLLIN,
-	};
-
-	drmEventContext evctx = {
-		.version = 3,
-		.page_flip_handler2 = atomic_event_handler,
-	};
+	/*
+	 * Only start the render threads once every output is set up, and its
+	 * context is no longer current on the thread which set it up.
+	 */
+	for (int i = 0; i < num_outputs; i++) {
+		if (outputs[i]->device->render_event_fd >= 0 &&
+		    !output_render_thread_start(outputs[i])) {
+			ret = 5;
+			goto out;
+		}
+	}
 
 	ret = clock_gettime(CLOCK_MONOTONIC, &anim_start);
 	if (ret < 0)
@@ -374,28 +1057,28 @@ int main(int argc UNUSED, char *argv[] UNUSED)
 		ret = 4;
 		goto out;
 	}
+	startup_phase("main loop ready");
 
 	/* Our main rendering loop, which we spin forever. */
 	while (!shall_exit) {
-		drmModeAtomicReq *req;
-		bool needs_modeset = false;
-		int output_count = 0;
+		int poll_timeout = -1;
 		int ret = 0;
 
 		/*
-		 * Allocate an atomic-modesetting request structure for any
-		 * work we will do in this loop iteration.
-		 *
-		 * Atomic modesetting allows us to group together KMS requests
-		 * for multiple outputs, so this request may contain more than
-		 * one output's repaint data.
+		 * Monitors which have been plugged in or unplugged get their
+		 * outputs added or removed before anything else, leaving
+		 * every other output as it is.
 		 */
-		req = drmModeAtomicAlloc();
-		assert(req);
+		if (outputs_hotplug(devices, num_devices, loop, render_ahead,
+				    idle)) {
+			free(outputs);
+			outputs = outputs_collect(devices, num_devices,
+						  &num_outputs);
+		}
 
 		/*
 		 * See which of our outputs needs repainting, and repaint them
-		 * if any.
+		 * if any, queueing up the frames they render.
 		 *
 		 * On our first run through the loop, all our outputs will
 		 * need repainting, so the request will contain the state for
@@ -405,19 +1088,33 @@ int main(int argc UNUSED, char *argv[] UNUSED)
 		 * of any hardware changes it would need to perform to reach
 		 * the target state.
 		 */
-		for (int i = 0; i < device->num_outputs; i++) {
-			struct output *output = device->outputs[i];
-			if (output->needs_repaint) {
-				/*
-				 * Add this output's new state to the atomic
-				 * request.
-				 */
-				repaint_one_output(output, req, &anim_start, &needs_modeset);
-				output_count++;
+		if (input)
+			latch_input(outputs, num_outputs, input);
+		for (int i = 0; i < num_outputs; i++) {
+			struct output *output = outputs[i];
+			if (!output->needs_repaint || output_render_busy(output) ||
+			    output->device->paused)
+				continue;
+
+			/*
+			 * With $KMS_LATE_LATCH, we also read anything which
+			 * has arrived since we woke up, right before we start
+			 * on each frame, so slow repaints of earlier outputs
+			 * don't leave later ones showing stale input.
+			 */
+			if (input && late_latch) {
+				input_dispatch(input);
+				latch_input(outputs, num_outputs, input);
 			}
+			repaint_one_output(output, &anim_start);
 		}
 
 		/*
+		 * Then add the oldest frame we have rendered for every output
+		 * which isn't still waiting for its last commit to complete.
+		 * Without rendering ahead, that is just the frame we have
+		 * rendered above; each device gets a request of its own.
+		 *
 		 * Committing the atomic request to KMS makes the configuration
 		 * current. As we request non-blocking mode, this function will
 		 * return immediately, and send us events through the DRM FD
@@ -435,88 +1132,180 @@ int main(int argc UNUSED, char *argv[] UNUSED)
 		 * each output individually, rather than having a single buffer
 		 * with the content for every output.
 		 */
-		if (output_count)
-			ret = atomic_commit(device, req, needs_modeset);
-		drmModeAtomicFree(req);
+		for (int d = 0; ret == 0 && d < num_devices; d++) {
+			struct device *device = devices[d];
+			struct atomic_req *req, *async_req;
+			unsigned int heap_allocs;
+			bool needs_modeset = false;
+			int output_count = 0;
+
+			if (device->paused)
+				continue;
+
+			/*
+			 * Atomic modesetting allows us to group together KMS
+			 * requests for multiple outputs, so this request may
+			 * contain more than one output's repaint data. Each
+			 * device takes its own commits, so we fill and commit
+			 * one per device; asynchronous flips each go in a
+			 * request of their own. Both only last until we've
+			 * committed, so they come from the device's frame
+			 * arena, which has long since grown big enough to hold
+			 * them in steady state; see arena.c.
+			 */
+			heap_allocs = device->frame_arena.heap_allocs;
+			req = atomic_req_create(&device->frame_arena);
+			async_req = atomic_req_create(&device->frame_arena);
+
+			for (int i = 0; i < device->num_outputs; i++) {
+				struct output *output = device->outputs[i];
+				if (output_queue_len(output) > 0 &&
+				    !output->buffer_pending &&
+				    !output->cursor.commit_pending &&
+				    commit_one_output(output, req, async_req,
+						      &needs_modeset)) {
+					output_count++;
+				} else if (cursor_commit_wanted(output)) {
+					output_add_cursor_atomic_req(output, req);
+					output->cursor.commit_pending = true;
+					output->atomic.in_req = true;
+					output_count++;
+				}
+			}
+
+			if (output_count)
+				ret = atomic_commit(device, req, needs_modeset);
+			if (ret == -EACCES) {
+				commit_lost_master(device);
+				ret = 0;
+			}
+
+			/*
+			 * Only modesets, which carry our full state, should
+			 * need the arena to grow. If any other commit does,
+			 * something has made steady-state requests bigger
+			 * than we expected. The arena keeps the bigger block
+			 * when it is reset, so release builds only warn, but
+			 * debug builds abort, so it can't go unnoticed.
+			 */
+			if (!needs_modeset &&
+			    device->frame_arena.heap_allocs != heap_allocs) {
+				error("frame arena grew by %u block(s) outside a modeset\n",
+				      device->frame_arena.heap_allocs - heap_allocs);
+#if defined(DEBUG)
+				abort();
+#endif
+			}
+			arena_reset(&device->frame_arena);
+		}
 		if (ret != 0) {
 			fprintf(stderr, "atomic commit failed: %d\n", ret);
 			break;
 		}
 
+		/*
+		 * KMS now has our full state for every output we committed,
+		 * so from here on their commits only need what changes.
+		 */
+		for (int i = 0; i < num_outputs; i++) {
+			struct output *output = outputs[i];
+			if (output->atomic.in_req) {
+				output_atomic_committed(output,
+							output->buffer_pending);
+				output->atomic.in_req = false;
+			}
+		}
+
 		/*
 		 * The out-fence FD from KMS signals when the commit we've just
 		 * made becomes active, at the same time as the event handler
-		 * will fire. We can use this to find when the _previous_
-		 * buffer is free to reuse again.
+		 * will fire. This tells us when the _previous_ buffer is free
+		 * to reuse again, so rather than waiting for the event, we can
+		 * release that buffer straight away: whoever next renders into
+		 * it waits for the fence first, the GPU path on the GPU and
+		 * the dumb path on the CPU.
 		 */
-		for (int i = 0; i < device->num_outputs; i++) {
-			struct output *output = device->outputs[i];
+		for (int i = 0; i < num_outputs; i++) {
+			struct output *output = outputs[i];
 			if (output->explicit_fencing && output->commit_fence_fd >= 0 &&
-			    output->buffer_last) {
+			    output->buffer_last && !output->cursor.commit_pending) {
 				assert(linux_sync_file_is_valid(output->commit_fence_fd));
 				fd_replace(&output->buffer_last->kms_fence_fd,
 					   output->commit_fence_fd);
 				output->commit_fence_fd = -1;
+
+				debug("\treleasing buffer with FB ID %" PRIu32 " on KMS fence\n",
+				      output->buffer_last->fb_id);
+				output_pool_release(output, output->buffer_last);
+				output->buffer_last = NULL;
 			}
 		}
 
 		/*
-		 * Now we have (maybe) repainted some outputs, we go to sleep waiting
-		 * for either output repaint events or completion events from KMS. As
-		 * each output completes, we will receive one event per output (making
-		 * the DRM FD be readable and waking us from poll), which we then
-		 * dispatch through drmHandleEvent into our callback.
+		 * Grow or shrink buffer pools, now we're out of the way; render
+		 * threads do this for their own outputs.
 		 */
-		ret = poll(poll_fds, num_poll_fds, -1);
-		if (ret == -1) {
-			fprintf(stderr, "error polling FDs: %d\n", ret);
-			break;
+		for (int i = 0; i < num_outputs; i++) {
+			if (!outputs[i]->render.threaded)
+				output_pool_maintain(outputs[i]);
 		}
 
-		for (int i = 0; i < num_poll_fds; ++i) {
-			if (!(poll_fds[i].revents & POLLIN))
-				continue;
-
-			if (i < device->num_outputs) {
-				/* For any output repaint event, we mark its output to get
-				 * repainted. The repainting will happen at the top of our main
-				 * loop, immediately after all events from FDs have been
-				 * handled.
-				 */
-				device->outputs[i]->needs_repaint = true;
-
-				/* disarm timer_fd, so subsequent polls won't wake up anymore
-				 * until a new wakeup time is set*/
-				static const struct itimerspec its = {
-					.it_interval = {0, 0},
-					.it_value = {0, 0}
-				};
-				int ret = timerfd_settime(device->outputs[i]->repaint_timer_fd,
-							  TFD_TIMER_ABSTIME, &its, NULL);
-				if (ret < 0)
-				{
-					error("failed set timerfd time: %s\n", strerror(errno));
-					ret = -1;
-					goto out;
-				}
-			} else {
-				/* The KMS master FD was signaled. Handle any pending DRM events */
-				ret = drmHandleEvent(device->kms_fd, &evctx);
-				if (ret == -1) {
-					fprintf(stderr, "error reading KMS events: %d\n", ret);
-					break;
-				}
+		/*
+		 * When rendering ahead, keep each output's queue topped up
+		 * for as long as we have buffers to render into. We only start
+		 * once the first frame is on screen, so we have a flip time
+		 * to predict the rest from.
+		 */
+		for (int i = 0; i < num_outputs; i++) {
+			struct output *output = outputs[i];
+			if (output->render_ahead && output_has_changes(output) &&
+			    !output->device->paused &&
+			    timespec_to_nsec(&output->last_frame) != 0 &&
+			    output_queue_len(output) < output->render_ahead &&
+			    !output_render_busy(output) &&
+			    output_pool_has_buffer(output)) {
+				output->needs_repaint = true;
+				poll_timeout = 0;
 			}
 		}
 
-		if (input)
-			shall_exit = input_was_ESC_key_pressed(input);
+		/*
+		 * Now we have (maybe) repainted some outputs, we go to sleep waiting
+		 * for either output repaint events or completion events from KMS,
+		 * unless we have more frames to render ahead. As
+		 * each output completes, we will receive one event per output (making
+		 * the DRM FD be readable and waking us from epoll), which we then
+		 * dispatch through drmHandleEvent into our callback.
+		 */
+		ret = event_loop_dispatch(loop, poll_timeout);
+		if (shall_dump_stats) {
+			shall_dump_stats = false;
+			dump_stats(outputs, num_outputs);
+		}
+		/* Interrupted by one of our signal handlers. */
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0) {
+			fprintf(stderr, "error handling events: %s\n",
+				strerror(-ret));
+			break;
+		}
 	}
 
+	dump_stats(outputs, num_outputs);
+
 out:
+	if (loop)
+		event_loop_destroy(loop);
 	if (input)
 	    input_destroy(input);
-	device_destroy(device);
+	if (hotplug)
+		hotplug_destroy(hotplug);
+	for (int i = 0; i < num_outputs; i++)
+		output_render_thread_stop(outputs[i]);
+	free(outputs);
+	devices_destroy(devices, num_devices);
+	fill_fini();
 	fprintf(stdout, "good-bye\n");
 	return ret;
 }
@@ -0,0 +1,343 @@
+/*
+ * This file implements each output's buffer pool: the set of full-screen
+ * buffers we render into and hand to KMS.
+ *
+ * Each buffer is as large as the output's mode, so with several 4K outputs
+ * every extra one is a noticeable amount of memory. How many we actually
+ * need depends on how we are running. With explicit fencing, a buffer comes
+ * back to us as soon as we have committed the one replacing it, so two are
+ * enough to render one frame while another is on screen; rendering ahead
+ * needs one more for every frame we queue. When we start missing deadlines,
+ * a spare buffer means a late flip never holds up the next frame.
+ *
+ * So rather than allocating a fixed number up front, we start with a single
+ * buffer, so the first frame isn't held up allocating the rest, fill up to
+ * the fewest we can run with once it is on screen, and grow the pool whenever we run out or
+ * miss a deadline, up to a limit. Once we have been keeping up comfortably
+ * for a while, we retire idle buffers again, one at a time. Retired buffers
+ * are kept aside for a while rather than destroyed, so if we need to grow
+ * again soon we can reuse their GBM BO (or dumb buffer) and framebuffer
+ * rather than allocating new ones; only once things have stayed calm for
+ * longer still do we free them.
+ *
+ * When outputs render on threads of their own (see render.c), buffers are
+ * taken from the pool on the render thread and given back on the main
+ * thread, so the pool has a lock; it is only ever held briefly.
+ *
+ * $KMS_BUFFERS_MIN and $KMS_BUFFERS_MAX override the limits; setting both
+ * to the same value gives a fixed-size pool. The pool's size and memory
+ * footprint are reported along with the rest of our statistics.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+/* The fewest buffers we can run with: one on screen, one to render into. */
+#define POOL_MIN_BUFFERS 2
+
+/* Retire an idle buffer after this many frames without a missed deadline. */
+#define POOL_SHRINK_FRAMES 300
+
+/* Free retired buffers once we've been keeping up for this many frames. */
+#define POOL_SPARE_FRAMES 1200
+
+static unsigned int pool_limit_from_env(const char *name, unsigned int def)
+{
+	const char *env = getenv(name);
+	unsigned long val;
+
+	if (!env)
+		return def;
+
+	val = strtoul(env, NULL, 10);
+	if (val < POOL_MIN_BUFFERS || val > BUFFER_QUEUE_MAX) {
+		fprintf(stderr, "%s=%s out of range (%d-%d); using %u\n",
+			name, env, POOL_MIN_BUFFERS, BUFFER_QUEUE_MAX, def);
+		return def;
+	}
+
+	return val;
+}
+
+static uint64_t buffer_bytes(const struct buffer *buffer)
+{
+	uint64_t ret = 0;
+
+	if (buffer->dumb.mem)
+		return buffer->dumb.size;
+
+	for (int i = 0; i < 4 && buffer->gem_handles[i]; i++)
+		ret += (uint64_t) buffer->pitches[i] * buffer->height;
+
+	return ret;
+}
+
+/*
+ * Adds a buffer to the pool, reusing a retired one if we have any. Retired
+ * buffers have missed every change since they were retired, so their age is
+ * 0 and damage tracking repaints them in full.
+ */
+static struct buffer *pool_grow(struct output *output)
+{
+	struct buffer *buffer;
+
+	assert(output->num_buffers < output->pool.max_buffers);
+
+	if (output->pool.num_spares > 0) {
+		buffer = output->pool.spares[--output->pool.num_spares];
+		debug("[%s] recycling buffer with FB ID %" PRIu32 "\n",
+		      output->name, buffer->fb_id);
+	} else {
+		buffer = buffer_create(output->device, output);
+		if (!buffer) {
+			error("[%s] couldn't grow buffer pool\n", output->name);
+			/* don't keep trying every frame */
+			output->pool.max_buffers = output->num_buffers;
+			return NULL;
+		}
+	}
+
+	output->buffers[output->num_buffers++] = buffer;
+	debug("[%s] buffer pool grown to %u\n", output->name,
+	      output->num_buffers);
+
+	return buffer;
+}
+
+/* Takes an idle buffer out of the pool, keeping it aside for reuse. */
+static void pool_retire(struct output *output)
+{
+	struct buffer *buffer = NULL;
+	unsigned int i;
+
+	for (i = 0; i < output->num_buffers; i++) {
+		if (!output->buffers[i]->in_use) {
+			buffer = output->buffers[i];
+			break;
+		}
+	}
+	if (!buffer)
+		return;
+
+	output->num_buffers--;
+	memmove(&output->buffers[i], &output->buffers[i + 1],
+		(output->num_buffers - i) * sizeof(output->buffers[0]));
+	output->buffers[output->num_buffers] = NULL;
+
+	buffer->age = 0;
+	region_init(&buffer->damage);
+	output->pool.spares[output->pool.num_spares++] = buffer;
+
+	debug("[%s] buffer pool shrunk to %u\n", output->name,
+	      output->num_buffers);
+}
+
+static void pool_free_spares(struct output *output)
+{
+	for (unsigned int i = 0; i < output->pool.num_spares; i++)
+		buffer_destroy(output->pool.spares[i]);
+	output->pool.num_spares = 0;
+}
+
+/*
+ * Sets up the pool for an output. We need min_buffers to run, with one more
+ * for each of render_ahead frames queued, but only one to show the first
+ * frame, so that is all we allocate here: the rest are allocated after
+ * we've committed a frame, by output_pool_maintain(), or as soon as we run
+ * out, by output_pool_get_buffer().
+ */
+bool output_pool_init(struct output *output)
+{
+	unsigned int min = POOL_MIN_BUFFERS + output->render_ahead;
+	unsigned int max = BUFFER_QUEUE_DEPTH + output->render_ahead;
+	struct buffer *buffer;
+
+	output->pool.min_buffers = pool_limit_from_env("KMS_BUFFERS_MIN", min);
+	output->pool.max_buffers = pool_limit_from_env("KMS_BUFFERS_MAX", max);
+	if (output->pool.max_buffers < output->pool.min_buffers)
+		output->pool.max_buffers = output->pool.min_buffers;
+
+	pthread_mutex_init(&output->pool.lock, NULL);
+	output->pool.initialised = true;
+
+	/*
+	 * Settle on a modifier first; the buffer we tested it with becomes
+	 * the first in the pool. See format.c.
+	 */
+	buffer = output_format_negotiate(output);
+	if (buffer)
+		output->buffers[output->num_buffers++] = buffer;
+	else if (!pool_grow(output))
+		return false;
+
+	return true;
+}
+
+void output_pool_fini(struct output *output)
+{
+	for (unsigned int i = 0; i < output->num_buffers; i++) {
+		if (output->buffers[i])
+			buffer_destroy(output->buffers[i]);
+		output->buffers[i] = NULL;
+	}
+	output->num_buffers = 0;
+	pool_free_spares(output);
+
+	if (output->pool.initialised) {
+		pthread_mutex_destroy(&output->pool.lock);
+		output->pool.initialised = false;
+	}
+}
+
+/*
+ * Takes a buffer we can render into from the pool, growing the pool if they
+ * are all on screen, in flight, or queued; returns NULL if the pool is
+ * already as large as we allow.
+ */
+struct buffer *output_pool_get_buffer(struct output *output)
+{
+	struct buffer *ret = NULL;
+
+	pthread_mutex_lock(&output->pool.lock);
+
+	for (unsigned int i = 0; i < output->num_buffers; i++) {
+		if (!output->buffers[i]->in_use) {
+			ret = output->buffers[i];
+			break;
+		}
+	}
+
+	if (!ret && output->num_buffers < output->pool.max_buffers)
+		ret = pool_grow(output);
+	if (ret)
+		ret->in_use = true;
+
+	pthread_mutex_unlock(&output->pool.lock);
+
+	return ret;
+}
+
+/* Gives a buffer back to the pool, once KMS is done with it. */
+void output_pool_release(struct output *output, struct buffer *buffer)
+{
+	pthread_mutex_lock(&output->pool.lock);
+	assert(buffer->in_use);
+	buffer->in_use = false;
+	pthread_mutex_unlock(&output->pool.lock);
+}
+
+/* Whether output_pool_get_buffer() would give us a buffer right now. */
+bool output_pool_has_buffer(struct output *output)
+{
+	bool ret;
+
+	pthread_mutex_lock(&output->pool.lock);
+
+	ret = output->num_buffers < output->pool.max_buffers;
+	for (unsigned int i = 0; !ret && i < output->num_buffers; i++)
+		ret = !output->buffers[i]->in_use;
+
+	pthread_mutex_unlock(&output->pool.lock);
+
+	return ret;
+}
+
+/*
+ * Called from the KMS event handler for every frame displayed, with whether
+ * or not it missed its deadline. Missing one gets us a spare buffer; keeping
+ * up for long enough lets us give one back.
+ */
+void output_pool_frame_done(struct output *output, bool late)
+{
+	pthread_mutex_lock(&output->pool.lock);
+
+	if (late) {
+		output->pool.calm_frames = 0;
+		if (output->num_buffers < output->pool.max_buffers)
+			output->pool.want_grow = true;
+	} else {
+		output->pool.calm_frames++;
+	}
+
+	pthread_mutex_unlock(&output->pool.lock);
+}
+
+/*
+ * Grows or shrinks the pool as output_pool_frame_done() decided, first
+ * bringing it up to min_buffers if we've only just started. This is
+ * called once we've finished a frame, so allocating a buffer doesn't delay
+ * one: from the main loop after it has made its commits, or from an output's
+ * render thread after it has rendered, as buffers must be created and
+ * destroyed on the thread which has the output's EGL context.
+ */
+void output_pool_maintain(struct output *output)
+{
+	pthread_mutex_lock(&output->pool.lock);
+
+	if (output->num_buffers < output->pool.min_buffers &&
+	    output->num_buffers < output->pool.max_buffers) {
+		pool_grow(output);
+	} else if (output->pool.want_grow) {
+		output->pool.want_grow = false;
+		if (output->num_buffers < output->pool.max_buffers)
+			pool_grow(output);
+	} else if (output->pool.calm_frames >= POOL_SHRINK_FRAMES &&
+		   output->num_buffers > output->pool.min_buffers) {
+		pool_retire(output);
+		output->pool.calm_frames = 0;
+	} else if (output->pool.calm_frames >= POOL_SPARE_FRAMES &&
+		   output->pool.num_spares > 0) {
+		debug("[%s] freeing %u retired buffers\n", output->name,
+		      output->pool.num_spares);
+		pool_free_spares(output);
+	}
+
+	pthread_mutex_unlock(&output->pool.lock);
+}
+
+/* Memory used by the output's buffers, including any retired ones. */
+uint64_t output_pool_bytes(struct output *output)
+{
+	uint64_t ret = 0;
+
+	pthread_mutex_lock(&output->pool.lock);
+
+	for (unsigned int i = 0; i < output->num_buffers; i++)
+		ret += buffer_bytes(output->buffers[i]);
+	for (unsigned int i = 0; i < output->pool.num_spares; i++)
+		ret += buffer_bytes(output->pool.spares[i]);
+
+	pthread_mutex_unlock(&output->pool.lock);
+
+	return ret;
+}
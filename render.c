@@ -0,0 +1,265 @@
+/*
+ * This file implements rendering a frame for an output, and optionally doing
+ * so on a thread of its own for each output.
+ *
+ * By default, the main loop renders every output itself, one after the
+ * other. With several outputs, that means a slow output holds up all the
+ * others, and switching between their EGL contexts costs time of its own.
+ * Setting $KMS_RENDER_THREADS gives each output a render thread, which makes
+ * the output's EGL context current once and keeps it for its lifetime.
+ *
+ * The main thread still decides when each output should render (from its
+ * repaint timer, or as soon as there is room when rendering ahead), works
+ * out the animation progress, and hands the frame to the render thread.
+ * It then goes back to waiting for events, while the render thread fills a
+ * buffer and pushes it onto the output's queue. Pushing a frame doesn't take
+ * any lock: the queue is a ring with a single producer (whoever renders) and
+ * a single consumer (the main loop), so each side only writes its own index.
+ * The render thread then pokes an eventfd to wake the main loop, which
+ * pops whichever frames are ready and commits them, merged into a single
+ * atomic request if several outputs finished at once.
+ *
+ * Only the main thread ever commits to KMS or handles events, and only it
+ * keeps track of what each plane has been committed with. The render
+ * threads do make TEST_ONLY commits to place layers on planes (see
+ * layer.c), but those carry every plane's state in full rather than
+ * working out what changed since the last commit, so they never read the
+ * committed state the main thread is updating; see
+ * output_add_planes_atomic_req() in kms.c. Each output's layers belong to
+ * its render thread while it renders a frame, and to the main thread in
+ * between; see layer.c.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kms-quads.h"
+
+/*
+ * The queue indices only ever increase, and wrap around the ring; the
+ * number of frames in the queue is the difference between them. We can
+ * never have more frames queued than we have buffers, so it never fills.
+ */
+void output_queue_push(struct output *output, struct buffer *buffer)
+{
+	unsigned int tail = output->queue_tail;
+
+	assert(tail - __atomic_load_n(&output->queue_head, __ATOMIC_ACQUIRE) <
+	       BUFFER_QUEUE_MAX);
+	output->queue[tail % BUFFER_QUEUE_MAX] = buffer;
+
+	/* Publish everything we wrote to the buffer along with it. */
+	__atomic_store_n(&output->queue_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+struct buffer *output_queue_pop(struct output *output)
+{
+	unsigned int head = output->queue_head;
+	struct buffer *ret;
+
+	if (head == __atomic_load_n(&output->queue_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	ret = output->queue[head % BUFFER_QUEUE_MAX];
+	__atomic_store_n(&output->queue_head, head + 1, __ATOMIC_RELEASE);
+
+	return ret;
+}
+
+unsigned int output_queue_len(struct output *output)
+{
+	return __atomic_load_n(&output->queue_tail, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&output->queue_head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Renders the frame at the given point in our animation into a free buffer,
+ * and queues it to be committed. If we are rendering ahead, we may have used
+ * every buffer we're allowed, in which case we try again when the next one
+ * is released.
+ */
+void output_render_frame(struct output *output, float anim_progress,
+			 bool first_frame)
+{
+	struct buffer *buffer;
+	struct region repaint;
+
+	buffer = output_pool_get_buffer(output);
+	if (!buffer) {
+		debug("[%s] no free buffer to repaint into\n", output->name);
+		return;
+	}
+
+	buffer_telemetry_begin(buffer);
+	buffer->frame.input = output->input.frame_usec * NSEC_PER_USEC;
+	buffer->frame.after_idle = output->idle.frame_woke;
+
+	/*
+	 * Move our layers into position for this frame, and find out which
+	 * of them we can put on planes; the rest are drawn by the renderer.
+	 */
+	output_layers_update(output, anim_progress);
+	output_assign_planes(output, buffer, first_frame);
+
+	/*
+	 * Only repaint what has changed since this buffer was last used;
+	 * see damage.c.
+	 */
+	output_damage_frame(output, buffer, anim_progress, &repaint);
+	buffer_fill(buffer, anim_progress, &repaint);
+	buffer_telemetry_submitted(buffer);
+
+	/* Queue the frame up to be committed, in order. */
+	output_queue_push(output, buffer);
+}
+
+static void *render_thread(void *data)
+{
+	struct output *output = data;
+	struct device *device = output->device;
+	const uint64_t one = 1;
+	EGLBoolean ret;
+
+	if (device->egl_dpy) {
+		ret = eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE,
+				     EGL_NO_SURFACE, output->egl.ctx);
+		assert(ret);
+	}
+
+	pthread_mutex_lock(&output->render.lock);
+	for (;;) {
+		float anim_progress;
+		bool first_frame;
+
+		while (!output->render.quit && !output->render.requested)
+			pthread_cond_wait(&output->render.cond,
+					  &output->render.lock);
+		if (output->render.quit)
+			break;
+
+		anim_progress = output->render.anim_progress;
+		first_frame = output->render.first_frame;
+		output->render.requested = false;
+		pthread_mutex_unlock(&output->render.lock);
+
+		output_render_frame(output, anim_progress, first_frame);
+		output_pool_maintain(output);
+
+		__atomic_add_fetch(&output->render.frames_done, 1,
+				   __ATOMIC_RELEASE);
+		if (write(device->render_event_fd, &one, sizeof(one)) < 0)
+			error("[%s] couldn't wake main loop: %s\n",
+			      output->name, strerror(errno));
+
+		pthread_mutex_lock(&output->render.lock);
+	}
+	pthread_mutex_unlock(&output->render.lock);
+
+	/* Leave the context free for output_destroy() on the main thread. */
+	if (device->egl_dpy) {
+		eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			       EGL_NO_CONTEXT);
+		eglReleaseThread();
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts the render thread for an output. The output's EGL context, if it
+ * has one, must not be current on the calling thread from here on.
+ */
+bool output_render_thread_start(struct output *output)
+{
+	struct device *device = output->device;
+
+	assert(device->render_event_fd >= 0);
+
+	if (device->egl_dpy)
+		eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			       EGL_NO_CONTEXT);
+
+	pthread_mutex_init(&output->render.lock, NULL);
+	pthread_cond_init(&output->render.cond, NULL);
+
+	if (pthread_create(&output->render.thread, NULL, render_thread,
+			   output) != 0) {
+		error("[%s] couldn't create render thread\n", output->name);
+		pthread_cond_destroy(&output->render.cond);
+		pthread_mutex_destroy(&output->render.lock);
+		return false;
+	}
+
+	output->render.threaded = true;
+	return true;
+}
+
+void output_render_thread_stop(struct output *output)
+{
+	if (!output->render.threaded)
+		return;
+
+	pthread_mutex_lock(&output->render.lock);
+	output->render.quit = true;
+	pthread_cond_signal(&output->render.cond);
+	pthread_mutex_unlock(&output->render.lock);
+
+	pthread_join(output->render.thread, NULL);
+	pthread_cond_destroy(&output->render.cond);
+	pthread_mutex_destroy(&output->render.lock);
+	output->render.threaded = false;
+}
+
+/* Hands a frame to the output's render thread; it must not be busy. */
+void output_render_thread_kick(struct output *output, float anim_progress,
+			       bool first_frame)
+{
+	assert(!output_render_busy(output));
+
+	pthread_mutex_lock(&output->render.lock);
+	output->render.anim_progress = anim_progress;
+	output->render.first_frame = first_frame;
+	output->render.requested = true;
+	output->render.frames_requested++;
+	pthread_cond_signal(&output->render.cond);
+	pthread_mutex_unlock(&output->render.lock);
+}
+
+/* Whether the output's render thread is still working on a frame. */
+bool output_render_busy(struct output *output)
+{
+	if (!output->render.threaded)
+		return false;
+
+	return output->render.frames_requested !=
+	       __atomic_load_n(&output->render.frames_done, __ATOMIC_ACQUIRE);
+}
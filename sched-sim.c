@@ -0,0 +1,557 @@
+/*
+ * This file implements the scheduler simulation, started with
+ * --sim-schedule on the command line.
+ *
+ * Frames which flip EARLY or LATE in the field are hard to reproduce: they
+ * depend on the display's timing and on how long each frame took to render,
+ * neither of which we control on a real device. Here we drive the same
+ * scheduling code the display loop uses, in schedule.c, with a simulated
+ * clock instead: vblanks and render costs come either from a synthetic model
+ * or from a trace recorded with $KMS_TELEMETRY_TRACE (see telemetry.c), and
+ * we play the buffers through the same states as main.c does, from the pool
+ * to the queue to buffer_pending and buffer_last.
+ *
+ * A frame is committed as soon as it has rendered, if nothing else is in
+ * flight, and flips at the first vblank after its commit is in. That is
+ * what the kernel does with explicit fencing, too, where we commit straight
+ * away and KMS waits for the render fence.
+ *
+ * Nothing here touches a device or the real clock, so a run is entirely
+ * repeatable, and takes milliseconds; with --max-miss-rate, it fails if too
+ * many frames missed their deadline, so scheduler changes can be checked
+ * with 'meson test'.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+/* How long before a vblank a commit has to be made to catch it. */
+#define SIM_COMMIT_NSEC (NSEC_PER_MSEC / 10)
+
+/* Simulated time starts here, rather than at 0, which means 'never'. */
+#define SIM_START_NSEC NSEC_PER_SEC
+
+struct sim_options {
+	unsigned int frames;
+	uint32_t refresh_mhz;
+	int64_t render_nsec; /* mean render cost */
+	int64_t render_jitter_nsec; /* ... varying evenly by up to this */
+	int64_t spike_nsec; /* extra cost of every spike_every'th frame */
+	unsigned int spike_every;
+	int64_t vblank_jitter_nsec; /* noise in vblank timestamps */
+	unsigned int render_ahead;
+	unsigned int seed;
+	const char *trace;
+	double max_miss_rate; /* percent, or negative not to check */
+};
+
+struct sim {
+	const struct sim_options *opts;
+	struct device device;
+	struct output *output;
+	struct buffer buffers[BUFFER_QUEUE_MAX];
+
+	int64_t *vblanks;
+	unsigned int num_vblanks;
+	unsigned int next_vblank; /* the first one we haven't passed */
+
+	int64_t *costs; /* render costs, used in turn */
+	unsigned int num_costs;
+	unsigned int next_cost;
+
+	uint32_t rng;
+
+	struct buffer *rendering; /* the frame being rendered, if any */
+	int64_t render_end;
+	bool repaint_armed;
+	int64_t repaint_at;
+	int64_t flip_at; /* when buffer_pending flips */
+
+	unsigned int shown;
+	int64_t *latencies; /* repaint start to flip, per frame shown */
+	unsigned int repeated_vblanks; /* vblanks which showed no new frame */
+	unsigned int half_rate_frames;
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s --sim-schedule [options]\n"
+		"\t--frames=N         show N frames (default 3600, or the\n"
+		"\t                   length of the trace)\n"
+		"\t--refresh=MHZ      refresh rate in mHz (default 60000)\n"
+		"\t--render=US        mean render cost (default 4000)\n"
+		"\t--render-jitter=US render cost varies by up to this\n"
+		"\t                   either way (default 1000)\n"
+		"\t--spike=US,N       every Nth frame costs US more\n"
+		"\t--vblank-jitter=US vblank timestamps vary by up to this\n"
+		"\t--render-ahead=N   queue up to N frames, as\n"
+		"\t                   $KMS_RENDER_AHEAD does\n"
+		"\t--seed=N           seed for the synthetic model\n"
+		"\t--trace=FILE       replay flips and render costs recorded\n"
+		"\t                   with $KMS_TELEMETRY_TRACE\n"
+		"\t--max-miss-rate=P  fail if over P%% of frames are late\n",
+		argv0);
+}
+
+static bool parse_options(int argc, char *argv[], struct sim_options *opts)
+{
+	*opts = (struct sim_options) {
+		.refresh_mhz = 60000,
+		.render_nsec = 4 * NSEC_PER_MSEC,
+		.render_jitter_nsec = NSEC_PER_MSEC,
+		.seed = 1,
+		.max_miss_rate = -1.0,
+	};
+
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		unsigned long us;
+
+		if (strcmp(arg, "--sim-schedule") == 0) {
+			continue;
+		} else if (strncmp(arg, "--frames=", 9) == 0) {
+			opts->frames = strtoul(arg + 9, NULL, 10);
+			if (opts->frames == 0)
+				return false;
+		} else if (strncmp(arg, "--refresh=", 10) == 0) {
+			opts->refresh_mhz = strtoul(arg + 10, NULL, 10);
+			if (opts->refresh_mhz == 0)
+				return false;
+		} else if (strncmp(arg, "--render=", 9) == 0) {
+			opts->render_nsec = strtoul(arg + 9, NULL, 10) *
+					    NSEC_PER_USEC;
+		} else if (strncmp(arg, "--render-jitter=", 16) == 0) {
+			opts->render_jitter_nsec =
+				strtoul(arg + 16, NULL, 10) * NSEC_PER_USEC;
+		} else if (strncmp(arg, "--spike=", 8) == 0) {
+			if (sscanf(arg + 8, "%lu,%u", &us,
+				   &opts->spike_every) != 2 ||
+			    opts->spike_every == 0)
+				return false;
+			opts->spike_nsec = us * NSEC_PER_USEC;
+		} else if (strncmp(arg, "--vblank-jitter=", 16) == 0) {
+			opts->vblank_jitter_nsec =
+				strtoul(arg + 16, NULL, 10) * NSEC_PER_USEC;
+		} else if (strncmp(arg, "--render-ahead=", 15) == 0) {
+			opts->render_ahead = strtoul(arg + 15, NULL, 10);
+			if (opts->render_ahead >
+			    BUFFER_QUEUE_MAX - BUFFER_QUEUE_DEPTH)
+				return false;
+		} else if (strncmp(arg, "--seed=", 7) == 0) {
+			opts->seed = strtoul(arg + 7, NULL, 10);
+		} else if (strncmp(arg, "--trace=", 8) == 0) {
+			opts->trace = arg + 8;
+		} else if (strncmp(arg, "--max-miss-rate=", 16) == 0) {
+			opts->max_miss_rate = strtod(arg + 16, NULL);
+		} else {
+			fprintf(stderr, "unknown simulation option '%s'\n", arg);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* A small deterministic PRNG, so runs repeat exactly; xorshift32. */
+static uint32_t sim_rand(struct sim *sim)
+{
+	uint32_t x = sim->rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sim->rng = x;
+	return x;
+}
+
+/* Returns a value spread evenly from -range to range. */
+static int64_t sim_jitter(struct sim *sim, int64_t range)
+{
+	if (range <= 0)
+		return 0;
+	return (int64_t) (sim_rand(sim) % (uint32_t) (2 * range + 1)) - range;
+}
+
+static void sim_synthesise(struct sim *sim, int64_t interval)
+{
+	const struct sim_options *opts = sim->opts;
+
+	/*
+	 * Missing deadlines can take us down to half rate, so leave plenty
+	 * of vblanks to show every frame in.
+	 */
+	sim->num_vblanks = opts->frames * 4 + 16;
+	sim->vblanks = calloc(sim->num_vblanks, sizeof(*sim->vblanks));
+	assert(sim->vblanks);
+	for (unsigned int i = 0; i < sim->num_vblanks; i++)
+		sim->vblanks[i] = SIM_START_NSEC + (i + 1) * interval +
+				  sim_jitter(sim, opts->vblank_jitter_nsec);
+
+	sim->num_costs = opts->frames;
+	sim->costs = calloc(sim->num_costs, sizeof(*sim->costs));
+	assert(sim->costs);
+	for (unsigned int i = 0; i < sim->num_costs; i++) {
+		int64_t cost = opts->render_nsec +
+			       sim_jitter(sim, opts->render_jitter_nsec);
+
+		if (opts->spike_every && (i + 1) % opts->spike_every == 0)
+			cost += opts->spike_nsec;
+		sim->costs[i] = (cost > 0) ? cost : 1;
+	}
+}
+
+/*
+ * Reads a trace of lines giving the output's name, the flip time and the
+ * render cost, replaying the first output in it. The flips only show us the
+ * vblanks a frame landed on, so we fill in those between, splitting each gap
+ * evenly into refresh intervals, which we take to be the usual gap. That
+ * keeps whatever jitter and drift the real timestamps had.
+ */
+static bool sim_load_trace(struct sim *sim, int64_t *interval)
+{
+	FILE *f = fopen(sim->opts->trace, "r");
+	char first[32] = "", name[32];
+	uint64_t flip, cost;
+	int64_t *flips = NULL, *gaps;
+	unsigned int num_flips = 0, alloc = 0;
+	char line[256];
+
+	if (!f) {
+		error("couldn't open trace %s\n", sim->opts->trace);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%31s %" SCNu64 " %" SCNu64, name, &flip,
+			   &cost) != 3 || flip == 0)
+			continue;
+		if (first[0] == '\0')
+			strcpy(first, name);
+		if (strcmp(name, first) != 0)
+			continue;
+		if (num_flips > 0 && (int64_t) flip <= flips[num_flips - 1])
+			continue;
+
+		if (num_flips == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			flips = realloc(flips, alloc * sizeof(*flips));
+			sim->costs = realloc(sim->costs,
+					     alloc * sizeof(*sim->costs));
+			assert(flips && sim->costs);
+		}
+		flips[num_flips] = flip;
+		sim->costs[num_flips] = (cost > 0) ? (int64_t) cost : 1;
+		num_flips++;
+	}
+	fclose(f);
+
+	if (num_flips < 2) {
+		error("trace %s has too few frames to replay\n",
+		      sim->opts->trace);
+		free(flips);
+		return false;
+	}
+	sim->num_costs = num_flips;
+
+	gaps = calloc(num_flips - 1, sizeof(*gaps));
+	assert(gaps);
+	for (unsigned int i = 0; i < num_flips - 1; i++)
+		gaps[i] = flips[i + 1] - flips[i];
+	*interval = stats_percentile(gaps, num_flips - 1, 50);
+
+	sim->num_vblanks = 0;
+	for (unsigned int i = 0; i < num_flips - 1; i++) {
+		int64_t gap = flips[i + 1] - flips[i];
+		unsigned int n = (gap + *interval / 2) / *interval;
+
+		gaps[i] = (n > 0) ? n : 1;
+		sim->num_vblanks += gaps[i];
+	}
+	sim->num_vblanks++;
+
+	sim->vblanks = calloc(sim->num_vblanks, sizeof(*sim->vblanks));
+	assert(sim->vblanks);
+	sim->num_vblanks = 0;
+	for (unsigned int i = 0; i < num_flips - 1; i++) {
+		int64_t gap = flips[i + 1] - flips[i];
+
+		for (int64_t j = 0; j < gaps[i]; j++)
+			sim->vblanks[sim->num_vblanks++] =
+				flips[i] + gap * j / gaps[i];
+	}
+	sim->vblanks[sim->num_vblanks++] = flips[num_flips - 1];
+
+	printf("replaying %u frames of '%s' from %s, %.3fms refresh interval\n",
+	       num_flips, first, sim->opts->trace,
+	       (double) *interval / NSEC_PER_MSEC);
+
+	free(gaps);
+	free(flips);
+	return true;
+}
+
+/* The first vblank at or after the given time, or -1 past the last one. */
+static int64_t sim_vblank_after(struct sim *sim, int64_t t)
+{
+	while (sim->next_vblank < sim->num_vblanks &&
+	       sim->vblanks[sim->next_vblank] < t)
+		sim->next_vblank++;
+
+	if (sim->next_vblank == sim->num_vblanks)
+		return -1;
+	return sim->vblanks[sim->next_vblank];
+}
+
+static void sim_render_start(struct sim *sim, int64_t now)
+{
+	struct output *output = sim->output;
+	struct buffer *buffer = output_pool_get_buffer(output);
+	int64_t cost = sim->costs[sim->next_cost++ % sim->num_costs];
+
+	assert(buffer);
+	assert(!sim->rendering);
+
+	memset(&buffer->frame, 0, sizeof(buffer->frame));
+	buffer->frame.repaint_start = now;
+	buffer->frame.render_submit = now;
+	buffer->frame.render_done = now + cost;
+
+	sim->rendering = buffer;
+	sim->render_end = now + cost;
+}
+
+/*
+ * Commits the oldest queued frame, if nothing is in flight, as
+ * commit_one_output() does. Returns false if we've run out of vblanks.
+ */
+static bool sim_commit(struct sim *sim, int64_t now)
+{
+	struct output *output = sim->output;
+
+	if (output->buffer_pending || output_queue_len(output) == 0)
+		return true;
+
+	output->buffer_pending = output_queue_pop(output);
+	sim->flip_at = sim_vblank_after(sim, now + SIM_COMMIT_NSEC);
+	return sim->flip_at >= 0;
+}
+
+static void sim_flip(struct sim *sim, int64_t now)
+{
+	struct output *output = sim->output;
+	struct buffer *buffer = output->buffer_pending;
+	int64_t last = timespec_to_nsec(&output->last_frame);
+	struct timespec event_time, repaint_time;
+	enum sched_action action;
+
+	if (last != 0) {
+		unsigned int vblanks = 0;
+
+		for (unsigned int i = sim->next_vblank; i > 0 &&
+		     sim->vblanks[i - 1] > last; i--)
+			vblanks++;
+		sim->repeated_vblanks += vblanks;
+	}
+	if (output->sched.frame_divisor > 1)
+		sim->half_rate_frames++;
+
+	sim->latencies[sim->shown++] =
+		now - (int64_t) buffer->frame.repaint_start;
+
+	timespec_from_nsec(&event_time, now);
+	action = output_sched_flip_done(output, &event_time,
+					buffer->frame.render_done,
+					&repaint_time);
+	if (action == SCHED_ACTION_REPAINT) {
+		sim->repaint_armed = true;
+		sim->repaint_at = timespec_to_nsec(&repaint_time);
+		if (sim->repaint_at < now)
+			sim->repaint_at = now;
+	}
+}
+
+/*
+ * Runs the simulation, one event at a time: a flip, a frame finishing
+ * rendering, or the repaint timer firing, whichever comes first.
+ */
+static void sim_run(struct sim *sim)
+{
+	struct output *output = sim->output;
+	int64_t now = sim->vblanks[0] - output->refresh_interval_nsec;
+
+	/* Our first frame is rendered straight away, as in main.c. */
+	sim->repaint_armed = true;
+	sim->repaint_at = now;
+
+	while (sim->shown < sim->opts->frames) {
+		int64_t next = INT64_MAX;
+
+		if (output->buffer_pending)
+			next = sim->flip_at;
+		if (sim->rendering && sim->render_end < next)
+			next = sim->render_end;
+		if (sim->repaint_armed && sim->repaint_at < next)
+			next = sim->repaint_at;
+		assert(next != INT64_MAX);
+		now = next;
+
+		if (output->buffer_pending && now == sim->flip_at) {
+			sim_flip(sim, now);
+		} else if (sim->rendering && now == sim->render_end) {
+			output_queue_push(output, sim->rendering);
+			sim->rendering = NULL;
+		} else {
+			sim->repaint_armed = false;
+			sim_render_start(sim, now);
+		}
+
+		if (!sim_commit(sim, now)) {
+			printf("ran out of vblanks after %u frames\n",
+			       sim->shown);
+			break;
+		}
+
+		/* See the render-ahead loop in main(). */
+		if (output->render_ahead && !sim->rendering &&
+		    timespec_to_nsec(&output->last_frame) != 0 &&
+		    output_queue_len(output) < output->render_ahead &&
+		    output_pool_has_buffer(output))
+			sim_render_start(sim, now);
+	}
+}
+
+static int sim_report(struct sim *sim)
+{
+	const struct sim_options *opts = sim->opts;
+	struct output *output = sim->output;
+	unsigned int n = sim->shown;
+	/* the first frame has no deadline to miss */
+	double miss_rate = (n > 1) ?
+		100.0 * output->telemetry.missed_frames / (n - 1) : 0.0;
+	int64_t p50, p99, max;
+
+	if (n == 0)
+		return 1;
+
+	/* stats_percentile() sorts the array, so compute these in order. */
+	p50 = stats_percentile(sim->latencies, n, 50);
+	p99 = stats_percentile(sim->latencies, n, 99);
+	max = sim->latencies[n - 1];
+
+	printf("sim: %u frames, %.3fms refresh interval, render ahead %u\n",
+	       n, (double) output->refresh_interval_nsec / NSEC_PER_MSEC,
+	       output->render_ahead);
+	printf("\tmissed deadlines: %" PRIu64 " (%.2f%%)\n",
+	       output->telemetry.missed_frames, miss_rate);
+	printf("\trepaint-to-flip latency: p50 %.3fms, p99 %.3fms, max %.3fms\n",
+	       (double) p50 / NSEC_PER_MSEC, (double) p99 / NSEC_PER_MSEC,
+	       (double) max / NSEC_PER_MSEC);
+	printf("\tvblanks repeating the last frame: %u\n",
+	       sim->repeated_vblanks);
+	printf("\tframes at half rate: %u\n", sim->half_rate_frames);
+
+	if (opts->max_miss_rate >= 0.0 && miss_rate > opts->max_miss_rate) {
+		printf("miss rate %.2f%% is over the limit of %.2f%%\n",
+		       miss_rate, opts->max_miss_rate);
+		return 1;
+	}
+
+	return 0;
+}
+
+int sched_sim_run(int argc, char *argv[])
+{
+	struct sim_options opts;
+	struct sim sim;
+	struct output *output;
+	int64_t interval;
+	int ret;
+
+	if (!parse_options(argc, argv, &opts)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&sim, 0, sizeof(sim));
+	sim.opts = &opts;
+	sim.rng = opts.seed ? opts.seed : 1;
+	interval = millihz_to_nsec(opts.refresh_mhz);
+
+	if (opts.trace) {
+		if (!sim_load_trace(&sim, &interval))
+			return 1;
+		if (opts.frames == 0)
+			opts.frames = sim.num_costs;
+	} else {
+		if (opts.frames == 0)
+			opts.frames = 3600;
+		sim_synthesise(&sim, interval);
+	}
+
+	sim.latencies = calloc(opts.frames, sizeof(*sim.latencies));
+	assert(sim.latencies);
+
+	/* A stand-in output, as the benchmark uses; see benchmark.c. */
+	output = calloc(1, sizeof(*output));
+	assert(output);
+	sim.output = output;
+	sim.device.monotonic_timestamps = true;
+	output->device = &sim.device;
+	snprintf(output->name, sizeof(output->name), "sim");
+	output->refresh_interval_nsec = interval;
+	output->render_ahead = opts.render_ahead;
+	output->commit_fence_fd = -1;
+	output->repaint_timer_fd = -1;
+	output_sched_init(output);
+
+	pthread_mutex_init(&output->pool.lock, NULL);
+	output->num_buffers = BUFFER_QUEUE_DEPTH + opts.render_ahead;
+	output->pool.min_buffers = output->num_buffers;
+	output->pool.max_buffers = output->num_buffers;
+	for (unsigned int i = 0; i < output->num_buffers; i++) {
+		sim.buffers[i].output = output;
+		sim.buffers[i].render_fence_fd = -1;
+		sim.buffers[i].kms_fence_fd = -1;
+		output->buffers[i] = &sim.buffers[i];
+	}
+
+	sim_run(&sim);
+	ret = sim_report(&sim);
+
+	pthread_mutex_destroy(&output->pool.lock);
+	free(output);
+	free(sim.latencies);
+	free(sim.costs);
+	free(sim.vblanks);
+	return ret;
+}
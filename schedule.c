@@ -0,0 +1,432 @@
+/*
+ * This file implements the repaint scheduler, which decides when each output
+ * should start rendering its next frame.
+ *
+ * The simplest approach is to start rendering a fixed amount of time before
+ * the next predicted flip. That works, but the margin is either too large
+ * (fast GPUs sit idle, and the content we display is older than it needs to
+ * be), or too small (slow GPUs miss the deadline, and we drop a frame).
+ *
+ * Instead, we measure how long each frame actually took from the start of the
+ * repaint until the rendering was complete. With explicit fencing, the render
+ * fence timestamp tells us exactly when the GPU finished; without it, we fall
+ * back to measuring how long the CPU took to prepare and commit the frame. We
+ * keep a window of recent samples, and start rendering a high percentile of
+ * that cost (plus a small safety margin) before the deadline.
+ *
+ * If we still miss deadlines repeatedly, or our rendering simply takes longer
+ * than a refresh interval, we halve our frame rate: we then aim for every
+ * second vblank, which gives us twice the time to render. Steady delivery at
+ * half rate looks much better than erratic delivery at full rate. Once our
+ * render cost comfortably fits into a single frame again, we go back to full
+ * rate.
+ *
+ * With variable refresh enabled (see output_vrr_setup() in kms.c), the
+ * display waits for a late frame rather than us missing the vblank outright,
+ * so a frame which runs over costs us only the time it ran over by. There we
+ * never halve the frame rate, and just keep planning for the cost we see.
+ *
+ * Everything that happens when a flip completes lives here too, apart from
+ * talking to KMS and arming the repaint timer, which main.c does: moving
+ * our buffers along, predicting the next flip, and deciding whether and when
+ * to repaint. That lets sched-sim.c drive it all with a simulated clock.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+/* Which percentile of recent render costs we plan for. */
+#define SCHED_COST_PERCENTILE 95
+
+/* Extra time on top of the measured render cost, covering the kernel's own
+ * commit work and any jitter in waking up from our timer. */
+#define SCHED_SAFETY_MARGIN_NSEC (NSEC_PER_MSEC / 2)
+
+/* Never start rendering closer to the deadline than this. */
+#define SCHED_MIN_LEEWAY_NSEC (NSEC_PER_MSEC / 2)
+
+/* Halve the frame rate if this many of the last 32 frames were late. */
+#define SCHED_MISS_LIMIT 4
+
+/* Go back to full rate after this many frames which would have fit. */
+#define SCHED_RECOVER_FRAMES 120
+
+/*
+ * Returns the given percentile of the render costs we have recorded for
+ * this output. We only keep a few dozen samples, so sorting a copy of them
+ * once per frame is cheaper than it sounds.
+ */
+static int64_t sched_cost_percentile(struct output *output,
+				     unsigned int percentile)
+{
+	int64_t sorted[SCHED_COST_SAMPLES];
+	unsigned int n = output->sched.num_samples;
+
+	memcpy(sorted, output->sched.samples, n * sizeof(sorted[0]));
+	return stats_percentile(sorted, n, percentile);
+}
+
+static unsigned int popcount32(uint32_t v)
+{
+	unsigned int ret = 0;
+
+	for (; v; v &= v - 1)
+		ret++;
+	return ret;
+}
+
+void output_sched_init(struct output *output)
+{
+	memset(&output->sched, 0, sizeof(output->sched));
+	output->sched.leeway_nsec = RENDER_LEEWAY_NSEC;
+	output->sched.frame_divisor = 1;
+}
+
+/*
+ * Called from the KMS event handler once a frame has been displayed, with the
+ * timing we recorded for it (see telemetry.c), and the difference between the
+ * actual and predicted flip times. The frame may be NULL if its render cost
+ * tells us nothing about when to start rendering, e.g. when rendering ahead.
+ */
+void output_sched_frame_done(struct output *output,
+			     const struct frame_record *frame,
+			     int64_t flip_delta_nsec)
+{
+	int64_t interval = output->refresh_interval_nsec;
+	int64_t cost = 0;
+	int64_t p;
+	unsigned int misses;
+
+	/*
+	 * The render fence tells us when the GPU actually finished; without
+	 * it, the best we have is when the CPU was done with the frame.
+	 */
+	if (frame && frame->repaint_start != 0) {
+		if (frame->render_done != 0)
+			cost = (int64_t) (frame->render_done -
+					  frame->repaint_start);
+		else if (frame->render_submit != 0)
+			cost = (int64_t) (frame->render_submit -
+					  frame->repaint_start);
+	}
+
+	if (cost > 0) {
+		output->sched.samples[output->sched.next_sample] = cost;
+		output->sched.next_sample =
+			(output->sched.next_sample + 1) % SCHED_COST_SAMPLES;
+		if (output->sched.num_samples < SCHED_COST_SAMPLES)
+			output->sched.num_samples++;
+	}
+
+	output->sched.miss_history <<= 1;
+	if (flip_delta_nsec > FRAME_TIMING_TOLERANCE)
+		output->sched.miss_history |= 1;
+	misses = popcount32(output->sched.miss_history);
+
+	p = sched_cost_percentile(output, SCHED_COST_PERCENTILE);
+	if (p == 0)
+		return;
+
+	/*
+	 * If we can't fit the frame into a single refresh interval, or we
+	 * keep missing regardless, give ourselves two intervals to render
+	 * each frame in.
+	 */
+	if (output->sched.frame_divisor == 1 && !output->vrr.enabled &&
+	    (p + SCHED_SAFETY_MARGIN_NSEC > interval ||
+	     misses >= SCHED_MISS_LIMIT)) {
+		printf("[%s] missing deadlines (%u of last 32, p%d render %" PRIi64 "us): halving frame rate\n",
+		       output->name, misses, SCHED_COST_PERCENTILE, p / 1000);
+		output->sched.frame_divisor = 2;
+		output->sched.miss_history = 0;
+		output->sched.recover_frames = 0;
+	} else if (output->sched.frame_divisor > 1) {
+		/*
+		 * Only go back to full rate once our cost has fit into
+		 * three-quarters of a single frame for a good while, so we
+		 * don't oscillate between the two rates.
+		 */
+		if (p + SCHED_SAFETY_MARGIN_NSEC < (interval * 3) / 4 &&
+		    misses == 0)
+			output->sched.recover_frames++;
+		else
+			output->sched.recover_frames = 0;
+
+		if (output->sched.recover_frames >= SCHED_RECOVER_FRAMES) {
+			printf("[%s] render cost recovered (p%d %" PRIi64 "us): returning to full frame rate\n",
+			       output->name, SCHED_COST_PERCENTILE, p / 1000);
+			output->sched.frame_divisor = 1;
+			output->sched.recover_frames = 0;
+		}
+	}
+
+	output->sched.leeway_nsec = p + SCHED_SAFETY_MARGIN_NSEC;
+	if (output->sched.leeway_nsec < SCHED_MIN_LEEWAY_NSEC)
+		output->sched.leeway_nsec = SCHED_MIN_LEEWAY_NSEC;
+	if (output->sched.leeway_nsec > interval * output->sched.frame_divisor)
+		output->sched.leeway_nsec = interval * output->sched.frame_divisor;
+
+	debug("[%s] render cost p%d %" PRIi64 "ns, leeway now %" PRIi64 "ns, frame divisor %u\n",
+	      output->name, SCHED_COST_PERCENTILE, p,
+	      output->sched.leeway_nsec, output->sched.frame_divisor);
+}
+
+/*
+ * Interval between the frames we are aiming for; a multiple of the refresh
+ * interval when we have fallen back to a lower frame rate.
+ */
+int64_t output_sched_frame_interval(struct output *output)
+{
+	return output->refresh_interval_nsec * output->sched.frame_divisor;
+}
+
+/* Time at which to start repainting for the frame at output->next_frame. */
+void output_sched_repaint_time(struct output *output, struct timespec *out)
+{
+	timespec_add_nsec(out, &output->next_frame, -output->sched.leeway_nsec);
+}
+
+/*
+ * Whether the output has something new to show: always, unless we only
+ * repaint on changes with $KMS_IDLE; see main.c.
+ */
+bool output_has_changes(struct output *output)
+{
+	return !output->idle.enabled || output->scroll.enabled ||
+	       output->idle.invalidated || output_layers_pending(output);
+}
+
+/*
+ * Predicts when the next frame we render will be displayed. Frames are
+ * committed in order, one per frame interval, so each one already in flight
+ * or waiting in the queue pushes it back by another interval.
+ */
+void output_sched_predict_frame(struct output *output, struct timespec *out)
+{
+	int64_t ahead = output_queue_len(output) +
+			(output->buffer_pending ? 1 : 0);
+
+	timespec_add_nsec(out, &output->next_frame,
+			  ahead * output_sched_frame_interval(output));
+}
+
+/*
+ * Wakes an idle output to render a frame for the first vblank it can make,
+ * starting at the given time; see main.c for why we count from the last
+ * flip.
+ */
+void output_sched_wake(struct output *output, const struct timespec *now)
+{
+	int64_t interval = output->refresh_interval_nsec;
+	int64_t leeway = output->sched.leeway_nsec;
+
+	/*
+	 * With variable refresh, the display is waiting for us, and shows
+	 * the frame as soon as it arrives.
+	 */
+	if (output->device->monotonic_timestamps && interval > 0 &&
+	    !output->vrr.enabled) {
+		int64_t since = timespec_sub_to_nsec(now, &output->last_frame) +
+				leeway;
+
+		timespec_add_nsec(&output->next_frame, &output->last_frame,
+				  (since / interval + 1) * interval);
+	} else {
+		timespec_add_nsec(&output->next_frame, now, leeway);
+	}
+
+	debug("[%s] waking from idle, predicting presentation at %" PRIu64 "\n",
+	      output->name, timespec_to_nsec(&output->next_frame));
+
+	output->idle.idle = false;
+	output->idle.woke = true;
+	output->needs_repaint = true;
+}
+
+/*
+ * Called once KMS has told us that buffer_pending is being displayed, from
+ * the time it gave us and when its rendering finished, if we know; see
+ * atomic_event_handler() in main.c, and the scheduler simulation in
+ * sched-sim.c, which drives this without a display.
+ *
+ * This moves our buffers on, tells the scheduler, the buffer pool and
+ * telemetry how the frame went, and predicts when the next frame will be
+ * shown. It returns what the output should do next: placing the next repaint
+ * is left to the caller, at the time given in repaint_time.
+ */
+enum sched_action output_sched_flip_done(struct output *output,
+					 const struct timespec *event_time,
+					 uint64_t render_done_nsec,
+					 struct timespec *repaint_time)
+{
+	int64_t delta_nsec;
+	bool first_frame;
+	bool async_flip;
+
+	/*
+	 * Compare the actual event timestamp to what we had predicted it
+	 * would be when we submitted it.
+	 *
+	 * As well as screaming into the logs if we hit a different time from
+	 * what we had predicted, we feed this into the scheduler: if our
+	 * frames are late, it will start drawing earlier, or if that is not
+	 * possible, halve our frame rate so we can draw steadily and
+	 * predictably, if more slowly.
+	 */
+	first_frame = (timespec_to_nsec(&output->last_frame) == 0);
+	delta_nsec = timespec_sub_to_nsec(event_time, &output->next_frame);
+	if (!first_frame &&
+	    llabs((long long) delta_nsec) > FRAME_TIMING_TOLERANCE) {
+		debug("[%s] FRAME %" PRIi64 "ns %s: expected %" PRIu64 ", got %" PRIu64 "\n",
+		      output->name,
+		      delta_nsec,
+		      (delta_nsec < 0) ? "EARLY" : "LATE",
+		      timespec_to_nsec(&output->next_frame),
+		      timespec_to_nsec(event_time));
+	} else {
+		debug("[%s] flip event time at %" PRIu64 " (delta %" PRIi64 "ns)\n",
+		      output->name,
+		      timespec_to_nsec(event_time),
+		      delta_nsec);
+	}
+
+	output->last_frame = *event_time;
+
+	assert(output->buffer_pending);
+	assert(output->buffer_pending->in_use);
+	async_flip = output->buffer_pending->frame.async_flip;
+
+	output_telemetry_frame_done(output, output->buffer_pending,
+				    timespec_to_nsec(event_time),
+				    render_done_nsec, delta_nsec, !first_frame);
+
+	/*
+	 * Tell the scheduler how long this frame took to render, and
+	 * whether or not it made its deadline. When rendering ahead, the
+	 * render time includes waiting for a buffer to come off screen, so
+	 * we only give it the latter.
+	 */
+	if (!first_frame) {
+		output_sched_frame_done(output,
+					output->render_ahead ? NULL :
+					&output->buffer_pending->frame,
+					async_flip ? 0 : delta_nsec);
+		output_pool_frame_done(output,
+				       !async_flip &&
+				       delta_nsec > FRAME_TIMING_TOLERANCE);
+	}
+
+	/*
+	 * buffer_pending is now being displayed, which means that
+	 * buffer_last is no longer being displayed and we can reuse it. With
+	 * explicit fencing, we will already have released buffer_last when
+	 * we made the commit.
+	 */
+	if (output->buffer_last) {
+		debug("\treleasing buffer with FB ID %" PRIu32 "\n", output->buffer_last->fb_id);
+		output_pool_release(output, output->buffer_last);
+		output->buffer_last = NULL;
+	}
+	output->buffer_last = output->buffer_pending;
+	output->buffer_pending = NULL;
+
+	/* External buffers our layers have stopped showing; see dmabuf.c. */
+	output_layers_release(output);
+
+	/* Next frame time is estimated to be flip event time plus refresh
+	 * interval, or a multiple of it if we've decided we can't keep up
+	 * with the full frame rate. This timestamp is also used as the
+	 * presentation time to drive the animation progress when repainting
+	 * outputs.
+	 */
+	timespec_add_nsec(&output->next_frame, event_time,
+			  output_sched_frame_interval(output));
+
+	/*
+	 * An asynchronous flip has no vblank to wait for, so we start on
+	 * the next frame straight away, and expect it to be shown as soon
+	 * as it has been rendered. If it can't be flipped asynchronously,
+	 * it will just be late, and we go back to the vblank schedule.
+	 */
+	if (async_flip)
+		timespec_add_nsec(&output->next_frame, event_time,
+				  output->sched.leeway_nsec);
+
+	debug("[%s] predicting presentation at %" PRIu64 " (%" PRIu64 "ns / %" PRIu64 "ms away)\n",
+	      output->name, timespec_to_nsec(&output->next_frame),
+	      timespec_sub_to_nsec(&output->next_frame, event_time),
+	      timespec_sub_to_msec(&output->next_frame, event_time));
+
+	/*
+	 * If nothing has changed, and no frame is on its way, leave this
+	 * one on screen until something does; see output_sched_wake().
+	 */
+	if (!output_has_changes(output) && output_queue_len(output) == 0 &&
+	    !output_render_busy(output)) {
+		debug("[%s] nothing to repaint; going idle\n", output->name);
+		output->idle.idle = true;
+		return SCHED_ACTION_IDLE;
+	}
+
+	/*
+	 * When rendering ahead, the main loop commits our next queued frame
+	 * straight away, and renders another as soon as there is a buffer
+	 * to put it in; there's no deadline to wait for.
+	 */
+	if (output->render_ahead)
+		return SCHED_ACTION_RENDER_AHEAD;
+
+	/* If our driver supports MONOTONIC clock based timestamps, schedule the
+	 * repaint to happen shortly before the next frame will be scanned out,
+	 * taking some leeway into account, so the frame rendering can actually
+	 * make the deadline. This technique allows a frame to be rendered
+	 * closely to its presentation time while minimizing latency. We size
+	 * the leeway from the render times we have measured, so it is only as
+	 * long as this output actually needs.
+	 *
+	 * If the driver doesn't support MONOTONIC timestamps, simply use an
+	 * absolute time that is far in the past so the repaint will be
+	 * scheduled as soon as possible. */
+	if (output->device->monotonic_timestamps) {
+		output_sched_repaint_time(output, repaint_time);
+		debug("[%s] scheduling re-paint at %" PRIu64 " (%" PRIu64 "ns / %" PRIu64 "ms away)\n",
+		      output->name, timespec_to_nsec(repaint_time),
+		      timespec_sub_to_nsec(repaint_time, event_time),
+		      timespec_sub_to_msec(repaint_time, event_time));
+	} else {
+		debug("[%s] scheduling re-paint to happen immediately\n",
+		      output->name);
+		*repaint_time = (struct timespec) { 0, 1 };
+	}
+
+	return SCHED_ACTION_REPAINT;
+}
@@ -0,0 +1,329 @@
+/*
+ * This file implements smooth scrolling for the GL path, by moving content
+ * we have already rendered rather than drawing it all again.
+ *
+ * Redrawing a whole screen of text every frame costs thousands of glyphs'
+ * worth of vertices and fragments, which an integrated GPU can't keep up
+ * with at 144Hz and beyond. But while scrolling, almost everything on
+ * screen in one frame was on screen in the last, just a few rows further
+ * down. So when $KMS_SCROLL is set, every output keeps an offscreen texture
+ * as wide and tall as the screen, which holds the rows of content we have
+ * most recently rendered, as a ring: content row c lives in row c modulo
+ * the height of the ring. Each frame, we render only the rows which have
+ * come into view since the ring last held them (a few rows' worth, at any
+ * sensible speed) into the ring, and then copy the rows now on screen out
+ * of it with glBlitFramebuffer(), in up to two pieces, either side of where
+ * the ring wraps around. A copy costs much the same whatever the content;
+ * drawing it doesn't.
+ *
+ * How far we have scrolled is worked out from the time the frame will be
+ * shown, just as the animation is (see repaint_one_output() in main.c), so
+ * the content moves by the same amount each refresh and catches up with
+ * any frames we drop; $KMS_SCROLL gives the speed in rows per second.
+ *
+ * We don't try to scroll by moving the primary plane's SRC_Y over a buffer
+ * taller than the screen: the content goes on forever, so we would need to
+ * re-render a whole buffer every time we reached its end, and keep a second
+ * one at hand for when we do. The ring costs one copy of the visible rows
+ * per frame instead, which is much cheaper than drawing them.
+ *
+ * The ring needs glBlitFramebuffer(), so we only scroll with GLES3 or GL
+ * contexts.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+/* What we scroll through, over and over, below each line's number. */
+static const char *const scroll_lines[] = {
+	"static unsigned int ring_row(struct output *output, int64_t row)",
+	"{",
+	"\t/* Content row c lives in ring row c modulo its height. */",
+	"\treturn mod_floor(row, output->scroll.ring_height);",
+	"}",
+	"",
+	"The quick brown fox jumps over the lazy dog. 0123456789 ÀÉÎÕÜ",
+	"",
+};
+
+static const uint32_t scroll_colours[2] = { 0xff1c1c24, 0xff24242e };
+
+/* The same size as the caption in text.c. */
+static unsigned int scroll_text_size(struct output *output)
+{
+	unsigned int size = output->mode.vdisplay / 54;
+
+	return (size < 8) ? 8 : size;
+}
+
+/* Rounds towards minus infinity, unlike C's division. */
+static int64_t div_floor(int64_t a, int64_t b)
+{
+	int64_t q = a / b;
+
+	if ((a % b) != 0 && ((a < 0) != (b < 0)))
+		q--;
+	return q;
+}
+
+static int64_t mod_floor(int64_t a, int64_t b)
+{
+	return a - div_floor(a, b) * b;
+}
+
+static unsigned int ring_row(struct output *output, int64_t row)
+{
+	return mod_floor(row, output->scroll.ring_height);
+}
+
+/*
+ * Creates the output's ring, if $KMS_SCROLL asks us to scroll; the output's
+ * context must be current.
+ */
+void output_scroll_init(struct output *output)
+{
+	const char *env = getenv("KMS_SCROLL");
+	char *end;
+	GLenum status;
+
+	memset(&output->scroll, 0, sizeof(output->scroll));
+	if (!env)
+		return;
+
+	if (output->egl.gles2) {
+		fprintf(stderr, "[%s] can't scroll without glBlitFramebuffer\n",
+			output->name);
+		return;
+	}
+
+	output->scroll.speed = strtod(env, &end);
+	if (end == env || output->scroll.speed <= 0)
+		output->scroll.speed = output->mode.vdisplay;
+	output->scroll.ring_height = output->mode.vdisplay;
+
+	glGenTextures(1, &output->scroll.tex);
+	output_gl_bind_texture(output, output->scroll.tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, output->mode.hdisplay,
+		     output->scroll.ring_height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+		     NULL);
+
+	glGenFramebuffers(1, &output->scroll.fbo);
+	output_gl_bind_framebuffer(output, GL_FRAMEBUFFER, output->scroll.fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, output->scroll.tex, 0);
+	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "[%s] couldn't create scroll ring: FBO status 0x%x\n",
+			output->name, status);
+		output_scroll_destroy(output);
+		return;
+	}
+
+	output->scroll.enabled = true;
+	printf("[%s] scrolling at %.0f rows per second\n", output->name,
+	       output->scroll.speed);
+}
+
+void output_scroll_destroy(struct output *output)
+{
+	output_gl_forget(output, output->scroll.fbo, output->scroll.tex);
+	glDeleteFramebuffers(1, &output->scroll.fbo);
+	glDeleteTextures(1, &output->scroll.tex);
+	output->scroll.fbo = 0;
+	output->scroll.tex = 0;
+	output->scroll.enabled = false;
+}
+
+void output_scroll_set_time(struct output *output, int64_t nsec)
+{
+	output->scroll.frame_offset =
+		(int64_t) (nsec * output->scroll.speed / NSEC_PER_SEC);
+}
+
+/*
+ * Renders n rows of content, starting at content row c, into the ring from
+ * ring row ring_y on; they must not wrap around the end of the ring. Glyphs
+ * can reach a little way out of their own line, so we draw text for the
+ * line before as well, clipped like everything else to the rows we were
+ * asked for.
+ */
+static void scroll_render_rows(struct output *output, int64_t c,
+			       unsigned int ring_y, unsigned int n)
+{
+	unsigned int size = scroll_text_size(output);
+	unsigned int line_height = (size * 5) / 4;
+	int64_t base = (int64_t) ring_y - c; /* content row to ring row */
+	int64_t first = div_floor(c, line_height);
+	int64_t last = div_floor(c + n - 1, line_height);
+	struct region clip;
+
+	region_init_rect(&clip, 0, ring_y, output->mode.hdisplay, ring_y + n);
+
+	for (int64_t l = first; l <= last; l++) {
+		int64_t y1 = l * line_height + base;
+		int64_t y2 = y1 + line_height;
+
+		output_egl_batch_add_quad(output, 0,
+					  y1 > ring_y ? y1 : ring_y,
+					  output->mode.hdisplay,
+					  y2 < ring_y + n ? y2 : ring_y + n,
+					  scroll_colours[l & 1]);
+	}
+
+	for (int64_t l = first - 1; l <= last; l++) {
+		const char *line =
+			scroll_lines[mod_floor(l, ARRAY_LENGTH(scroll_lines))];
+		char text[256];
+
+		snprintf(text, sizeof(text), "%6" PRId64 "  %s", l + 1, line);
+		output_text_draw(output, size / 2,
+				 (int) (l * line_height + base) + size, size,
+				 0xffe0e0e0, text, &clip);
+	}
+}
+
+/*
+ * Renders whatever rows of content between top and bottom the ring doesn't
+ * already hold into it, splitting them where the ring wraps around.
+ */
+static void scroll_render(struct output *output, int64_t top, int64_t bottom)
+{
+	while (top < bottom) {
+		unsigned int ring_y = ring_row(output, top);
+		int64_t n = output->scroll.ring_height - ring_y;
+
+		if (n > bottom - top)
+			n = bottom - top;
+		scroll_render_rows(output, top, ring_y, n);
+		top += n;
+	}
+}
+
+/*
+ * Brings the ring up to date with the content on screen at the given
+ * offset. Newly rendered rows overwrite the ones the same distance away on
+ * the other side of the ring, so the ring always holds one contiguous run
+ * of content rows.
+ */
+static void scroll_update(struct output *output, struct buffer *buffer,
+			  int64_t top)
+{
+	int64_t bottom = top + buffer->height;
+	int64_t ring_height = output->scroll.ring_height;
+	int64_t *valid_top = &output->scroll.valid_top;
+	int64_t *valid_bottom = &output->scroll.valid_bottom;
+
+	if (*valid_top < *valid_bottom && top >= *valid_top &&
+	    bottom <= *valid_bottom)
+		return;
+
+	output_gl_bind_framebuffer(output, GL_FRAMEBUFFER, output->scroll.fbo);
+	output_egl_set_target(output, output->mode.hdisplay, ring_height,
+			      false);
+
+	if (*valid_top >= *valid_bottom || bottom <= *valid_top ||
+	    top >= *valid_bottom) {
+		/* Nothing we have is still on screen. */
+		scroll_render(output, top, bottom);
+		*valid_top = top;
+		*valid_bottom = bottom;
+	} else {
+		if (top < *valid_top) {
+			scroll_render(output, top, *valid_top);
+			*valid_top = top;
+			if (*valid_bottom - *valid_top > ring_height)
+				*valid_bottom = *valid_top + ring_height;
+		}
+		if (bottom > *valid_bottom) {
+			scroll_render(output, *valid_bottom, bottom);
+			*valid_bottom = bottom;
+			if (*valid_bottom - *valid_top > ring_height)
+				*valid_top = *valid_bottom - ring_height;
+		}
+	}
+
+	output_egl_batch_flush(output);
+	output_gl_bind_framebuffer(output, GL_FRAMEBUFFER, buffer->gbm.fbo_id);
+	output_egl_set_target(output, buffer->width, buffer->height,
+			      output->egl.have_gl_mesa_framebuffer_flip_y);
+}
+
+/*
+ * Fills the repaint area of the buffer with the content at this frame's
+ * offset, copied out of the ring. The buffer must be the bound framebuffer,
+ * with nothing queued in the quad batch yet, as the copy doesn't wait for
+ * the batch.
+ *
+ * The ring has no flip_y, so its rows count from the bottom of the window,
+ * and in the same order as they are in memory. With
+ * GL_MESA_framebuffer_flip_y, the buffer's window rows count from the top,
+ * so we copy upside down to keep the content the right way up.
+ */
+void output_scroll_draw(struct output *output, struct buffer *buffer,
+			const struct region *repaint)
+{
+	int64_t top = output->scroll.frame_offset;
+
+	assert(output->egl.batch_quads == 0);
+	scroll_update(output, buffer, top);
+
+	output_gl_bind_framebuffer(output, GL_READ_FRAMEBUFFER,
+				   output->scroll.fbo);
+	output_gl_bind_framebuffer(output, GL_DRAW_FRAMEBUFFER,
+				   buffer->gbm.fbo_id);
+	for (unsigned int r = 0; r < repaint->num_rects; r++) {
+		const struct rect *rect = &repaint->rects[r];
+		int32_t y = rect->y1;
+
+		while (y < rect->y2) {
+			unsigned int ring_y = ring_row(output, top + y);
+			int32_t n = output->scroll.ring_height - ring_y;
+			int32_t dst_y1 = y, dst_y2;
+
+			if (n > rect->y2 - y)
+				n = rect->y2 - y;
+			dst_y2 = y + n;
+			if (output->egl.have_gl_mesa_framebuffer_flip_y) {
+				dst_y1 = buffer->height - y;
+				dst_y2 = buffer->height - (y + n);
+			}
+			glBlitFramebuffer(rect->x1, ring_y, rect->x2, ring_y + n,
+					  rect->x1, dst_y1, rect->x2, dst_y2,
+					  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			y += n;
+		}
+	}
+	output_gl_bind_framebuffer(output, GL_FRAMEBUFFER, buffer->gbm.fbo_id);
+}
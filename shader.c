@@ -0,0 +1,418 @@
+/*
+ * This file implements building the GL programs we draw with, and caching
+ * them so we only compile each one once.
+ *
+ * Every output has a context of its own, and each context used to compile
+ * and link the same shaders again, every time we started. Some drivers,
+ * especially on Arm GPUs, take tens of milliseconds per program, so with
+ * several outputs and more than one program that adds up to a noticeable
+ * delay before the first frame. Once a program is linked, though, GL can
+ * give it to us as an opaque binary with glGetProgramBinary(), which any
+ * other context on the same driver can load with glProgramBinary(), much
+ * faster than compiling.
+ *
+ * So programs are keyed by a hash of their sources, their attribute
+ * locations and the driver which built them. The first output to need a
+ * program either loads its binary from our cache directory, under
+ * $XDG_CACHE_HOME, or compiles it and writes the binary there; every output
+ * after that loads the binary we kept in memory. A driver may refuse a
+ * binary it wrote itself, for instance after an upgrade which didn't change
+ * its version string, in which case we compile from source again and
+ * replace the cached copy.
+ *
+ * We don't share one program between outputs through a shared EGL context:
+ * each output's projection is a uniform, which is part of the program, and
+ * with render threads two outputs could be drawing with it at once.
+ *
+ * Outputs are set up on threads of their own (see main.c), so the cache has
+ * a lock. We hold it while compiling, so outputs after the first wait for
+ * its binary rather than all compiling the same program at once.
+ * GLES2 contexts can only get at binaries through an extension, so they
+ * always compile.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "kms-quads.h"
+
+#define PROGRAM_CACHE_MAX 16
+#define PROGRAM_CACHE_MAGIC 0x4c51504b /* 'KPQL' */
+
+struct program_binary {
+	uint64_t key;
+	GLenum format;
+	GLsizei length;
+	void *data;
+};
+
+/* What comes before the binary in each file in our cache directory. */
+struct program_file_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t length;
+	uint32_t pad;
+	uint64_t key;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct program_binary binaries[PROGRAM_CACHE_MAX];
+	unsigned int num_binaries;
+} program_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* 64-bit FNV-1a, continuing from the hash so far. */
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static uint64_t hash_string(uint64_t hash, const char *str)
+{
+	/* Include the terminator, so "ab" + "c" differs from "a" + "bc". */
+	return hash_bytes(hash, str ? str : "", str ? strlen(str) + 1 : 1);
+}
+
+static uint64_t program_key(const char *vert, const char *frag,
+			    const struct shader_attrib *attribs,
+			    unsigned int num_attribs)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	hash = hash_string(hash, (const char *) glGetString(GL_VENDOR));
+	hash = hash_string(hash, (const char *) glGetString(GL_RENDERER));
+	hash = hash_string(hash, (const char *) glGetString(GL_VERSION));
+	hash = hash_string(hash, vert);
+	hash = hash_string(hash, frag);
+	for (unsigned int i = 0; i < num_attribs; i++) {
+		hash = hash_string(hash, attribs[i].name);
+		hash = hash_bytes(hash, &attribs[i].location,
+				  sizeof(attribs[i].location));
+	}
+
+	return hash;
+}
+
+/*
+ * Finds the directory we keep binaries in, creating it if need be, and
+ * returns the path of the file for the given key in it. Returns false if
+ * we have nowhere to keep them.
+ */
+static bool program_cache_path(uint64_t key, char *path, size_t len)
+{
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char dir[PATH_MAX];
+	int ret;
+
+	if (cache_home && cache_home[0] == '/') {
+		ret = snprintf(dir, sizeof(dir), "%s", cache_home);
+	} else if (home && home[0] == '/') {
+		ret = snprintf(dir, sizeof(dir), "%s/.cache", home);
+	} else {
+		return false;
+	}
+	if (ret < 0 || (size_t) ret >= sizeof(dir))
+		return false;
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return false;
+	if ((size_t) ret + strlen("/quantom-leap") >= sizeof(dir))
+		return false;
+	strcat(dir, "/quantom-leap");
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return false;
+
+	ret = snprintf(path, len, "%s/%016" PRIx64 ".bin", dir, key);
+	return ret >= 0 && (size_t) ret < len;
+}
+
+/*
+ * Reads a cached binary from disk into the in-memory entry, which must
+ * have its key set. The file must be complete and name the same key.
+ */
+static bool program_cache_read(struct program_binary *binary)
+{
+	struct program_file_header header;
+	char path[PATH_MAX];
+	bool ret = false;
+	FILE *f;
+
+	if (!program_cache_path(binary->key, path, sizeof(path)))
+		return false;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return false;
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    header.magic != PROGRAM_CACHE_MAGIC || header.key != binary->key ||
+	    header.length == 0 || header.length > INT32_MAX)
+		goto out;
+
+	binary->data = malloc(header.length);
+	assert(binary->data);
+	if (fread(binary->data, header.length, 1, f) != 1) {
+		free(binary->data);
+		binary->data = NULL;
+		goto out;
+	}
+
+	binary->format = header.format;
+	binary->length = header.length;
+	ret = true;
+
+out:
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Writes a binary to disk. We write to a temporary file and rename it over
+ * the real one, so another instance starting at the same time never reads
+ * half a binary.
+ */
+static void program_cache_write(const struct program_binary *binary)
+{
+	struct program_file_header header = {
+		.magic = PROGRAM_CACHE_MAGIC,
+		.format = binary->format,
+		.length = binary->length,
+		.key = binary->key,
+	};
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	bool ok;
+	FILE *f;
+
+	if (!program_cache_path(binary->key, path, sizeof(path)))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+
+	f = fopen(tmp, "wb");
+	if (!f) {
+		debug("couldn't write program binary to %s: %s\n", tmp,
+		      strerror(errno));
+		return;
+	}
+	ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+	     fwrite(binary->data, binary->length, 1, f) == 1;
+	ok = (fclose(f) == 0) && ok;
+
+	if (!ok || rename(tmp, path) < 0) {
+		debug("couldn't write program binary to %s\n", path);
+		unlink(tmp);
+	}
+}
+
+static struct program_binary *program_cache_find(uint64_t key)
+{
+	for (unsigned int i = 0; i < program_cache.num_binaries; i++) {
+		if (program_cache.binaries[i].key == key)
+			return &program_cache.binaries[i];
+	}
+	return NULL;
+}
+
+/* Whether the context can give us program binaries and load them back. */
+static bool program_binaries_supported(struct output *output)
+{
+	GLint num_formats = 0;
+
+	if (output->egl.gles2 || !output->device->egl.get_program_binary ||
+	    !output->device->egl.program_binary)
+		return false;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+	return num_formats > 0;
+}
+
+/* Loads a binary into a new program, returning 0 if GL won't take it. */
+static GLuint program_load(struct output *output,
+			   const struct program_binary *binary)
+{
+	GLuint program = glCreateProgram();
+	GLint status = GL_FALSE;
+
+	output->device->egl.program_binary(program, binary->format,
+					   binary->data, binary->length);
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		glDeleteProgram(program);
+		return 0;
+	}
+
+	return program;
+}
+
+static bool
+create_shader(GLuint program, const char *source, GLenum shader_type)
+{
+	GLuint shader;
+	GLint status;
+
+	shader = glCreateShader(shader_type);
+	assert(shader != 0);
+
+	glShaderSource(shader, 1, (const char **) &source, NULL);
+	glCompileShader(shader);
+
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		char log[1000];
+		GLsizei len;
+		glGetShaderInfoLog(shader, 1000, &len, log);
+		fprintf(stderr, "Error: compiling %s: %*s\n",
+			shader_type == GL_VERTEX_SHADER ? "vertex" : "fragment",
+			len, log);
+		glDeleteShader(shader);
+		return false;
+	}
+
+	glAttachShader(program, shader);
+	glDeleteShader(shader);
+
+	return true;
+}
+
+/* Compiles and links a program from source, returning 0 on failure. */
+static GLuint program_compile(const char *vert, const char *frag,
+			      const struct shader_attrib *attribs,
+			      unsigned int num_attribs)
+{
+	GLuint program = glCreateProgram();
+	GLint status;
+
+	if (!create_shader(program, vert, GL_VERTEX_SHADER) ||
+	    !create_shader(program, frag, GL_FRAGMENT_SHADER)) {
+		glDeleteProgram(program);
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < num_attribs; i++)
+		glBindAttribLocation(program, attribs[i].location,
+				     attribs[i].name);
+
+	glLinkProgram(program);
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		char log[1000];
+		GLsizei len;
+		glGetProgramInfoLog(program, 1000, &len, log);
+		error("Error: linking GLSL program: %*s\n", len, log);
+		glDeleteProgram(program);
+		return 0;
+	}
+
+	return program;
+}
+
+/* Keeps the binary of a program we have just linked, in memory and on disk. */
+static void program_store(struct output *output,
+			  struct program_binary *binary, GLuint program)
+{
+	GLint length = 0;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	free(binary->data);
+	binary->data = malloc(length);
+	assert(binary->data);
+	output->device->egl.get_program_binary(program, length,
+					       &binary->length,
+					       &binary->format, binary->data);
+	if (binary->length <= 0) {
+		free(binary->data);
+		binary->data = NULL;
+		return;
+	}
+
+	program_cache_write(binary);
+}
+
+/*
+ * Returns a linked program built from the given sources, with the given
+ * attribute locations, in the current context, or 0 if it won't compile or
+ * link. The caller owns the program.
+ */
+GLuint output_egl_program_create(struct output *output, const char *vert,
+				 const char *frag,
+				 const struct shader_attrib *attribs,
+				 unsigned int num_attribs)
+{
+	struct program_binary *binary = NULL;
+	uint64_t key;
+	GLuint program;
+
+	if (!program_binaries_supported(output))
+		return program_compile(vert, frag, attribs, num_attribs);
+
+	key = program_key(vert, frag, attribs, num_attribs);
+	pthread_mutex_lock(&program_cache.lock);
+	binary = program_cache_find(key);
+	if (!binary && program_cache.num_binaries < PROGRAM_CACHE_MAX) {
+		binary = &program_cache.binaries[program_cache.num_binaries++];
+		binary->key = key;
+		program_cache_read(binary);
+	}
+
+	if (binary && binary->data) {
+		program = program_load(output, binary);
+		if (program) {
+			debug("[%s] loaded program %016" PRIx64 " from cache\n",
+			      output->name, key);
+			pthread_mutex_unlock(&program_cache.lock);
+			return program;
+		}
+		debug("[%s] driver rejected cached program %016" PRIx64 "\n",
+		      output->name, key);
+	}
+
+	program = program_compile(vert, frag, attribs, num_attribs);
+	if (program && binary)
+		program_store(output, binary, program);
+	pthread_mutex_unlock(&program_cache.lock);
+
+	return program;
+}
@@ -0,0 +1,347 @@
+/*
+ * This file implements frame-timing telemetry: a fixed-size ring of records
+ * for the most recent frames on each output, and summary statistics computed
+ * from them on demand.
+ *
+ * Every frame gets a record when we start repainting it, which travels with
+ * the buffer until KMS tells us the buffer has been displayed, at which point
+ * it is filled in with the flip time and copied into the output's ring. No
+ * memory is allocated after startup, and recording a frame only costs a
+ * handful of clock reads and stores, so this can be left on in release builds
+ * where debug() compiles away to nothing.
+ *
+ * The statistics can be dumped at any time by sending SIGUSR1 to the
+ * process, and are dumped for every output on exit.
+ *
+ * With $KMS_TELEMETRY_TRACE set to a file name, we also write a line to it
+ * for every frame displayed: the output's name, the flip time and how long
+ * the frame took to render, in nanoseconds. The scheduler simulation
+ * replays these with --sim-schedule --trace=FILE; see sched-sim.c.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+static uint64_t now_nsec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_nsec(&now);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Returns the given percentile of an array of values, sorting the array in
+ * place to do so.
+ */
+int64_t stats_percentile(int64_t *values, unsigned int count,
+			 unsigned int percentile)
+{
+	unsigned int idx;
+
+	if (count == 0)
+		return 0;
+
+	qsort(values, count, sizeof(values[0]), compare_int64);
+	idx = (count * percentile) / 100;
+	if (idx >= count)
+		idx = count - 1;
+	return values[idx];
+}
+
+void buffer_telemetry_begin(struct buffer *buffer)
+{
+	memset(&buffer->frame, 0, sizeof(buffer->frame));
+	buffer->frame.repaint_start = now_nsec();
+}
+
+void buffer_telemetry_submitted(struct buffer *buffer)
+{
+	buffer->frame.render_submit = now_nsec();
+}
+
+/*
+ * Appends a frame to $KMS_TELEMETRY_TRACE, if it is set. Only the main loop
+ * displays frames, so no locking is needed; the file is flushed on exit.
+ */
+static void telemetry_trace(struct output *output,
+			    const struct frame_record *rec)
+{
+	static FILE *trace;
+	static bool tried;
+	uint64_t render = 0;
+
+	if (!tried) {
+		const char *path = getenv("KMS_TELEMETRY_TRACE");
+
+		tried = true;
+		if (path) {
+			trace = fopen(path, "w");
+			if (!trace)
+				error("couldn't open %s for the frame trace\n",
+				      path);
+		}
+	}
+	if (!trace)
+		return;
+
+	if (rec->render_done > rec->repaint_start)
+		render = rec->render_done - rec->repaint_start;
+	else if (rec->render_submit > rec->repaint_start)
+		render = rec->render_submit - rec->repaint_start;
+	fprintf(trace, "%s %" PRIu64 " %" PRIu64 "\n", output->name, rec->flip,
+		render);
+}
+
+/*
+ * Called once KMS has told us that the buffer has started displaying. This
+ * moves the buffer's frame record into the output's ring, overwriting the
+ * oldest entry if the ring is full.
+ */
+void output_telemetry_frame_done(struct output *output, struct buffer *buffer,
+				 uint64_t flip_nsec, uint64_t render_done_nsec,
+				 int64_t delta_nsec, bool predicted)
+{
+	struct frame_record *rec;
+
+	buffer->frame.flip = flip_nsec;
+	buffer->frame.render_done = render_done_nsec;
+	buffer->frame.delta_nsec = predicted ? delta_nsec : 0;
+
+	rec = &output->telemetry.frames[output->telemetry.head];
+	*rec = buffer->frame;
+	telemetry_trace(output, rec);
+	output->telemetry.head = (output->telemetry.head + 1) % TELEMETRY_FRAMES;
+	if (output->telemetry.count < TELEMETRY_FRAMES)
+		output->telemetry.count++;
+
+	output->telemetry.total_frames++;
+	if (predicted && delta_nsec > FRAME_TIMING_TOLERANCE)
+		output->telemetry.missed_frames++;
+}
+
+/* Returns the i-th oldest record still in the ring. */
+static const struct frame_record *
+telemetry_record(struct output *output, unsigned int i)
+{
+	unsigned int first = (output->telemetry.head + TELEMETRY_FRAMES -
+			      output->telemetry.count) % TELEMETRY_FRAMES;
+
+	return &output->telemetry.frames[(first + i) % TELEMETRY_FRAMES];
+}
+
+/*
+ * Computes summary statistics over the frames currently in the ring; the
+ * missed-frame and total counters cover the whole run.
+ */
+void output_telemetry_get_stats(struct output *output, struct frame_stats *stats)
+{
+	int64_t values[TELEMETRY_FRAMES];
+	unsigned int n = 0;
+	double sum = 0.0, sum_sq = 0.0;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->total_frames = output->telemetry.total_frames;
+	stats->missed_frames = output->telemetry.missed_frames;
+
+	/*
+	 * Frame times are the intervals between consecutive flips, leaving
+	 * out the time we spent idle before a frame; see main.c.
+	 */
+	for (unsigned int i = 1; i < output->telemetry.count; i++) {
+		const struct frame_record *prev = telemetry_record(output, i - 1);
+		const struct frame_record *cur = telemetry_record(output, i);
+		int64_t interval = (int64_t) (cur->flip - prev->flip);
+
+		if (cur->after_idle)
+			continue;
+
+		values[n++] = interval;
+		sum += interval;
+		sum_sq += (double) interval * interval;
+	}
+	stats->num_samples = n;
+	if (n == 0)
+		return;
+
+	stats->frame_mean_nsec = sum / n;
+	stats->jitter_nsec = sqrt(fmax(0.0, sum_sq / n -
+				  stats->frame_mean_nsec * stats->frame_mean_nsec));
+	stats->frame_p50_nsec = stats_percentile(values, n, 50);
+	stats->frame_p99_nsec = stats_percentile(values, n, 99);
+
+	/*
+	 * Latency is from starting the repaint until the flip. We keep
+	 * frames which were flipped asynchronously apart from the others,
+	 * so the two can be compared.
+	 */
+	for (int async = 0; async <= 1; async++) {
+		n = 0;
+		for (unsigned int i = 0; i < output->telemetry.count; i++) {
+			const struct frame_record *rec =
+				telemetry_record(output, i);
+
+			if (rec->async_flip != async ||
+			    rec->repaint_start == 0 ||
+			    rec->flip < rec->repaint_start)
+				continue;
+			values[n++] = (int64_t) (rec->flip - rec->repaint_start);
+		}
+		if (async) {
+			stats->num_async_samples = n;
+			stats->async_latency_p50_nsec =
+				stats_percentile(values, n, 50);
+			stats->async_latency_p99_nsec =
+				stats_percentile(values, n, 99);
+		} else {
+			stats->latency_p50_nsec = stats_percentile(values, n, 50);
+			stats->latency_p99_nsec = stats_percentile(values, n, 99);
+		}
+	}
+
+	/*
+	 * Input latency is from the kernel generating an input event until
+	 * the first frame which reflects it flips.
+	 */
+	n = 0;
+	for (unsigned int i = 0; i < output->telemetry.count; i++) {
+		const struct frame_record *rec = telemetry_record(output, i);
+
+		if (rec->input == 0 || rec->flip < rec->input)
+			continue;
+		values[n++] = (int64_t) (rec->flip - rec->input);
+	}
+	stats->num_input_samples = n;
+	stats->input_latency_p50_nsec = stats_percentile(values, n, 50);
+	stats->input_latency_p99_nsec = stats_percentile(values, n, 99);
+}
+
+void output_telemetry_dump(struct output *output, FILE *f)
+{
+	struct frame_stats stats;
+
+	output_telemetry_get_stats(output, &stats);
+
+	fprintf(f, "[%s] %" PRIu64 " frames, %" PRIu64 " missed deadlines\n",
+		output->name, stats.total_frames, stats.missed_frames);
+	fprintf(f, "\t%u buffers (%u retired), %.1f MiB\n",
+		output->num_buffers, output->pool.num_spares,
+		output_pool_bytes(output) / (1024.0 * 1024.0));
+	if (stats.num_samples == 0)
+		return;
+
+	fprintf(f, "\tframe time over last %u frames: mean %.3fms, p50 %.3fms, p99 %.3fms, jitter %.3fms\n",
+		stats.num_samples,
+		stats.frame_mean_nsec / NSEC_PER_MSEC,
+		(double) stats.frame_p50_nsec / NSEC_PER_MSEC,
+		(double) stats.frame_p99_nsec / NSEC_PER_MSEC,
+		stats.jitter_nsec / NSEC_PER_MSEC);
+	fprintf(f, "\trepaint-to-flip latency: p50 %.3fms, p99 %.3fms\n",
+		(double) stats.latency_p50_nsec / NSEC_PER_MSEC,
+		(double) stats.latency_p99_nsec / NSEC_PER_MSEC);
+	if (stats.num_async_samples > 0)
+		fprintf(f, "\twith async flips over %u frames: p50 %.3fms, p99 %.3fms (p50 %.3fms sooner)\n",
+			stats.num_async_samples,
+			(double) stats.async_latency_p50_nsec / NSEC_PER_MSEC,
+			(double) stats.async_latency_p99_nsec / NSEC_PER_MSEC,
+			(double) (stats.latency_p50_nsec -
+				  stats.async_latency_p50_nsec) / NSEC_PER_MSEC);
+	if (stats.num_input_samples > 0)
+		fprintf(f, "\tinput-to-flip latency over %u frames: p50 %.3fms, p99 %.3fms\n",
+			stats.num_input_samples,
+			(double) stats.input_latency_p50_nsec / NSEC_PER_MSEC,
+			(double) stats.input_latency_p99_nsec / NSEC_PER_MSEC);
+}
+
+/*
+ * Startup is timed phase by phase, from startup_begin() until every output
+ * has shown its first frame; each phase prints how long it took, and how
+ * long we had been starting up by the end of it. Only the main thread
+ * marks phases. Coming back from a VT switch is timed too, from
+ * output_resume_begin() until the output's first frame after it.
+ */
+static struct {
+	uint64_t start;
+	uint64_t last;
+} startup;
+
+void startup_begin(void)
+{
+	startup.start = now_nsec();
+	startup.last = startup.start;
+}
+
+void startup_phase(const char *phase)
+{
+	uint64_t now = now_nsec();
+
+	if (startup.start == 0)
+		return;
+
+	printf("startup: %-32s %8.2fms (%8.2fms in)\n", phase,
+	       (double) (now - startup.last) / NSEC_PER_MSEC,
+	       (double) (now - startup.start) / NSEC_PER_MSEC);
+	startup.last = now;
+}
+
+void output_startup_first_frame(struct output *output)
+{
+	char phase[64];
+
+	/* ... or after we were switched back to; see main.c. */
+	if (output->resume_nsec != 0) {
+		printf("[%s] first frame shown %.2fms after resume\n",
+		       output->name,
+		       (double) (now_nsec() - output->resume_nsec) /
+				NSEC_PER_MSEC);
+		output->resume_nsec = 0;
+		return;
+	}
+
+	snprintf(phase, sizeof(phase), "[%s] first frame shown",
+		 output->name);
+	startup_phase(phase);
+}
+
+void output_resume_begin(struct output *output)
+{
+	output->resume_nsec = now_nsec();
+}
@@ -0,0 +1,518 @@
+/*
+ * This file implements text rendering for the GL path, with a glyph atlas.
+ *
+ * Drawing each glyph from a texture of its own would mean binding a new
+ * texture, and issuing a new draw call, for every character on screen.
+ * Instead, every output has a single atlas texture, which the glyphs we
+ * draw are packed into the first time we need them at a given size, and
+ * found again through a small hash table every time after that. A glyph on
+ * screen is then just one more quad in the batch the rest of the scene is
+ * drawn with (see egl-gles.c), whose texture co-ordinates happen to point
+ * at its texels in the atlas rather than at the single fully-covered texel
+ * solid quads use. A whole screen of text costs one draw call per
+ * QUAD_BATCH_MAX glyphs, and no texture switches at all.
+ *
+ * Glyphs are packed as they come, left to right along horizontal 'shelves'
+ * as tall as the tallest glyph on them; glyphs of the same size are all
+ * about as tall as each other, so little space is wasted. We rasterise into
+ * a copy of the atlas in system memory, and before the next draw upload only
+ * the rows which have changed with glTexSubImage2D(), rather than the whole
+ * texture. Once the atlas or the cache fills up, which takes many sizes of
+ * a great many glyphs, we draw everything queued so far, and start again
+ * from an empty atlas.
+ *
+ * The glyphs themselves are rasterised by FreeType, from the font file named
+ * by $KMS_FONT, or the first common monospace font we find installed. We
+ * can build without FreeType, in which case the atlas only holds the texel
+ * solid quads are drawn with, and no text is drawn.
+ */
+
+/*
+ * Copyright © 2026 Quantom Leap contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+#if defined(HAVE_FREETYPE)
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#endif
+
+/* Empty texels left between glyphs, so none can bleed into another. */
+#define TEXT_ATLAS_PADDING 1
+
+/* The largest size we rasterise glyphs at, in pixels. */
+#define TEXT_MAX_SIZE (TEXT_ATLAS_SIZE / 4)
+
+/* Where we look for a font if $KMS_FONT isn't set. */
+static const char *const text_font_paths[] = {
+	"/usr/share/fonts/TTF/DejaVuSansMono.ttf",
+	"/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf",
+	"/usr/share/fonts/dejavu-sans-mono-fonts/DejaVuSansMono.ttf",
+	"/usr/share/fonts/liberation-mono/LiberationMono-Regular.ttf",
+	"/usr/share/fonts/truetype/liberation/LiberationMono-Regular.ttf",
+};
+
+#if defined(HAVE_FREETYPE)
+/*
+ * FreeType faces can't be used from several threads at once, and each
+ * output may render on a thread of its own, so each output loads the font
+ * for itself.
+ */
+struct text_font {
+	FT_Library library;
+	FT_Face face;
+	unsigned int size; /* the pixel size the face is currently set to */
+};
+
+static struct text_font *text_font_load(struct output *output)
+{
+	const char *env = getenv("KMS_FONT");
+	struct text_font *font = calloc(1, sizeof(*font));
+
+	assert(font);
+	if (FT_Init_FreeType(&font->library) != 0) {
+		error("[%s] couldn't initialise FreeType\n", output->name);
+		free(font);
+		return NULL;
+	}
+
+	for (int i = env ? -1 : 0; i < (int) ARRAY_LENGTH(text_font_paths); i++) {
+		const char *path = (i < 0) ? env : text_font_paths[i];
+
+		if (FT_New_Face(font->library, path, 0, &font->face) == 0) {
+			debug("[%s] drawing text with %s\n", output->name, path);
+			return font;
+		}
+		if (i < 0)
+			error("[%s] couldn't load font %s\n", output->name, path);
+	}
+
+	printf("[%s] no font found; set KMS_FONT to draw text\n", output->name);
+	FT_Done_FreeType(font->library);
+	free(font);
+	return NULL;
+}
+
+static void text_font_destroy(struct text_font *font)
+{
+	FT_Done_Face(font->face);
+	FT_Done_FreeType(font->library);
+	free(font);
+}
+#else
+static struct text_font *text_font_load(struct output *output)
+{
+	return NULL;
+}
+
+static void text_font_destroy(struct text_font *font)
+{
+}
+#endif
+
+/*
+ * Empties the atlas, apart from texel (0, 0), which is always fully covered
+ * for solid quads to use. The whole texture is uploaded again before the
+ * next draw.
+ */
+static void atlas_reset(struct text_atlas *atlas)
+{
+	memset(atlas->glyphs, 0, sizeof(atlas->glyphs));
+	atlas->num_glyphs = 0;
+
+	memset(atlas->pixels, 0, TEXT_ATLAS_SIZE * TEXT_ATLAS_SIZE);
+	atlas->pixels[0] = 0xff;
+	atlas->shelf_x = 1 + TEXT_ATLAS_PADDING;
+	atlas->shelf_y = 0;
+	atlas->shelf_height = 1;
+
+	atlas->dirty_y1 = 0;
+	atlas->dirty_y2 = TEXT_ATLAS_SIZE;
+}
+
+/* GLES only has unsized alpha textures; GL core only has red ones. */
+static GLenum atlas_format(struct output *output)
+{
+	return output->egl.gl_core ? GL_RED : GL_ALPHA;
+}
+
+/*
+ * Creates the output's atlas; the output's context must be current. The
+ * atlas stays bound to texture unit 0, which the quad program samples.
+ */
+void output_text_init(struct output *output)
+{
+	struct text_atlas *atlas = &output->egl.atlas;
+
+	memset(atlas, 0, sizeof(*atlas));
+	atlas->pixels = calloc(TEXT_ATLAS_SIZE * TEXT_ATLAS_SIZE, 1);
+	assert(atlas->pixels);
+
+	glGenTextures(1, &atlas->tex);
+	output_gl_bind_texture(output, atlas->tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0,
+		     output->egl.gl_core ? GL_R8 : GL_ALPHA,
+		     TEXT_ATLAS_SIZE, TEXT_ATLAS_SIZE, 0,
+		     atlas_format(output), GL_UNSIGNED_BYTE, NULL);
+
+	atlas_reset(atlas);
+	atlas->font = text_font_load(output);
+}
+
+void output_text_destroy(struct output *output)
+{
+	struct text_atlas *atlas = &output->egl.atlas;
+
+	if (atlas->font)
+		text_font_destroy(atlas->font);
+	atlas->font = NULL;
+	output_gl_forget(output, 0, atlas->tex);
+	glDeleteTextures(1, &atlas->tex);
+	free(atlas->pixels);
+	atlas->pixels = NULL;
+}
+
+/*
+ * Uploads every row of the atlas we have rasterised glyphs into since the
+ * last upload. Whole rows are contiguous in our copy, so we don't need
+ * GL_UNPACK_ROW_LENGTH, which GLES2 doesn't have.
+ */
+void output_text_upload(struct output *output)
+{
+	struct text_atlas *atlas = &output->egl.atlas;
+
+	/*
+	 * Importing buffers binds textures of their own, so make sure the
+	 * atlas is bound whenever we draw; that is free if it already is.
+	 */
+	output_gl_bind_texture(output, atlas->tex);
+
+	if (atlas->dirty_y1 >= atlas->dirty_y2)
+		return;
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, atlas->dirty_y1,
+			TEXT_ATLAS_SIZE, atlas->dirty_y2 - atlas->dirty_y1,
+			atlas_format(output), GL_UNSIGNED_BYTE,
+			&atlas->pixels[atlas->dirty_y1 * TEXT_ATLAS_SIZE]);
+	atlas->dirty_y1 = atlas->dirty_y2 = 0;
+}
+
+static unsigned int glyph_hash(uint32_t codepoint, unsigned int size)
+{
+	return ((codepoint * 2654435761u) ^ (size * 40503u)) &
+	       (TEXT_GLYPH_CACHE_SIZE - 1);
+}
+
+/* Finds the glyph's slot in the cache, or the empty slot it would go in. */
+static struct glyph *glyph_slot(struct text_atlas *atlas, uint32_t codepoint,
+				unsigned int size)
+{
+	unsigned int i = glyph_hash(codepoint, size);
+
+	for (;;) {
+		struct glyph *glyph = &atlas->glyphs[i];
+
+		if (glyph->size == 0 ||
+		    (glyph->codepoint == codepoint && glyph->size == size))
+			return glyph;
+		i = (i + 1) & (TEXT_GLYPH_CACHE_SIZE - 1);
+	}
+}
+
+#if defined(HAVE_FREETYPE)
+/*
+ * Rasterises a glyph onto the current shelf, or a new one below it. Returns
+ * false if there's no room left in the atlas. Codepoints the font has no
+ * glyph for get an empty one, which still advances the pen.
+ */
+static bool glyph_rasterise(struct text_atlas *atlas, uint32_t codepoint,
+			    unsigned int size, struct glyph *glyph)
+{
+	struct text_font *font = atlas->font;
+	FT_GlyphSlot slot;
+	unsigned int width, height;
+
+	if (font->size != size) {
+		FT_Set_Pixel_Sizes(font->face, 0, size);
+		font->size = size;
+	}
+
+	memset(glyph, 0, sizeof(*glyph));
+	glyph->codepoint = codepoint;
+	glyph->size = size;
+
+	if (FT_Load_Char(font->face, codepoint, FT_LOAD_RENDER) != 0) {
+		glyph->advance = size / 2;
+		return true;
+	}
+
+	slot = font->face->glyph;
+	width = slot->bitmap.width;
+	height = slot->bitmap.rows;
+	glyph->bearing_x = slot->bitmap_left;
+	glyph->bearing_y = slot->bitmap_top;
+	glyph->advance = (slot->advance.x + 32) >> 6;
+	if (width == 0 || height == 0 ||
+	    slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+		return true;
+
+	if (atlas->shelf_x + width > TEXT_ATLAS_SIZE) {
+		atlas->shelf_y += atlas->shelf_height + TEXT_ATLAS_PADDING;
+		atlas->shelf_x = 0;
+		atlas->shelf_height = 0;
+	}
+	if (atlas->shelf_y + height > TEXT_ATLAS_SIZE)
+		return false;
+
+	for (unsigned int row = 0; row < height; row++) {
+		memcpy(&atlas->pixels[(atlas->shelf_y + row) * TEXT_ATLAS_SIZE +
+				      atlas->shelf_x],
+		       &slot->bitmap.buffer[row * slot->bitmap.pitch], width);
+	}
+
+	glyph->x = atlas->shelf_x;
+	glyph->y = atlas->shelf_y;
+	glyph->width = width;
+	glyph->height = height;
+
+	if (atlas->dirty_y1 >= atlas->dirty_y2) {
+		atlas->dirty_y1 = atlas->shelf_y;
+		atlas->dirty_y2 = atlas->shelf_y + height;
+	} else {
+		if (atlas->shelf_y < atlas->dirty_y1)
+			atlas->dirty_y1 = atlas->shelf_y;
+		if (atlas->shelf_y + height > atlas->dirty_y2)
+			atlas->dirty_y2 = atlas->shelf_y + height;
+	}
+
+	atlas->shelf_x += width + TEXT_ATLAS_PADDING;
+	if (height > atlas->shelf_height)
+		atlas->shelf_height = height;
+
+	return true;
+}
+#else
+static bool glyph_rasterise(struct text_atlas *atlas, uint32_t codepoint,
+			    unsigned int size, struct glyph *glyph)
+{
+	return false;
+}
+#endif
+
+/*
+ * Returns the glyph for a codepoint at the given pixel size, rasterising it
+ * into the atlas if we haven't already. This may draw everything queued in
+ * the batch so far, so the glyph is only valid until the next call.
+ */
+const struct glyph *output_text_glyph(struct output *output,
+				      uint32_t codepoint, unsigned int size)
+{
+	struct text_atlas *atlas = &output->egl.atlas;
+	struct glyph *glyph;
+	struct glyph tmp;
+
+	if (!atlas->font || size == 0 || size > TEXT_MAX_SIZE)
+		return NULL;
+
+	glyph = glyph_slot(atlas, codepoint, size);
+	if (glyph->size != 0)
+		return glyph;
+
+	/*
+	 * Keep the cache no more than three-quarters full, so lookups stay
+	 * short; when it is, or the atlas is, start again.
+	 */
+	if (atlas->num_glyphs >= (TEXT_GLYPH_CACHE_SIZE * 3) / 4 ||
+	    !glyph_rasterise(atlas, codepoint, size, &tmp)) {
+		debug("[%s] glyph atlas full; starting again\n", output->name);
+		output_egl_batch_flush(output);
+		atlas_reset(atlas);
+		if (!glyph_rasterise(atlas, codepoint, size, &tmp))
+			return NULL;
+		glyph = glyph_slot(atlas, codepoint, size);
+	}
+
+	*glyph = tmp;
+	atlas->num_glyphs++;
+	return glyph;
+}
+
+/*
+ * Decodes the next codepoint from a UTF-8 string, and moves past it.
+ * Malformed sequences decode as U+FFFD, one byte at a time.
+ */
+static uint32_t utf8_next(const char **str)
+{
+	const unsigned char *s = (const unsigned char *) *str;
+	uint32_t cp;
+	unsigned int len;
+
+	if (s[0] < 0x80) {
+		*str += 1;
+		return s[0];
+	} else if ((s[0] & 0xe0) == 0xc0) {
+		cp = s[0] & 0x1f;
+		len = 2;
+	} else if ((s[0] & 0xf0) == 0xe0) {
+		cp = s[0] & 0x0f;
+		len = 3;
+	} else if ((s[0] & 0xf8) == 0xf0) {
+		cp = s[0] & 0x07;
+		len = 4;
+	} else {
+		*str += 1;
+		return 0xfffd;
+	}
+
+	for (unsigned int i = 1; i < len; i++) {
+		if ((s[i] & 0xc0) != 0x80) {
+			*str += 1;
+			return 0xfffd;
+		}
+		cp = (cp << 6) | (s[i] & 0x3f);
+	}
+
+	*str += len;
+	return cp;
+}
+
+unsigned int output_text_draw(struct output *output, int x, int y,
+			      unsigned int size, uint32_t argb,
+			      const char *utf8, const struct region *clip)
+{
+	int pen = x;
+
+	while (*utf8) {
+		uint32_t codepoint = utf8_next(&utf8);
+		const struct glyph *glyph =
+			output_text_glyph(output, codepoint, size);
+		struct rect dst;
+
+		if (!glyph)
+			continue;
+
+		dst.x1 = pen + glyph->bearing_x;
+		dst.y1 = y - glyph->bearing_y;
+		dst.x2 = dst.x1 + glyph->width;
+		dst.y2 = dst.y1 + glyph->height;
+		for (unsigned int r = 0; glyph->width && r < clip->num_rects; r++)
+			output_egl_batch_add_glyph(output, &dst, glyph,
+						   &clip->rects[r], argb);
+
+		pen += glyph->advance;
+	}
+
+	return pen - x;
+}
+
+/* What we fill the screen with when benchmarking text. */
+static const char *const text_page_lines[] = {
+	"static void output_text_draw(struct output *output, int x, int y)",
+	"{",
+	"\tfor (unsigned int i = 0; i < output->num_layers; i++) {",
+	"\t\tstruct layer *layer = &output->layers[i];",
+	"\t\tif (rect_intersect(&layer->rect, clip, &r)) /* drawn */",
+	"\t\t\tglyphs += layer->rect.x2 - layer->rect.x1;",
+	"\t}",
+	"}",
+	"The quick brown fox jumps over the lazy dog. 0123456789 ÀÉÎÕÜ",
+	"",
+};
+
+/* Whether any of the region's rectangles cross the rows [y1, y2). */
+static bool region_crosses_rows(const struct region *region, int y1, int y2)
+{
+	for (unsigned int r = 0; r < region->num_rects; r++) {
+		if (region->rects[r].y1 < y2 && y1 < region->rects[r].y2)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Draws the text in our scene: a caption naming the output in its top left
+ * corner, which never moves, so damage tracking needn't know about it. When
+ * benchmarking, we also fill the whole screen with text scrolling with the
+ * animation, which only works when repainting everything.
+ */
+void output_text_draw_scene(struct output *output, float anim_progress,
+			    const struct region *repaint)
+{
+	const unsigned int num_lines = ARRAY_LENGTH(text_page_lines);
+	struct text_atlas *atlas = &output->egl.atlas;
+	unsigned int size = output->mode.vdisplay / 54;
+	unsigned int line_height, scroll;
+	char caption[128];
+	int len, y;
+
+	if (!atlas->font)
+		return;
+
+	if (size < 8)
+		size = 8;
+	line_height = (size * 5) / 4;
+
+	len = snprintf(caption, sizeof(caption), "%s  %u x %u", output->name,
+		       output->mode.hdisplay, output->mode.vdisplay);
+	if (output->refresh_interval_nsec > 0 && len > 0 &&
+	    (size_t) len < sizeof(caption))
+		snprintf(caption + len, sizeof(caption) - len, " @ %.2f Hz",
+			 (double) NSEC_PER_SEC / output->refresh_interval_nsec);
+	output_text_draw(output, size, size + line_height, size, 0xffffffff,
+			 caption, repaint);
+
+	if (!atlas->page)
+		return;
+
+	scroll = anim_progress * num_lines * line_height;
+	y = line_height - (int) (scroll % line_height);
+
+	for (unsigned int l = scroll / line_height;
+	     y - (int) line_height < (int) output->mode.vdisplay;
+	     l++, y += line_height) {
+		const char *line = text_page_lines[l % num_lines];
+		unsigned int x = 0, width = 1;
+
+		if (!region_crosses_rows(repaint, y - line_height, y + size / 2))
+			continue;
+
+		/* Repeat the line across the screen. */
+		while (x < output->mode.hdisplay && width > 0) {
+			width = output_text_draw(output, x, y, size,
+						 0xffe0e0e0, line, repaint);
+			x += width + size;
+		}
+	}
+}
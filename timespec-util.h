@@ -33,6 +33,7 @@
 
 #define NSEC_PER_SEC 1000000000
 #define NSEC_PER_MSEC 1000000
+#define NSEC_PER_USEC 1000
 
 /* Subtract timespecs
  *